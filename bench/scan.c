@@ -0,0 +1,124 @@
+/**
+ * Minimal Migration Manager - Scanning Benchmark
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ *
+ * Times each version of the scanning primitives this CPU can run,
+ * and the SQL scanner on top of them, over a made-up seed:
+ *
+ *     make bench
+ *     ./bench/scan [megabytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/sql.h"
+#include "../src/scan.c"
+
+#define ROW "INSERT INTO t VALUES (1, 'Lorem ipsum dolor sit amet, " \
+            "consectetur adipiscing elit, sed do eiusmod tempor " \
+            "incididunt ut labore et dolore magna aliqua.');\n" \
+            "        -- A comment, which goes on for a little while\n"
+
+/* So the work can't be optimized away */
+static size_t sink = 0;
+
+/**
+ * Fill a buffer with rows.
+ */
+static void fill(char *buf, size_t len)
+{
+	size_t i, n;
+
+	for (i = 0; i < len; i += n) {
+		n = sizeof(ROW) - 1;
+		if (n > len - i) n = len - i;
+		memcpy(buf + i, ROW, n);
+	}
+}
+
+/**
+ * Walk a buffer with one of the primitives, as a scanner would.
+ */
+static void walk(const struct scan_impl *p, int what, const char *buf,
+                 size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		switch (what) {
+		case 0: i += p->space(buf + i, len - i); break;
+		case 1: i += p->any(buf + i, len - i, "'\\"); break;
+		case 2: i += p->marker(buf + i, len - i); break;
+		default: break;
+		}
+
+		++sink;
+	}
+}
+
+/**
+ * Time something, and print the throughput.
+ */
+static void report(const char *what, clock_t start, size_t len)
+{
+	double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	if (secs <= 0.0) secs = 1e-9;
+	printf("  %-12s %8.1f MB/s\n", what,
+	       (double)len / (1024.0 * 1024.0) / secs);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *names[3] = { "whitespace", "quotes", "markers" };
+	const struct scan_impl *v[3];
+	struct sql_scanner s;
+	size_t len, n = 0, k;
+	char *buf, *ws;
+	clock_t start;
+	int what;
+
+	len = (size_t)(argc > 1 ? atol(argv[1]) : 64L) * 1024 * 1024;
+	if (!len || !(buf = malloc(len)) || !(ws = malloc(len))) {
+		fprintf(stderr, "usage: %s [megabytes]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Whitespace is timed over long runs of it */
+	fill(buf, len);
+	memset(ws, ' ', len);
+	ws[len - 1] = 'x';
+
+	v[n++] = &portable;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) v[n++] = &sse2;
+	if (__builtin_cpu_supports("avx2")) v[n++] = &avx2;
+#endif
+
+	for (k = 0; k < n; k++) {
+		printf("%s:\n", v[k]->name);
+		for (what = 0; what < 3; what++) {
+			start = clock();
+			walk(v[k], what, what ? buf : ws, len);
+			report(names[what], start, len);
+		}
+
+		impl  = v[k];
+		start = clock();
+		sql_scan_init(&s, sql_dialect("mysql"));
+		sql_scan(&s, buf, len, len);
+		report("sql_scan", start, len);
+		sink += s.n_stmts;
+	}
+
+	free(ws);
+	free(buf);
+	return sink ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -10,7 +10,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "file.h"
 #include "config.h"
 #include "db.h"
 #include "source.h"
@@ -18,8 +17,200 @@
 #include "state.h"
 #include "stringbuf.h"
 #include "migration.h"
+#include "prefetch.h"
+#include "seed.h"
+#include "watch.h"
 #include "commands.h"
 
+/**
+ * Free a list of migrations.
+ *
+ * \param[in] migrations Migrations
+ * \param[in] size       Number of migrations
+ */
+static void free_migrations(char **migrations, size_t size)
+{
+	if (migrations) {
+		while (size) free(migrations[--size]);
+		free(migrations);
+	}
+}
+
+/**
+ * Load a migration, compute its checksum, and run it.
+ *
+ * \param[in]  source    Migration source
+ * \param[in]  migration Migration name
+ * \param[in]  run       migration_upgrade(), migration_downgrade(),
+ *                       or NULL to only compute the checksum.
+ * \param[out] sum       Buffer for the checksum (or NULL.)
+ * \return 0 on success, non-zero on failure.
+ */
+static int with_migration(const char *source, const char *migration,
+                          int (*run)(const struct migration *m),
+                          char *sum)
+{
+	struct migration m;
+	char *mem;
+	size_t size;
+	int retval = 1;
+
+	if (!(mem = source_load_migration(source, migration, &size)))
+		return retval;
+
+	migration_parse(&m, mem, size);
+	m.name = migration;
+	if ((!sum || !migration_checksum(mem, size, sum)) &&
+	    (!run || !run(&m)))
+		retval = 0;
+
+	source_unload_migration(source, mem, size);
+	return retval;
+}
+
+/**
+ * Record a migration which was applied without the ledger knowing
+ * about it.
+ *
+ * \param[in] source    Migration source
+ * \param[in] migration Migration name
+ * \return 0 on success, non-zero on failure.
+ */
+static int record_migration(const char *source, const char *migration)
+{
+	char sum[MIGRATION_CHECKSUM_LEN];
+
+	if (with_migration(source, migration, NULL, sum))
+		return 1;
+
+	db_pipeline_label(migration);
+	return state_ledger_add(migration, sum, 0);
+}
+
+/**
+ * Comparator for searching a list of migration names.
+ */
+static int migration_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Migrations which haven't been applied, and those which were
+ * applied before there was a ledger to record them in.
+ */
+struct pending_set {
+	char **migrations;   /**< Pending migrations */
+	size_t size;         /**< Number of pending migrations */
+	size_t n_ooo;        /**< Number of them which are out of order */
+	char **unrecorded;   /**< Applied, but missing from the ledger */
+	size_t n_unrecorded; /**< Number of unrecorded migrations */
+};
+
+/**
+ * Free a set of pending migrations.
+ *
+ * \param[in] p Pending migrations
+ */
+static void free_pending_set(struct pending_set *p)
+{
+	free_migrations(p->migrations, p->size);
+	free_migrations(p->unrecorded, p->n_unrecorded);
+	memset(p, 0, sizeof(*p));
+}
+
+/**
+ * Find the migrations which haven't been applied.
+ *
+ * Pending migrations are those the source has, which the ledger
+ * doesn't. Pending migrations which sort before the last applied
+ * migration are out of order, and are listed first.
+ *
+ * A ledger which has been kept all along only has to be checked
+ * against what's changed since the current revision. Databases
+ * which predate the ledger only know the last revision they were
+ * migrated to, so everything the source has that isn't pending
+ * relative to it has been applied. Those migrations are listed as
+ * unrecorded, to be added to the ledger once there's a transaction
+ * to do so in. Nothing is written here.
+ *
+ * \param[in]  source  Migration source
+ * \param[in]  current Current revision
+ * \param[out] p       Pending migrations
+ * \return 0 on success, non-zero on failure.
+ */
+static int find_pending(const char *source, const char *current,
+                        struct pending_set *p)
+{
+	char **migrations, **range = NULL;
+	size_t i, j, n = 0, n_range = 0, last = 0, u = 0;
+	int backfill, applied;
+
+	memset(p, 0, sizeof(*p));
+	if (state_ledger_load())
+		return 1;
+
+	backfill = !state_ledger_size() && current;
+	migrations = source_find_migrations(source, backfill ? NULL : current,
+	                                    NULL, &n);
+	if (!migrations)
+		return 0;
+
+	if (backfill) {
+		range = source_find_migrations(source, current, NULL, &n_range);
+		if (range)
+			qsort(range, n_range, sizeof(char *), migration_cmp);
+		else n_range = 0;
+
+		if (!(p->unrecorded = malloc(n * sizeof(char *)))) {
+			error("Out of memory");
+			free_migrations(range, n_range);
+			free_migrations(migrations, n);
+			return 1;
+		}
+	}
+
+	/**
+	 * Drop the applied migrations, keeping the order of the rest.
+	 * Whatever is left ahead of the last applied migration is
+	 * out of order.
+	 */
+	for (i = j = 0; i < n; i++) {
+		if (backfill) {
+			applied = !n_range ||
+			          !bsearch(&migrations[i], range, n_range,
+			                   sizeof(char *), migration_cmp);
+		} else applied = state_ledger_lookup(migrations[i]) != NULL;
+
+		if (!applied) {
+			migrations[j++] = migrations[i];
+			continue;
+		}
+
+		if (backfill) p->unrecorded[u++] = migrations[i];
+		else free(migrations[i]);
+		last = j;
+	}
+
+	free_migrations(range, n_range);
+	if (!u) {
+		free(p->unrecorded);
+		p->unrecorded = NULL;
+	}
+
+	if (!j) {
+		free(migrations);
+		migrations = NULL;
+		last = 0;
+	}
+
+	p->migrations   = migrations;
+	p->size         = j;
+	p->n_ooo        = last;
+	p->n_unrecorded = u;
+	return 0;
+}
+
 /**
  * Get the local HEAD revision.
  */
@@ -41,11 +232,7 @@ static int head(const char *source, const char *current,
 		PRINT_1("%s\n", local_head);
 	}
 
-	if (migrations) {
-		while (size) free(migrations[--size]);
-		free(migrations);
-	}
-
+	free_migrations(migrations, size);
 	return EXIT_SUCCESS;
 }
 
@@ -59,20 +246,15 @@ static int seed(const char *source, const char *current,
                 int argc, char *argv[])
 {
 	int retval = EXIT_SUCCESS;
-	char *sfile = NULL;
 	const char *srev = NULL;
-	size_t size = 0;
 	(void)current;
 	(void)argc;
 
 	if (!argv[0]) goto err;
 
-	/* Map the seed file, and execute its contents */
-	sfile = map_file(argv[0], &size);
-	if (!sfile) goto err;
-
+	/* Stream the seed file into the database */
 	PRINT("Running seed file...\n");
-	if (db_query(sfile, NULL, NULL))
+	if (seed_load(argv[0]))
 		goto err;
 
 	/* Create our state table */
@@ -89,7 +271,6 @@ static int seed(const char *source, const char *current,
 	}
 
 ret:
-	unmap_file(sfile, size);
 	return retval;
 
 err:
@@ -103,76 +284,128 @@ err:
 static int pending(const char *source, const char *current,
                    int argc, char *argv[])
 {
-	char **migrations = NULL;
-	size_t size = 0, i;
+	struct pending_set p;
+	size_t i;
+	unsigned long scanned, skipped;
 	(void)argc;
 	(void)argv;
 
 	/* Get the migrations */
-	migrations = source_find_migrations(source, current, NULL, &size);
-	PRINT_1("%lu migrations pending:\n", size);
+	if (find_pending(source, current, &p))
+		return EXIT_FAILURE;
+
+	/* Say how much of the migration path had to be looked at */
+	if (!source_get_scan_stats(source, &scanned, &skipped)) {
+		PRINT_2("%lu entries scanned, %lu skipped.\n", scanned,
+		        skipped);
+	}
+
+	PRINT_1("%lu migrations pending:\n", p.size);
 
 	/* ... and print them out. */
-	if (migrations) {
-		for (i = 0; i < size; i++) {
-			PRINT_1("  + %s\n", migrations[i]);
-			free(migrations[i]);
-		}
+	for (i = 0; i < p.size; i++) {
+		if (i < p.n_ooo) {
+			PRINT_1("  + %s (out of order)\n", p.migrations[i]);
+		} else PRINT_1("  + %s\n", p.migrations[i]);
 	}
 
-	free(migrations);
+	free_pending_set(&p);
 	return EXIT_SUCCESS;
 }
 
 /**
  * Apply all pending migrations.
+ *
+ * \param[in] source  Migration source
+ * \param[in] current Current revision
+ * \param[in] quiet   Non-zero to say nothing if nothing's pending
+ * \return EXIT_SUCCESS on success, or EXIT_FAILURE on failure.
  */
-static int migrate(const char *source, const char *current,
-                   int argc, char *argv[])
+static int apply_pending(const char *source, const char *current,
+                         int quiet)
 {
 	int retval = EXIT_FAILURE;
-	char **migrations = NULL;
-	const char *migration_path;
+	struct pending_set p;
+	const struct migration *m;
 	const char *local_head;
-	size_t size = 0, mp_len;
-	unsigned int i;
-	(void)argc;
-	(void)argv;
+	char sum[MIGRATION_CHECKSUM_LEN];
+	unsigned long start;
+	unsigned int i = 0, j, recorded = 0, backfilled = 0;
 
 	/* Get the migrations */
-	migrations = source_find_migrations(source, current, NULL, &size);
-	if (!migrations) {
-		error("migrate: no migrations found");
+	if (find_pending(source, current, &p))
+		goto ret;
+
+	if (!p.migrations && !p.unrecorded) {
+		if (!quiet) error("migrate: no migrations found");
 		retval = EXIT_SUCCESS;
 		goto ret;
 	}
 
-	migration_path = source_get_migration_path(source);
-	if (!migration_path) {
-		error("migrate: unable to get migration path");
+	/* Read ahead of the database, while it's busy */
+	if (prefetch_start(source, p.migrations, p.size))
 		goto ret;
-	} else {
-		mp_len = strlen(migration_path);
-		sbuf_reset(1);
-		sbuf_add_str(migration_path, 0, 0);
-		if (migration_path[mp_len - 1] != '/')
-			sbuf_add_str("/", 0, mp_len);
-	}
 
 	if (db_query("BEGIN", NULL, NULL)) {
 		error("migrate: failed to BEGIN transaction");
 		goto ret;
 	}
 
-	/* ... and run them. */
-	for (i = 0; i < size; i++) {
-		PRINT_1("Applying %s...", migrations[i]);
-		sbuf_add_str(migrations[i], 0, mp_len + 1);
-		if (migration_upgrade(sbuf_get_buffer()))
+	/**
+	 * ... and run them, recording each one in the ledger. Where the
+	 * driver can, the statements are pipelined. Their results are
+	 * collected once each migration has run, so that the time kept
+	 * for it is the database's, and again once it's in the ledger,
+	 * so that it's only OK once the database says so.
+	 */
+	db_pipeline_begin();
+
+	/* Record what was applied before there was a ledger */
+	for (j = 0; j < p.n_unrecorded; j++) {
+		if (record_migration(source, p.unrecorded[j])) {
+			error("Unable to populate the migration ledger");
+			goto abort;
+		}
+
+		backfilled = j + 1;
+	}
+
+	for (i = 0; i < p.size; i++) {
+		if (i < p.n_ooo) {
+			PRINT_1("Applying %s (out of order)...",
+			        p.migrations[i]);
+		} else PRINT_1("Applying %s...", p.migrations[i]);
+
+		start = now_ms();
+		if (!(m = prefetch_get(i))
+		    || migration_checksum(m->mem, m->size, sum)
+		    || migration_upgrade(m)
+		    || db_pipeline_sync())
 			goto rollback;
+
+		db_pipeline_label(p.migrations[i]);
+		if (state_ledger_add(p.migrations[i], sum, now_ms() - start))
+			goto rollback;
+
+		/* It's in the ledger, even if the database has yet to say */
+		recorded = i + 1;
+		if (db_pipeline_sync())
+			goto rollback;
+
+		/**
+		 * Without transactional DDL, a failure means rolling back
+		 * by hand, so the migrations are kept until we're done.
+		 */
+		if (db_has_transactional_ddl())
+			prefetch_release(i);
 		PRINT(" OK\n");
 	}
 
+	if (db_pipeline_end()) {
+		error("migrate: failed to apply migrations");
+		goto abort;
+	}
+
 	if (db_query("COMMIT", NULL, NULL)) {
 		error("migrate: failed to COMMIT transaction");
 		goto ret;
@@ -188,19 +421,26 @@ static int migrate(const char *source, const char *current,
 	}
 
 ret:
+	prefetch_stop();
 	sbuf_reset(1);
-	if (migrations) {
-		while (size) free(migrations[--size]);
-		free(migrations);
-	}
+	free_pending_set(&p);
 	return retval;
 
 rollback:
 	PRINT(" FAILED\n");
+
+abort:
+	db_pipeline_end();
 	if (db_query("ROLLBACK", NULL, NULL)) {
 		error("migrate: failed to ROLLBACK transaction");
 	}
 
+	/* Forget what was recorded in the ledger along the way */
+	for (j = 0; j < recorded; j++)
+		state_ledger_remove(p.migrations[j]);
+	for (j = 0; j < backfilled; j++)
+		state_ledger_remove(p.unrecorded[j]);
+
 	/**
 	 * This should only be required for databases which lack
 	 * transactional DDL support (like MySQL.)
@@ -210,27 +450,72 @@ rollback:
 
 	error("migrate: your database lacks transactional DDL support. "
 	      "Performing a manual rollback.");
-	while (--i <= size) {
-		PRINT_1("--> Rolling back %s...", migrations[i]);
-		sbuf_add_str(migrations[i], 0, mp_len + 1);
-		if (migration_downgrade(sbuf_get_buffer())) {
+	while (--i <= p.size) {
+		PRINT_1("--> Rolling back %s...", p.migrations[i]);
+		if (!(m = prefetch_get(i)) || migration_downgrade(m)) {
 			PRINT(" FAILED\n");
 		} else PRINT(" OK\n");
 	}
 	goto ret;
 }
 
+/**
+ * Apply all pending migrations.
+ */
+static int migrate(const char *source, const char *current,
+                   int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+	return apply_pending(source, current, 0);
+}
+
+/**
+ * Apply migrations as they appear, until interrupted.
+ *
+ * The database connection, the state and the ledger are kept
+ * between runs, so each change only costs a rescan of the source.
+ * A migration that fails is left pending, and is tried again the
+ * next time something changes.
+ */
+static int watch(const char *source, const char *current,
+                 int argc, char *argv[])
+{
+	int retval = EXIT_FAILURE, changed;
+	const char *const *paths;
+	(void)argc;
+	(void)argv;
+
+	if (!(paths = source_get_watch_paths(source)) || watch_start(paths)) {
+		error("watch: unable to watch for migrations");
+		return retval;
+	}
+
+	PRINT_1("Watching %s...\n", *paths);
+	apply_pending(source, current, 1);
+	while ((changed = watch_wait()) > 0) {
+		/* e.g. HEAD is now on a branch kept somewhere else */
+		watch_add(source_get_watch_paths(source));
+		apply_pending(source, current, 1);
+	}
+
+	if (!changed) retval = EXIT_SUCCESS;
+	watch_stop();
+	return retval;
+}
+
 /**
  * Rollback migrations between HEAD and the given revision.
+ *
+ * Migrations which the ledger says were never applied are skipped.
  */
 static int rollback(const char *source, const char *current,
                     int argc, char *argv[])
 {
 	int retval = EXIT_FAILURE;
 	char **migrations = NULL;
-	const char *migration_path = NULL;
 	const char *revision = NULL;
-	size_t size = 0, i, mp_len;
+	size_t size = 0, i;
 
 	if (!argc) revision = state_get_previous();
 	else revision = argv[0];
@@ -249,17 +534,8 @@ static int rollback(const char *source, const char *current,
 		goto ret;
 	}
 
-	migration_path = source_get_migration_path(source);
-	if (!migration_path) {
-		error("rollback: unable to get migration path");
+	if (state_ledger_load())
 		goto ret;
-	} else {
-		mp_len = strlen(migration_path);
-		sbuf_reset(1);
-		sbuf_add_str(migration_path, 0, 0);
-		if (migration_path[mp_len - 1] != '/')
-			sbuf_add_str("/", 0, mp_len);
-	}
 
 	if (db_query("BEGIN", NULL, NULL)) {
 		error("rollback: failed to BEGIN transaction");
@@ -267,12 +543,26 @@ static int rollback(const char *source, const char *current,
 	}
 
 	/* ... and roll them back. */
+	db_pipeline_begin();
 	for (i = size - 1; i <= size; i--) {
+		if (state_ledger_size() &&
+		    !state_ledger_lookup(migrations[i]))
+			continue;
+
 		PRINT_1("Rolling back %s...", migrations[i]);
-		sbuf_add_str(migrations[i], 0, mp_len + 1);
-		if (migration_downgrade(sbuf_get_buffer()))
+		if (with_migration(source, migrations[i], migration_downgrade,
+		                   NULL))
 			goto rollback;
-		else PRINT(" OK\n");
+
+		/* It's only rolled back once the database says so */
+		if (state_ledger_remove(migrations[i]) || db_pipeline_sync())
+			goto rollback;
+		PRINT(" OK\n");
+	}
+
+	if (db_pipeline_end()) {
+		error("rollback: failed to roll back migrations");
+		goto abort;
 	}
 
 	if (db_query("COMMIT", NULL, NULL)) {
@@ -288,14 +578,14 @@ static int rollback(const char *source, const char *current,
 
 ret:
 	sbuf_reset(1);
-	if (migrations) {
-		while (size) free(migrations[--size]);
-		free(migrations);
-	}
+	free_migrations(migrations, size);
 	return retval;
 
 rollback:
 	PRINT(" FAILED\n");
+
+abort:
+	db_pipeline_end();
 	if (db_query("ROLLBACK", NULL, NULL)) {
 		error("rollback: failed to ROLLBACK transaction");
 	}
@@ -312,13 +602,16 @@ rollback:
 /**
  * Create a state table in a database, and update it
  * to the current revision.
+ *
+ * Every migration the source knows about is assumed to have been
+ * applied, and is recorded in the ledger.
  */
 static int assimilate(const char *source,
                       const char *current,
                       int argc, char *argv[])
 {
-	char **migrations;
-	size_t size = 0;
+	char **migrations = NULL;
+	size_t size = 0, i;
 	int retval = EXIT_FAILURE;
 	(void)current;
 	(void)argc;
@@ -334,8 +627,22 @@ static int assimilate(const char *source,
 	/* Get the migrations to get the current head. */
 	migrations = source_find_migrations(source, NULL, NULL, &size);
 	if (migrations) {
-		while (size) free(migrations[--size]);
-		free(migrations);
+		if (db_query("BEGIN", NULL, NULL))
+			goto ledger_err;
+
+		db_pipeline_begin();
+		for (i = 0; i < size; i++) {
+			if (record_migration(source, migrations[i]))
+				break;
+		}
+
+		if (db_pipeline_end() || i < size) {
+			db_query("ROLLBACK", NULL, NULL);
+			goto ledger_err;
+		}
+
+		if (db_query("COMMIT", NULL, NULL))
+			goto ledger_err;
 	}
 
 	/* Add the local HEAD revision to the table. */
@@ -347,10 +654,16 @@ static int assimilate(const char *source,
 	}
 
 ret:
+	free_migrations(migrations, size);
 	return retval;
+
+ledger_err:
+	state_destroy();
+	error("assimilate: unable to populate the migration ledger");
+	goto ret;
 }
 
-#define N_COMMANDS 6
+#define N_COMMANDS 7
 #define MIN_COMMAND_LEN 4
 #define MAX_COMMAND_LEN 10
 
@@ -367,7 +680,8 @@ static const struct command {
 	{ "pending", 7, 0, 1, pending },
 	{ "migrate", 7, 0, 1, migrate },
 	{ "rollback", 8, 0, 1, rollback }, /* argv: <revision> */
-	{ "assimilate", 10, 0, 0, assimilate }
+	{ "assimilate", 10, 0, 0, assimilate },
+	{ "watch", 5, 0, 1, watch }
 };
 
 /**
@@ -13,6 +13,7 @@
 #include <ctype.h>
 
 #include "config.h"
+#include "scan.h"
 #include "utils.h"
 
 #ifndef IN_TESTS
@@ -278,7 +279,8 @@ int parse_config(const char *config, size_t len)
 
 		/* Skip comments. */
 		if (pos < len && config[pos] == ';') {
-			while (pos < len && config[pos++] != '\n');
+			pos += scan_any(config + pos, len - pos, "\n");
+			if (pos < len) pos++;
 			continue;
 		}
 
@@ -23,24 +23,27 @@
 static const char *default_migration_path = "migrations";
 
 /**
- * Default config file data.
+ * Default config file data, in parts which are written in turn.
  */
-static const char *default_config_1 =
+static const char *default_config[4] = {
     "[main]\n"
     "history=3        ; Number of state transitions to keep (max 10.)\n"
     "source=file      ; Source to get migrations from.\n"
     "driver=sqlite3   ; Database driver.\n\n"
     ";\n"
     "; Database connection settings\n"
-    ";\nhost=\nport=\nusername=\npassword=\ndb=:memory:\n\n";
+    ";\nhost=\nport=\nusername=\npassword=\ndb=:memory:\n\n",
 
-static const char *default_config_2 =
     ";\n"
     "; Settings for the 'file' source\n"
     ";\n"
     "[file]\n"
     "; Path (relative or absolute) to the migration files.\n"
-    "migration_path=migrations\n\n"
+    "migration_path=migrations\n"
+    "; Index of the migration files, kept so that the path needn't be\n"
+    "; scanned every time (optional.)\n"
+    ";index_file=migrations.idx\n\n",
+
     ";\n"
     "; Settings for the 'git' source\n"
     ";\n"
@@ -48,7 +51,23 @@ static const char *default_config_2 =
     "; Path (relative or absolute) to the git repository.\n"
     "repo_path=.\n"
     "; Path relative to the repository where the migration files are.\n"
-    "migration_path=migrations\n";
+    "migration_path=migrations\n"
+    "; Cache of the migrations each commit touched, so that commits\n"
+    "; needn't be diffed again (optional.)\n"
+    ";cache_file=migrations.cache\n"
+    "; Number of threads used to diff commits (default: 1)\n"
+    ";threads=4\n"
+    "; Read migrations from the repository, not the working tree\n"
+    ";read_blobs=1\n\n",
+
+    ";\n"
+    "; Settings for the 'pack' source\n"
+    ";\n"
+    "[pack]\n"
+    "; Path (relative or absolute) to the migration pack, which is\n"
+    "; built from the 'file' source's migrations by 'mmm pack'.\n"
+    "pack_file=migrations.pack\n"
+};
 
 /**
  * Genrate a default config file.
@@ -62,7 +81,7 @@ static int gen_config_file(const char *config_file, mode_t mode)
 	int fd = 0, retval = 0;
 	ssize_t bw = 0;
 	const char *tmp;
-	size_t bytes_written = 0, size;
+	size_t bytes_written = 0, size, part = 0;
 
 	/* Clear the eXecute bits in mode, and create the file */
 	mode &= (mode_t)~(S_IXUSR | S_IXGRP | S_IXOTH);
@@ -74,7 +93,7 @@ static int gen_config_file(const char *config_file, mode_t mode)
 	}
 
 	/* Write the configuration */
-	tmp = default_config_1;
+	tmp = default_config[part];
 	size = strlen(tmp);
 write_more:
 	errno = 0;
@@ -90,10 +109,10 @@ write_more:
 		goto write_more;
 
 	/* Make sure we output the whole config file */
-	if (tmp == default_config_1) {
+	if (++part < sizeof(default_config) / sizeof(*default_config)) {
+		tmp = default_config[part];
 		bytes_written = 0;
-		size = strlen(default_config_2);
-		tmp = default_config_2;
+		size = strlen(tmp);
 		goto write_more;
 	}
 
@@ -0,0 +1,101 @@
+/**
+ * Minimal Migration Manager - Bulk-load (copy) Sections
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <string.h>
+#include <ctype.h>
+
+#include "utils.h"
+#include "copy.h"
+
+/**
+ * Parse a copy section marker.
+ *
+ * \param[in]  line   Line to parse (without the newline.)
+ * \param[in]  len    Length of the line.
+ * \param[out] target Buffer of at least COPY_TARGET_MAX bytes, which
+ *                    receives the table (and column list) to load.
+ * \return 1 if the line is a copy marker, 0 if it isn't, or -1 if
+ *         it's malformed.
+ */
+int copy_marker(const char *line, size_t len, char *target)
+{
+	size_t start, end, i;
+
+	if (!line || len < COPY_MARKER_LEN ||
+	    memcmp(line, COPY_MARKER, COPY_MARKER_LEN))
+		return 0;
+
+	/* Find the closing bracket */
+	for (end = COPY_MARKER_LEN; end < len && line[end] != ']'; end++)
+		if (line[end] == ';') goto err;
+	if (end == len) goto err;
+
+	/* Only whitespace may follow it */
+	for (i = end + 1; i < len; i++)
+		if (!isspace((unsigned char)line[i])) goto err;
+
+	/* Trim the target */
+	for (start = COPY_MARKER_LEN;
+	     start < end && isspace((unsigned char)line[start]); start++);
+	while (end > start && isspace((unsigned char)line[end - 1])) end--;
+	if (start == end || end - start >= COPY_TARGET_MAX)
+		goto err;
+
+	memcpy(target, line + start, end - start);
+	target[end - start] = '\0';
+	return 1;
+
+err:
+	error("invalid copy section: '%.*s'", (int)len, line);
+	return -1;
+}
+
+/**
+ * Find the rows in a copy section.
+ *
+ * Only complete lines are counted as rows, unless eof is set.
+ *
+ * \param[in]  s    Section data (just past the marker line.)
+ * \param[in]  len  Number of bytes available.
+ * \param[in]  eof  Non-zero if there's no more data beyond len.
+ * \param[out] rows Length of the rows found.
+ * \param[out] next Offset just past the data that was consumed.
+ * \return 1 if the end of the section was found, 0 otherwise.
+ */
+int copy_rows(const char *s, size_t len, int eof, size_t *rows,
+              size_t *next)
+{
+	const char *nl;
+	size_t i = 0, eol;
+
+	while (i < len) {
+		if (!(nl = memchr(s + i, '\n', len - i)) && !eof)
+			break;
+
+		eol = nl ? (size_t)(nl - s) : len;
+		if (eol > i && s[eol - 1] == '\r') --eol;
+
+		/* "\." ends the section, and is consumed along with it */
+		if (eol - i == 2 && s[i] == '\\' && s[i + 1] == '.') {
+			*rows = i;
+			*next = nl ? (size_t)(nl - s) + 1 : len;
+			return 1;
+		}
+
+		/* Another marker ends it too, but it belongs to the caller */
+		if (eol - i >= 4 && !memcmp(s + i, "-- [", 4)) {
+			*rows = *next = i;
+			return 1;
+		}
+
+		i = nl ? (size_t)(nl - s) + 1 : len;
+	}
+
+	*rows = *next = i;
+	return eof;
+}
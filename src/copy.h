@@ -0,0 +1,67 @@
+/**
+ * \file copy.h
+ *
+ * Minimal Migration Manager - Bulk-load (copy) Sections
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+#ifndef COPY_H
+#define COPY_H
+
+#include <stddef.h>
+
+/**
+ * \def COPY_MARKER
+ *
+ * Start of the line which introduces a copy section, e.g.:
+ *
+ *     -- [copy countries(code, name)]
+ *     US	United States
+ *     CA	Canada
+ *     \.
+ *
+ * The rows that follow are in PostgreSQL's text COPY format, and run
+ * up to a line containing only "\.", the next "-- [" marker, or the
+ * end of the file.
+ */
+#define COPY_MARKER "-- [copy "
+#define COPY_MARKER_LEN 9
+
+/**
+ * \def COPY_TARGET_MAX
+ *
+ * Maximum length of a copy section's target, including the
+ * terminating NUL.
+ */
+#define COPY_TARGET_MAX 256
+
+/**
+ * Parse a copy section marker.
+ *
+ * \param[in]  line   Line to parse (without the newline.)
+ * \param[in]  len    Length of the line.
+ * \param[out] target Buffer of at least COPY_TARGET_MAX bytes, which
+ *                    receives the table (and column list) to load.
+ * \return 1 if the line is a copy marker, 0 if it isn't, or -1 if
+ *         it's malformed.
+ */
+int copy_marker(const char *line, size_t len, char *target);
+
+/**
+ * Find the rows in a copy section.
+ *
+ * Only complete lines are counted as rows, unless eof is set.
+ *
+ * \param[in]  s    Section data (just past the marker line.)
+ * \param[in]  len  Number of bytes available.
+ * \param[in]  eof  Non-zero if there's no more data beyond len.
+ * \param[out] rows Length of the rows found.
+ * \param[out] next Offset just past the data that was consumed.
+ * \return 1 if the end of the section was found, 0 otherwise.
+ */
+int copy_rows(const char *s, size_t len, int eof, size_t *rows,
+              size_t *next);
+
+#endif /* COPY_H */
@@ -23,9 +23,21 @@ static const struct db_driver_vtable *drivers[N_DB_DRIVERS];
  * connection.
  */
 static struct db_session {
-	size_t type; /**< Driver type */
-	void *dbh;   /**< Driver-specific connection handle */
-} session = { N_DB_DRIVERS, NULL };
+	size_t type;       /**< Driver type */
+	void *dbh;         /**< Driver-specific connection handle */
+	struct db_row row; /**< Row buffer, reused for every row */
+	int row_cap;       /**< Number of columns the row has room for */
+} session = { N_DB_DRIVERS, NULL, { 0, 0, NULL, NULL, NULL }, 0 };
+
+/**
+ * Driver-independent representation of a prepared
+ * statement.
+ */
+struct db_stmt {
+	size_t type;  /**< Driver type */
+	void *stmt;   /**< Driver-specific statement handle */
+	int n_params; /**< Number of parameters */
+};
 
 /**
  * Lookup a database driver in the table.
@@ -51,6 +63,38 @@ static size_t find_driver(const char *name, size_t len)
 	return SIZE_MAX;
 }
 
+/**
+ * Get the session's row buffer, with room for a number of columns.
+ *
+ * \param[in] n_cols Number of columns.
+ * \return The row buffer, or NULL if it couldn't be grown.
+ */
+struct db_row *db_row_buffer(int n_cols)
+{
+	struct db_row *row = &session.row;
+	char **tmp;
+	size_t *lengths;
+
+	if (n_cols < 0) return NULL;
+	if (n_cols > session.row_cap) {
+		/* Fields and column names share one array */
+		tmp = realloc(row->fields, sizeof(char *) * 2 * (size_t)n_cols);
+		if (!tmp) return NULL;
+		row->fields = tmp;
+
+		lengths = realloc(row->lengths,
+		                  sizeof(size_t) * (size_t)n_cols);
+		if (!lengths) return NULL;
+		row->lengths = lengths;
+		session.row_cap = n_cols;
+	}
+
+	row->n_cols       = n_cols;
+	row->index        = 0;
+	row->column_names = row->fields + n_cols;
+	return row;
+}
+
 /**
  * Initialize the database layer.
  *
@@ -147,12 +191,28 @@ ret:
  */
 int db_query(const char *query, db_row_callback_t callback,
              void *userdata)
+{
+	return db_query_len(query, query ? strlen(query) : 0, callback,
+	                    userdata);
+}
+
+/**
+ * Query a database, with a query which needn't be NUL-terminated.
+ *
+ * \param[in] query    SQL Query to execute.
+ * \param[in] len      Length of the query.
+ * \param[in] callback Callback function, to be called per-row returned.
+ * \param[in] userdata Userdata to be passed to the callback.
+ * \return 0 on success, non-zero on error.
+ */
+int db_query_len(const char *query, size_t len,
+                 db_row_callback_t callback, void *userdata)
 {
 	if (!session.dbh || !query || session.type >= N_DB_DRIVERS)
 		goto err;
 
 	if (drivers[session.type] && drivers[session.type]->query) {
-		return drivers[session.type]->query(session.dbh, query,
+		return drivers[session.type]->query(session.dbh, query, len,
 		                                    callback, userdata);
 	}
 
@@ -160,6 +220,191 @@ err:
 	return -1;
 }
 
+/**
+ * Count the parameter markers in a query, skipping over any
+ * quoted strings or identifiers.
+ *
+ * \param[in] query SQL Query.
+ * \return The number of parameters.
+ */
+static int count_params(const char *query)
+{
+	int n = 0;
+	char quote = '\0';
+
+	for (; *query; query++) {
+		if (quote) {
+			if (*query == quote) quote = '\0';
+		} else if (*query == '\'' || *query == '"') {
+			quote = *query;
+		} else if (*query == '?') ++n;
+	}
+
+	return n;
+}
+
+/**
+ * Prepare a statement for repeated execution.
+ *
+ * Parameters are marked with a '?' in the query, and are bound
+ * as text (or NULL) in the order they appear.
+ *
+ * \param[in] query SQL Query to prepare.
+ * \return A statement handle, or NULL on error.
+ */
+struct db_stmt *db_prepare(const char *query)
+{
+	struct db_stmt *stmt = NULL;
+	const struct db_driver_vtable *driver;
+
+	if (!session.dbh || !query || session.type >= N_DB_DRIVERS)
+		goto ret;
+
+	driver = drivers[session.type];
+	if (!driver || !driver->prepare)
+		goto ret;
+
+	if (!(stmt = malloc(sizeof(struct db_stmt))))
+		goto ret;
+
+	stmt->type     = session.type;
+	stmt->n_params = count_params(query);
+	stmt->stmt     = driver->prepare(session.dbh, query, stmt->n_params);
+	if (!stmt->stmt) {
+		free(stmt);
+		stmt = NULL;
+	}
+
+ret:
+	return stmt;
+}
+
+/**
+ * Bind parameters to a prepared statement, and execute it.
+ *
+ * \param[in] stmt     Statement handle.
+ * \param[in] params   Parameter values (one per '?' in the query.)
+ * \param[in] callback Callback function, to be called per-row returned.
+ * \param[in] userdata Userdata to be passed to the callback.
+ * \return 0 on success, non-zero on error.
+ */
+int db_execute(struct db_stmt *stmt, const char *const *params,
+               db_row_callback_t callback, void *userdata)
+{
+	if (!stmt || !session.dbh || stmt->type != session.type)
+		goto err;
+
+	if (stmt->n_params && !params)
+		goto err;
+
+	if (drivers[session.type] && drivers[session.type]->execute) {
+		return drivers[session.type]->execute(session.dbh, stmt->stmt,
+		                                      stmt->n_params, params,
+		                                      callback, userdata);
+	}
+
+err:
+	return -1;
+}
+
+/**
+ * Free a prepared statement.
+ *
+ * This must be called before the session is disconnected.
+ *
+ * \param[in] stmt Statement handle.
+ */
+void db_finalize(struct db_stmt *stmt)
+{
+	if (!stmt) return;
+
+	if (session.dbh && stmt->type == session.type &&
+	    drivers[session.type] && drivers[session.type]->finalize)
+		drivers[session.type]->finalize(session.dbh, stmt->stmt);
+	free(stmt);
+}
+
+/**
+ * Bulk-load rows into a table, using the fastest means the
+ * database offers.
+ *
+ * \param[in] target Table to load, optionally followed by a
+ *                   parenthesized column list.
+ * \param[in] rows   Row data.
+ * \param[in] len    Length of the row data.
+ * \return 0 on success, non-zero on error.
+ */
+int db_copy(const char *target, const char *rows, size_t len)
+{
+	if (!session.dbh || !target || !rows || session.type >= N_DB_DRIVERS)
+		goto err;
+
+	if (!len) return 0;
+	if (drivers[session.type] && drivers[session.type]->copy) {
+		return drivers[session.type]->copy(session.dbh, target, rows,
+		                                   len);
+	}
+
+err:
+	return -1;
+}
+
+/**
+ * Start sending queries without waiting for their results, if the
+ * driver supports it.
+ */
+void db_pipeline_begin(void)
+{
+	if (session.dbh && session.type < N_DB_DRIVERS &&
+	    drivers[session.type] && drivers[session.type]->pipeline)
+		drivers[session.type]->pipeline(session.dbh, 1);
+}
+
+/**
+ * Wait for the results of everything sent since db_pipeline_begin(),
+ * and go back to running queries one at a time.
+ *
+ * \return 0 on success, non-zero if anything failed.
+ */
+int db_pipeline_end(void)
+{
+	if (session.dbh && session.type < N_DB_DRIVERS &&
+	    drivers[session.type] && drivers[session.type]->pipeline)
+		return drivers[session.type]->pipeline(session.dbh, 0);
+	return 0;
+}
+
+/**
+ * Wait for the results of everything sent so far, and carry on
+ * pipelining.
+ *
+ * \return 0 on success, non-zero if anything failed.
+ */
+int db_pipeline_sync(void)
+{
+	if (!db_pipeline_label(NULL))
+		return 0;
+
+	if (db_pipeline_end())
+		return 1;
+	db_pipeline_begin();
+	return 0;
+}
+
+/**
+ * Label the statements sent from here on.
+ *
+ * \param[in] label Label, or NULL for none.
+ * \return 1 if statements are being pipelined, 0 otherwise.
+ */
+int db_pipeline_label(const char *label)
+{
+	if (session.dbh && session.type < N_DB_DRIVERS &&
+	    drivers[session.type] && drivers[session.type]->pipeline_label)
+		return drivers[session.type]->pipeline_label(session.dbh, label);
+	return 0;
+}
+
 /**
  * Determine the database's support for transactional DDL commands.
  *
@@ -172,6 +417,16 @@ int db_has_transactional_ddl(void)
 	        drivers[session.type]->has_transactional_ddl);
 }
 
+/**
+ * Get the name of the driver used by the current session.
+ *
+ * \return The driver name, or NULL if there's no session.
+ */
+const char *db_get_driver_name(void)
+{
+	return session.dbh ? drivers[session.type]->name : NULL;
+}
+
 /**
  * Disconnect the database session.
  */
@@ -183,6 +438,10 @@ void db_disconnect(void)
 	if (drivers[session.type] && drivers[session.type]->disconnect)
 		drivers[session.type]->disconnect(session.dbh);
 ret:
+	free(session.row.fields);
+	free(session.row.lengths);
+	memset(&session.row, 0, sizeof(session.row));
+	session.row_cap = 0;
 	session.type = N_DB_DRIVERS;
 	session.dbh = NULL;
 }
@@ -14,18 +14,42 @@
 #include <inttypes.h>
 #include "config.h"
 
+/**
+ * A row of a result.
+ *
+ * The arrays belong to the database session, and are reused for each
+ * row (and each query), so they're only valid until the callback
+ * returns.
+ */
+struct db_row {
+	int n_cols;          /**< Number of columns */
+	unsigned long index; /**< Index of the row within its result set */
+	char **fields;       /**< Data fields (NULL for a NULL value) */
+	size_t *lengths;     /**< Length of each field */
+	char **column_names; /**< Column names */
+};
+
 /**
  * Callback for handling database result rows.
  *
- * \param[in] userdata     Userdata passed from \a db_driver_query.
- * \param[in] n_cols       Number of columns in the result.
- * \param[in] fields       Data fields for this row.
- * \param[in] column_names Array of column names corresponding to the row
- *                         data.
- * \return 0 on success, 1 on failure or to stop processing data.
+ * Rows may be passed to the callback as they arrive from the
+ * server, so it mustn't query the database itself. Stopping early
+ * lets the driver skip (or cancel) the rest of the result.
+ *
+ * Stopping isn't an error: every driver returns 0 from a query
+ * which the callback stopped. A callback that fails has to say so
+ * through its userdata.
+ *
+ * \param[in] userdata Userdata passed from \a db_driver_query.
+ * \param[in] row      The row.
+ * \return 0 to carry on, non-zero to stop processing data.
  */
-typedef int (*db_row_callback_t)(void *userdata, int n_cols,
-                                 char **fields, char **column_names);
+typedef int (*db_row_callback_t)(void *userdata, const struct db_row *row);
+
+/**
+ * Prepared statement handle.
+ */
+struct db_stmt;
 
 /**
  * Initialize the database layer.
@@ -72,6 +96,104 @@ int db_connect(const char *driver, const char *host,
 int db_query(const char *query, db_row_callback_t callback,
              void *userdata);
 
+/**
+ * Query a database, with a query which needn't be NUL-terminated
+ * (e.g. a statement within a mapped migration.)
+ *
+ * \param[in] query    SQL Query to execute.
+ * \param[in] len      Length of the query.
+ * \param[in] callback Callback function, to be called per-row returned.
+ * \param[in] userdata Userdata to be passed to the callback.
+ * \return 0 on success, non-zero on error.
+ */
+int db_query_len(const char *query, size_t len,
+                 db_row_callback_t callback, void *userdata);
+
+/**
+ * Prepare a statement for repeated execution.
+ *
+ * Parameters are marked with a '?' in the query, and are bound
+ * as text (or NULL) in the order they appear.
+ *
+ * \param[in] query SQL Query to prepare.
+ * \return A statement handle, or NULL on error.
+ */
+struct db_stmt *db_prepare(const char *query);
+
+/**
+ * Bind parameters to a prepared statement, and execute it.
+ *
+ * \param[in] stmt     Statement handle.
+ * \param[in] params   Parameter values (one per '?' in the query.)
+ * \param[in] callback Callback function, to be called per-row returned.
+ * \param[in] userdata Userdata to be passed to the callback.
+ * \return 0 on success, non-zero on error.
+ */
+int db_execute(struct db_stmt *stmt, const char *const *params,
+               db_row_callback_t callback, void *userdata);
+
+/**
+ * Free a prepared statement.
+ *
+ * This must be called before the session is disconnected.
+ *
+ * \param[in] stmt Statement handle.
+ */
+void db_finalize(struct db_stmt *stmt);
+
+/**
+ * Bulk-load rows into a table, using the fastest means the
+ * database offers.
+ *
+ * The rows are in PostgreSQL's text COPY format: one row per line,
+ * with fields separated by tabs, backslash escapes, and \N for NULL.
+ *
+ * \param[in] target Table to load, optionally followed by a
+ *                   parenthesized column list.
+ * \param[in] rows   Row data.
+ * \param[in] len    Length of the row data.
+ * \return 0 on success, non-zero on error.
+ */
+int db_copy(const char *target, const char *rows, size_t len);
+
+/**
+ * Start sending queries without waiting for their results, if the
+ * driver supports it.
+ *
+ * Until db_pipeline_end() is called, db_query() and db_execute()
+ * may return success for statements which haven't run yet, unless
+ * they're given a callback. Errors are reported by
+ * db_pipeline_end(). If the pipeline can't be started, queries are
+ * simply run one at a time.
+ */
+void db_pipeline_begin(void);
+
+/**
+ * Wait for the results of everything sent since db_pipeline_begin(),
+ * and go back to running queries one at a time.
+ *
+ * \return 0 on success, non-zero if anything failed.
+ */
+int db_pipeline_end(void);
+
+/**
+ * Wait for the results of everything sent so far, and carry on
+ * pipelining.
+ *
+ * \return 0 on success (or if nothing's being pipelined,) non-zero
+ *         if anything failed.
+ */
+int db_pipeline_sync(void);
+
+/**
+ * Label the statements sent from here on, so that an error turning
+ * up later says which one failed.
+ *
+ * \param[in] label Label (copied,) or NULL for none.
+ * \return 1 if statements are being pipelined, 0 otherwise.
+ */
+int db_pipeline_label(const char *label);
+
 /**
  * Determine the database's support for transactional DDL commands.
  *
@@ -80,6 +202,13 @@ int db_query(const char *query, db_row_callback_t callback,
  */
 int db_has_transactional_ddl(void);
 
+/**
+ * Get the name of the driver used by the current session.
+ *
+ * \return The driver name, or NULL if there's no session.
+ */
+const char *db_get_driver_name(void);
+
 /**
  * Disconnect the database session.
  */
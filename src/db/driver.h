@@ -13,6 +13,17 @@
 #include "../db.h"
 #include "../config.h"
 
+/**
+ * Get the session's row buffer, with room for a number of columns.
+ *
+ * Drivers fill this in for each row they pass to a callback, so
+ * that nothing needs to be allocated per query, or per row.
+ *
+ * \param[in] n_cols Number of columns.
+ * \return The row buffer, or NULL if it couldn't be grown.
+ */
+struct db_row *db_row_buffer(int n_cols);
+
 /**
  * Driver Vector Table
  *
@@ -69,15 +80,95 @@ struct db_driver_vtable {
 	/**
 	 * Execute a query on a database connection.
 	 *
+	 * The query isn't necessarily NUL-terminated, and the byte
+	 * just past it may not be readable.
+	 *
 	 * \param[in] dbh      Engine-specific connection handle.
 	 * \param[in] query    SQL Query to execute.
+	 * \param[in] len      Length of the query.
 	 * \param[in] callback Callback function, to be called per-row returned.
 	 * \param[in] userdata Userdata to be passed to the callback.
 	 * \return 0 on success, non-zero on error.
 	 */
-	int (*query)(void *dbh, const char *query,
+	int (*query)(void *dbh, const char *query, size_t len,
 	             db_row_callback_t callback, void *userdata);
 
+	/**
+	 * Prepare a statement on a database connection.
+	 *
+	 * Parameters are marked with a '?' in the query.
+	 *
+	 * \param[in] dbh      Engine-specific connection handle.
+	 * \param[in] query    SQL Query to prepare.
+	 * \param[in] n_params Number of parameters in the query.
+	 * \return A pointer to an engine-specific statement handle,
+	 *         or NULL on error.
+	 */
+	void *(*prepare)(void *dbh, const char *query, int n_params);
+
+	/**
+	 * Bind text parameters to a prepared statement, and execute it.
+	 *
+	 * \param[in] dbh      Engine-specific connection handle.
+	 * \param[in] stmt     Engine-specific statement handle.
+	 * \param[in] n_params Number of parameters.
+	 * \param[in] params   Parameter values (NULL for a NULL value.)
+	 * \param[in] callback Callback function, to be called per-row returned.
+	 * \param[in] userdata Userdata to be passed to the callback.
+	 * \return 0 on success, non-zero on error.
+	 */
+	int (*execute)(void *dbh, void *stmt, int n_params,
+	               const char *const *params,
+	               db_row_callback_t callback, void *userdata);
+
+	/**
+	 * Free a prepared statement.
+	 *
+	 * \param[in] dbh  Engine-specific connection handle.
+	 * \param[in] stmt Engine-specific statement handle.
+	 */
+	void (*finalize)(void *dbh, void *stmt);
+
+	/**
+	 * Bulk-load rows into a table.
+	 *
+	 * The rows are in PostgreSQL's text COPY format: one row per
+	 * line, with fields separated by tabs, backslash escapes, and
+	 * \N for NULL.
+	 *
+	 * \param[in] dbh    Engine-specific connection handle.
+	 * \param[in] target Table to load, optionally followed by a
+	 *                   parenthesized column list.
+	 * \param[in] rows   Row data.
+	 * \param[in] len    Length of the row data.
+	 * \return 0 on success, non-zero on error.
+	 */
+	int (*copy)(void *dbh, const char *target, const char *rows,
+	            size_t len);
+	/**
+	 * Enter or leave pipeline mode (optional.)
+	 *
+	 * In pipeline mode, queries and statements which don't return
+	 * rows may be sent without waiting for their results, which are
+	 * collected no later than when pipeline mode is left.
+	 *
+	 * \param[in] dbh    Engine-specific connection handle.
+	 * \param[in] enable Non-zero to enter pipeline mode.
+	 * \return 0 on success, non-zero on error (or if anything sent
+	 *         through the pipeline failed.)
+	 */
+	int (*pipeline)(void *dbh, int enable);
+	/**
+	 * Label the statements sent through the pipeline from here on,
+	 * so that an error turning up later can say which one failed
+	 * (optional.)
+	 *
+	 * \param[in] dbh   Engine-specific connection handle.
+	 * \param[in] label Label (copied,) or NULL for none.
+	 * \return 1 if in pipeline mode, 0 otherwise.
+	 */
+	int (*pipeline_label)(void *dbh, const char *label);
+
     /**
      * Disconnect a database connection.
      *
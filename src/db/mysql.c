@@ -8,11 +8,13 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #ifndef IN_TESTS
 /* The newer mysql headers aren't ANSI-friendly :/ */
 #define inline
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>
 #endif
 
 #include "driver.h"
@@ -45,6 +47,72 @@ static int db_mysql_uninit(void)
 	return 0;
 }
 
+/**
+ * In-memory "file" handed to LOAD DATA LOCAL INFILE.
+ */
+struct infile {
+	const char *rows; /**< Row data, or NULL outside of a copy */
+	size_t len;       /**< Bytes left */
+};
+
+/**
+ * The rows being copied. Since the server names the file it wants,
+ * the handler only ever hands out these.
+ */
+static struct infile infile;
+
+/**
+ * Open the in-memory file.
+ *
+ * Anything other than the 'mmm' stream, or any request made
+ * outside of db_mysql_copy(), is refused, so that the server can't
+ * read files from the client.
+ */
+static int infile_init(void **ptr, const char *filename, void *userdata)
+{
+	struct infile *f = userdata;
+
+	*ptr = f;
+	return !f->rows || !filename || strcmp(filename, "mmm");
+}
+
+/**
+ * Read the next piece of the in-memory file.
+ */
+static int infile_read(void *ptr, char *buf, unsigned int buf_len)
+{
+	struct infile *f = ptr;
+	size_t n = f->len > buf_len ? buf_len : f->len;
+
+	memcpy(buf, f->rows, n);
+	f->rows += n;
+	f->len  -= n;
+	return (int)n;
+}
+
+/**
+ * Close the in-memory file.
+ */
+static void infile_end(void *ptr)
+{
+	(void)ptr;
+}
+
+/**
+ * Report a refused request for a file.
+ */
+static int infile_error(void *ptr, char *msg, unsigned int msg_len)
+{
+	static const char refused[] = "LOAD DATA LOCAL INFILE refused";
+
+	(void)ptr;
+	if (msg_len) {
+		strncpy(msg, refused, msg_len - 1);
+		msg[msg_len - 1] = '\0';
+	}
+	return CR_UNKNOWN_ERROR;
+}
+
 /**
  * Open a connection to a mysql database.
  *
@@ -52,6 +120,9 @@ static int db_mysql_uninit(void)
  * its defaults, if available; and sets the default session
  * character set to UTF-8.
  *
+ * LOAD DATA LOCAL INFILE is enabled for db_mysql_copy(), with a
+ * handler that only serves the rows being copied.
+ *
  * Passing a host that starts with '/' will cause this function
  * to attempt to connect via the UNIX socket located at the path
  * specified in host.
@@ -78,6 +149,7 @@ static void *db_mysql_connect(const char *host, const unsigned short port,
 	mysql_options(dbh, MYSQL_READ_DEFAULT_GROUP, "mysql");
 	mysql_options(dbh, MYSQL_SET_CHARSET_NAME, "utf8");
 	mysql_options(dbh, MYSQL_OPT_RECONNECT, &tr);
+	mysql_options(dbh, MYSQL_OPT_LOCAL_INFILE, &tr);
 
 	/* Socket connections should be specified via 'host' */
 	if (host && *host == '/') {
@@ -96,8 +168,12 @@ static void *db_mysql_connect(const char *host, const unsigned short port,
 		error("[mysql_connect] %s", mysql_error(dbh));
 		if (dbh) mysql_close(dbh);
 		dbh = NULL;
+		goto ret;
 	}
 
+	mysql_set_local_infile_handler(dbh, infile_init, infile_read,
+	                               infile_end, infile_error, &infile);
+
 ret:
 	return (void *)dbh;
 }
@@ -105,70 +181,79 @@ ret:
 /**
  * Execute a query on a database connection.
  *
+ * Rows are fetched from the server as the callback asks for them,
+ * rather than buffering the whole result first.
+ *
  * NOTE: If we don't handle ALL results from the server, it may
- * drop the connection.
+ * drop the connection. Freeing a result which hasn't been fully
+ * read discards the rest of its rows, without converting them.
  *
  * \param[in] dbh      MYSQL connection handle.
  * \param[in] query    SQL Query to execute.
+ * \param[in] len      Length of the query.
  * \param[in] callback Callback function, to be called per-row returned.
  * \param[in] userdata Userdata to be passed to the callback.
  * \return 0 on success, non-zero on error.
  */
-static int db_mysql_query(void *dbh, const char *query,
+static int db_mysql_query(void *dbh, const char *query, size_t len,
                           db_row_callback_t callback, void *userdata)
 {
 	MYSQL_RES *res = NULL;
 	MYSQL_FIELD *fields;
 	MYSQL_ROW row;
-	char **columns = NULL;
+	struct db_row *r;
+	unsigned long *lengths;
 	const char *errmsg;
-	int retval = 0, x = 0;
+	int retval = 0, stop = 0, x = 0;
 	unsigned int ncols, i;
-	unsigned long nrows;
 
 	if (!dbh || !query) goto err;
 
 	/* Perform the query */
-	if (mysql_real_query(dbh, query, strlen(query)))
+	if (mysql_real_query(dbh, query, (unsigned long)len))
 		goto err_msg;
 
 	do {
 		/* Get the result */
-		res = mysql_store_result(dbh);
+		res = mysql_use_result(dbh);
 		if (!res) goto next_result;
 
 		/* If we don't need/want more results, skip processing. */
-		if (retval) goto next_result;
+		if (retval || stop || !callback) goto next_result;
 
-		/* Ensure we have at least 1 row and column */
-		nrows = mysql_num_rows(res);
+		/* Ensure we have at least 1 column */
 		ncols = mysql_num_fields(res);
-		if (!nrows || !ncols || !callback)
-			goto next_result;
+		if (!ncols) goto next_result;
 
 		/* Fetch the fields */
 		fields = mysql_fetch_fields(res);
 		if (!fields) goto next_result;
 
-		/* Allocate an array for the field names */
-		columns = malloc(sizeof(char *) * ncols);
-		if (!columns) {
+		if (!(r = db_row_buffer((int)ncols))) {
 			retval = 1;
 			goto next_result;
-		} else {
-			for (i = 0; i < ncols; i++)
-				columns[i] = fields[i].name;
 		}
 
+		for (i = 0; i < ncols; i++)
+			r->column_names[i] = fields[i].name;
+
 		/* Fetch the rows and pass them to the callback */
-		for (i = 0; i < nrows; i++) {
-			row = mysql_fetch_row(res);
-			retval = callback(userdata, (int)ncols, row,
-			                  columns);
-			if (retval) break;
+		while ((row = mysql_fetch_row(res))) {
+			lengths = mysql_fetch_lengths(res);
+			for (i = 0; i < ncols; i++) {
+				r->fields[i]  = row[i];
+				r->lengths[i] = (size_t)lengths[i];
+			}
+
+			if ((stop = callback(userdata, r))) break;
+			++r->index;
 		}
 
-		free(columns);
+		/* A row we couldn't fetch is an error */
+		if (!row && mysql_errno(dbh)) {
+			mysql_free_result(res);
+			goto err_msg;
+		}
 
 next_result:
 		if (res) mysql_free_result(res);
@@ -176,7 +261,6 @@ next_result:
 	} while (!x);
 
 	if (x > 0) goto err_msg;
-	retval = 0;
 
 ret:
 	return retval;
@@ -186,10 +270,252 @@ err_msg:
 	if (errmsg) error("query failed: %s", errmsg);
 
 err:
-	++retval;
+	retval = 1;
 	goto ret;
 }
 
+/**
+ * Prepare a statement.
+ *
+ * \param[in] dbh      MYSQL connection handle.
+ * \param[in] query    SQL Query to prepare.
+ * \param[in] n_params Unused.
+ * \return A pointer to a MYSQL_STMT statement handle, or NULL on
+ *         error.
+ */
+static void *db_mysql_prepare(void *dbh, const char *query, int n_params)
+{
+	MYSQL_STMT *stmt = NULL;
+	(void)n_params;
+
+	if (!dbh || !query || !(stmt = mysql_stmt_init(dbh)))
+		goto ret;
+
+	if (mysql_stmt_prepare(stmt, query, strlen(query))) {
+		error("prepare failed: %s", mysql_stmt_error(stmt));
+		mysql_stmt_close(stmt);
+		stmt = NULL;
+	}
+
+ret:
+	return (void *)stmt;
+}
+
+/**
+ * Fetch the rows of a statement's result set, and pass them to a
+ * callback.
+ *
+ * The rows are buffered on the client, so that the buffers for
+ * each column can be sized to fit the longest value.
+ *
+ * \param[in] stmt     MYSQL_STMT statement handle.
+ * \param[in] meta     Result set metadata.
+ * \param[in] callback Callback function, to be called per-row returned.
+ * \param[in] userdata Userdata to be passed to the callback.
+ * \return 0 on success, non-zero on error.
+ */
+static int fetch_rows(MYSQL_STMT *stmt, MYSQL_RES *meta,
+                      db_row_callback_t callback, void *userdata)
+{
+	MYSQL_FIELD *fields;
+	MYSQL_BIND *bind = NULL;
+	struct db_row *row;
+	unsigned long *lengths;
+	unsigned int ncols, i;
+	int x, retval = 1;
+
+	ncols = mysql_num_fields(meta);
+	if (!ncols || !(fields = mysql_fetch_fields(meta)))
+		goto ret;
+
+	mysql_stmt_attr_set(stmt, STMT_ATTR_UPDATE_MAX_LENGTH, &tr);
+	if (mysql_stmt_store_result(stmt))
+		goto ret;
+
+	bind    = calloc(ncols, sizeof(MYSQL_BIND));
+	lengths = calloc(ncols, sizeof(unsigned long));
+	row     = db_row_buffer((int)ncols);
+	if (!bind || !lengths || !row) goto done;
+
+	/* Bind a buffer big enough for the longest value in each column */
+	for (i = 0; i < ncols; i++) {
+		row->column_names[i] = fields[i].name;
+		bind[i].buffer_type   = MYSQL_TYPE_STRING;
+		bind[i].buffer_length = fields[i].max_length + 1;
+		bind[i].buffer        = malloc(bind[i].buffer_length);
+		bind[i].length        = &lengths[i];
+		bind[i].is_null       = &bind[i].is_null_value;
+		if (!bind[i].buffer) goto done;
+	}
+
+	if (mysql_stmt_bind_result(stmt, bind))
+		goto done;
+
+	/* Fetch the rows and pass them to the callback */
+	while (!(x = mysql_stmt_fetch(stmt))) {
+		for (i = 0; i < ncols; i++) {
+			row->lengths[i] = (size_t)lengths[i];
+			if (bind[i].is_null_value)
+				row->fields[i] = NULL;
+			else row->fields[i] = bind[i].buffer;
+		}
+
+		if (callback(userdata, row)) {
+			x = MYSQL_NO_DATA;
+			break;
+		}
+
+		++row->index;
+	}
+
+	if (x == MYSQL_NO_DATA)
+		retval = 0;
+
+done:
+	for (i = 0; bind && i < ncols; i++)
+		free(bind[i].buffer);
+	free(lengths);
+	free(bind);
+	mysql_stmt_free_result(stmt);
+
+ret:
+	return retval;
+}
+
+/**
+ * Bind text parameters to a prepared statement, and execute it.
+ *
+ * \param[in] dbh      MYSQL connection handle.
+ * \param[in] stmt     MYSQL_STMT statement handle.
+ * \param[in] n_params Number of parameters.
+ * \param[in] params   Parameter values.
+ * \param[in] callback Callback function, to be called per-row returned.
+ * \param[in] userdata Userdata to be passed to the callback.
+ * \return 0 on success, non-zero on error.
+ */
+static int db_mysql_execute(void *dbh, void *stmt, int n_params,
+                            const char *const *params,
+                            db_row_callback_t callback, void *userdata)
+{
+	MYSQL_STMT *s = (MYSQL_STMT *)stmt;
+	MYSQL_BIND *bind = NULL;
+	MYSQL_RES *meta = NULL;
+	unsigned long *lengths = NULL;
+	const char *tmp;
+	int i, retval = 1;
+
+	if (!dbh || !s || n_params < 0) goto ret;
+
+	if (n_params) {
+		bind    = calloc((size_t)n_params, sizeof(MYSQL_BIND));
+		lengths = calloc((size_t)n_params, sizeof(unsigned long));
+		if (!bind || !lengths) goto ret;
+	}
+
+	for (i = 0; i < n_params; i++) {
+		if (!params[i]) {
+			bind[i].buffer_type = MYSQL_TYPE_NULL;
+			continue;
+		}
+
+		tmp = params[i];
+		lengths[i] = strlen(tmp);
+		bind[i].buffer_type   = MYSQL_TYPE_STRING;
+		bind[i].buffer        = (char *)(uintptr_t)tmp;
+		bind[i].buffer_length = lengths[i];
+		bind[i].length        = &lengths[i];
+	}
+
+	if ((bind && mysql_stmt_bind_param(s, bind)) ||
+	    mysql_stmt_execute(s))
+		goto err_msg;
+
+	/* Statements which don't return rows have no metadata */
+	retval = 0;
+	if (!(meta = mysql_stmt_result_metadata(s)))
+		goto ret;
+
+	if (!callback) {
+		mysql_stmt_free_result(s);
+	} else if ((retval = fetch_rows(s, meta, callback, userdata)))
+		goto err_msg;
+
+ret:
+	if (meta) mysql_free_result(meta);
+	free(lengths);
+	free(bind);
+	return retval;
+
+err_msg:
+	error("query failed: %s", mysql_stmt_error(s));
+	retval = 1;
+	goto ret;
+}
+
+/**
+ * Free a prepared statement.
+ *
+ * \param[in] dbh  Unused.
+ * \param[in] stmt MYSQL_STMT statement handle.
+ */
+static void db_mysql_finalize(void *dbh, void *stmt)
+{
+	(void)dbh;
+	if (stmt) mysql_stmt_close((MYSQL_STMT *)stmt);
+}
+
+/**
+ * Bulk-load rows into a table with LOAD DATA LOCAL INFILE.
+ *
+ * The rows are streamed from memory by the connection's local
+ * infile handler, rather than a real file. Since LOAD DATA turns
+ * bad values into warnings rather than errors, any warning fails
+ * the copy. MySQL's default format for LOAD DATA
+ * (tab-separated, backslash escapes, \N for NULL) is the same as
+ * PostgreSQL's text COPY format. The column list has to come after
+ * the CHARACTER SET clause, so it's split from the table name.
+ *
+ * \param[in] dbh    MYSQL connection handle.
+ * \param[in] target Table to load, optionally followed by a
+ *                   parenthesized column list.
+ * \param[in] rows   Row data.
+ * \param[in] len    Length of the row data.
+ * \return 0 on success, non-zero on error.
+ */
+static int db_mysql_copy(void *dbh, const char *target, const char *rows,
+                         size_t len)
+{
+	const char *cols;
+	char *query;
+	unsigned int warnings;
+	int retval;
+
+	if (!dbh || !target || !rows)
+		return 1;
+
+	if (!(query = malloc(strlen(target) + 64)))
+		return 1;
+
+	if (!(cols = strchr(target, '(')))
+		cols = target + strlen(target);
+
+	sprintf(query, "LOAD DATA LOCAL INFILE 'mmm' INTO TABLE %.*s "
+	               "CHARACTER SET utf8 %s", (int)(cols - target), target,
+	        cols);
+
+	infile.rows = rows;
+	infile.len  = len;
+	retval = db_mysql_query(dbh, query, strlen(query), NULL, NULL);
+	infile.rows = NULL;
+	free(query);
+
+	if (!retval && (warnings = mysql_warning_count(dbh))) {
+		error("copy into %s: %u warnings", target, warnings);
+		retval = 1;
+	}
+	return retval;
+}
+
 /**
  * Close a mysql connection.
  *
@@ -208,5 +534,11 @@ const struct db_driver_vtable mysql_vtable = {
 	db_mysql_uninit,
 	db_mysql_connect,
 	db_mysql_query,
+	db_mysql_prepare,
+	db_mysql_execute,
+	db_mysql_finalize,
+	db_mysql_copy,
+	/* pipeline */ NULL,
+	/* pipeline_label */ NULL,
 	db_mysql_disconnect
 };
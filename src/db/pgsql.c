@@ -14,6 +14,7 @@
 #endif
 
 #include "driver.h"
+#include "../sql.h"
 #include "../stringbuf.h"
 #include "../utils.h"
 
@@ -61,88 +62,674 @@ ret:
 }
 
 /**
- * Execute a query on a database connection.
+ * Check the status of a result, and free it.
+ *
+ * \param[in] dbh PGconn connection handle.
+ * \param[in] res Result.
+ * \return 0 on success, non-zero on error.
+ */
+static int process_result(PGconn *dbh, PGresult *res)
+{
+	char *errmsg;
+	int retval = 0;
+
+	if (res && (PQresultStatus(res) == PGRES_COMMAND_OK ||
+	            PQresultStatus(res) == PGRES_TUPLES_OK))
+		goto done;
+
+	errmsg = PQerrorMessage(dbh);
+	if (errmsg) error("query failed: %s", errmsg);
+	retval = 1;
+
+done:
+	if (res) PQclear(res);
+	return retval;
+}
+
+/**
+ * Determine whether a query may be cancelled once its callback
+ * stops.
+ *
+ * This has to be checked before the query is sent, since the
+ * connection is busy (PQTRANS_ACTIVE) until its results have all
+ * been collected. Cancelling in a transaction would abort it, and
+ * cancelling a query of several statements could stop the ones
+ * after the one being read, so only a lone statement outside of a
+ * transaction qualifies.
+ *
+ * \param[in] dbh   PGconn connection handle.
+ * \param[in] query SQL Query to be sent, or NULL for a prepared
+ *                  statement.
+ * \param[in] len   Length of the query.
+ * \return 1 if the query may be cancelled, 0 otherwise.
+ */
+static int can_cancel(PGconn *dbh, const char *query, size_t len)
+{
+	struct sql_scanner s;
+
+	if (PQtransactionStatus(dbh) != PQTRANS_IDLE)
+		return 0;
+	if (!query) return 1;
+
+	sql_scan_init(&s, sql_dialect("pgsql"));
+	sql_scan(&s, query, len, len);
+	return s.n_stmts + (s.tokens ? 1 : 0) <= 1;
+}
+
+/**
+ * Pass rows to a callback as they arrive.
+ *
+ * The query must have just been sent. In single-row mode, libpq
+ * hands us each row as soon as it's received, rather than buffering
+ * the whole result. If the callback asks us to stop, and the query
+ * may be cancelled (see can_cancel()), the rest of it is cancelled
+ * rather than received only to be thrown away.
  *
  * \param[in] dbh      PGconn connection handle.
- * \param[in] query    SQL Query to execute.
  * \param[in] callback Callback function, to be called per-row returned.
  * \param[in] userdata Userdata to be passed to the callback.
- * \return 0 on success, non-zero on error.
+ * \param[in] cancel   Non-zero if the query may be cancelled.
+ * \return 0 on success (even if the callback stopped us), non-zero
+ *         on error.
  */
-static int db_pgsql_query(void *dbh, const char *query,
-                          db_row_callback_t callback, void *userdata)
+static int stream_results(PGconn *dbh, db_row_callback_t callback,
+                          void *userdata, int cancel)
 {
 	PGresult *res;
-	char **columns = NULL, **row = NULL, *errmsg;
-	int i, j, nrows, ncols, retval = 0;
+	PGcancel *c;
+	struct db_row *row;
+	char *errmsg, msg[256];
+	unsigned long index = 0;
+	int i, j, nrows, ncols, last, stop = 0, retval = 0;
 
-	if (!dbh || !query) goto err;
+	PQsetSingleRowMode(dbh);
 
-	/* Perform the query */
-	res = PQexec(dbh, query);
-	if (!res) goto err_msg;
+	/* Every result has to be collected, even after we've stopped */
+	while ((res = PQgetResult(dbh))) {
+		if (stop || retval)
+			goto next;
 
-	/* The command ran successfully */
-	if (PQresultStatus(res) == PGRES_COMMAND_OK)
-		goto done;
+		switch (PQresultStatus(res)) {
+		case PGRES_SINGLE_TUPLE: last = 0; break;
+		case PGRES_TUPLES_OK:    last = 1; break;
+		case PGRES_COMMAND_OK:   goto next;
+		default:
+			errmsg = PQerrorMessage(dbh);
+			if (errmsg) error("query failed: %s", errmsg);
+			retval = 1;
+			goto next;
+		}
+
+		nrows = PQntuples(res);
+		ncols = PQnfields(res);
+		if (nrows <= 0 || ncols <= 0)
+			goto end_of_set;
+
+		/**
+		 * Each row arrives in a result of its own, so the names
+		 * have to be pointed at each time.
+		 */
+		if (!(row = db_row_buffer(ncols))) {
+			retval = 1;
+			goto next;
+		}
+
+		for (j = 0; j < ncols; j++)
+			row->column_names[j] = PQfname(res, j);
+
+		for (i = 0; i < nrows && !stop; i++) {
+			for (j = 0; j < ncols; j++) {
+				if (PQgetisnull(res, i, j)) {
+					row->fields[j]  = NULL;
+					row->lengths[j] = 0;
+				} else {
+					row->fields[j]  = PQgetvalue(res, i, j);
+					row->lengths[j] =
+						(size_t)PQgetlength(res, i, j);
+				}
+			}
+
+			row->index = index++;
+			stop = callback(userdata, row);
+		}
 
-	/* The command ran successfully, and returned results */
-	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		if (stop && cancel && (c = PQgetCancel(dbh))) {
+			PQcancel(c, msg, sizeof(msg));
+			PQfreeCancel(c);
+		}
+
+end_of_set:
+		if (last) index = 0;
+
+next:
 		PQclear(res);
-		goto err_msg;
 	}
 
-	/* Process the result */
-	nrows = PQntuples(res);
-	ncols = PQnfields(res);
-	if (nrows <= 0 || ncols <= 0 || !callback)
-		goto done;
+	return retval;
+}
 
-	/* Allocate an array for the field names */
-	columns = malloc(sizeof(char *) * (unsigned int)ncols);
-	if (!columns) {
-		retval = 1;
-		goto done;
-	} else {
-		for (i = 0; i < ncols; i++)
-			columns[i] = PQfname(res, i);
-	}
+#ifdef LIBPQ_HAS_PIPELINING
+/**
+ * Number of statements sent before we stop to collect their
+ * results, so that neither end blocks on a full socket buffer.
+ */
+#define PIPELINE_MAX 256
 
-	row = malloc(sizeof(char *) * (unsigned int)ncols);
-	if (!row) {
-		retval = 1;
-		free(columns);
+/**
+ * Length of the excerpt kept for each statement, for error
+ * messages.
+ */
+#define EXCERPT_LEN 48
+
+/**
+ * Longest label kept for each statement (see db_pgsql_label().)
+ */
+#define LABEL_LEN 128
+
+/**
+ * Statements which have been sent, but whose results haven't been
+ * collected.
+ *
+ * In pipeline mode, statements go out back-to-back, and their
+ * results are collected when the pipeline is synced. Once one
+ * fails, the server skips everything up to the next sync, so only
+ * the first failure is reported.
+ */
+static struct pipeline {
+	int active;            /**< In pipeline mode */
+	int failed;            /**< A statement has failed */
+	char label[LABEL_LEN]; /**< Label for what's sent next */
+	size_t n_pending;      /**< Statements awaiting results */
+	struct pending {
+		char label[LABEL_LEN];      /**< Caller's label */
+		char excerpt[EXCERPT_LEN];  /**< Start of the statement */
+	} pending[PIPELINE_MAX];
+} pipeline;
+
+/**
+ * Copy the start of a statement, on one line, for error messages.
+ */
+static void excerpt(char *dst, const char *stmt)
+{
+	size_t i;
+
+	while (*stmt == ' ' || *stmt == '\t' || *stmt == '\r' ||
+	       *stmt == '\n') stmt++;
+
+	for (i = 0; i < EXCERPT_LEN - 1 && stmt[i]; i++)
+		dst[i] = (stmt[i] == '\n' || stmt[i] == '\r' ||
+		          stmt[i] == '\t') ? ' ' : stmt[i];
+	dst[i] = '\0';
+}
+
+/**
+ * Collect the results of the statements in the pipeline.
+ *
+ * \param[in] dbh PGconn connection handle.
+ * \return 0 if every statement in the pipeline has succeeded,
+ *         non-zero otherwise.
+ */
+static int pipeline_sync(PGconn *dbh)
+{
+	PGresult *res;
+	char *errmsg;
+	size_t i;
+
+	if (!pipeline.n_pending)
+		goto ret;
+
+	if (PQpipelineSync(dbh) != 1) {
+		errmsg = PQerrorMessage(dbh);
+		error("query failed: %s", errmsg ? errmsg : "");
+		pipeline.failed = 1;
 		goto done;
 	}
 
-	/* Fetch the rows and pass them to the callback */
-	for (i = 0; i < nrows; i++) {
-		for (j = 0; j < ncols; j++) {
-			if (PQgetisnull(res, i, j))
-				row[j] = NULL;
-			else row[j] = PQgetvalue(res, i, j);
-		}
+	/* Each statement's results are followed by a NULL */
+	for (i = 0; i < pipeline.n_pending; i++) {
+		while ((res = PQgetResult(dbh))) {
+			if (PQresultStatus(res) == PGRES_FATAL_ERROR &&
+			    !pipeline.failed) {
+				errmsg = PQresultErrorMessage(res);
+				error("query failed: %s", errmsg ? errmsg : "");
+				error("%s failed: %s",
+				      *pipeline.pending[i].label ?
+				      pipeline.pending[i].label : "statement",
+				      pipeline.pending[i].excerpt);
+				pipeline.failed = 1;
+			} else if (PQresultStatus(res) == PGRES_PIPELINE_ABORTED) {
+				pipeline.failed = 1;
+			}
 
-		if (callback(userdata, ncols, row, columns))
-			break;
+			PQclear(res);
+		}
 	}
 
-	free(row);
-	free(columns);
+	/* ... and the sync has its own result */
+	res = PQgetResult(dbh);
+	if (!res || PQresultStatus(res) != PGRES_PIPELINE_SYNC)
+		pipeline.failed = 1;
+	if (res) PQclear(res);
 
 done:
-	PQclear(res);
+	pipeline.n_pending = 0;
+
+ret:
+	return pipeline.failed;
+}
+
+/**
+ * Keep track of a statement we've sent.
+ *
+ * \param[in] dbh  PGconn connection handle.
+ * \param[in] stmt The statement.
+ * \param[in] sent Return value of the PQsend function.
+ * \return 0 on success, non-zero if the pipeline has failed.
+ */
+static int pipeline_push(PGconn *dbh, const char *stmt, int sent)
+{
+	struct pending *p;
+	char *errmsg;
+
+	if (!sent) {
+		errmsg = PQerrorMessage(dbh);
+		error("query failed: %s", errmsg ? errmsg : "");
+		pipeline.failed = 1;
+		goto ret;
+	}
+
+	p = pipeline.pending + pipeline.n_pending++;
+	strcpy(p->label, pipeline.label);
+	excerpt(p->excerpt, stmt);
+	if (pipeline.n_pending == PIPELINE_MAX)
+		pipeline_sync(dbh);
+
+ret:
+	return pipeline.failed;
+}
+
+/**
+ * Send each statement in a query down the pipeline.
+ *
+ * Only one statement may be sent at a time in pipeline mode, so
+ * the query is split into its statements.
+ *
+ * \param[in] dbh   PGconn connection handle.
+ * \param[in] query SQL Query to send (from terminate().)
+ * \param[in] len   Length of the query.
+ * \return 0 on success, non-zero if the pipeline has failed.
+ */
+static int pipeline_query(PGconn *dbh, char *query, size_t len)
+{
+	struct sql_scanner s;
+	size_t start, end;
+	unsigned long n;
+	char c;
+
+	sql_scan_init(&s, sql_dialect("pgsql") | SQL_ONE);
+	while (s.pos < len && !pipeline.failed) {
+		start = s.boundary;
+		n     = s.n_stmts;
+		sql_scan(&s, query, len, len);
+
+		/* Skip empty statements, but not a final one without a ';' */
+		if (s.n_stmts > n) end = s.boundary;
+		else if (s.pos >= len && s.tokens) end = len;
+		else continue;
+
+		c = query[end];
+		query[end] = '\0';
+		pipeline_push(dbh, query + start,
+		              PQsendQueryParams(dbh, query + start, 0, NULL,
+		                                NULL, NULL, NULL, 0));
+		query[end] = c;
+	}
+
+	return pipeline.failed;
+}
+
+/**
+ * Leave pipeline mode for something which needs its results
+ * right away.
+ *
+ * \param[in] dbh PGconn connection handle.
+ * \return 1 if the pipeline was paused, 0 otherwise.
+ */
+static int pipeline_pause(PGconn *dbh)
+{
+	if (!pipeline.active)
+		return 0;
+
+	pipeline_sync(dbh);
+	if (PQexitPipelineMode(dbh) != 1)
+		pipeline.failed = 1;
+	return 1;
+}
+
+/**
+ * Re-enter pipeline mode, after pipeline_pause().
+ *
+ * \param[in] dbh    PGconn connection handle.
+ * \param[in] paused Return value of pipeline_pause().
+ */
+static void pipeline_resume(PGconn *dbh, int paused)
+{
+	if (paused && PQenterPipelineMode(dbh) != 1)
+		pipeline.failed = 1;
+}
+
+/**
+ * Enter or leave pipeline mode.
+ *
+ * \param[in] dbh    PGconn connection handle.
+ * \param[in] enable Non-zero to enter pipeline mode.
+ * \return 0 on success, non-zero on error (or if any statement
+ *         sent through the pipeline failed.)
+ */
+static int db_pgsql_pipeline(void *dbh, int enable)
+{
+	int retval = 0;
+
+	if (!dbh) return 1;
+	if (enable) {
+		if (pipeline.active) goto ret;
+		memset(&pipeline, 0, sizeof(pipeline));
+		if (PQenterPipelineMode(dbh) != 1) {
+			error("unable to enter pipeline mode");
+			retval = 1;
+		} else pipeline.active = 1;
+	} else if (pipeline.active) {
+		retval = pipeline_sync(dbh);
+		if (PQexitPipelineMode(dbh) != 1)
+			retval = 1;
+		pipeline.active = 0;
+	}
 
 ret:
 	return retval;
+}
 
-err_msg:
-	errmsg = PQerrorMessage(dbh);
-	if (errmsg) error("query failed: %s", errmsg);
+/**
+ * Label the statements sent through the pipeline from here on.
+ *
+ * \param[in] dbh   PGconn connection handle.
+ * \param[in] label Label, or NULL for none.
+ * \return 1 if in pipeline mode, 0 otherwise.
+ */
+static int db_pgsql_label(void *dbh, const char *label)
+{
+	if (!dbh || !pipeline.active)
+		return 0;
+
+	*pipeline.label = '\0';
+	if (label) strncat(pipeline.label, label, LABEL_LEN - 1);
+	return 1;
+}
+#else
+#define pipeline_pause(dbh) 0
+#define pipeline_resume(dbh, paused) (void)(paused)
+#endif /* LIBPQ_HAS_PIPELINING */
+
+/**
+ * libpq only takes NUL-terminated queries, so each query is copied
+ * here first. The buffer is kept until the connection is closed.
+ */
+static struct query_buffer {
+	char *buf;  /**< Query */
+	size_t cap; /**< Size of the buffer */
+} qbuf;
+
+/**
+ * Copy a query into the query buffer, and terminate it.
+ *
+ * \param[in] query SQL Query.
+ * \param[in] len   Length of the query.
+ * \return The copy, or NULL if the buffer couldn't be grown.
+ */
+static char *terminate(const char *query, size_t len)
+{
+	char *tmp;
+
+	if (len >= qbuf.cap) {
+		if (!(tmp = realloc(qbuf.buf, len + 1))) {
+			error("Out of memory");
+			return NULL;
+		}
+
+		qbuf.buf = tmp;
+		qbuf.cap = len + 1;
+	}
+
+	memcpy(qbuf.buf, query, len);
+	qbuf.buf[len] = '\0';
+	return qbuf.buf;
+}
+
+/**
+ * Execute a query on a database connection.
+ *
+ * Rows are passed to the callback as they arrive. In pipeline mode,
+ * queries without a callback are sent without waiting for their
+ * results.
+ *
+ * \param[in] dbh      PGconn connection handle.
+ * \param[in] query    SQL Query to execute.
+ * \param[in] len      Length of the query.
+ * \param[in] callback Callback function, to be called per-row returned.
+ * \param[in] userdata Userdata to be passed to the callback.
+ * \return 0 on success, non-zero on error.
+ */
+static int db_pgsql_query(void *dbh, const char *query, size_t len,
+                          db_row_callback_t callback, void *userdata)
+{
+	int retval, paused, cancel;
+	char *sql;
+
+	if (!dbh || !query || !(sql = terminate(query, len))) return 1;
+#ifdef LIBPQ_HAS_PIPELINING
+	if (pipeline.active && !callback)
+		return pipeline.failed || pipeline_query(dbh, sql, len);
+#endif
+
+	paused = pipeline_pause(dbh);
+	if (!callback) {
+		retval = process_result(dbh, PQexec(dbh, sql));
+	} else {
+		cancel = can_cancel(dbh, sql, len);
+		if (PQsendQuery(dbh, sql))
+			retval = stream_results(dbh, callback, userdata,
+			                        cancel);
+		else retval = process_result(dbh, NULL);
+	}
+	pipeline_resume(dbh, paused);
+	return retval;
+}
+
+/**
+ * Prepared statements are named, since libpq has no other way to
+ * refer to them.
+ */
+#define STMT_NAME_LEN 24
+static unsigned long stmt_counter = 0;
+
+/**
+ * Prepare a statement.
+ *
+ * The '?' parameter markers are rewritten into the $n form that
+ * PostgreSQL expects.
+ *
+ * \param[in] dbh      PGconn connection handle.
+ * \param[in] query    SQL Query to prepare.
+ * \param[in] n_params Number of parameters in the query.
+ * \return A pointer to the statement name, or NULL on error.
+ */
+static void *db_pgsql_prepare(void *dbh, const char *query, int n_params)
+{
+	char *name = NULL, *q = NULL, *d, quote = '\0';
+	int n = 0, paused, failed;
+
+	if (!dbh || !query || n_params < 0)
+		goto err;
+
+	name = malloc(STMT_NAME_LEN);
+	q = malloc(strlen(query) + (size_t)n_params * 10 + 1);
+	if (!name || !q) goto err;
+
+	for (d = q; *query; query++) {
+		if (quote) {
+			if (*query == quote) quote = '\0';
+		} else if (*query == '\'' || *query == '"') {
+			quote = *query;
+		} else if (*query == '?' && n < n_params) {
+			d += sprintf(d, "$%d", ++n);
+			continue;
+		}
+
+		*d++ = *query;
+	}
+
+	*d = '\0';
+	sprintf(name, "mmm_stmt_%lu", ++stmt_counter);
+	paused = pipeline_pause(dbh);
+	failed = process_result(dbh, PQprepare(dbh, name, q, n_params, NULL));
+	pipeline_resume(dbh, paused);
+	if (failed) goto err;
+
+	free(q);
+	return name;
 
 err:
-	++retval;
-	goto ret;
+	free(q);
+	free(name);
+	return NULL;
+}
+
+/**
+ * Bind text parameters to a prepared statement, and execute it.
+ *
+ * \param[in] dbh      PGconn connection handle.
+ * \param[in] stmt     Statement name.
+ * \param[in] n_params Number of parameters.
+ * \param[in] params   Parameter values.
+ * \param[in] callback Callback function, to be called per-row returned.
+ * \param[in] userdata Userdata to be passed to the callback.
+ * \return 0 on success, non-zero on error.
+ */
+static int db_pgsql_execute(void *dbh, void *stmt, int n_params,
+                            const char *const *params,
+                            db_row_callback_t callback, void *userdata)
+{
+	int retval, paused, cancel;
+
+	if (!dbh || !stmt) return 1;
+#ifdef LIBPQ_HAS_PIPELINING
+	if (pipeline.active && !callback) {
+		return pipeline.failed ||
+		       pipeline_push(dbh, stmt,
+		                     PQsendQueryPrepared(dbh, (const char *)stmt,
+		                                         n_params, params, NULL,
+		                                         NULL, 0));
+	}
+#endif
+
+	paused = pipeline_pause(dbh);
+	if (!callback) {
+		retval = process_result(dbh,
+		                        PQexecPrepared(dbh, (const char *)stmt,
+		                                       n_params, params, NULL,
+		                                       NULL, 0));
+	} else {
+		cancel = can_cancel(dbh, NULL, 0);
+		if (PQsendQueryPrepared(dbh, (const char *)stmt, n_params,
+		                        params, NULL, NULL, 0))
+			retval = stream_results(dbh, callback, userdata,
+			                        cancel);
+		else retval = process_result(dbh, NULL);
+	}
+	pipeline_resume(dbh, paused);
+	return retval;
+}
+
+/**
+ * Free a prepared statement.
+ *
+ * \param[in] dbh  PGconn connection handle.
+ * \param[in] stmt Statement name.
+ */
+static void db_pgsql_finalize(void *dbh, void *stmt)
+{
+	char query[STMT_NAME_LEN + 12];
+
+	if (dbh && stmt) {
+		sprintf(query, "DEALLOCATE %s", (const char *)stmt);
+		db_pgsql_query(dbh, query, strlen(query), NULL, NULL);
+	}
+
+	free(stmt);
+}
+
+/**
+ * Largest piece of row data passed to PQputCopyData() at once.
+ */
+#define COPY_PIECE (1UL << 20)
+
+/**
+ * Bulk-load rows into a table with COPY ... FROM STDIN.
+ *
+ * \param[in] dbh    PGconn connection handle.
+ * \param[in] target Table to load, optionally followed by a
+ *                   parenthesized column list.
+ * \param[in] rows   Row data.
+ * \param[in] len    Length of the row data.
+ * \return 0 on success, non-zero on error.
+ */
+static int db_pgsql_copy(void *dbh, const char *target, const char *rows,
+                         size_t len)
+{
+	PGresult *res;
+	char *query;
+	size_t n;
+	int retval = 1, paused;
+
+	if (!dbh || !target || !rows)
+		return 1;
+
+	if (!(query = malloc(strlen(target) + 17)))
+		return 1;
+
+	/* COPY doesn't work in pipeline mode */
+	paused = pipeline_pause(dbh);
+	sprintf(query, "COPY %s FROM STDIN", target);
+	res = PQexec(dbh, query);
+	free(query);
+
+	if (!res || PQresultStatus(res) != PGRES_COPY_IN) {
+		process_result(dbh, res);
+		goto ret;
+	}
+
+	PQclear(res);
+	for (; len; rows += n, len -= n) {
+		n = len > COPY_PIECE ? COPY_PIECE : len;
+		if (PQputCopyData(dbh, rows, (int)n) != 1)
+			break;
+	}
+
+	/* The last row needs a newline, if it doesn't have one */
+	if (!len && rows[-1] != '\n' && PQputCopyData(dbh, "\n", 1) != 1)
+		len = 1;
+
+	/* Abort the COPY if we couldn't send everything */
+	if (PQputCopyEnd(dbh, len ? "incomplete data" : NULL) == 1 && !len)
+		retval = 0;
+
+	/* Collect the result(s), until the connection is idle again */
+	while ((res = PQgetResult(dbh)))
+		retval |= process_result(dbh, res);
+
+ret:
+	pipeline_resume(dbh, paused);
+	return retval;
 }
 
 /**
@@ -153,6 +740,8 @@ err:
 static void db_pgsql_disconnect(void *dbh)
 {
 	if (dbh) PQfinish((PGconn *)dbh);
+	free(qbuf.buf);
+	memset(&qbuf, 0, sizeof(qbuf));
 }
 
 const struct db_driver_vtable pgsql_vtable = {
@@ -163,5 +752,16 @@ const struct db_driver_vtable pgsql_vtable = {
 	/* uninit */ NULL,
 	db_pgsql_connect,
 	db_pgsql_query,
+	db_pgsql_prepare,
+	db_pgsql_execute,
+	db_pgsql_finalize,
+	db_pgsql_copy,
+#ifdef LIBPQ_HAS_PIPELINING
+	db_pgsql_pipeline,
+	db_pgsql_label,
+#else
+	/* pipeline */ NULL,
+	/* pipeline_label */ NULL,
+#endif
 	db_pgsql_disconnect
 };
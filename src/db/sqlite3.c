@@ -6,7 +6,10 @@
  * See the LICENSE file for details.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <stdint.h>
 
 #ifndef IN_TESTS
@@ -67,37 +70,354 @@ static void *db_sqlite3_connect(const char *host,
 	return (void *)dbh;
 }
 
+/**
+ * Step through a statement, passing each row to a callback.
+ *
+ * \param[in] s        Pointer to a sqlite3 statement handle.
+ * \param[in] callback Callback function, to be called per-row returned.
+ * \param[in] userdata Userdata to be passed to the callback.
+ * \param[out] stop    Set to 1 if the callback stopped early.
+ * \return 0 on success, non-zero on error.
+ */
+static int step_rows(sqlite3_stmt *s, db_row_callback_t callback,
+                     void *userdata, int *stop)
+{
+	struct db_row *row = NULL;
+	const char *tmp;
+	int i, n_cols, rc;
+
+	/* Setup the column names once, since they won't change */
+	n_cols = sqlite3_column_count(s);
+	if (n_cols > 0 && callback) {
+		if (!(row = db_row_buffer(n_cols)))
+			return 1;
+
+		for (i = 0; i < n_cols; i++) {
+			tmp = sqlite3_column_name(s, i);
+			row->column_names[i] = (char *)(uintptr_t)tmp;
+		}
+	}
+
+	/* Fetch the rows and pass them to the callback */
+	while ((rc = sqlite3_step(s)) == SQLITE_ROW) {
+		if (!row) continue;
+
+		for (i = 0; i < n_cols; i++) {
+			tmp = (const char *)sqlite3_column_text(s, i);
+			row->fields[i]  = (char *)(uintptr_t)tmp;
+			row->lengths[i] = (size_t)sqlite3_column_bytes(s, i);
+		}
+
+		if (callback(userdata, row)) {
+			*stop = 1;
+			return 0;
+		}
+
+		++row->index;
+	}
+
+	return !(rc == SQLITE_DONE);
+}
+
 /**
  * Execute a query on a database connection.
  *
  * \param[in] dbh      Pointer to a sqlite3 database handle.
  * \param[in] query    SQL Query to execute.
+ * \param[in] len      Length of the query.
  * \param[in] callback Callback function, to be called per-row returned.
  * \param[in] userdata Userdata to be passed to the callback.
  * \return 0 on success, non-zero on error.
  */
-static int db_sqlite3_query(void *dbh, const char *query,
+static int db_sqlite3_query(void *dbh, const char *query, size_t len,
                             db_row_callback_t callback, void *userdata)
 {
-	int i;
-	char *errmsg = NULL;
+	sqlite3_stmt *stmt;
+	const char *end = query + len;
+	int i, stop = 0;
+
+	if (len > INT_MAX) {
+		error("query failed: query too long");
+		return 1;
+	}
 
-	i = sqlite3_exec((sqlite3 *)dbh, query, callback, userdata,
-	                 &errmsg);
+	/* Run each statement in turn, until the callback stops us */
+	while (!stop && query && query < end) {
+		if (sqlite3_prepare_v2((sqlite3 *)dbh, query,
+		                       (int)(end - query), &stmt,
+		                       &query) != SQLITE_OK)
+			goto err;
 
-	/**
-	 * The callback requested an abort. This may
-	 * be normal.
-	 */
-	if (i == SQLITE_ABORT) i = SQLITE_OK;
+		/* Whitespace or a comment */
+		if (!stmt) continue;
+
+		i = step_rows(stmt, callback, userdata, &stop);
+		sqlite3_finalize(stmt);
+		if (i) goto err;
+	}
+
+	return 0;
+
+err:
+	error("query failed: %s", sqlite3_errmsg((sqlite3 *)dbh));
+	return 1;
+}
+
+/**
+ * Execute one of our own statements.
+ *
+ * \param[in] dbh Pointer to a sqlite3 database handle.
+ * \param[in] sql SQL to execute.
+ * \return 0 on success, non-zero on error.
+ */
+static int exec(void *dbh, const char *sql)
+{
+	char *errmsg = NULL;
+	int i;
 
-	/* Print an error if we have one */
+	i = sqlite3_exec((sqlite3 *)dbh, sql, NULL, NULL, &errmsg);
 	if (i != SQLITE_OK && errmsg)
 		error("query failed: %s", errmsg);
 	if (errmsg) sqlite3_free(errmsg);
 	return !(i == SQLITE_OK);
 }
 
+/**
+ * Prepare a statement.
+ *
+ * \param[in] dbh      Pointer to a sqlite3 database handle.
+ * \param[in] query    SQL Query to prepare.
+ * \param[in] n_params Unused.
+ * \return A pointer to a sqlite3 statement handle, or NULL on error.
+ */
+static void *db_sqlite3_prepare(void *dbh, const char *query,
+                                int n_params)
+{
+	sqlite3_stmt *stmt = NULL;
+	(void)n_params;
+
+	if (sqlite3_prepare_v3((sqlite3 *)dbh, query, -1,
+	                       SQLITE_PREPARE_PERSISTENT, &stmt,
+	                       NULL) != SQLITE_OK) {
+		error("prepare failed: %s", sqlite3_errmsg((sqlite3 *)dbh));
+		stmt = NULL;
+	}
+
+	return (void *)stmt;
+}
+
+/**
+ * Bind text parameters to a prepared statement, and execute it.
+ *
+ * \param[in] dbh      Pointer to a sqlite3 database handle.
+ * \param[in] stmt     Pointer to a sqlite3 statement handle.
+ * \param[in] n_params Number of parameters.
+ * \param[in] params   Parameter values.
+ * \param[in] callback Callback function, to be called per-row returned.
+ * \param[in] userdata Userdata to be passed to the callback.
+ * \return 0 on success, non-zero on error.
+ */
+static int db_sqlite3_execute(void *dbh, void *stmt, int n_params,
+                              const char *const *params,
+                              db_row_callback_t callback, void *userdata)
+{
+	sqlite3_stmt *s = (sqlite3_stmt *)stmt;
+	int i, stop = 0, retval = 0;
+
+	for (i = 0; i < n_params; i++) {
+		if (sqlite3_bind_text(s, i + 1, params[i], -1,
+		                      SQLITE_STATIC) != SQLITE_OK)
+			goto err;
+	}
+
+	if (step_rows(s, callback, userdata, &stop))
+		goto err;
+
+ret:
+	sqlite3_reset(s);
+	sqlite3_clear_bindings(s);
+	return retval;
+
+err:
+	error("query failed: %s", sqlite3_errmsg((sqlite3 *)dbh));
+	++retval;
+	goto ret;
+}
+
+/**
+ * Free a prepared statement.
+ *
+ * \param[in] dbh  Unused.
+ * \param[in] stmt Pointer to a sqlite3 statement handle.
+ */
+static void db_sqlite3_finalize(void *dbh, void *stmt)
+{
+	(void)dbh;
+	sqlite3_finalize((sqlite3_stmt *)stmt);
+}
+
+/**
+ * Decode a field in PostgreSQL's text COPY format, in place.
+ *
+ * \param[in] field Field
+ * \param[in] len   Length of the field
+ * \return The decoded length.
+ */
+static size_t decode_field(char *field, size_t len)
+{
+	size_t i, j;
+
+	for (i = j = 0; i < len; i++, j++) {
+		if (field[i] != '\\' || i + 1 == len) {
+			field[j] = field[i];
+			continue;
+		}
+
+		switch (field[++i]) {
+		case 'b': field[j] = '\b'; break;
+		case 'f': field[j] = '\f'; break;
+		case 'n': field[j] = '\n'; break;
+		case 'r': field[j] = '\r'; break;
+		case 't': field[j] = '\t'; break;
+		case 'v': field[j] = '\v'; break;
+		default:  field[j] = field[i]; break;
+		}
+	}
+
+	return j;
+}
+
+/**
+ * Bind the fields in a row to a prepared INSERT.
+ *
+ * A row ending in CRLF has its CR dropped, since a literal CR in
+ * a field would have been escaped.
+ *
+ * \param[in] stmt     Pointer to a sqlite3 statement handle.
+ * \param[in] row      Row (which will be decoded in place.)
+ * \param[in] len      Length of the row.
+ * \param[in] n_fields Number of fields expected.
+ * \return 0 on success, non-zero on error.
+ */
+static int bind_row(sqlite3_stmt *stmt, char *row, size_t len,
+                    int n_fields)
+{
+	char *end, *tab;
+	size_t n;
+	int i, rc;
+
+	if (len && row[len - 1] == '\r') --len;
+	end = row + len;
+	for (i = 0; i < n_fields; i++) {
+		if (!(tab = memchr(row, '\t', (size_t)(end - row))))
+			tab = end;
+
+		/* Only the last field may run to the end of the row */
+		if ((tab == end) != (i == n_fields - 1))
+			return 1;
+
+		n = (size_t)(tab - row);
+		if (n == 2 && row[0] == '\\' && row[1] == 'N') {
+			rc = sqlite3_bind_null(stmt, i + 1);
+		} else {
+			rc = sqlite3_bind_text(stmt, i + 1, row,
+			                       (int)decode_field(row, n),
+			                       SQLITE_STATIC);
+		}
+
+		if (rc != SQLITE_OK) return 1;
+		row = tab + 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Bulk-load rows into a table.
+ *
+ * There's no bulk-loading interface in sqlite3, so we do the next
+ * best thing: prepare an INSERT once, and run it for each row
+ * inside of a savepoint (which works whether or not we're already
+ * in a transaction.)
+ *
+ * \param[in] dbh    Pointer to a sqlite3 database handle.
+ * \param[in] target Table to load, optionally followed by a
+ *                   parenthesized column list.
+ * \param[in] rows   Row data.
+ * \param[in] len    Length of the row data.
+ * \return 0 on success, non-zero on error.
+ */
+static int db_sqlite3_copy(void *dbh, const char *target,
+                           const char *rows, size_t len)
+{
+	sqlite3_stmt *stmt = NULL;
+	const char *end = rows + len, *eol, *p;
+	char *query = NULL, *row = NULL, *d;
+	unsigned long n_rows = 0;
+	int i, n_fields = 1, retval = 1;
+
+	/* Every row must have as many fields as the first */
+	if (!(eol = memchr(rows, '\n', len))) eol = end;
+	for (p = rows; p < eol; p++)
+		if (*p == '\t') ++n_fields;
+
+	query = malloc(strlen(target) + (size_t)n_fields * 2 + 24);
+	row   = malloc(len);
+	if (!query || !row) {
+		error("Out of memory");
+		goto ret;
+	}
+
+	d = query + sprintf(query, "INSERT INTO %s VALUES (?", target);
+	for (i = 1; i < n_fields; i++) {
+		*d++ = ',';
+		*d++ = '?';
+	}
+	strcpy(d, ")");
+
+	if (exec(dbh, "SAVEPOINT mmm_copy"))
+		goto ret;
+
+	if (sqlite3_prepare_v3((sqlite3 *)dbh, query, -1, 0, &stmt,
+	                       NULL) != SQLITE_OK) {
+		error("prepare failed: %s", sqlite3_errmsg((sqlite3 *)dbh));
+		goto rollback;
+	}
+
+	for (; rows < end; rows = eol + 1) {
+		if (!(eol = memchr(rows, '\n', (size_t)(end - rows))))
+			eol = end;
+
+		++n_rows;
+		memcpy(row, rows, (size_t)(eol - rows));
+		if (bind_row(stmt, row, (size_t)(eol - rows), n_fields)) {
+			error("copy failed: row %lu doesn't have %d fields",
+			      n_rows, n_fields);
+			goto rollback;
+		}
+
+		if (sqlite3_step(stmt) != SQLITE_DONE) {
+			error("copy failed: row %lu: %s", n_rows,
+			      sqlite3_errmsg((sqlite3 *)dbh));
+			goto rollback;
+		}
+
+		sqlite3_reset(stmt);
+	}
+
+	retval = exec(dbh, "RELEASE mmm_copy");
+
+ret:
+	if (stmt) sqlite3_finalize(stmt);
+	free(query);
+	free(row);
+	return retval;
+
+rollback:
+	exec(dbh, "ROLLBACK TO mmm_copy; RELEASE mmm_copy");
+	goto ret;
+}
+
 /**
  * Close a sqlite3 database handle.
  *
@@ -116,5 +436,11 @@ const struct db_driver_vtable sqlite3_vtable = {
 	db_sqlite3_uninit,
 	db_sqlite3_connect,
 	db_sqlite3_query,
+	db_sqlite3_prepare,
+	db_sqlite3_execute,
+	db_sqlite3_finalize,
+	db_sqlite3_copy,
+	/* pipeline */ NULL,
+	/* pipeline_label */ NULL,
 	db_sqlite3_disconnect
 };
@@ -20,9 +20,23 @@
 #if defined(HAVE_SYS_MMAN_H) && defined(_POSIX_MAPPED_FILES) && _POSIX_MAPPED_FILES != -1
 #include <sys/mman.h>
 #endif
+
+#ifdef HAVE_LIBZ
+#define ZLIB_CONST
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
 #endif /* IN_TESTS */
 
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
 #include "utils.h"
+#include "uring.h"
 #include "file.h"
 
 #if !defined(HAVE_SYS_MMAN_H) || !defined(_POSIX_MAPPED_FILES) || _POSIX_MAPPED_FILES == -1
@@ -85,6 +99,463 @@ static int munmap(void *addr, size_t length)
 }
 #endif /* !HAVE_SYS_MMAN_H || !_POSIX_MAPPED_FILES */
 
+/**
+ * Size of the buffer for reading compressed files.
+ */
+#ifndef FILE_CHUNK
+#define FILE_CHUNK (64UL << 10)
+#endif
+
+/**
+ * How a file is compressed.
+ */
+enum file_codec {
+	CODEC_NONE,
+	CODEC_GZIP,
+	CODEC_ZSTD
+};
+
+/**
+ * A file being read (and decompressed, if need be.)
+ */
+struct file_reader {
+	const char *path;      /**< Path to the file */
+	int fd;                /**< File descriptor (-1 if reading memory) */
+	enum file_codec codec; /**< How the file is compressed */
+	unsigned long size;    /**< Size of the file (0 if unknown) */
+	const char *in;        /**< Input which hasn't been consumed */
+	size_t in_len;         /**< Length of the input */
+	int eof;               /**< No more input */
+	int end;               /**< No more output */
+#ifdef HAVE_LIBZ
+	z_stream z;            /**< zlib stream */
+	int z_init;            /**< The zlib stream was initialized */
+#endif
+#ifdef HAVE_LIBZSTD
+	ZSTD_DStream *zs;      /**< zstd stream */
+	int zs_frame;          /**< We're in the middle of a frame */
+#endif
+	char buf[FILE_CHUNK];  /**< Input buffer */
+};
+
+/**
+ * \def FILE_BATCH_MIN
+ *
+ * Fewest files map_files() reads in together, rather than mapping
+ * them one at a time.
+ */
+#ifndef FILE_BATCH_MIN
+#define FILE_BATCH_MIN 8
+#endif
+
+/**
+ * A buffer which files were read into together, by map_files().
+ */
+struct arena {
+	char *mem;   /**< Files */
+	size_t refs; /**< Number of files still handed out */
+};
+
+/**
+ * Files handed out by map_file(), map_files() or copy_file() which
+ * were never really mapped.
+ */
+static struct inflated {
+	char *mem;             /**< Decompressed data, or a file in an arena */
+	struct arena *arena;   /**< Arena the file is in (or NULL) */
+	struct inflated *next; /**< Next file */
+} *inflated = NULL;
+
+/**
+ * Files may be mapped on one thread (e.g. by the prefetcher) and
+ * unmapped on another, so the list, and the arenas' references,
+ * are guarded.
+ */
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t inflated_lock = PTHREAD_MUTEX_INITIALIZER;
+#define INFLATED_LOCK()   pthread_mutex_lock(&inflated_lock)
+#define INFLATED_UNLOCK() pthread_mutex_unlock(&inflated_lock)
+#else
+#define INFLATED_LOCK()   ((void)0)
+#define INFLATED_UNLOCK() ((void)0)
+#endif
+
+/**
+ * Keep track of a file which was handed out without being mapped.
+ *
+ * \param[in] node  Node to keep it in
+ * \param[in] mem   File
+ * \param[in] arena Arena the file is in (or NULL)
+ */
+static void keep(struct inflated *node, char *mem, struct arena *arena)
+{
+	node->mem   = mem;
+	node->arena = arena;
+	INFLATED_LOCK();
+	if (arena) ++arena->refs;
+	node->next = inflated;
+	inflated   = node;
+	INFLATED_UNLOCK();
+}
+
+/**
+ * Work out how a file is compressed, by its magic number.
+ */
+static enum file_codec sniff(const char *buf, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+
+	if (len >= 2 && p[0] == 0x1f && p[1] == 0x8b)
+		return CODEC_GZIP;
+	if (len >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f &&
+	    p[3] == 0xfd)
+		return CODEC_ZSTD;
+	return CODEC_NONE;
+}
+
+/**
+ * Read more input, if we've consumed what we have.
+ *
+ * \return 0 on success, non-zero on failure.
+ */
+static int fill(struct file_reader *f)
+{
+	ssize_t br;
+
+	if (f->in_len || f->eof) return 0;
+	if (f->fd < 0) {
+		f->eof = 1;
+		return 0;
+	}
+
+	do {
+		errno = 0;
+		br = read(f->fd, f->buf, sizeof(f->buf));
+	} while (br < 0 && errno == EINTR);
+
+	if (br < 0) {
+		error("failed to read '%s': %s", f->path, strerror(errno));
+		return 1;
+	}
+
+	if (!br) f->eof = 1;
+	f->in     = f->buf;
+	f->in_len = (size_t)br;
+	return 0;
+}
+
+/**
+ * Get ready to decompress the file, based on what it starts with.
+ *
+ * \return 0 on success, non-zero on failure.
+ */
+static int start(struct file_reader *f)
+{
+	const char *name = NULL;
+
+	if (fill(f)) return 1;
+	f->codec = sniff(f->in, f->in_len);
+	if (f->codec == CODEC_GZIP) {
+#ifdef HAVE_LIBZ
+		f->size = 0;
+		if (inflateInit2(&f->z, 15 + 16) == Z_OK) {
+			f->z_init = 1;
+			return 0;
+		}
+#endif
+		name = "gzip";
+	} else if (f->codec == CODEC_ZSTD) {
+#ifdef HAVE_LIBZSTD
+		f->size = 0;
+		if ((f->zs = ZSTD_createDStream()) &&
+		    !ZSTD_isError(ZSTD_initDStream(f->zs)))
+			return 0;
+#endif
+		name = "zstd";
+	} else return 0;
+
+	error("failed to read '%s': unable to decompress %s data",
+	      f->path, name);
+	return 1;
+}
+
+#ifdef HAVE_LIBZ
+/**
+ * Decompress gzip data. Concatenated gzip members are read as one.
+ */
+static int read_gzip(struct file_reader *f, char *buf, size_t len,
+                     size_t *n)
+{
+	int r;
+
+	if (len > INT_MAX) len = INT_MAX;
+	f->z.next_out  = (Bytef *)buf;
+	f->z.avail_out = (uInt)len;
+	while (f->z.avail_out == len && !f->end) {
+		if (fill(f)) return 1;
+		if (!f->in_len) {
+			error("failed to read '%s': unexpected end of file",
+			      f->path);
+			return 1;
+		}
+
+		f->z.next_in  = (const Bytef *)f->in;
+		f->z.avail_in = (uInt)f->in_len;
+		r = inflate(&f->z, Z_NO_FLUSH);
+		f->in     = (const char *)f->z.next_in;
+		f->in_len = f->z.avail_in;
+
+		if (r == Z_STREAM_END) {
+			if (fill(f)) return 1;
+			if (!f->in_len) f->end = 1;
+			else if (inflateReset(&f->z) != Z_OK) r = Z_DATA_ERROR;
+		}
+
+		if (r != Z_OK && r != Z_STREAM_END) {
+			error("failed to read '%s': %s", f->path,
+			      f->z.msg ? f->z.msg : "corrupt data");
+			return 1;
+		}
+	}
+
+	*n = len - f->z.avail_out;
+	return 0;
+}
+#endif
+
+#ifdef HAVE_LIBZSTD
+/**
+ * Decompress zstd data.
+ */
+static int read_zstd(struct file_reader *f, char *buf, size_t len,
+                     size_t *n)
+{
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	size_t r;
+
+	out.dst  = buf;
+	out.size = len;
+	out.pos  = 0;
+	while (!out.pos && !f->end) {
+		if (fill(f)) return 1;
+		in.src  = f->in;
+		in.size = f->in_len;
+		in.pos  = 0;
+
+		r = ZSTD_decompressStream(f->zs, &out, &in);
+		if (ZSTD_isError(r)) {
+			error("failed to read '%s': %s", f->path,
+			      ZSTD_getErrorName(r));
+			return 1;
+		}
+
+		/* Anything but 0 means we're in the middle of a frame */
+		if (in.pos || out.pos) f->zs_frame = r != 0;
+		f->in     += in.pos;
+		f->in_len -= in.pos;
+		if (f->eof && !f->in_len && !out.pos) {
+			if (f->zs_frame) {
+				error("failed to read '%s': unexpected end of "
+				      "file", f->path);
+				return 1;
+			}
+
+			f->end = 1;
+		}
+	}
+
+	*n = out.pos;
+	return 0;
+}
+#endif
+
+/**
+ * Read uncompressed data.
+ */
+static int read_plain(struct file_reader *f, char *buf, size_t len,
+                      size_t *n)
+{
+	ssize_t br;
+
+	/* Whatever was read to check for a magic number comes first */
+	if (f->in_len || f->fd < 0) {
+		*n = len < f->in_len ? len : f->in_len;
+		memcpy(buf, f->in, *n);
+		f->in     += *n;
+		f->in_len -= *n;
+		return 0;
+	}
+
+	do {
+		errno = 0;
+		br = read(f->fd, buf, len);
+	} while (br < 0 && errno == EINTR);
+
+	if (br < 0) {
+		error("failed to read '%s': %s", f->path, strerror(errno));
+		return 1;
+	}
+
+	*n = (size_t)br;
+	return 0;
+}
+
+/**
+ * Open a file for reading, decompressing it if it's compressed.
+ *
+ * \param[in] path Path to the file (which must outlive the reader.)
+ * \return A reader, or NULL on error.
+ */
+struct file_reader *file_open(const char *path)
+{
+	struct file_reader *f;
+	struct stat sbuf;
+
+	if (!path) return NULL;
+	if (!(f = calloc(1, sizeof(struct file_reader)))) {
+		error("Out of memory");
+		return NULL;
+	}
+
+	f->path = path;
+	errno   = 0;
+	if ((f->fd = open(path, O_RDONLY)) < 0) {
+		error("unable to open '%s': %s", path, strerror(errno));
+		goto err;
+	}
+
+	if (!fstat(f->fd, &sbuf))
+		f->size = (unsigned long)sbuf.st_size;
+
+	if (start(f)) goto err;
+	return f;
+
+err:
+	file_close(f);
+	return NULL;
+}
+
+/**
+ * Read (and decompress) the next part of a file.
+ *
+ * \param[in]  f   Reader
+ * \param[out] buf Buffer
+ * \param[in]  len Size of the buffer
+ * \param[out] n   Number of bytes read (0 at the end of the file.)
+ * \return 0 on success, non-zero on failure.
+ */
+int file_read(struct file_reader *f, char *buf, size_t len, size_t *n)
+{
+	*n = 0;
+	if (!f || !buf) return 1;
+	if (!len) return 0;
+
+#ifdef HAVE_LIBZ
+	if (f->codec == CODEC_GZIP)
+		return read_gzip(f, buf, len, n);
+#endif
+#ifdef HAVE_LIBZSTD
+	if (f->codec == CODEC_ZSTD)
+		return read_zstd(f, buf, len, n);
+#endif
+	return read_plain(f, buf, len, n);
+}
+
+/**
+ * Get the size of a file being read.
+ *
+ * \param[in] f Reader
+ * \return The size of the file, or 0 if it isn't known (e.g. if
+ *         it's compressed.)
+ */
+unsigned long file_size(const struct file_reader *f)
+{
+	return f ? f->size : 0;
+}
+
+/**
+ * Close a file being read.
+ *
+ * \param[in] f Reader
+ */
+void file_close(struct file_reader *f)
+{
+	if (!f) return;
+
+#ifdef HAVE_LIBZ
+	if (f->z_init) inflateEnd(&f->z);
+#endif
+#ifdef HAVE_LIBZSTD
+	if (f->zs) ZSTD_freeDStream(f->zs);
+#endif
+	if (f->fd > -1) close(f->fd);
+	free(f);
+}
+
+/**
+ * Decompress a mapped file into memory.
+ *
+ * \param[in]     path Path to the file
+ * \param[in]     mem  Mapped file
+ * \param[in,out] size Size of the file, and then of its contents.
+ * \return The decompressed contents, or NULL on error.
+ */
+static char *inflate_mapping(const char *path, const char *mem,
+                             size_t *size)
+{
+	struct file_reader *f;
+	struct inflated *node = NULL;
+	char *buf = NULL, *tmp;
+	size_t len = 0, cap = *size << 2, n;
+
+	if (!(f = calloc(1, sizeof(struct file_reader))) ||
+	    !(node = malloc(sizeof(struct inflated))))
+		goto oom;
+
+	f->path   = path;
+	f->fd     = -1;
+	f->in     = mem;
+	f->in_len = *size;
+	if (start(f)) goto err;
+
+	/* Guess at the size, and grow it as needed */
+	if (cap < FILE_CHUNK) cap = FILE_CHUNK;
+	if (!(buf = malloc(cap + 1))) goto oom;
+
+	do {
+		if (len == cap) {
+			if (!(tmp = realloc(buf, (cap << 1) + 1))) goto oom;
+			buf  = tmp;
+			cap <<= 1;
+		}
+
+		if (file_read(f, buf + len, cap - len, &n)) goto err;
+		len += n;
+	} while (n);
+
+	/* Something must have come out of it */
+	if (!len) {
+		error("failed to map '%s': nothing to decompress", path);
+		goto err;
+	}
+
+	buf[len] = '\0';
+	keep(node, buf, NULL);
+	file_close(f);
+	*size = len;
+	return buf;
+
+oom:
+	error("Out of memory");
+
+err:
+	file_close(f);
+	free(node);
+	free(buf);
+	return NULL;
+}
+
 /**
  * Map a file into memory
  *
@@ -97,7 +568,8 @@ char *map_file(const char *path, size_t *size)
 {
 	int fd = -1;
 	struct stat sbuf;
-	char *retval = NULL;
+	char *retval = NULL, *mem;
+	size_t len;
 
 	sbuf.st_size = 0;
 	if (!path || !size)
@@ -109,11 +581,22 @@ char *map_file(const char *path, size_t *size)
 	if (fd < 0 || fstat(fd, &sbuf) || !sbuf.st_size)
 		goto err;
 
-	/* Map the file */
-	retval = mmap(NULL, (size_t)sbuf.st_size, MAP_PRIVATE, PROT_READ, fd, 0);
+	/* Map the file (read-only, since nothing writes to it) */
+	retval = mmap(NULL, (size_t)sbuf.st_size, PROT_READ, MAP_PRIVATE,
+	              fd, 0);
 	if (retval == MAP_FAILED)
 		goto err;
 
+	/* Compressed files are decompressed into memory, instead */
+	if (sniff(retval, (size_t)sbuf.st_size) != CODEC_NONE) {
+		mem = retval;
+		len = (size_t)sbuf.st_size;
+		retval = inflate_mapping(path, mem, &len);
+		munmap(mem, (size_t)sbuf.st_size);
+		if (!retval) goto fail;
+		sbuf.st_size = (off_t)len;
+	}
+
 ret:
 	if (size) *size = (size_t)sbuf.st_size;
 	if (fd > -1) close(fd);
@@ -123,11 +606,137 @@ err:
 	if (errno) {
 		error("failed to map '%s': %s", path, strerror(errno));
 	} else error("failed to map '%s'", path);
+
+fail:
 	if (fd > -1) close(fd);
 	if (size) *size = 0;
 	return NULL;
 }
 
+/**
+ * Hand out a file from an arena.
+ *
+ * \param[in]     a    Arena
+ * \param[in]     path Path to the file (for errors.)
+ * \param[in]     mem  File
+ * \param[in,out] size Size of the file, and then of its contents.
+ * \return The file, or NULL on error.
+ */
+static char *arena_file(struct arena *a, const char *path, char *mem,
+                        size_t *size)
+{
+	struct inflated *node;
+
+	/* Compressed files are decompressed, as they'd be if mapped */
+	if (sniff(mem, *size) != CODEC_NONE)
+		return inflate_mapping(path, mem, size);
+
+	if (!(node = malloc(sizeof(struct inflated)))) {
+		error("Out of memory");
+		return NULL;
+	}
+
+	keep(node, mem, a);
+	return mem;
+}
+
+/**
+ * Map a number of files into memory.
+ *
+ * Where there are enough of them, and io_uring can be used, they're
+ * read into an arena together. Otherwise, or where one couldn't be
+ * read that way, they're mapped one at a time.
+ *
+ * \param[in]  paths Paths to the files
+ * \param[in]  n     Number of files
+ * \param[out] mem   Each file (NULL where one couldn't be mapped.)
+ * \param[out] size  Size of each file (0 where one couldn't be mapped.)
+ * \return The number of files mapped.
+ */
+size_t map_files(char **paths, size_t n, char **mem, size_t *size)
+{
+	struct uring_file *files = NULL;
+	struct arena *a = NULL;
+	size_t i, refs, retval = 0;
+
+	if (!paths || !mem || !size)
+		return 0;
+
+	/* We hold a reference until we're done handing files out */
+	if (n >= FILE_BATCH_MIN &&
+	    (files = malloc(n * sizeof(struct uring_file))) &&
+	    (a = malloc(sizeof(struct arena)))) {
+		a->refs = 1;
+		a->mem  = uring_read_files(paths, n, files);
+	}
+
+	for (i = 0; i < n; i++) {
+		size[i] = 0;
+		if (a && a->mem && files[i].ok) {
+			size[i] = files[i].size;
+			mem[i]  = arena_file(a, paths[i], a->mem + files[i].off,
+			                     &size[i]);
+			if (!mem[i]) size[i] = 0;
+		} else mem[i] = map_file(paths[i], &size[i]);
+		if (mem[i]) ++retval;
+	}
+
+	if (a) {
+		INFLATED_LOCK();
+		refs = --a->refs;
+		INFLATED_UNLOCK();
+		if (!refs) {
+			free(a->mem);
+			free(a);
+		}
+	}
+
+	free(files);
+	return retval;
+}
+
+/**
+ * Copy a file which is already in memory.
+ *
+ * \param[in]     path Name of the file (for errors.)
+ * \param[in]     mem  Contents of the file
+ * \param[in,out] size Size of the file, and then of the copy.
+ * \return The copy, or NULL on error.
+ */
+char *copy_file(const char *path, const char *mem, size_t *size)
+{
+	struct inflated *node = NULL;
+	char *buf = NULL;
+
+	if (!mem || !size || !*size) {
+		error("failed to map '%s'", path);
+		goto err;
+	}
+
+	/* Compressed files are decompressed, instead */
+	if (sniff(mem, *size) != CODEC_NONE) {
+		if (!(buf = inflate_mapping(path, mem, size)))
+			goto err;
+		return buf;
+	}
+
+	if (!(node = malloc(sizeof(struct inflated))) ||
+	    !(buf = malloc(*size + 1))) {
+		error("Out of memory");
+		free(node);
+		goto err;
+	}
+
+	memcpy(buf, mem, *size);
+	buf[*size] = '\0';
+	keep(node, buf, NULL);
+	return buf;
+
+err:
+	if (size) *size = 0;
+	return NULL;
+}
+
 /**
  * Unmap a previously mapped file
  *
@@ -136,7 +745,32 @@ err:
  */
 void unmap_file(char *mem, size_t len)
 {
-	if (mem && len)
+	struct inflated **p, *node = NULL;
+	struct arena *a = NULL;
+
+	if (!mem || !len) return;
+
+	/* Neither decompressed files, nor those in arenas, were mapped */
+	INFLATED_LOCK();
+	for (p = &inflated; *p; p = &(*p)->next) {
+		if ((*p)->mem != mem) continue;
+		node = *p;
+		*p   = node->next;
+		if ((a = node->arena) && --a->refs) a = NULL;
+		break;
+	}
+	INFLATED_UNLOCK();
+
+	if (!node) {
 		munmap(mem, len);
+		return;
+	}
+
+	/* The arena goes once the last file in it does */
+	if (a) {
+		free(a->mem);
+		free(a);
+	} else if (!node->arena) free(node->mem);
+	free(node);
 }
 
@@ -13,6 +13,9 @@
 /**
  * Map a file into memory
  *
+ * Compressed files are decompressed into memory instead, and the
+ * size is that of their contents.
+ *
  * \param[in]  path   Path to the file to be mapped.
  * \param[out] size   Size of the file (in bytes.)
  * \return A pointer to the file buffer. On error, NULL will
@@ -20,6 +23,23 @@
  */
 char *map_file(const char *path, size_t *size);
 
+/**
+ * Map a number of files into memory.
+ *
+ * Where there are enough of them, they're read in together (with
+ * io_uring, where the kernel has it,) instead of being mapped one
+ * at a time. Either way, each is given back with unmap_file() (which
+ * needn't be on the same thread,) and compressed files are
+ * decompressed, as by map_file().
+ *
+ * \param[in]  paths Paths to the files
+ * \param[in]  n     Number of files
+ * \param[out] mem   Each file (NULL where one couldn't be mapped.)
+ * \param[out] size  Size of each file (0 where one couldn't be mapped.)
+ * \return The number of files mapped.
+ */
+size_t map_files(char **paths, size_t n, char **mem, size_t *size);
+
 /**
  * Unmap a previously mapped file
  *
@@ -28,4 +48,61 @@ char *map_file(const char *path, size_t *size);
  */
 void unmap_file(char *mem, size_t len);
 
+/**
+ * Copy a file which is already in memory (e.g. one read from a git
+ * repository,) so that it can be handed out as if it were mapped.
+ *
+ * Compressed files are decompressed, as by map_file(). The copy is
+ * NUL-terminated, and is given back with unmap_file().
+ *
+ * \param[in]     path Name of the file (for errors.)
+ * \param[in]     mem  Contents of the file
+ * \param[in,out] size Size of the file, and then of the copy.
+ * \return The copy, or NULL on error (with size set to 0.)
+ */
+char *copy_file(const char *path, const char *mem, size_t *size);
+
+/**
+ * A file being read.
+ */
+struct file_reader;
+
+/**
+ * Open a file for reading.
+ *
+ * Files which are compressed with gzip or zstd are decompressed as
+ * they're read, provided mmm was built with support for them.
+ *
+ * \param[in] path Path to the file (which must outlive the reader.)
+ * \return A reader, or NULL on error.
+ */
+struct file_reader *file_open(const char *path);
+
+/**
+ * Read (and decompress) the next part of a file.
+ *
+ * \param[in]  f   Reader
+ * \param[out] buf Buffer
+ * \param[in]  len Size of the buffer
+ * \param[out] n   Number of bytes read (0 at the end of the file.)
+ * \return 0 on success, non-zero on failure.
+ */
+int file_read(struct file_reader *f, char *buf, size_t len, size_t *n);
+
+/**
+ * Get the size of a file being read.
+ *
+ * \param[in] f Reader
+ * \return The size of the file, or 0 if it isn't known (e.g. if
+ *         it's compressed.)
+ */
+unsigned long file_size(const struct file_reader *f);
+
+/**
+ * Close a file being read.
+ *
+ * \param[in] f Reader
+ */
+void file_close(struct file_reader *f);
+
 #endif /* FILE_H */
@@ -22,6 +22,7 @@
 #include "commands.h"
 #include "state.h"
 #include "config_gen.h"
+#include "pack.h"
 #include "stringbuf.h"
 #include "utils.h"
 
@@ -54,7 +55,12 @@ static const char *usage_2 =
 
 static const char *usage_3 =
     "     assimilate          Track an existing database, assuming\n"
-    "                         that all migrations have been applied.\n";
+    "                         that all migrations have been applied.\n"
+    "     watch               Apply migrations as they appear, until\n"
+    "                         interrupted.\n"
+    "     pack [pack file]    Pack the 'file' source's migrations into\n"
+    "                         the 'pack' source's pack_file, or the\n"
+    "                         given file.\n";
 
 /**
  * Configurable parameters.
@@ -204,6 +210,15 @@ int main(int argc, char *argv[])
 	config_init(main_config);
 	if (load_config())
 		goto err;
+
+	/* Packing migrations doesn't need the database */
+	if (argc >= 1 && !strcmp(argv[n_args], "pack")) {
+		if (pack_build("file", argc > 1 ? argv[n_args + 1] :
+		               source_get_migration_path("pack")))
+			retval = EXIT_FAILURE;
+		goto ret;
+	}
+
 	if (state_init(config.history))
 		goto err;
 
@@ -231,9 +246,9 @@ int main(int argc, char *argv[])
 	}
 
 ret:
-	/* Clean up */
-	db_disconnect();
+	/* Clean up (statements are finalized before disconnecting) */
 	state_uninit();
+	db_disconnect();
 	source_uninit();
 	db_uninit();
 	return retval;
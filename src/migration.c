@@ -6,13 +6,36 @@
  * See the LICENSE file for details.
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 
 #include "db.h"
-#include "file.h"
+#include "sql.h"
+#include "copy.h"
+#include "scan.h"
+#include "utils.h"
 #include "migration.h"
 
+/**
+ * Once a migration has been running for this long (in
+ * milliseconds,) each statement is reported as it's run.
+ */
+#ifndef MIGRATION_PROGRESS_MS
+#define MIGRATION_PROGRESS_MS 2000UL
+#endif
+
+/**
+ * Length of the excerpt of a failed statement in error messages.
+ */
+#define EXCERPT_LEN 48
+
+/**
+ * Longest part of a migration's name kept in the label for each
+ * statement.
+ */
+#define LABEL_NAME_MAX 64
+
 static const char *down = "-- [down]";
 static const char *up = "-- [up]";
 
@@ -20,95 +43,280 @@ static const unsigned int down_len = 9;
 static const unsigned int up_len = 7;
 
 /**
- * Trim leading whitespace
+ * Where we are in the migration being run.
+ */
+static struct run {
+	const char *name;     /**< Migration name (or NULL) */
+	unsigned int flags;   /**< Scanner flags */
+	const char *counted;  /**< Lines have been counted up to here */
+	unsigned long line;   /**< Line number at counted */
+	unsigned long n;      /**< Statements run so far */
+	unsigned long start;  /**< When the migration started */
+	int verbose;          /**< Report each statement */
+} run;
+
+/**
+ * Trim the whitespace around a section.
  *
- * \param[in] s String
- * \return A pointer to the first byte in s beyond any leading
- *         whitespace.
+ * \param[in]     mem Migration
+ * \param[in,out] s   Section
  */
-static char *ltrim(char *s)
+static void trim(const char *mem, struct migration_section *s)
 {
-	char *tmp = s;
+	size_t n = scan_space(mem + s->off, s->len);
 
-	while (tmp && isspace(*tmp)) ++tmp;
-	return tmp;
+	s->off += n;
+	s->len -= n;
+
+	while (s->len && isspace((unsigned char)mem[s->off + s->len - 1]))
+		--s->len;
 }
 
 /**
- * Trim trailing whitespace
+ * Find the sections of a migration, in one pass.
  *
- * \param[in] s String
+ * \param[out] m    Migration
+ * \param[in]  mem  Migration, as loaded from the source.
+ * \param[in]  size Size of the migration
  */
-static void rtrim(char *s)
+void migration_parse(struct migration *m, char *mem, size_t size)
 {
-	char *tmp;
+	struct migration_section *s[2];
+	const char *p, *end = mem + size;
+	size_t len;
+	int k, open = -1, found[2] = { 0, 0 };
+
+	memset(m, 0, sizeof(*m));
+	if (!mem) return;
 
-	if (s) {
-		tmp = s + strlen(s) - 1;
-		while (tmp >= s && isspace(*tmp)) --tmp;
-		if (tmp > s) *++tmp = 0;
+	m->mem  = mem;
+	m->size = size;
+	s[0] = &m->up;
+	s[1] = &m->down;
+
+	for (p = mem; (p += scan_marker(p, (size_t)(end - p))) < end; p++) {
+		len = (size_t)(end - p);
+		if (len >= up_len && !memcmp(p, up, up_len)) k = 0;
+		else if (len >= down_len && !memcmp(p, down, down_len)) k = 1;
+		else continue;
+
+		/* A section ends at the first marker for the other one */
+		if (open == !k) {
+			s[open]->len = (size_t)(p - mem) - s[open]->off;
+			open = -1;
+		}
+
+		if (!found[k]) {
+			found[k]  = 1;
+			s[k]->off = (size_t)(p - mem);
+			s[k]->off += k ? down_len : up_len;
+			open      = k;
+		}
 	}
+
+	if (open >= 0)
+		s[open]->len = size - s[open]->off;
+
+	trim(mem, &m->up);
+	trim(mem, &m->down);
 }
 
 /**
- * Locate the desired query and run it.
+ * Get the line number of a statement.
  *
- * \param[in] path Migration path
- * \param[in] mode 1 if upgrade, 0 if downgrade
- * \return 0 on success, 1 on error.
+ * Statements are run in order, so the lines are counted from
+ * where the last statement was.
+ *
+ * \param[in] p Statement
+ * \return The line the statement starts on.
  */
-static int run_migration(const char *path, int mode)
+static unsigned long line_of(const char *p)
 {
-	size_t size;
-	char *mem, *buf, *tmp;
-	int retval = 1;
-
-	mem = buf = map_file(path, &size);
-	if (!buf) goto ret;
-
-	/* Check for our desired query */
-	tmp = strstr(buf, (mode ? up : down));
-	if (!tmp) {
-		retval = 0;
-		goto ret;
+	while (run.counted < p) {
+		if (*run.counted++ == '\n')
+			++run.line;
 	}
 
-	/* Skip leading whitespace */
-	buf = ltrim(tmp + (mode ? up_len : down_len) + 1);
+	return run.line;
+}
 
-	/* Check for the opposite query, and ignore it. */
-	tmp = strstr(buf, mode ? down : up);
-	if (tmp) *tmp = 0;
+/**
+ * Run a single statement.
+ *
+ * Where the statements are pipelined, they're only sent here, and
+ * the driver reports any failure later on, along with the label
+ * given to the statement. Once statements are being reported, each
+ * one is waited on, so that it's timed by how long it took to run.
+ *
+ * \param[in] sql Statement
+ * \param[in] len Length of the statement
+ * \return 0 on success, non-zero on error.
+ */
+static int run_statement(const char *sql, size_t len)
+{
+	char label[LABEL_NAME_MAX + 64];
+	unsigned long line = line_of(sql), ms;
+	size_t n;
+	int retval, pipelined;
 
-	/* Skip trailing whitespace */
-	rtrim(buf);
+	/* Once we've been at it for a while, report each statement */
+	if (!run.verbose && now_ms() - run.start >= MIGRATION_PROGRESS_MS) {
+		if (db_pipeline_sync()) return 1;
+		run.verbose = 1;
+	}
+
+	++run.n;
+	if (run.verbose) {
+		PRINT_2("\n  statement %lu (line %lu)...", run.n, line);
+		fflush(stdout);
+	}
+
+	sprintf(label, "%.*s%sstatement %lu (line %lu)", LABEL_NAME_MAX,
+	        run.name ? run.name : "", run.name ? ": " : "", run.n, line);
+	pipelined = db_pipeline_label(label);
 
-	/* Run the query */
-	if (*buf) retval = db_query(buf, NULL, NULL);
+	ms = now_ms();
+	retval = db_query_len(sql, len, NULL, NULL);
+	if (!retval && run.verbose) retval = db_pipeline_sync();
+	ms = now_ms() - ms;
+
+	if (run.verbose) PRINT_1(" %lu ms", ms);
+	if (retval && !pipelined) {
+		for (n = 0; n < len && n < EXCERPT_LEN && sql[n] != '\n'; n++);
+		error("%s failed: %.*s%s", label, (int)n, sql,
+		      n < len ? "..." : "");
+	}
 
-ret:
-	unmap_file(mem, size);
 	return retval;
 }
 
+/**
+ * Parse the marker line of a copy section.
+ *
+ * \param[in]  buf    Section, starting at its marker line
+ * \param[in]  len    Number of bytes in the section
+ * \param[out] target Buffer of at least COPY_TARGET_MAX bytes
+ * \return The length of the marker line (with its newline,) or
+ *         (size_t)-1 if it's malformed.
+ */
+static size_t copy_start(const char *buf, size_t len, char *target)
+{
+	const char *nl;
+
+	if (!(nl = memchr(buf, '\n', len)))
+		nl = buf + len;
+	if (copy_marker(buf, (size_t)(nl - buf), target) < 0)
+		return (size_t)-1;
+	return (size_t)(nl - buf) + (nl < buf + len);
+}
+
+/**
+ * Run a section of a migration, one statement at a time, and
+ * bulk-load any copy sections within it.
+ *
+ * Copy markers are found by the scanner, so that one inside a
+ * string or a function body isn't taken for a copy section.
+ *
+ * \param[in] sql Section
+ * \param[in] len Length of the section
+ * \return 0 on success, non-zero on error.
+ */
+static int run_section(const char *sql, size_t len)
+{
+	char target[COPY_TARGET_MAX];
+	struct sql_scanner s;
+	size_t end, skip = 0, rows, next;
+	unsigned long n;
+
+	sql_scan_init(&s, run.flags | SQL_COPY);
+	while (s.pos < len) {
+		n = s.n_stmts;
+		sql_scan(&s, sql, len, len);
+		if (s.marker && (skip = copy_start(sql + s.pos, len - s.pos,
+		                                   target)) == (size_t)-1)
+			return 1;
+
+		/* Skip empty statements, but not a final one without a ';' */
+		if (s.n_stmts > n || (s.pos >= len && s.tokens)) {
+			end = s.n_stmts > n ? s.end : len;
+			while (end > s.start &&
+			       isspace((unsigned char)sql[end - 1]))
+				--end;
+			if (run_statement(sql + s.start, end - s.start))
+				return 1;
+		}
+
+		if (!s.marker) continue;
+
+		/* Load the rows following the marker */
+		s.pos += skip;
+		copy_rows(sql + s.pos, len - s.pos, 1, &rows, &next);
+		if (rows && db_copy(target, sql + s.pos, rows))
+			return 1;
+
+		s.pos   += next;
+		s.marker = 0;
+		s.prev   = '\n';
+	}
+
+	return 0;
+}
+
+/**
+ * Run a section of a migration, statement by statement.
+ *
+ * \param[in] m Migration
+ * \param[in] s Section
+ * \return 0 on success, 1 on error.
+ */
+static int run_migration(const struct migration *m,
+                         const struct migration_section *s)
+{
+	if (!m || !m->mem) return 1;
+
+	run.name    = m->name;
+	run.flags   = sql_dialect(db_get_driver_name()) | SQL_ONE;
+	run.counted = m->mem;
+	run.line    = 1;
+	run.n       = 0;
+	run.start   = now_ms();
+	run.verbose = 0;
+	return run_section(m->mem + s->off, s->len);
+}
+
 /**
  * Run the "up" portion of a migration.
  *
- * \param[in] path Migration to run
+ * \param[in] m Migration (from migration_parse().)
  * \return 0 on success, non-zero on failure.
  */
-int migration_upgrade(const char *path)
+int migration_upgrade(const struct migration *m)
 {
-	return run_migration(path, 1);
+	return run_migration(m, m ? &m->up : NULL);
 }
 
 /**
  * Run the "down" portion of a migration.
  *
- * \param[in] path Migration to run
+ * \param[in] m Migration (from migration_parse().)
+ * \return 0 on success, non-zero on failure.
+ */
+int migration_downgrade(const struct migration *m)
+{
+	return run_migration(m, m ? &m->down : NULL);
+}
+
+/**
+ * Compute the checksum of a migration.
+ *
+ * \param[in]  mem  Migration
+ * \param[in]  size Size of the migration
+ * \param[out] sum  Buffer of at least MIGRATION_CHECKSUM_LEN bytes
  * \return 0 on success, non-zero on failure.
  */
-int migration_downgrade(const char *path)
+int migration_checksum(const char *mem, size_t size, char *sum)
 {
-	return run_migration(path, 0);
+	if (!mem || !sum) return 1;
+	sprintf(sum, "%08lx", checksum(mem, size));
+	return 0;
 }
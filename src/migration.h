@@ -10,20 +10,72 @@
 #ifndef MIGRATION_H
 #define MIGRATION_H
 
+#include <stddef.h>
+
+/**
+ * \def MIGRATION_CHECKSUM_LEN
+ *
+ * Size of a migration checksum, including the terminating NUL.
+ */
+#define MIGRATION_CHECKSUM_LEN 9
+
+/**
+ * A section of a migration.
+ */
+struct migration_section {
+	size_t off; /**< Offset of the section, past its marker */
+	size_t len; /**< Length of the section (0 if there isn't one) */
+};
+
+/**
+ * A migration, and an index of its sections.
+ */
+struct migration {
+	const char *name;              /**< Name, for messages (or NULL) */
+	char *mem;                     /**< Migration */
+	size_t size;                   /**< Size of the migration */
+	struct migration_section up;   /**< "-- [up]" section */
+	struct migration_section down; /**< "-- [down]" section */
+};
+
+/**
+ * Find the sections of a migration, in one pass.
+ *
+ * Each section runs from its marker to the first marker for the
+ * other section after it (or to the end of the migration,) less
+ * any whitespace around it. The migration needn't be
+ * NUL-terminated, and isn't modified.
+ *
+ * \param[out] m    Migration
+ * \param[in]  mem  Migration, as loaded from the source.
+ * \param[in]  size Size of the migration
+ */
+void migration_parse(struct migration *m, char *mem, size_t size);
+
 /**
  * Run the "up" portion of a migration.
  *
- * \param[in] path Migration to run
+ * \param[in] m Migration (from migration_parse().)
  * \return 0 on success, non-zero on failure.
  */
-int migration_upgrade(const char *path);
+int migration_upgrade(const struct migration *m);
 
 /**
  * Run the "down" portion of a migration.
  *
- * \param[in] path Migration to run
+ * \param[in] m Migration (from migration_parse().)
+ * \return 0 on success, non-zero on failure.
+ */
+int migration_downgrade(const struct migration *m);
+
+/**
+ * Compute the checksum of a migration.
+ *
+ * \param[in]  mem  Migration
+ * \param[in]  size Size of the migration
+ * \param[out] sum  Buffer of at least MIGRATION_CHECKSUM_LEN bytes
  * \return 0 on success, non-zero on failure.
  */
-int migration_downgrade(const char *path);
+int migration_checksum(const char *mem, size_t size, char *sum);
 
 #endif /* MIGRATION_H */
@@ -0,0 +1,383 @@
+/**
+ * Minimal Migration Manager - Migration Packs
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef IN_TESTS
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
+#include "source.h"
+#include "utils.h"
+#include "pack.h"
+
+/**
+ * Magic number for migration packs.
+ */
+static const char pack_magic[8] = "mmmpak1";
+
+/**
+ * The pack starts with a header: the magic number, the number of
+ * migrations, and the size of the names (in bytes.)
+ */
+#define PACK_HEADER 16
+
+/**
+ * Each index entry holds the designation (high and low 32 bits,)
+ * the offset of the name within the names, and the offset, size,
+ * and checksum of the migration.
+ */
+#define PACK_ENTRY 24
+
+/**
+ * Get a big-endian 32-bit number.
+ */
+static unsigned long get32(const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+
+	return ((unsigned long)u[0] << 24) | ((unsigned long)u[1] << 16) |
+	       ((unsigned long)u[2] << 8) | (unsigned long)u[3];
+}
+
+/**
+ * Put a big-endian 32-bit number.
+ */
+static void put32(char *p, unsigned long x)
+{
+	p[0] = (char)((x >> 24) & 0xff);
+	p[1] = (char)((x >> 16) & 0xff);
+	p[2] = (char)((x >> 8) & 0xff);
+	p[3] = (char)(x & 0xff);
+}
+
+/**
+ * Get the designation from an index entry.
+ *
+ * Designations wider than an unsigned long are rejected by
+ * pack_check(), so the high bits only matter on 64-bit machines.
+ */
+static unsigned long entry_num(const char *e)
+{
+	return ((get32(e) << 16) << 16) | get32(e + 4);
+}
+
+/**
+ * Write all of a buffer.
+ *
+ * \return 0 on success, non-zero on failure.
+ */
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t bw;
+
+	while (len) {
+		errno = 0;
+		if ((bw = write(fd, buf, len)) <= 0) {
+			if (bw < 0 && errno == EINTR)
+				continue;
+			return 1;
+		}
+
+		buf += bw;
+		len -= (size_t)bw;
+	}
+
+	return 0;
+}
+
+/**
+ * Build the header, index, and names for a pack. The migrations'
+ * offsets, sizes, and checksums are filled in as they're written.
+ *
+ * \param[in]  m    Migrations
+ * \param[in]  n    Number of migrations
+ * \param[out] size Size of the index
+ * \return The index, or NULL on error.
+ */
+static char *build_index(char **m, size_t n, size_t *size)
+{
+	char *index, *e, *names;
+	size_t i, k, len, names_len = 0;
+	unsigned long num, prev = 0;
+
+	for (i = 0; i < n; i++)
+		names_len += strlen(m[i]) + 1;
+
+	*size = PACK_HEADER + n * PACK_ENTRY + names_len;
+	errno = 0;
+	if (!(index = calloc(1, *size))) {
+		error("memory allocation failed: %s", strerror(ENOMEM));
+		return NULL;
+	}
+
+	memcpy(index, pack_magic, sizeof(pack_magic));
+	put32(index + 8, (unsigned long)n);
+	put32(index + 12, (unsigned long)names_len);
+
+	names = index + PACK_HEADER + n * PACK_ENTRY;
+	for (i = k = 0; i < n; i++) {
+		/* The index has to be sorted by designation */
+		if ((num = strtoul(m[i], NULL, 0)) < prev) {
+			error("pack: '%s' is out of order", m[i]);
+			free(index);
+			return NULL;
+		}
+
+		e = index + PACK_HEADER + i * PACK_ENTRY;
+		put32(e, (num >> 16) >> 16);
+		put32(e + 4, num & 0xffffffffUL);
+		put32(e + 8, (unsigned long)k);
+
+		len = strlen(m[i]) + 1;
+		memcpy(names + k, m[i], len);
+		k   += len;
+		prev = num;
+	}
+
+	return index;
+}
+
+/**
+ * Build a migration pack.
+ *
+ * \param[in] source Name of the source to read the migrations from.
+ * \param[in] path   Path to the pack.
+ * \return 0 on success, non-zero on failure.
+ */
+int pack_build(const char *source, const char *path)
+{
+	char tmp[1024], **m, *index = NULL, *mem, *e;
+	size_t i, n = 0, size, len;
+	unsigned long off;
+	int fd = -1, retval = 1, err;
+
+	if (!path || !*path) {
+		error("pack: no pack_file specified");
+		return retval;
+	}
+
+	if (strlen(path) + 5 > sizeof(tmp)) {
+		error("pack: path too long: %s", path);
+		return retval;
+	}
+
+	if (!(m = source_find_migrations(source, NULL, NULL, &n))) {
+		error("pack: no migrations found");
+		return retval;
+	}
+
+	if (!(index = build_index(m, n, &len)))
+		goto ret;
+
+	/* Leave room for the index, which is written last */
+	sprintf(tmp, "%s.tmp", path);
+	errno = 0;
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC,
+	          S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) goto err;
+	if (write_all(fd, index, len)) goto write_err;
+
+	/* Append the migrations, each with a terminating NUL */
+	off = (unsigned long)len;
+	for (i = 0; i < n; i++) {
+		if (!(mem = source_load_migration(source, m[i], &size)))
+			goto remove_tmp;
+
+		if ((((unsigned long)size + off + 1) >> 16) >> 16) {
+			source_unload_migration(source, mem, size);
+			error("pack: '%s' would be too large", path);
+			goto remove_tmp;
+		}
+
+		e = index + PACK_HEADER + i * PACK_ENTRY;
+		put32(e + 12, off);
+		put32(e + 16, (unsigned long)size);
+		put32(e + 20, checksum(mem, size));
+
+		err = write_all(fd, mem, size) || write_all(fd, "", 1);
+		source_unload_migration(source, mem, size);
+		if (err) goto write_err;
+		off += (unsigned long)size + 1;
+	}
+
+	/* Now, we can fill in the index */
+	errno = 0;
+	if (lseek(fd, 0, SEEK_SET) || write_all(fd, index, len))
+		goto write_err;
+
+	err = close(fd);
+	fd  = -1;
+	if (err || rename(tmp, path))
+		goto write_err;
+
+	PRINT_2("Packed %lu migrations into %s\n", (unsigned long)n, path);
+	retval = 0;
+
+ret:
+	if (fd > -1) close(fd);
+	free(index);
+	while (n) free(m[--n]);
+	free(m);
+	return retval;
+
+write_err:
+	error("pack: unable to write '%s': %s", tmp,
+	      errno ? strerror(errno) : "short write");
+remove_tmp:
+	if (fd > -1) close(fd);
+	fd = -1;
+	unlink(tmp);
+	goto ret;
+
+err:
+	error("pack: unable to write '%s': %s", tmp, strerror(errno));
+	goto ret;
+}
+
+/**
+ * Check that a pack is intact.
+ *
+ * \param[in]  mem  Pack
+ * \param[in]  size Size of the pack
+ * \param[out] n    Number of migrations in the pack
+ * \return 0 if the pack is usable, non-zero otherwise.
+ */
+int pack_check(const char *mem, size_t size, size_t *n)
+{
+	const char *e;
+	size_t i, count, end;
+	unsigned long num, prev = 0, names_len, off, len;
+
+	if (!mem || !n || size < PACK_HEADER ||
+	    memcmp(mem, pack_magic, sizeof(pack_magic)))
+		return 1;
+
+	/* Make sure the index fits, and the last name is terminated */
+	count     = (size_t)get32(mem + 8);
+	names_len = get32(mem + 12);
+	if (count > (size - PACK_HEADER) / PACK_ENTRY)
+		return 1;
+
+	end = PACK_HEADER + count * PACK_ENTRY;
+	if (names_len > size - end || (names_len && mem[end + names_len - 1]))
+		return 1;
+	end += (size_t)names_len;
+
+	/* ... and that everything it points to is past it */
+	for (i = 0; i < count; i++) {
+		e   = mem + PACK_HEADER + i * PACK_ENTRY;
+		num = entry_num(e);
+		off = get32(e + 12);
+		len = get32(e + 16);
+		if (((num >> 16) >> 16) != get32(e) || num < prev ||
+		    get32(e + 8) >= names_len || off < end || off >= size ||
+		    len >= size - off || mem[off + len])
+			return 1;
+		prev = num;
+	}
+
+	*n = count;
+	return 0;
+}
+
+/**
+ * Find the first migration with a designation greater than
+ * (or equal to, if \a eq is set) \a num.
+ */
+static size_t bound(const char *mem, size_t n, unsigned long num, int eq)
+{
+	size_t lo = 0, mid;
+	unsigned long x;
+
+	while (lo < n) {
+		mid = lo + (n - lo) / 2;
+		x   = entry_num(mem + PACK_HEADER + mid * PACK_ENTRY);
+		if (x < num || (!eq && x == num))
+			lo = mid + 1;
+		else n = mid;
+	}
+
+	return lo;
+}
+
+/**
+ * Find the first migration with a designation greater than \a num.
+ *
+ * \param[in] mem Pack (which has passed pack_check())
+ * \param[in] n   Number of migrations in the pack
+ * \param[in] num Designation
+ * \return The index of the migration, or \a n if there isn't one.
+ */
+size_t pack_upper(const char *mem, size_t n, unsigned long num)
+{
+	return bound(mem, n, num, 0);
+}
+
+/**
+ * Find a migration by name.
+ *
+ * \param[in] mem  Pack (which has passed pack_check())
+ * \param[in] n    Number of migrations in the pack
+ * \param[in] name Migration name
+ * \return The index of the migration, or \a n if it isn't there.
+ */
+size_t pack_find(const char *mem, size_t n, const char *name)
+{
+	size_t i;
+	unsigned long num = strtoul(name, NULL, 0);
+
+	for (i = bound(mem, n, num, 1); i < n; i++) {
+		if (entry_num(mem + PACK_HEADER + i * PACK_ENTRY) != num)
+			break;
+		if (!strcmp(pack_name(mem, i), name))
+			return i;
+	}
+
+	return n;
+}
+
+/**
+ * Get the name of a migration in a pack.
+ *
+ * \param[in] mem Pack (which has passed pack_check())
+ * \param[in] i   Index of the migration
+ * \return The name of the migration.
+ */
+const char *pack_name(const char *mem, size_t i)
+{
+	const char *names = mem + PACK_HEADER +
+	                    (size_t)get32(mem + 8) * PACK_ENTRY;
+
+	return names + get32(mem + PACK_HEADER + i * PACK_ENTRY + 8);
+}
+
+/**
+ * Get a migration in a pack, without copying it.
+ *
+ * \param[in]  mem  Pack (which has passed pack_check())
+ * \param[in]  i    Index of the migration
+ * \param[out] size Size of the migration
+ * \param[out] sum  Checksum of the migration
+ * \return The migration, which is NUL-terminated.
+ */
+char *pack_migration(char *mem, size_t i, size_t *size,
+                     unsigned long *sum)
+{
+	const char *e = mem + PACK_HEADER + i * PACK_ENTRY;
+
+	*size = (size_t)get32(e + 16);
+	*sum  = get32(e + 20);
+	return mem + get32(e + 12);
+}
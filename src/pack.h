@@ -0,0 +1,88 @@
+/**
+ * \file pack.h
+ *
+ * Minimal Migration Manager - Migration Packs
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+
+/**
+ * Build a migration pack.
+ *
+ * A pack holds every migration a source knows about in one file: a
+ * header, an index sorted as sort_migrations() would sort it, the
+ * names, and then the migrations themselves (each NUL-terminated.)
+ * Numbers are stored big-endian, so packs can be built on one
+ * machine and used on another.
+ *
+ * The pack is written to a temporary file, which then replaces
+ * \a path.
+ *
+ * \param[in] source Name of the source to read the migrations from.
+ * \param[in] path   Path to the pack.
+ * \return 0 on success, non-zero on failure.
+ */
+int pack_build(const char *source, const char *path);
+
+/**
+ * Check that a pack is intact.
+ *
+ * Everything the index points to must be within the pack, and the
+ * index must be sorted. The migrations' checksums aren't checked.
+ *
+ * \param[in]  mem  Pack
+ * \param[in]  size Size of the pack
+ * \param[out] n    Number of migrations in the pack
+ * \return 0 if the pack is usable, non-zero otherwise.
+ */
+int pack_check(const char *mem, size_t size, size_t *n);
+
+/**
+ * Find the first migration with a designation greater than \a num.
+ *
+ * \param[in] mem Pack (which has passed pack_check())
+ * \param[in] n   Number of migrations in the pack
+ * \param[in] num Designation
+ * \return The index of the migration, or \a n if there isn't one.
+ */
+size_t pack_upper(const char *mem, size_t n, unsigned long num);
+
+/**
+ * Find a migration by name.
+ *
+ * \param[in] mem  Pack (which has passed pack_check())
+ * \param[in] n    Number of migrations in the pack
+ * \param[in] name Migration name
+ * \return The index of the migration, or \a n if it isn't there.
+ */
+size_t pack_find(const char *mem, size_t n, const char *name);
+
+/**
+ * Get the name of a migration in a pack.
+ *
+ * \param[in] mem Pack (which has passed pack_check())
+ * \param[in] i   Index of the migration
+ * \return The name of the migration.
+ */
+const char *pack_name(const char *mem, size_t i);
+
+/**
+ * Get a migration in a pack, without copying it.
+ *
+ * \param[in]  mem  Pack (which has passed pack_check())
+ * \param[in]  i    Index of the migration
+ * \param[out] size Size of the migration
+ * \param[out] sum  Checksum of the migration, as computed by
+ *                  checksum() when the pack was built.
+ * \return The migration, which is NUL-terminated.
+ */
+char *pack_migration(char *mem, size_t i, size_t *size,
+                     unsigned long *sum);
+
+#endif /* PACK_H */
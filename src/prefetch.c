@@ -0,0 +1,396 @@
+/**
+ * Minimal Migration Manager - Prefetching Pending Migrations
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+/**
+ * posix_madvise() is from POSIX.1-2001.
+ */
+#ifndef IN_TESTS
+#undef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef IN_TESTS
+#include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#endif
+
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "file.h"
+#include "source.h"
+#include "utils.h"
+#include "prefetch.h"
+
+#define JOB_EMPTY   0 /**< Not loaded yet */
+#define JOB_UNREAD  1 /**< To be read in */
+#define JOB_READING 2 /**< Being read in */
+#define JOB_PENDING 3 /**< Loaded, but not parsed */
+#define JOB_BUSY    4 /**< Being parsed */
+#define JOB_DONE    5 /**< Ready (or couldn't be loaded) */
+
+/**
+ * A migration to be prefetched.
+ */
+struct job {
+	char *mem;          /**< Migration, as loaded */
+	size_t size;        /**< Size of the migration */
+	struct migration m; /**< Migration, once parsed */
+	int state;          /**< JOB_* */
+};
+
+/**
+ * Migrations are handed to the prefetcher, in order and a batch at a
+ * time, as the thread running them gets to them. Those in files are
+ * read in by the prefetcher, a batch at a time, since map_files()
+ * can be used from any thread. The sources can't, so migrations a
+ * source provides itself (e.g. from a pack) are loaded by the thread
+ * running them, and only parsed by the prefetcher. If the thread
+ * running them catches up, it parses the next one itself, and reads
+ * it in itself if there's nobody else to.
+ */
+static struct prefetch {
+	const char *source; /**< Migration source */
+	char **names;       /**< Migration names */
+	char **paths;       /**< Paths to them (or NULL) */
+	struct job *jobs;   /**< Migrations, in order */
+	size_t n;           /**< Number of migrations */
+	size_t loaded;      /**< Number of migrations loaded */
+	size_t next;        /**< Next migration for the prefetcher */
+	int stop;           /**< Set to stop the prefetcher */
+#ifdef HAVE_LIBPTHREAD
+	int started;           /**< Non-zero once we've tried a thread */
+	int threaded;          /**< Non-zero if there's a prefetcher */
+	pthread_t thread;      /**< Prefetcher */
+	pthread_mutex_t lock;  /**< Guards loaded, next, stop and states */
+	pthread_cond_t change; /**< Signalled when any of those change */
+#endif
+} pf;
+
+#ifdef HAVE_LIBPTHREAD
+#define PF_LOCK()   pthread_mutex_lock(&pf.lock)
+#define PF_UNLOCK() pthread_mutex_unlock(&pf.lock)
+#define PF_WAIT()   pthread_cond_wait(&pf.change, &pf.lock)
+#define PF_DONE()   pthread_cond_broadcast(&pf.change)
+#else
+#define PF_LOCK()   ((void)0)
+#define PF_UNLOCK() ((void)0)
+#define PF_WAIT()   ((void)0)
+#define PF_DONE()   ((void)0)
+#endif
+
+/**
+ * Ask for a migration to be read in, ahead of it being parsed.
+ *
+ * \param[in] mem  Migration
+ * \param[in] size Size of the migration
+ */
+static void advise(char *mem, size_t size)
+{
+#if !defined(IN_TESTS) && defined(POSIX_MADV_WILLNEED)
+	long page = sysconf(_SC_PAGESIZE);
+	size_t off;
+
+	/* The migration may not start on a page (e.g. in a pack) */
+	if (page <= 0) return;
+	off = (size_t)mem % (size_t)page;
+	posix_madvise(mem - off, size + off, POSIX_MADV_WILLNEED);
+#else
+	(void)mem;
+	(void)size;
+#endif
+}
+
+/**
+ * Read in and parse a migration.
+ *
+ * \param[in] job Migration, which has been claimed (JOB_BUSY.)
+ */
+static void prepare(struct job *job)
+{
+	struct migration m;
+
+	memset(&m, 0, sizeof(m));
+	if (job->mem) {
+		advise(job->mem, job->size);
+		migration_parse(&m, job->mem, job->size);
+		m.name = pf.names[job - pf.jobs];
+	}
+
+	PF_LOCK();
+	job->m     = m;
+	job->state = JOB_DONE;
+	PF_DONE();
+	PF_UNLOCK();
+}
+
+/**
+ * Read in the migrations still to be read from the given one on,
+ * up to the given number of them, together.
+ *
+ * This is called, and returns, with the lock held.
+ *
+ * \param[in] i   Index of the first migration (JOB_UNREAD.)
+ * \param[in] max Most migrations to read (up to PREFETCH_BATCH.)
+ */
+static void read_in(size_t i, size_t max)
+{
+	char *mem[PREFETCH_BATCH];
+	size_t size[PREFETCH_BATCH], n, j;
+
+	for (n = 0; n < max && i + n < pf.loaded &&
+	     pf.jobs[i + n].state == JOB_UNREAD; n++)
+		pf.jobs[i + n].state = JOB_READING;
+
+	PF_UNLOCK();
+	map_files(pf.paths + i, n, mem, size);
+	PF_LOCK();
+
+	for (j = 0; j < n; j++) {
+		pf.jobs[i + j].mem   = mem[j];
+		pf.jobs[i + j].size  = size[j];
+		pf.jobs[i + j].state = JOB_PENDING;
+	}
+
+	PF_DONE();
+}
+
+/**
+ * Get the most migrations the thread running them should read in
+ * itself, when it catches up with what's been read: none while the
+ * prefetcher is there to do it, and only the first one before the
+ * prefetcher's been started.
+ */
+static size_t own_reads(void)
+{
+#ifdef HAVE_LIBPTHREAD
+	if (pf.threaded) return 0;
+	if (!pf.started && pf.n > 1) return 1;
+#endif
+	return PREFETCH_BATCH;
+}
+
+#ifdef HAVE_LIBPTHREAD
+/**
+ * Read in and parse migrations as they're loaded, until we're told
+ * to stop.
+ */
+static void *prefetcher(void *arg)
+{
+	struct job *job;
+
+	(void)arg;
+	PF_LOCK();
+	while (!pf.stop) {
+		while (pf.next < pf.loaded &&
+		       pf.jobs[pf.next].state != JOB_UNREAD &&
+		       pf.jobs[pf.next].state != JOB_PENDING)
+			++pf.next;
+
+		if (pf.next == pf.loaded) {
+			PF_WAIT();
+			continue;
+		}
+
+		job = &pf.jobs[pf.next];
+		if (job->state == JOB_UNREAD) {
+			read_in(pf.next, PREFETCH_BATCH);
+			continue;
+		}
+
+		++pf.next;
+		job->state = JOB_BUSY;
+		PF_UNLOCK();
+		prepare(job);
+		PF_LOCK();
+	}
+
+	PF_UNLOCK();
+	return NULL;
+}
+#endif
+
+/**
+ * Load migrations up to PREFETCH_DEPTH past the given one, up to
+ * PREFETCH_BATCH at a time, so that they can be read in together.
+ *
+ * Only this thread changes pf.loaded, so it can be read unlocked.
+ *
+ * \param[in] i Index of the migration about to be run
+ */
+static void load_ahead(size_t i)
+{
+	char *mem[PREFETCH_BATCH];
+	size_t size[PREFETCH_BATCH];
+	size_t last = i + PREFETCH_DEPTH + 1, n, j;
+
+	if (last > pf.n) last = pf.n;
+	while (pf.loaded < last) {
+		n = last - pf.loaded;
+		if (n > PREFETCH_BATCH) n = PREFETCH_BATCH;
+
+		/* Files are left for the prefetcher to read in */
+		for (j = 0; !pf.paths && j < n; j++) {
+			size[j] = 0;
+			mem[j]  = source_load_migration(pf.source,
+			                                pf.names[pf.loaded + j],
+			                                &size[j]);
+		}
+
+		PF_LOCK();
+		for (j = 0; j < n; j++) {
+			if (!pf.paths) {
+				pf.jobs[pf.loaded].mem   = mem[j];
+				pf.jobs[pf.loaded].size  = size[j];
+				pf.jobs[pf.loaded].state = JOB_PENDING;
+			} else pf.jobs[pf.loaded].state = JOB_UNREAD;
+			++pf.loaded;
+		}
+
+		PF_DONE();
+		PF_UNLOCK();
+	}
+}
+
+/**
+ * Start prefetching a list of migrations.
+ *
+ * \param[in] source     Migration source
+ * \param[in] migrations Migration names
+ * \param[in] n          Number of migrations
+ * \return 0 on success, non-zero on failure.
+ */
+int prefetch_start(const char *source, char **migrations, size_t n)
+{
+	memset(&pf, 0, sizeof(pf));
+	if (!n) return 0;
+
+	errno = 0;
+	if (!(pf.jobs = calloc(n, sizeof(struct job)))) {
+		error("memory allocation failed: %s", strerror(ENOMEM));
+		return 1;
+	}
+
+	pf.source = source;
+	pf.names  = migrations;
+	pf.paths  = source_get_migration_paths(source, migrations, n);
+	pf.n      = n;
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_init(&pf.lock, NULL);
+	pthread_cond_init(&pf.change, NULL);
+#endif
+	return 0;
+}
+
+/**
+ * Get a migration, waiting for it to be prefetched if needs be.
+ *
+ * \param[in] i Index of the migration
+ * \return The parsed migration, or NULL if it couldn't be loaded.
+ */
+const struct migration *prefetch_get(size_t i)
+{
+	struct job *job;
+	size_t n;
+
+	if (i >= pf.n) return NULL;
+	load_ahead(i);
+	job = &pf.jobs[i];
+
+	PF_LOCK();
+	while (job->state != JOB_DONE) {
+		if (job->state == JOB_UNREAD && (n = own_reads())) {
+			read_in(i, n);
+		} else if (job->state == JOB_PENDING) {
+			job->state = JOB_BUSY;
+			PF_UNLOCK();
+			prepare(job);
+			PF_LOCK();
+		} else PF_WAIT();
+	}
+	PF_UNLOCK();
+
+#ifdef HAVE_LIBPTHREAD
+	/**
+	 * The prefetcher is only started once the first migration has
+	 * been parsed here, so it never races us to set up the scanner.
+	 */
+	if (!pf.started && pf.n > 1) {
+		pf.started  = 1;
+		pf.threaded = !pthread_create(&pf.thread, NULL, prefetcher,
+		                              NULL);
+	}
+#endif
+
+	return job->m.mem ? &job->m : NULL;
+}
+
+/**
+ * Give back a migration which won't be needed again.
+ *
+ * \param[in] i Index of the migration
+ */
+void prefetch_release(size_t i)
+{
+	struct job *job;
+	char *mem;
+
+	if (i >= pf.loaded) return;
+	job = &pf.jobs[i];
+
+	PF_LOCK();
+	while (job->state == JOB_BUSY || job->state == JOB_READING)
+		PF_WAIT();
+
+	mem        = job->mem;
+	job->mem   = NULL;
+	job->state = JOB_DONE;
+	memset(&job->m, 0, sizeof(job->m));
+	PF_UNLOCK();
+
+	if (mem) source_unload_migration(pf.source, mem, job->size);
+}
+
+/**
+ * Stop prefetching, and unload whatever's still loaded.
+ */
+void prefetch_stop(void)
+{
+	size_t i;
+
+	if (!pf.jobs) return;
+
+#ifdef HAVE_LIBPTHREAD
+	PF_LOCK();
+	pf.stop = 1;
+	PF_DONE();
+	PF_UNLOCK();
+
+	if (pf.threaded)
+		pthread_join(pf.thread, NULL);
+	pthread_cond_destroy(&pf.change);
+	pthread_mutex_destroy(&pf.lock);
+#endif
+
+	for (i = 0; i < pf.loaded; i++) {
+		if (pf.jobs[i].mem)
+			source_unload_migration(pf.source, pf.jobs[i].mem,
+			                        pf.jobs[i].size);
+	}
+
+	free(pf.paths);
+	free(pf.jobs);
+	memset(&pf, 0, sizeof(pf));
+}
@@ -0,0 +1,73 @@
+/**
+ * \file prefetch.h
+ *
+ * Minimal Migration Manager - Prefetching Pending Migrations
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stddef.h>
+#include "migration.h"
+
+/**
+ * \def PREFETCH_DEPTH
+ *
+ * How many migrations are loaded ahead of the one being run.
+ */
+#ifndef PREFETCH_DEPTH
+#define PREFETCH_DEPTH 4
+#endif
+
+/**
+ * \def PREFETCH_BATCH
+ *
+ * Most migrations loaded at once.
+ */
+#ifndef PREFETCH_BATCH
+#define PREFETCH_BATCH 64
+#endif
+
+/**
+ * Start prefetching a list of migrations.
+ *
+ * Migrations are loaded up to PREFETCH_DEPTH ahead of the one being
+ * run, PREFETCH_BATCH at a time, and (where there are threads) read
+ * in and parsed by another thread while the database is busy with
+ * the one before.
+ *
+ * \param[in] source     Migration source
+ * \param[in] migrations Migration names (which must outlive the
+ *                       prefetch.)
+ * \param[in] n          Number of migrations
+ * \return 0 on success, non-zero on failure.
+ */
+int prefetch_start(const char *source, char **migrations, size_t n);
+
+/**
+ * Get a migration, waiting for it to be prefetched if needs be.
+ *
+ * \param[in] i Index of the migration
+ * \return The parsed migration, or NULL if it couldn't be loaded.
+ */
+const struct migration *prefetch_get(size_t i);
+
+/**
+ * Give back a migration which won't be needed again.
+ *
+ * Migrations which aren't given back stay loaded until
+ * prefetch_stop(), and can be had again from prefetch_get().
+ *
+ * \param[in] i Index of the migration
+ */
+void prefetch_release(size_t i);
+
+/**
+ * Stop prefetching, and unload whatever's still loaded.
+ */
+void prefetch_stop(void);
+
+#endif /* PREFETCH_H */
@@ -0,0 +1,299 @@
+/**
+ * Minimal Migration Manager - Scanning Primitives
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <string.h>
+#include <ctype.h>
+
+#include "scan.h"
+
+/**
+ * SSE2 and AVX2 versions are built with GCC (5 and up) or clang on
+ * x86, and only used if the CPU has them.
+ */
+#if !defined(NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#define MARKER     "-- ["
+#define MARKER_LEN 4
+
+/**
+ * A set of primitives, for one kind of CPU.
+ */
+struct scan_impl {
+	const char *name;
+	size_t (*space)(const char *s, size_t len);
+	size_t (*any)(const char *s, size_t len, const char *set);
+	size_t (*marker)(const char *s, size_t len);
+};
+
+/* {{{ Portable versions */
+static size_t space_c(const char *s, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len && isspace((unsigned char)s[i])) i++;
+	return i;
+}
+
+static size_t any_c(const char *s, size_t len, const char *set)
+{
+	const char *p;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		for (p = set; *p && *p != s[i]; p++);
+		if (*p) break;
+	}
+
+	return i;
+}
+
+static size_t marker_c(const char *s, size_t len)
+{
+	const char *p = s, *end = s + len;
+
+	while ((size_t)(end - p) >= MARKER_LEN &&
+	       (p = memchr(p, '-', (size_t)(end - p - MARKER_LEN + 1)))) {
+		if (!memcmp(p, MARKER, MARKER_LEN))
+			return (size_t)(p - s);
+		++p;
+	}
+
+	return len;
+}
+
+static const struct scan_impl portable = {
+	"portable", space_c, any_c, marker_c
+};
+/* }}} */
+
+#ifdef HAVE_X86_SIMD
+#define LOAD128(p) _mm_loadu_si128((const __m128i *)(const void *)(p))
+#define LOAD256(p) _mm256_loadu_si256((const __m256i *)(const void *)(p))
+#define FIRST(x)   ((size_t)__builtin_ctz(x))
+
+/* {{{ SSE2 versions */
+__attribute__((target("sse2")))
+static size_t space_sse2(const char *s, size_t len)
+{
+	const __m128i blank = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t'), four = _mm_set1_epi8(4);
+	__m128i v, t;
+	unsigned int bits;
+	size_t i;
+
+	/* Whitespace is ' ', or '\t' through '\r' */
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = LOAD128(s + i);
+		t = _mm_sub_epi8(v, tab);
+		t = _mm_cmpeq_epi8(_mm_min_epu8(t, four), t);
+		t = _mm_or_si128(t, _mm_cmpeq_epi8(v, blank));
+		bits = ~(unsigned int)_mm_movemask_epi8(t) & 0xffffU;
+		if (bits) return i + FIRST(bits);
+	}
+
+	return i + space_c(s + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static size_t any_sse2(const char *s, size_t len, const char *set)
+{
+	__m128i c[SCAN_SET_MAX], v, m;
+	unsigned int bits;
+	size_t i, k, n = 0;
+
+	while (n < SCAN_SET_MAX && set[n]) {
+		c[n] = _mm_set1_epi8(set[n]);
+		++n;
+	}
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = LOAD128(s + i);
+		m = _mm_cmpeq_epi8(v, c[0]);
+		for (k = 1; k < n; k++)
+			m = _mm_or_si128(m, _mm_cmpeq_epi8(v, c[k]));
+		if ((bits = (unsigned int)_mm_movemask_epi8(m)))
+			return i + FIRST(bits);
+	}
+
+	return i + any_c(s + i, len - i, set);
+}
+
+__attribute__((target("sse2")))
+static size_t marker_sse2(const char *s, size_t len)
+{
+	const __m128i dash = _mm_set1_epi8('-');
+	const __m128i blank = _mm_set1_epi8(' ');
+	const __m128i open = _mm_set1_epi8('[');
+	__m128i m;
+	unsigned int bits;
+	size_t i;
+
+	/* Compare each of the marker's bytes at once */
+	for (i = 0; i + 16 + MARKER_LEN - 1 <= len; i += 16) {
+		m = _mm_and_si128(_mm_cmpeq_epi8(LOAD128(s + i), dash),
+		                  _mm_cmpeq_epi8(LOAD128(s + i + 1), dash));
+		m = _mm_and_si128(m, _mm_cmpeq_epi8(LOAD128(s + i + 2), blank));
+		m = _mm_and_si128(m, _mm_cmpeq_epi8(LOAD128(s + i + 3), open));
+		if ((bits = (unsigned int)_mm_movemask_epi8(m)))
+			return i + FIRST(bits);
+	}
+
+	return i + marker_c(s + i, len - i);
+}
+
+static const struct scan_impl sse2 = {
+	"sse2", space_sse2, any_sse2, marker_sse2
+};
+/* }}} */
+
+/* {{{ AVX2 versions */
+__attribute__((target("avx2")))
+static size_t space_avx2(const char *s, size_t len)
+{
+	const __m256i blank = _mm256_set1_epi8(' ');
+	const __m256i tab = _mm256_set1_epi8('\t');
+	const __m256i four = _mm256_set1_epi8(4);
+	__m256i v, t;
+	unsigned int bits;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = LOAD256(s + i);
+		t = _mm256_sub_epi8(v, tab);
+		t = _mm256_cmpeq_epi8(_mm256_min_epu8(t, four), t);
+		t = _mm256_or_si256(t, _mm256_cmpeq_epi8(v, blank));
+		bits = ~(unsigned int)_mm256_movemask_epi8(t);
+		if (bits) return i + FIRST(bits);
+	}
+
+	return i + space_sse2(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t any_avx2(const char *s, size_t len, const char *set)
+{
+	__m256i c[SCAN_SET_MAX], v, m;
+	unsigned int bits;
+	size_t i, k, n = 0;
+
+	while (n < SCAN_SET_MAX && set[n]) {
+		c[n] = _mm256_set1_epi8(set[n]);
+		++n;
+	}
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = LOAD256(s + i);
+		m = _mm256_cmpeq_epi8(v, c[0]);
+		for (k = 1; k < n; k++)
+			m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, c[k]));
+		if ((bits = (unsigned int)_mm256_movemask_epi8(m)))
+			return i + FIRST(bits);
+	}
+
+	return i + any_sse2(s + i, len - i, set);
+}
+
+__attribute__((target("avx2")))
+static size_t marker_avx2(const char *s, size_t len)
+{
+	const __m256i dash = _mm256_set1_epi8('-');
+	const __m256i blank = _mm256_set1_epi8(' ');
+	const __m256i open = _mm256_set1_epi8('[');
+	__m256i m;
+	unsigned int bits;
+	size_t i;
+
+	for (i = 0; i + 32 + MARKER_LEN - 1 <= len; i += 32) {
+		m = _mm256_and_si256(_mm256_cmpeq_epi8(LOAD256(s + i), dash),
+		                     _mm256_cmpeq_epi8(LOAD256(s + i + 1),
+		                                       dash));
+		m = _mm256_and_si256(m, _mm256_cmpeq_epi8(LOAD256(s + i + 2),
+		                                          blank));
+		m = _mm256_and_si256(m, _mm256_cmpeq_epi8(LOAD256(s + i + 3),
+		                                          open));
+		if ((bits = (unsigned int)_mm256_movemask_epi8(m)))
+			return i + FIRST(bits);
+	}
+
+	return i + marker_sse2(s + i, len - i);
+}
+
+static const struct scan_impl avx2 = {
+	"avx2", space_avx2, any_avx2, marker_avx2
+};
+/* }}} */
+#endif /* HAVE_X86_SIMD */
+
+/* Primitives in use */
+static const struct scan_impl *impl = NULL;
+
+/**
+ * Choose the best primitives the CPU can run.
+ */
+static const struct scan_impl *select_impl(void)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return impl = &avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return impl = &sse2;
+#endif
+	return impl = &portable;
+}
+
+/**
+ * Skip whitespace.
+ *
+ * \param[in] s   Buffer
+ * \param[in] len Length of the buffer
+ * \return The offset of the first byte which isn't whitespace,
+ *         or \a len if there isn't one.
+ */
+size_t scan_space(const char *s, size_t len)
+{
+	return (impl ? impl : select_impl())->space(s, len);
+}
+
+/**
+ * Find the first of a set of bytes.
+ *
+ * \param[in] s   Buffer
+ * \param[in] len Length of the buffer
+ * \param[in] set Bytes to look for (1 to SCAN_SET_MAX of them.)
+ * \return The offset of the first byte in \a set, or \a len if
+ *         there isn't one.
+ */
+size_t scan_any(const char *s, size_t len, const char *set)
+{
+	const char *p;
+
+	/* The C library is already good at finding one byte */
+	if (!set[1]) {
+		p = memchr(s, *set, len);
+		return p ? (size_t)(p - s) : len;
+	}
+
+	return (impl ? impl : select_impl())->any(s, len, set);
+}
+
+/**
+ * Find the next "-- [" marker.
+ *
+ * \param[in] s   Buffer
+ * \param[in] len Length of the buffer
+ * \return The offset of the marker, or \a len if there isn't one.
+ */
+size_t scan_marker(const char *s, size_t len)
+{
+	return (impl ? impl : select_impl())->marker(s, len);
+}
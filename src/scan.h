@@ -0,0 +1,59 @@
+/**
+ * \file scan.h
+ *
+ * Minimal Migration Manager - Scanning Primitives
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+/**
+ * \def SCAN_SET_MAX
+ *
+ * Maximum number of bytes scan_any() can look for at once.
+ */
+#define SCAN_SET_MAX 4
+
+/**
+ * These look at 16 or 32 bytes at a time where the CPU allows it
+ * (chosen when first used,) or one at a time otherwise. Whitespace
+ * is as isspace() has it in the "C" locale.
+ */
+
+/**
+ * Skip whitespace.
+ *
+ * \param[in] s   Buffer
+ * \param[in] len Length of the buffer
+ * \return The offset of the first byte which isn't whitespace,
+ *         or \a len if there isn't one.
+ */
+size_t scan_space(const char *s, size_t len);
+
+/**
+ * Find the first of a set of bytes.
+ *
+ * \param[in] s   Buffer
+ * \param[in] len Length of the buffer
+ * \param[in] set Bytes to look for (1 to SCAN_SET_MAX of them,
+ *                NUL-terminated.)
+ * \return The offset of the first byte in \a set, or \a len if
+ *         there isn't one.
+ */
+size_t scan_any(const char *s, size_t len, const char *set);
+
+/**
+ * Find the next "-- [" marker (as starts a section of a migration.)
+ *
+ * \param[in] s   Buffer
+ * \param[in] len Length of the buffer
+ * \return The offset of the marker, or \a len if there isn't one.
+ */
+size_t scan_marker(const char *s, size_t len);
+
+#endif /* SCAN_H */
@@ -0,0 +1,247 @@
+/**
+ * Minimal Migration Manager - Streaming Seed Loader
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "db.h"
+#include "file.h"
+#include "copy.h"
+#include "sql.h"
+#include "utils.h"
+#include "seed.h"
+
+/**
+ * Size of each read, and the initial size of the buffer.
+ */
+#ifndef SEED_CHUNK
+#define SEED_CHUNK (1UL << 20)
+#endif
+
+/**
+ * Size of the largest statement we'll buffer. The buffer only
+ * grows beyond SEED_CHUNK when a single statement won't fit.
+ */
+#ifndef SEED_MAX_STATEMENT
+#define SEED_MAX_STATEMENT (64UL << 20)
+#endif
+
+/**
+ * Interval between progress reports (in milliseconds.)
+ */
+#define SEED_PROGRESS_MS 2000UL
+
+/**
+ * Send a batch of statements to the database.
+ *
+ * \param[in] buf    Buffer
+ * \param[in] len    Length of the batch
+ * \param[in] offset Offset of the batch within the file
+ * \return 0 on success, non-zero on failure.
+ */
+static int run_batch(const char *buf, size_t len, unsigned long offset)
+{
+	char label[64];
+	int retval, pipelined;
+
+	/* A pipelined batch says where it was if it fails later on */
+	sprintf(label, "seed: bytes %lu-%lu", offset,
+	        offset + (unsigned long)len);
+	pipelined = db_pipeline_label(label);
+	if ((retval = db_query_len(buf, len, NULL, NULL)) && !pipelined) {
+		error("seed: failed to load bytes %lu-%lu", offset,
+		      offset + (unsigned long)len);
+	}
+	return retval;
+}
+
+/**
+ * Report our progress.
+ */
+static void report(unsigned long offset, unsigned long total,
+                   unsigned long n_stmts)
+{
+	if (total) {
+		PRINT_3("  %lu of %lu bytes, %lu statements\n",
+		        offset, total, n_stmts);
+	} else PRINT_2("  %lu bytes, %lu statements\n", offset, n_stmts);
+}
+
+/**
+ * Handle a copy section marker at the start of the buffer.
+ *
+ * \param[in]  s      Scanner
+ * \param[in]  buf    Buffer
+ * \param[in]  len    Number of bytes in the buffer
+ * \param[in]  eof    Non-zero if the whole file has been read
+ * \param[out] target Copy target
+ * \return The number of bytes consumed, or (size_t)-1 on error.
+ */
+static size_t start_copy(struct sql_scanner *s, const char *buf,
+                         size_t len, int eof, char *target)
+{
+	const char *nl;
+	size_t n;
+
+	/* We need the whole line */
+	if (!(nl = memchr(buf, '\n', len)) && !eof)
+		return 0;
+
+	n = nl ? (size_t)(nl - buf) : len;
+	if (copy_marker(buf, n, target) < 0)
+		return (size_t)-1;
+
+	++s->n_stmts;
+	s->marker = 0;
+	return nl ? n + 1 : n;
+}
+
+/**
+ * Load a seed file into the database.
+ *
+ * \param[in] path Path to the seed file
+ * \return 0 on success, non-zero on failure.
+ */
+int seed_load(const char *path)
+{
+	struct sql_scanner s;
+	struct file_reader *f = NULL;
+	char target[COPY_TARGET_MAX], *buf = NULL, *tmp;
+	const char *driver = db_get_driver_name();
+	size_t cap = SEED_CHUNK, len = 0, limit, done, rows, br;
+	unsigned long offset = 0, total, last_report, ran = 0;
+	int eof = 0, copying = 0, atomic, retval = 1;
+
+	/*
+	 * PostgreSQL used to get the whole seed in one PQexec(), which
+	 * made it atomic. Since it's now sent in batches, it's wrapped
+	 * in a transaction to keep it that way, and the statements are
+	 * pipelined so that the batches don't cost a round trip each.
+	 */
+	atomic = driver && !strcmp(driver, "pgsql");
+	sql_scan_init(&s, sql_dialect(driver) | SQL_COPY);
+
+	/* Compressed seeds are decompressed as they're read */
+	if (!path || !(f = file_open(path)))
+		goto ret;
+
+	total = file_size(f);
+
+	if (!(buf = malloc(cap + 1))) {
+		error("Out of memory");
+		goto ret;
+	}
+
+	if (atomic) {
+		if (db_query("BEGIN", NULL, NULL))
+			goto ret;
+		db_pipeline_begin();
+	}
+
+	last_report = now_ms();
+	for (;;) {
+		/* Fill the buffer */
+		while (!eof && len < cap) {
+			if (file_read(f, buf + len, cap - len, &br))
+				goto rollback;
+
+			if (!br) eof = 1;
+			len += br;
+		}
+
+		buf[len] = '\0';
+		if (copying) {
+			/* Load the complete rows, and keep the rest */
+			if (copy_rows(buf, len, eof, &rows, &done)) {
+				copying = 0;
+				s.prev  = '\n';
+			}
+
+			if (rows && db_copy(target, buf, rows)) {
+				error("seed: failed to load bytes %lu-%lu", offset,
+				      offset + (unsigned long)rows);
+				goto rollback;
+			}
+
+			if (!done && !copying) continue;
+		} else if (s.marker) {
+			done = start_copy(&s, buf, len, eof, target);
+			if (done == (size_t)-1)
+				goto rollback;
+			copying = 1;
+			ran = s.n_stmts;
+		} else {
+			limit = eof ? len : len - SQL_LOOKAHEAD;
+			sql_scan(&s, buf, limit, len);
+
+			/* Run the complete statements, and keep the rest */
+			if ((done = s.boundary) && s.n_stmts > ran &&
+			    run_batch(buf, done, offset))
+				goto rollback;
+
+			ran = s.n_stmts;
+			s.boundary = 0;
+			if (!done && s.marker) continue;
+		}
+
+		if (done) {
+			offset += (unsigned long)done;
+			memmove(buf, buf + done, len - done);
+			len  -= done;
+			s.pos = s.pos > done ? s.pos - done : 0;
+		} else if (eof) {
+			break;
+		} else if (cap >= SEED_MAX_STATEMENT) {
+			error("seed: statement at byte %lu is larger than %lu "
+			      "bytes", offset, (unsigned long)SEED_MAX_STATEMENT);
+			goto rollback;
+		} else {
+			/* The statement won't fit, so make room for it */
+			if (!(tmp = realloc(buf, (cap << 1) + 1))) {
+				error("Out of memory");
+				goto rollback;
+			}
+
+			buf  = tmp;
+			cap <<= 1;
+		}
+
+		if (now_ms() - last_report >= SEED_PROGRESS_MS) {
+			report(offset, total, s.n_stmts);
+			last_report = now_ms();
+		}
+	}
+
+	/* Whatever's left is a final statement without a semicolon */
+	if (s.tokens) {
+		++s.n_stmts;
+		if (run_batch(buf, len, offset))
+			goto rollback;
+	}
+	offset += (unsigned long)len;
+
+	if (atomic && (db_pipeline_end() || db_query("COMMIT", NULL, NULL)))
+		goto rollback;
+
+	report(offset, total, s.n_stmts);
+	retval = 0;
+
+ret:
+	file_close(f);
+	free(buf);
+	return retval;
+
+rollback:
+	if (atomic) {
+		db_pipeline_end();
+		db_query("ROLLBACK", NULL, NULL);
+	}
+	goto ret;
+}
@@ -0,0 +1,26 @@
+/**
+ * \file seed.h
+ *
+ * Minimal Migration Manager - Streaming Seed Loader
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+#ifndef SEED_H
+#define SEED_H
+
+/**
+ * Load a seed file into the database.
+ *
+ * The file is read in bounded chunks, which are cut at statement
+ * boundaries and passed to the database a batch at a time, so
+ * memory use doesn't depend on the size of the file. Progress is
+ * reported as the file is loaded.
+ *
+ * \param[in] path Path to the seed file
+ * \return 0 on success, non-zero on failure.
+ */
+int seed_load(const char *path);
+
+#endif /* SEED_H */
@@ -10,15 +10,21 @@
 #include <string.h>
 #include <limits.h>
 #include <inttypes.h>
+#include <errno.h>
 
 #include "source.h"
 #include "source/backend.h"
+#include "file.h"
+#include "stringbuf.h"
 #include "utils.h"
 
 /* Total number of source backends */
-#define N_SOURCE_BACKENDS 2
+#define N_SOURCE_BACKENDS 3
 static const struct source_backend_vtable *sources[N_SOURCE_BACKENDS];
 
+/* What's watched for sources which only have a migration path */
+static const char *watch_paths[2];
+
 /**
  * Lookup a source backend in the table.
  */
@@ -183,6 +189,176 @@ err:
 	return NULL;
 }
 
+/**
+ * Get the paths to watch for new migrations.
+ *
+ * \param[in] source Name of the source to use.
+ * \return A NULL-terminated list of paths to watch, or NULL if there
+ *         aren't any.
+ */
+const char *const *source_get_watch_paths(const char *source)
+{
+	size_t i;
+
+	if (!source) goto err;
+
+	i = find_backend(source, strlen(source));
+	if (i == SIZE_MAX) goto err;
+	if (sources[i]->get_watch_paths)
+		return sources[i]->get_watch_paths();
+	if (!(watch_paths[0] = sources[i]->get_migration_path()))
+		goto err;
+	return watch_paths;
+
+err:
+	return NULL;
+}
+
+/**
+ * Get the contents of a migration.
+ *
+ * Unless the source provides them itself, migrations are mapped from
+ * the migration path. The path is built in the common string buffer.
+ *
+ * \param[in]  source Name of the source to use.
+ * \param[in]  file   Migration name.
+ * \param[out] size   Size of the migration.
+ * \return The migration, or NULL on error.
+ */
+char *source_load_migration(const char *source, const char *file,
+                            size_t *size)
+{
+	size_t i, len;
+	const char *path;
+
+	if (!source || !file || !size) goto err;
+
+	i = find_backend(source, strlen(source));
+	if (i == SIZE_MAX) goto err;
+	if (sources[i]->load_migration)
+		return sources[i]->load_migration(file, size);
+
+	if (!sources[i]->get_migration_path ||
+	    !(path = sources[i]->get_migration_path())) {
+		error("unable to get migration path");
+		goto err;
+	}
+
+	len = strlen(path);
+	sbuf_reset(0);
+	if (sbuf_add_str(path, 0, 0) ||
+	    (len && path[len - 1] != '/' && sbuf_add_str("/", 0, 0)) ||
+	    sbuf_add_str(file, 0, 0)) {
+		error("path too long: %s", file);
+		goto err;
+	}
+
+	return map_file(sbuf_get_buffer(), size);
+
+err:
+	return NULL;
+}
+
+/**
+ * Get the paths to a number of migrations, so that they can be
+ * mapped together (with map_files().)
+ *
+ * \param[in] source Name of the source to use.
+ * \param[in] files  Migration names.
+ * \param[in] n      Number of migrations.
+ * \return The paths (in one block, to be freed by the caller,) or
+ *         NULL if the source provides its migrations itself, or on
+ *         error.
+ */
+char **source_get_migration_paths(const char *source, char **files,
+                                  size_t n)
+{
+	char **paths = NULL, *p;
+	const char *path;
+	size_t i, len, total;
+	int sep;
+
+	if (!source || !files || !n) goto ret;
+
+	i = find_backend(source, strlen(source));
+	if (i == SIZE_MAX || sources[i]->load_migration) goto ret;
+	if (!sources[i]->get_migration_path ||
+	    !(path = sources[i]->get_migration_path())) {
+		error("unable to get migration path");
+		goto ret;
+	}
+
+	/* Build the paths, all in one go */
+	len   = strlen(path);
+	sep   = len && path[len - 1] != '/';
+	total = n * sizeof(char *);
+	for (i = 0; i < n; i++)
+		total += len + (size_t)sep + strlen(files[i]) + 1;
+
+	if (!(paths = malloc(total))) {
+		error("memory allocation failed: %s", strerror(ENOMEM));
+		goto ret;
+	}
+
+	p = (char *)(paths + n);
+	for (i = 0; i < n; i++) {
+		paths[i] = p;
+		memcpy(p, path, len);
+		p += len;
+		if (sep) *p++ = '/';
+		strcpy(p, files[i]);
+		p += strlen(files[i]) + 1;
+	}
+
+ret:
+	return paths;
+}
+
+/**
+ * Give back a migration from source_load_migration(), or one
+ * mapped from source_get_migration_paths().
+ *
+ * \param[in] source Name of the source to use.
+ * \param[in] mem    Migration.
+ * \param[in] size   Size of the migration.
+ */
+void source_unload_migration(const char *source, char *mem, size_t size)
+{
+	size_t i;
+
+	if (!source || !mem) return;
+
+	i = find_backend(source, strlen(source));
+	if (i == SIZE_MAX) return;
+	if (sources[i]->load_migration) {
+		if (sources[i]->unload_migration)
+			sources[i]->unload_migration(mem, size);
+	} else unmap_file(mem, size);
+}
+
+/**
+ * Get the counts from the source's last scan for migrations.
+ *
+ * \param[in]  source  Name of the source to use.
+ * \param[out] scanned Entries looked at.
+ * \param[out] skipped Entries which weren't migrations.
+ * \return 0 on success, non-zero if the source doesn't scan for
+ *         migrations, or hasn't.
+ */
+int source_get_scan_stats(const char *source, unsigned long *scanned,
+                          unsigned long *skipped)
+{
+	size_t i;
+
+	if (!source || !scanned || !skipped)
+		return 1;
+
+	i = find_backend(source, strlen(source));
+	if (i == SIZE_MAX || !sources[i]->get_scan_stats)
+		return 1;
+	return sources[i]->get_scan_stats(scanned, skipped);
+}
+
 /**
  * Uninitialize the migration source layer.
  *
@@ -213,6 +389,7 @@ void source_uninit(void)
  */
 #ifndef IN_TESTS
 extern const struct source_backend_vtable file_vtable;
+extern const struct source_backend_vtable pack_vtable;
 #endif
 
 #ifdef HAVE_GIT
@@ -231,4 +408,10 @@ static const struct source_backend_vtable *sources[N_SOURCE_BACKENDS] = {
 #else
 	NULL,
 #endif
+
+#ifndef IN_TESTS
+	&pack_vtable
+#else
+	NULL
+#endif
 };
@@ -71,6 +71,69 @@ const char *source_get_file_revision(const char *source, const char *file);
  */
 const char *source_get_migration_path(const char *source);
 
+/**
+ * Get the paths to watch for new migrations.
+ *
+ * This is the migration path, unless the source says otherwise.
+ *
+ * \param[in] source Name of the source to use.
+ * \return A NULL-terminated list of paths to watch, the first of
+ *         which is required, or NULL if there aren't any.
+ */
+const char *const *source_get_watch_paths(const char *source);
+
+/**
+ * Get the contents of a migration.
+ *
+ * The migration is read-only, since it may be mapped straight from
+ * a file (or from a pack,) and mustn't be written to.
+ *
+ * \param[in]  source Name of the source to use.
+ * \param[in]  file   Migration name.
+ * \param[out] size   Size of the migration.
+ * \return The migration, or NULL on error.
+ */
+char *source_load_migration(const char *source, const char *file,
+                            size_t *size);
+
+/**
+ * Get the paths to a number of migrations, so that they can be
+ * mapped together (with map_files(), from any thread,) rather than
+ * loaded one at a time. Each is given back with
+ * source_unload_migration().
+ *
+ * \param[in] source Name of the source to use.
+ * \param[in] files  Migration names.
+ * \param[in] n      Number of migrations.
+ * \return The paths (in one block, to be freed by the caller,) or
+ *         NULL if the source provides its migrations itself, or on
+ *         error.
+ */
+char **source_get_migration_paths(const char *source, char **files,
+                                  size_t n);
+
+/**
+ * Give back a migration from source_load_migration(), or one
+ * mapped from source_get_migration_paths().
+ *
+ * \param[in] source Name of the source to use.
+ * \param[in] mem    Migration.
+ * \param[in] size   Size of the migration.
+ */
+void source_unload_migration(const char *source, char *mem, size_t size);
+
+/**
+ * Get the counts from the source's last scan for migrations.
+ *
+ * \param[in]  source  Name of the source to use.
+ * \param[out] scanned Entries looked at.
+ * \param[out] skipped Entries which weren't migrations.
+ * \return 0 on success, non-zero if the source doesn't scan for
+ *         migrations, or hasn't.
+ */
+int source_get_scan_stats(const char *source, unsigned long *scanned,
+                          unsigned long *skipped);
+
 /**
  * Uninitialize the migration source layer.
  *
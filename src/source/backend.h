@@ -66,6 +66,43 @@ struct source_backend_vtable {
 	 */
 	const char *(*get_migration_path)(void);
 
+	/**
+	 * Get the paths to watch for new migrations (optional.)
+	 *
+	 * \return A NULL-terminated list of paths to watch, the first
+	 *         of which is required, or NULL if there aren't any.
+	 */
+	const char *const *(*get_watch_paths)(void);
+
+	/**
+	 * Get the contents of a migration (optional.)
+	 *
+	 * Sources which don't provide this have their migrations read
+	 * from the migration path.
+	 *
+	 * \param[in]  file Migration name.
+	 * \param[out] size Size of the migration.
+	 * \return The migration, NUL-terminated, or NULL on error.
+	 */
+	char *(*load_migration)(const char *file, size_t *size);
+
+	/**
+	 * Give back a migration from load_migration (optional.)
+	 *
+	 * \param[in] mem  Migration.
+	 * \param[in] size Size of the migration.
+	 */
+	void (*unload_migration)(char *mem, size_t size);
+
+	/**
+	 * Get the counts from the last scan for migrations (optional.)
+	 *
+	 * \param[out] scanned Entries looked at.
+	 * \param[out] skipped Entries which weren't migrations.
+	 * \return 0 on success, non-zero if nothing was scanned.
+	 */
+	int (*get_scan_stats)(unsigned long *scanned, unsigned long *skipped);
+
 	/**
 	 * Uninitialize the backend, doing any cleanup along the way.
 	 *
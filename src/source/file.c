@@ -6,25 +6,40 @@
  * See the LICENSE file for details.
  */
 
+/**
+ * fstatat() and dirfd() are from POSIX.1-2008, and d_type is an
+ * extension.
+ */
+#ifndef IN_TESTS
+#undef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <time.h>
 
 #ifndef IN_TESTS
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #endif
 
 #include "backend.h"
+#include "../file.h"
 #include "../stringbuf.h"
 #include "../utils.h"
 
 /* Configurable variables */
 static struct config {
 	char migration_path[256]; /**< This will usually be relative. */
+	char index_file[256];     /**< Migration index (optional.) */
 } config;
 
 /* Buffer for concatenating migration_path + filenames. */
@@ -33,6 +48,41 @@ static const char *pathbuf;
 /* Local HEAD revision */
 static char local_head[50];
 
+/**
+ * Magic number for the migration index.
+ */
+static const char index_magic[8] = "mmmidx1";
+
+/**
+ * The migration index starts with this header, which is followed
+ * by the entries (sorted as sort_migrations() would sort them,)
+ * and then the NUL-terminated names. It's only meant for the
+ * machine that wrote it, so everything is in the native format.
+ */
+struct index_header {
+	char magic[8];       /**< index_magic */
+	unsigned long dev;   /**< Device of the migration path */
+	unsigned long ino;   /**< Inode of the migration path */
+	unsigned long mtime; /**< Modification time of the migration path */
+	unsigned long n;     /**< Number of entries */
+	unsigned long names; /**< Size of the names (in bytes) */
+};
+
+/**
+ * Migration index entry.
+ */
+struct index_entry {
+	unsigned long num;  /**< Numeric designation */
+	unsigned long name; /**< Offset of the name */
+};
+
+/* Counts from the last scan of the migration path */
+static struct scan_stats {
+	unsigned long scanned; /**< Directory entries read */
+	unsigned long skipped; /**< Entries which weren't migrations */
+	unsigned long stats;   /**< Entries we had to stat() */
+} scan_stats;
+
 /**
  * Callback for receiving configuration key/value pairs.
  *
@@ -44,52 +94,86 @@ static char local_head[50];
 static void file_config(void)
 {
 	CONFIG_SET_STRING("migration_path", 14, config.migration_path);
+	CONFIG_SET_STRING("index_file", 10, config.index_file);
 }
 
 /**
  * Add a migration to the migration list.
  *
+ * The list grows geometrically, so that building it is linear in
+ * the number of migrations.
+ *
  * \param[in,out] migrations List of migrations.
  * \param[in,out] offset     Offset at which to append this migration
+ * \param[in,out] cap        Number of entries the list has room for
  * \param[in]     file       Filename to add
+ * \param[in]     len        Length of the filename
  * \return 0 on success, non-zero on error.
  */
-static int add_migration(char ***migrations, size_t *offset, char *file)
+static int add_migration(char ***migrations, size_t *offset, size_t *cap,
+                         const char *file, size_t len)
 {
-	char **m = NULL, *tmp = NULL;
-	size_t off;
+	char **m = *migrations, *tmp = NULL;
+	size_t n;
 	int err = 0;
 
 	/* Create a copy of file */
-	off = strlen(file);
 	errno = 0;
-	tmp = malloc(off + 1);
+	tmp = malloc(len + 1);
 	if (!tmp) goto malloc_err;
-	memcpy(tmp, file, off + 1);
+	memcpy(tmp, file, len + 1);
 
-	/* Now, enlarge the migrations array */
-	off = *offset;
-	errno = 0;
-	m = realloc(*migrations, (off + 1) * sizeof(char *));
-	if (!m) goto malloc_err;
+	/* Now, enlarge the migrations array if need be */
+	if (*offset >= *cap) {
+		n = *cap ? *cap << 1 : 64;
+		errno = 0;
+		m = realloc(*migrations, n * sizeof(char *));
+		if (!m) goto malloc_err;
+		*migrations = m;
+		*cap = n;
+	}
 
 	/* Finally, add the migration */
-	m[off++] = tmp;
-	*offset = off;
-	*migrations = m;
+	m[(*offset)++] = tmp;
 
 ret:
 	return err;
 
 malloc_err:
 	free(tmp);
-	free(m);
 	if (errno == ENOMEM)
 		error("memory allocation failed: %s", strerror(ENOMEM));
 	++err;
 	goto ret;
 }
 
+/**
+ * Determine whether a directory entry is a regular file.
+ *
+ * The type is taken from the entry itself where the filesystem
+ * provides one, so we only need to stat() symlinks, and entries
+ * on filesystems which don't fill in d_type.
+ *
+ * \param[in] fd Directory file descriptor
+ * \param[in] d  Directory entry
+ * \return 1 if the entry is a regular file, 0 otherwise.
+ */
+static int is_regular_file(int fd, const struct dirent *d)
+{
+	struct stat sbuf;
+
+#ifdef DT_UNKNOWN
+	if (d->d_type == DT_REG) return 1;
+	if (d->d_type != DT_UNKNOWN && d->d_type != DT_LNK)
+		return 0;
+#endif
+
+	++scan_stats.stats;
+	if (fstatat(fd, d->d_name, &sbuf, 0))
+		return 0;
+	return S_ISREG(sbuf.st_mode) ? 1 : 0;
+}
+
 /**
  * Scan the migration path for migrations.
  *
@@ -107,21 +191,25 @@ static int scan_path_for_migrations(char ***migrations, size_t *size,
 {
 	DIR *dir;
 	struct dirent *d;
-	struct stat sbuf;
-	size_t i;
+	size_t i, cap = 0;
 	unsigned long x;
-	char *tmp;
-	int err = 0;
+	char *tmp, **m;
+	int fd, err = 0;
 
+	memset(&scan_stats, 0, sizeof(scan_stats));
 	if (!(dir = opendir(pathbuf))) {
 		++err;
 		goto ret;
 	}
 
+	fd = dirfd(dir);
 	while ((d = readdir(dir))) {
+		++scan_stats.scanned;
+		++scan_stats.skipped;
+
 		/**
-		 * We only want file names that are at least
-		 * 5 chars long (length of *.sql),
+		 * We only want file names that are longer than
+		 * their extension (e.g. *.sql),
 		 */
 		i = strlen(d->d_name);
 		if (i < 5) continue;
@@ -136,23 +224,8 @@ static int scan_path_for_migrations(char ***migrations, size_t *size,
 			continue;
 		}
 
-		/* that have a .sql extension, */
-		if (memcmp(d->d_name + i - 4, ".sql", 4))
-			continue;
-
-		/* and fit in our buffer. */
-		if (sbuf_add_str(d->d_name, 0, pathbuf_pos)) {
-			error("warning: path too long: '%s/%s'",
-			      pathbuf, d->d_name);
-			continue;
-		}
-
-		/* Skip anything we can't stat() */
-		if (stat(pathbuf, &sbuf))
-			continue;
-
-		/* or isn't a regular file. */
-		if (!S_ISREG(sbuf.st_mode))
+		/* that have a .sql (or .sql.gz, etc.) extension, */
+		if (!sql_ext(d->d_name, i))
 			continue;
 
 		/* Skip anything before the previous revision */
@@ -166,7 +239,19 @@ static int scan_path_for_migrations(char ***migrations, size_t *size,
 				continue;
 		}
 
-		if (add_migration(migrations, size, d->d_name)) {
+		/* and fit in our buffer. */
+		if (sbuf_add_str(d->d_name, 0, pathbuf_pos)) {
+			error("warning: path too long: '%s/%s'",
+			      pathbuf, d->d_name);
+			continue;
+		}
+
+		/* Skip anything that isn't a regular file */
+		if (!is_regular_file(fd, d))
+			continue;
+
+		--scan_stats.skipped;
+		if (add_migration(migrations, size, &cap, d->d_name, i)) {
 			++err;
 			break;
 		}
@@ -174,10 +259,273 @@ static int scan_path_for_migrations(char ***migrations, size_t *size,
 
 	closedir(dir);
 
+	/* Give back what we didn't use */
+	if (!err && *size && *size < cap &&
+	    (m = realloc(*migrations, *size * sizeof(char *))))
+		*migrations = m;
+
 ret:
 	return err;
 }
 
+/**
+ * Build a migration index.
+ *
+ * \param[in]  m   Migrations, sorted with sort_migrations()
+ * \param[in]  n   Number of migrations
+ * \param[in]  st  Status of the migration path
+ * \param[out] len Length of the index
+ * \return The index, or NULL on error.
+ */
+static char *index_build(char **m, size_t n, const struct stat *st,
+                         size_t *len)
+{
+	struct index_header h;
+	struct index_entry *e;
+	char *buf, *names;
+	size_t i, k, size = 0;
+
+	for (i = 0; i < n; i++)
+		size += strlen(m[i]) + 1;
+
+	*len = sizeof(h) + n * sizeof(struct index_entry) + size;
+	errno = 0;
+	if (!(buf = malloc(*len))) {
+		error("memory allocation failed: %s", strerror(ENOMEM));
+		return NULL;
+	}
+
+	memcpy(h.magic, index_magic, sizeof(h.magic));
+	h.dev   = (unsigned long)st->st_dev;
+	h.ino   = (unsigned long)st->st_ino;
+	h.mtime = (unsigned long)st->st_mtime;
+	h.n     = (unsigned long)n;
+	h.names = (unsigned long)size;
+	memcpy(buf, &h, sizeof(h));
+
+	e     = (struct index_entry *)(void *)(buf + sizeof(h));
+	names = (char *)(e + n);
+	for (i = k = 0; i < n; i++) {
+		e[i].num  = strtoul(m[i], NULL, 0);
+		e[i].name = (unsigned long)k;
+		size = strlen(m[i]) + 1;
+		memcpy(names + k, m[i], size);
+		k += size;
+	}
+
+	return buf;
+}
+
+/**
+ * Find the index of the first entry with a designation greater
+ * than \a num.
+ */
+static size_t index_upper(const struct index_entry *e, size_t n,
+                          unsigned long num)
+{
+	size_t lo = 0, mid;
+
+	while (lo < n) {
+		mid = lo + (n - lo) / 2;
+		if (e[mid].num <= num)
+			lo = mid + 1;
+		else n = mid;
+	}
+
+	return lo;
+}
+
+/**
+ * Look up the migrations in range in a migration index.
+ *
+ * \param[in]  buf        Index
+ * \param[in]  len        Length of the index
+ * \param[in]  st         Status of the migration path
+ * \param[in]  head       Current head revision
+ * \param[in]  prev       Previous revision (for rollbacks.)
+ * \param[out] migrations Migrations in range
+ * \param[out] size       Number of migrations in range
+ * \return 0 on success, non-zero if the index is stale or invalid.
+ */
+static int index_lookup(const char *buf, size_t len, const struct stat *st,
+                        unsigned long head, unsigned long prev,
+                        char ***migrations, size_t *size)
+{
+	struct index_header h;
+	const struct index_entry *e;
+	const char *names;
+	char **m = NULL;
+	size_t i, first = 0, last, n;
+
+	if (!buf || len < sizeof(h)) return 1;
+	memcpy(&h, buf, sizeof(h));
+	if (memcmp(h.magic, index_magic, sizeof(h.magic)) ||
+	    h.dev != (unsigned long)st->st_dev ||
+	    h.ino != (unsigned long)st->st_ino ||
+	    h.mtime != (unsigned long)st->st_mtime)
+		return 1;
+
+	/* Make sure everything fits, and the last name is terminated */
+	n = (size_t)h.n;
+	if (n > (len - sizeof(h)) / sizeof(struct index_entry) ||
+	    (size_t)h.names != len - sizeof(h) - n * sizeof(*e) ||
+	    (h.names && buf[len - 1]))
+		return 1;
+
+	e     = (const struct index_entry *)(const void *)(buf + sizeof(h));
+	names = (const char *)(e + n);
+
+	/* Skip anything up to the previous revision, or current head */
+	if (prev < ULONG_MAX) {
+		first = index_upper(e, n, prev);
+		last  = index_upper(e, n, head);
+	} else {
+		if (head < ULONG_MAX)
+			first = index_upper(e, n, head);
+		last = n;
+	}
+
+	*size = 0;
+	*migrations = NULL;
+	if (first >= last) return 0;
+
+	errno = 0;
+	if (!(m = malloc((last - first) * sizeof(char *))))
+		goto err;
+
+	for (i = first; i < last; i++) {
+		if (e[i].name >= h.names) goto err;
+		n = strlen(names + e[i].name) + 1;
+		if (!(m[*size] = malloc(n))) goto err;
+		memcpy(m[(*size)++], names + e[i].name, n);
+	}
+
+	*migrations = m;
+	return 0;
+
+err:
+	while (m && *size) free(m[--*size]);
+	free(m);
+	return 1;
+}
+
+/**
+ * Look up the migrations in range in the index file, if it's
+ * up-to-date.
+ *
+ * \return 0 on success, non-zero if there's no usable index.
+ */
+static int index_load(const struct stat *st, unsigned long head,
+                      unsigned long prev, char ***migrations,
+                      size_t *size)
+{
+	struct stat sbuf;
+	char *buf;
+	size_t len;
+	int retval;
+
+	/* It's fine if there isn't one yet */
+	if (stat(config.index_file, &sbuf) || !sbuf.st_size)
+		return 1;
+
+	if (!(buf = map_file(config.index_file, &len)))
+		return 1;
+
+	retval = index_lookup(buf, len, st, head, prev, migrations, size);
+	unmap_file(buf, len);
+	return retval;
+}
+
+/**
+ * Write the index file, replacing the old one.
+ *
+ * Failing to write the index isn't fatal, since it only costs us
+ * a scan of the migration path next time.
+ *
+ * \param[in] buf Index
+ * \param[in] len Length of the index
+ */
+static void index_save(const char *buf, size_t len)
+{
+	char tmp[sizeof(config.index_file) + 4];
+	size_t off = 0;
+	ssize_t bw;
+	int fd;
+
+	sprintf(tmp, "%s.tmp", config.index_file);
+	errno = 0;
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC,
+	          S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) goto err;
+
+	while (off < len) {
+		errno = 0;
+		if ((bw = write(fd, buf + off, len - off)) <= 0) {
+			if (bw < 0 && errno == EINTR)
+				continue;
+			close(fd);
+			goto unlink_err;
+		}
+
+		off += (size_t)bw;
+	}
+
+	if (close(fd) || rename(tmp, config.index_file))
+		goto unlink_err;
+	return;
+
+unlink_err:
+	unlink(tmp);
+err:
+	error("warning: unable to write '%s': %s", config.index_file,
+	      errno ? strerror(errno) : "short write");
+}
+
+/**
+ * Rebuild the index from a scan of the migration path, and look up
+ * the migrations in range.
+ *
+ * \param[in]  st          Status of the migration path
+ * \param[in]  pathbuf_pos Index of the end of the string in \a pathbuf.
+ * \param[in]  head        Current head revision
+ * \param[in]  prev        Previous revision (for rollbacks.)
+ * \param[out] migrations  Migrations in range
+ * \param[out] size        Number of migrations in range
+ * \return 0 on success, non-zero on failure.
+ */
+static int index_rebuild(const struct stat *st, size_t pathbuf_pos,
+                         unsigned long head, unsigned long prev,
+                         char ***migrations, size_t *size)
+{
+	char **all = NULL, *buf;
+	size_t n = 0, len;
+	int retval = 1;
+
+	if (scan_path_for_migrations(&all, &n, pathbuf_pos, ULONG_MAX,
+	                             ULONG_MAX))
+		goto ret;
+
+	sort_migrations(all, n);
+	if (!(buf = index_build(all, n, st, &len)))
+		goto ret;
+
+	/**
+	 * If the migration path was changed within the last second, we
+	 * can't tell whether another change would touch its mtime, so
+	 * the index would have to be rebuilt next time anyway.
+	 */
+	if ((unsigned long)st->st_mtime < (unsigned long)time(NULL))
+		index_save(buf, len);
+
+	retval = index_lookup(buf, len, st, head, prev, migrations, size);
+	free(buf);
+
+ret:
+	while (all && n) free(all[--n]);
+	free(all);
+	return retval;
+}
+
 /**
  * Copy the numeric designation in the given filename to
  * be used as the local HEAD revision.
@@ -213,6 +561,7 @@ static void update_local_head(const char *head)
 static char **file_find_migrations(const char *cur_rev,
                                    const char *prev_rev, size_t *size)
 {
+	struct stat st;
 	size_t i;
 	unsigned long hnum = ULONG_MAX;
 	unsigned long pnum = ULONG_MAX;
@@ -221,6 +570,7 @@ static char **file_find_migrations(const char *cur_rev,
 	if (size) *size = 0;
 	else goto ret;
 
+	memset(&scan_stats, 0, sizeof(scan_stats));
 	if (!*config.migration_path) {
 		error("no migration_path specified");
 		goto err;
@@ -255,11 +605,17 @@ static char **file_find_migrations(const char *cur_rev,
 			goto err;
 	}
 
-	if (scan_path_for_migrations(&migrations, size, i, hnum, pnum))
+	/* Use the index if we have one, and the path hasn't changed */
+	if (*config.index_file && !stat(pathbuf, &st)) {
+		if (index_load(&st, hnum, pnum, &migrations, size) &&
+		    index_rebuild(&st, i, hnum, pnum, &migrations, size))
+			goto err;
+	} else if (scan_path_for_migrations(&migrations, size, i, hnum,
+	                                    pnum)) {
 		goto err;
+	} else if (migrations) sort_migrations(migrations, *size);
 
 	if (migrations && *size) {
-		bubblesort(migrations, *size);
 		update_local_head(migrations[*size - 1]);
 	} else {
 		if (hnum != ULONG_MAX)
@@ -320,6 +676,25 @@ static int file_init(void)
 	return 0;
 }
 
+/**
+ * Get the counts from the last scan of the migration path.
+ *
+ * \param[out] scanned Entries looked at.
+ * \param[out] skipped Entries which weren't migrations.
+ * \return 0 on success, non-zero if the migration path hasn't been
+ *         scanned (e.g. if the index was used.)
+ */
+static int file_get_scan_stats(unsigned long *scanned,
+                               unsigned long *skipped)
+{
+	if (!scan_stats.scanned)
+		return 1;
+
+	*scanned = scan_stats.scanned;
+	*skipped = scan_stats.skipped;
+	return 0;
+}
+
 /**
  * Uninitialize the file source backend.
  *
@@ -338,5 +713,9 @@ struct source_backend_vtable file_vtable = {
 	file_get_head,
 	file_get_file_revision,
 	file_get_migration_path,
+	NULL, /* file_get_watch_paths */
+	NULL, /* file_load_migration */
+	NULL, /* file_unload_migration */
+	file_get_scan_stats,
 	file_uninit
 };
@@ -6,16 +6,26 @@
  * See the LICENSE file for details.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
 #ifndef IN_TESTS
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <git2.h>
 #endif
 
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
 #include "backend.h"
 #include "../config.h"
+#include "../file.h"
 #include "../utils.h"
 
 /**
@@ -23,10 +33,17 @@
  *
  * migration_path - Path to migrations, relative to the repo.
  * repo_path      - Path to the git repository (default: ".")
+ * cache_file     - Path to the delta cache (optional.)
+ * threads        - Number of threads used for diffing (default: 1)
+ * read_blobs     - Read migrations from the repository, rather than
+ *                  the working tree (default: 0, or 1 if it's bare.)
  */
 static struct config {
 	char migration_path[256];
 	char repo_path[256];
+	char cache_file[256];
+	size_t threads;
+	size_t read_blobs;
 } config;
 
 /* Representation of the path to libgit2's diff routines. */
@@ -40,9 +57,16 @@ static const git_strarray migration_strs = {
 	1
 };
 
+/* The migration_path as a path within a tree, if it can be used as one */
+static char subtree[256];
+
 /* The local HEAD revision ID */
 static char local_head[50];
 static char file_rev[50];
+static char git_dir[1024];
+static char common_dir[1024];
+static char ref_dir[1024];
+static const char *watch_paths[4];
 
 /**
  * A list of migrations corresponding to
@@ -50,15 +74,121 @@ static char file_rev[50];
  */
 struct mlist {
 	size_t size;
-	char **migrations;
+	size_t seq;                /**< Position in the list */
+	struct path **migrations;  /**< NULL where one was deleted */
 	struct mlist *next;
 };
 
+/**
+ * A place in the migration list which holds a path.
+ */
+struct slot {
+	struct mlist *ml;  /**< Batch */
+	size_t i;          /**< Index in the batch */
+	struct slot *next; /**< Next slot holding the same path */
+};
+
+/**
+ * A path seen during the walk. Each path is stored once, and
+ * knows which slots in the migration list hold it.
+ */
+struct path {
+	struct path *next;   /**< Next path in the hash chain */
+	struct slot *slots;  /**< Slots holding this path, in order */
+	unsigned long hash;  /**< Hash of the name */
+	char name[1];        /**< Path */
+};
+
+/**
+ * Hash table of the paths we've seen.
+ */
+static struct paths {
+	struct path **table; /**< Hash chains */
+	size_t mask;         /**< Number of chains, minus 1 */
+	size_t n;            /**< Number of paths */
+} paths;
+
+/**
+ * Alignment of allocations from the arena.
+ */
+#define ARENA_ALIGN sizeof(union { void *p; size_t s; double d; })
+
+/**
+ * Size of each block of the arena.
+ */
+#define ARENA_BLOCK 65536
+
+/**
+ * Paths, slots, and the hash table are allocated from the arena,
+ * which is released all at once after the walk.
+ */
+static struct arena {
+	char *block; /**< Current block */
+	size_t used; /**< Bytes used in the current block */
+	size_t size; /**< Size of the current block */
+} arena;
+
 static struct mlist *mlist_head = NULL;
 static struct mlist *mlist_tail = NULL;
 static git_diff_options opts;
 static git_diff_find_options findopts;
 
+/**
+ * A growable buffer.
+ */
+struct buffer {
+	char *buf;  /**< Contents */
+	size_t len; /**< Length of the contents */
+	size_t cap; /**< Size of the buffer */
+};
+
+/**
+ * Magic number for the delta cache.
+ */
+static const char cache_magic[8] = "mmmgdc1";
+
+/**
+ * The delta cache holds the migration deltas of each commit we've
+ * diffed, so that no commit needs to be diffed twice. Commits don't
+ * change, so the records never go stale, though they do depend on
+ * the migration_path.
+ *
+ * The cache file holds the magic number and the migration_path,
+ * followed by a record for each commit: its ID, its deltas ('A' or
+ * 'D' followed by the path, or 'R' followed by the old path, and
+ * then the new path,) and an empty string. Every string is
+ * NUL-terminated. The whole file is read into memory, and new
+ * records are appended to it.
+ */
+static struct cache {
+	struct buffer data; /**< Contents of the cache */
+	size_t saved;       /**< Length of what's in the cache file */
+	size_t *slots;      /**< Hash table of record offsets (plus 1) */
+	size_t mask;        /**< Number of slots, minus 1 */
+	size_t n;           /**< Number of records */
+} cache;
+
+/**
+ * The repository is opened once, and kept open until the backend
+ * is uninitialized.
+ */
+static git_repository *repository = NULL;
+
+/**
+ * Number of resolved revisions to remember.
+ */
+#define REVCACHE_SIZE 8
+
+/**
+ * Resolved revisions.
+ */
+static struct revcache {
+	char *spec;   /**< Revision */
+	git_oid oid;  /**< Object it resolved to */
+	git_oid head; /**< HEAD at the time (for relative revisions) */
+} revcache[REVCACHE_SIZE];
+static size_t revcache_next = 0;
+
 /* {{{ static void initialize_diff_options(void) */
 static void initialize_diff_options(void)
 {
@@ -97,20 +227,20 @@ static void initialize_diff_options(void)
 
 /* {{{ static int is_path_sql(const char *path) */
 /**
- * Is this path a ".sql" file?
+ * Is this path a ".sql" (or ".sql.gz", etc.) file?
  *
  * \param[in] path Path to check
  * \return 1 if the path is an SQL file, 0 otherwise.
  */
 static int is_path_sql(const char *path)
 {
-	size_t i;
+	size_t i, ext;
 	int retval = 0;
 
 	if (!path) goto ret;
 
 	i = strlen(path);
-	if (i < 5 || memcmp(&path[i - 4], ".sql", 5))
+	if (!(ext = sql_ext(path, i)) || ext == i)
 		goto ret;
 	++retval;
 
@@ -118,110 +248,663 @@ ret:
 	return retval;
 } /* }}} */
 
-/* {{{ static int is_duplicate(const char *path) */
+/* {{{ static void set_subtree(void) */
+/**
+ * Work out whether the migration_path can be looked up in a tree,
+ * which it can if it's a plain relative path to a directory, rather
+ * than a pattern.
+ */
+static void set_subtree(void)
+{
+	const char *s = subtree;
+	size_t len = strlen(config.migration_path);
+
+	while (len && config.migration_path[len - 1] == '/') --len;
+	memcpy(subtree, config.migration_path, len);
+	subtree[len] = '\0';
+	if (!len || *s == '/' || strpbrk(s, "*?[\\") || strstr(s, "//"))
+		goto err;
+
+	/* Reject any "." or ".." components */
+	for (; *s; s += strcspn(s, "/") + (s[strcspn(s, "/")] == '/')) {
+		if (*s == '.' && (s[1] == '/' || !s[1] ||
+		    (s[1] == '.' && (s[2] == '/' || !s[2]))))
+			goto err;
+	}
+
+	return;
+
+err:
+	*subtree = '\0';
+} /* }}} */
+
+/* {{{ Path table */
 /**
- * Simple O(n) test for duplicates.
+ * Allocate memory from the arena.
  *
- * \param[in] path Path to check
- * \return 1 if the path is a duplicate, 0 otherwise.
+ * \param[in] len Number of bytes
+ * \return The memory, or NULL on failure.
  */
-static int is_duplicate(const char *path)
+static void *arena_alloc(size_t len)
 {
-	size_t i, plen;
-	struct mlist *ml;
-	int retval = 0;
+	char *block;
+	size_t size;
 
-	plen = strlen(path);
-	for (ml = mlist_head; ml; ml = ml->next) {
-		for (i = 0; i < ml->size; i++) {
-			if (plen != strlen(ml->migrations[i]))
-				continue;
+	len = (len + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+	if (!arena.block || arena.size - arena.used < len) {
+		size = (len + ARENA_ALIGN > ARENA_BLOCK) ?
+		       len + ARENA_ALIGN : ARENA_BLOCK;
+		errno = 0;
+		if (!(block = malloc(size)))
+			return NULL;
+
+		/* Each block starts with a link to the previous one */
+		memcpy(block, &arena.block, sizeof(char *));
+		arena.block = block;
+		arena.size  = size;
+		arena.used  = ARENA_ALIGN;
+	}
+
+	arena.used += len;
+	return arena.block + arena.used - len;
+}
+
+/**
+ * Release the arena, and with it, every path.
+ */
+static void arena_free(void)
+{
+	char *prev;
+
+	while (arena.block) {
+		memcpy(&prev, arena.block, sizeof(char *));
+		free(arena.block);
+		arena.block = prev;
+	}
+
+	memset(&arena, 0, sizeof(arena));
+	memset(&paths, 0, sizeof(paths));
+}
+
+/**
+ * Find a path in the path table.
+ *
+ * \param[in] name   Path
+ * \param[in] create If non-zero, add the path if it isn't there.
+ * \return The path, or NULL if it isn't there (or can't be added.)
+ */
+static struct path *find_path(const char *name, int create)
+{
+	struct path *p, *next, **table;
+	size_t i, n, len = strlen(name);
+	unsigned long hash = checksum(name, len);
+
+	for (p = paths.table ? paths.table[hash & paths.mask] : NULL; p;
+	     p = p->next) {
+		if (p->hash == hash && !strcmp(p->name, name))
+			return p;
+	}
 
-			if (!memcmp(path, ml->migrations[i], plen)) {
-				++retval;
-				goto ret;
+	if (!create)
+		return NULL;
+
+	/* Keep the chains short */
+	if (paths.n >= (paths.table ? paths.mask + 1 : 0)) {
+		n = paths.table ? (paths.mask + 1) * 2 : 1024;
+		if (!(table = arena_alloc(n * sizeof(struct path *))))
+			return NULL;
+
+		memset(table, 0, n * sizeof(struct path *));
+		for (i = 0; paths.table && i <= paths.mask; i++) {
+			for (p = paths.table[i]; p; p = next) {
+				next = p->next;
+				p->next = table[p->hash & (n - 1)];
+				table[p->hash & (n - 1)] = p;
 			}
 		}
+
+		paths.table = table;
+		paths.mask  = n - 1;
 	}
 
-ret:
-	return retval;
-} /* }}} */
+	if (!(p = arena_alloc(sizeof(struct path) + len)))
+		return NULL;
+
+	p->hash  = hash;
+	p->slots = NULL;
+	memcpy(p->name, name, len + 1);
+	p->next = paths.table[hash & paths.mask];
+	paths.table[hash & paths.mask] = p;
+	paths.n++;
+	return p;
+}
+
+/**
+ * Put a slot in a path's list of slots, which is kept in the same
+ * order as the migration list.
+ *
+ * \param[in] p Path
+ * \param[in] s Slot
+ */
+static void put_slot(struct path *p, struct slot *s)
+{
+	struct slot **link = &p->slots;
+
+	while (*link && ((*link)->ml->seq < s->ml->seq ||
+	       ((*link)->ml == s->ml && (*link)->i < s->i)))
+		link = &(*link)->next;
+
+	s->ml->migrations[s->i] = p;
+	s->next = *link;
+	*link   = s;
+}
+/* }}} */
+
+/**
+ * Add a migration to a batch, unless it's already in the list.
+ *
+ * \param[in] ml   Batch
+ * \param[in] path Path to the migration
+ * \return 0 on success, non-zero on failure.
+ */
+static int add_migration(struct mlist *ml, const char *path)
+{
+	struct path **tmp, *p;
+	struct slot *s;
+
+	if (!(p = find_path(path, 1)))
+		return 1;
+	if (p->slots)
+		return 0;
+
+	errno = 0;
+	tmp = realloc(ml->migrations, (ml->size + 1) * sizeof(*tmp));
+	if (!tmp || !(s = arena_alloc(sizeof(struct slot)))) {
+		if (tmp) ml->migrations = tmp;
+		return 1;
+	}
+
+	ml->migrations = tmp;
+	s->ml = ml;
+	s->i  = ml->size++;
+	put_slot(p, s);
+	return 0;
+}
 
 /**
  * Apply a rename or a delete to the migration list.
  *
+ * The first slot in each batch which holds the old path is changed,
+ * so only the slots holding it are visited.
+ *
  * \param[in] old_path Old path
  * \param[in] new_path New path
  * \return 0 if the modification was successful, non-zero otherwise.
  */
 static int modify_mlist(const char *old_path, const char *new_path)
 {
-	size_t i, old_len, new_len;
-	struct mlist *ml;
-	int retval = 0;
+	struct path *p, *q = NULL;
+	struct slot *s, **link;
+	struct mlist *last = NULL;
 
-	if (!old_path) goto err;
+	if (!old_path) return 1;
+	if (!*old_path || !(p = find_path(old_path, 0)) || !p->slots)
+		return 0;
 
-	old_len = strlen(old_path);
-	if (!old_len) goto ret;
+	if (new_path && !(q = find_path(new_path, 1)))
+		return 1;
+	if (q == p) return 0;
 
-	for (ml = mlist_head; ml; ml = ml->next) {
-		for (i = 0; i < ml->size; i++) {
-			if (!ml->migrations[i])
-				continue;
-			if (strlen(ml->migrations[i]) != old_len)
-				continue;
-			if (!memcmp(ml->migrations[i], old_path, old_len))
-				break;
+	for (link = &p->slots; (s = *link); ) {
+		if (s->ml == last) {
+			link = &s->next;
+			continue;
 		}
 
-		if (i == ml->size)
-			continue;
+		/* Apply a delete, or a rename */
+		last  = s->ml;
+		*link = s->next;
+		s->ml->migrations[s->i] = NULL;
+		if (q) put_slot(q, s);
+	}
+
+	return 0;
+}
+
+/* {{{ Deltas */
+/**
+ * Append to a buffer.
+ *
+ * \param[in] b   Buffer
+ * \param[in] s   Data to append
+ * \param[in] len Length of the data
+ * \return 0 on success, non-zero on failure.
+ */
+static int buffer_append(struct buffer *b, const char *s, size_t len)
+{
+	char *tmp;
+	size_t cap = b->cap ? b->cap : 4096;
 
-		/* Apply a delete */
-		free(ml->migrations[i]);
-		ml->migrations[i] = NULL;
-		if (!new_path) continue;
+	while (cap - b->len < len)
+		cap *= 2;
 
-		/* Apply a rename */
-		new_len = strlen(new_path);
+	if (cap != b->cap) {
 		errno = 0;
-		ml->migrations[i] = malloc(new_len + 1);
-		if (!ml->migrations[i]) goto err;
-		memcpy(ml->migrations[i], new_path, new_len + 1);
+		if (!(tmp = realloc(b->buf, cap)))
+			return 1;
+		b->buf = tmp;
+		b->cap = cap;
 	}
 
+	memcpy(b->buf + b->len, s, len);
+	b->len += len;
+	return 0;
+}
+
+/**
+ * Add a delta to a list of deltas.
+ *
+ * A list of deltas is held as it is in a delta cache record: 'A' or
+ * 'D' followed by the path, or 'R' followed by the old path and then
+ * the new path, each NUL-terminated. Deltas with empty paths have no
+ * effect on the migration list, so they're left out.
+ *
+ * \param[in] b        Buffer
+ * \param[in] kind     'A', 'D', or 'R'
+ * \param[in] old_path Old path
+ * \param[in] new_path New path
+ * \return 0 on success, non-zero on failure.
+ */
+static int buffer_delta(struct buffer *b, char kind, const char *old_path,
+                        const char *new_path)
+{
+	const char *path = (kind == 'A') ? new_path : old_path;
+
+	if (kind == 'R' && !*new_path) kind = 'D';
+	if (!*path) return 0;
+
+	return buffer_append(b, &kind, 1) ||
+	       buffer_append(b, path, strlen(path) + 1) ||
+	       (kind == 'R' && buffer_append(b, new_path,
+	                                     strlen(new_path) + 1));
+}
+/* }}} */
+
+/* {{{ Delta cache */
+/**
+ * Free the delta cache.
+ */
+static void cache_free(void)
+{
+	free(cache.data.buf);
+	free(cache.slots);
+	memset(&cache, 0, sizeof(cache));
+}
+
+/**
+ * Find the hash table slot for a commit ID.
+ *
+ * \param[in] id Commit ID
+ * \return The slot holding the commit's record, or the empty
+ *         slot where it would go.
+ */
+static size_t *cache_slot(const char *id)
+{
+	size_t i = (size_t)checksum(id, strlen(id)) & cache.mask;
+
+	while (cache.slots[i] &&
+	       strcmp(cache.data.buf + cache.slots[i] - 1, id))
+		i = (i + 1) & cache.mask;
+	return &cache.slots[i];
+}
+
+/**
+ * Add a record to the hash table, growing it to keep it at most
+ * half full.
+ *
+ * \param[in] off Offset of the record
+ * \return 0 on success, non-zero on failure.
+ */
+static int cache_insert(size_t off)
+{
+	size_t i, n, *slot, *old = cache.slots;
+
+	n = old ? cache.mask + 1 : 0;
+	if ((cache.n + 1) * 2 > n) {
+		errno = 0;
+		if (!(slot = calloc(n ? n * 2 : 1024, sizeof(size_t))))
+			return 1;
+
+		cache.slots = slot;
+		cache.mask  = (n ? n * 2 : 1024) - 1;
+		for (i = 0; i < n; i++) {
+			if (old[i])
+				*cache_slot(cache.data.buf + old[i] - 1) =
+				    old[i];
+		}
+		free(old);
+	}
+
+	if (!*(slot = cache_slot(cache.data.buf + off))) {
+		*slot = off + 1;
+		cache.n++;
+	}
+
+	return 0;
+}
+
+/**
+ * Find the deltas for a commit in the delta cache.
+ *
+ * \param[in] id Commit ID
+ * \return The offset of the commit's deltas, or 0 if the commit
+ *         isn't in the cache.
+ */
+static size_t cache_find(const char *id)
+{
+	size_t off;
+
+	if (!cache.slots || !(off = *cache_slot(id)))
+		return 0;
+	return off + strlen(id);
+}
+
+/**
+ * Find the end of a delta cache record.
+ *
+ * \param[in] mem  Cache
+ * \param[in] size Size of the cache
+ * \param[in] off  Offset of the record
+ * \return The offset past the end of the record, or 0 if the
+ *         record is incomplete or invalid.
+ */
+static size_t record_end(const char *mem, size_t size, size_t off)
+{
+	const char *s = mem + off, *e, *end = mem + size;
+	int want = 1; /* The ID, or a rename's new path */
+
+	while (s < end && (e = memchr(s, '\0', (size_t)(end - s)))) {
+		if (e == s)
+			return want ? 0 : (size_t)(e + 1 - mem);
+
+		if (want) --want;
+		else if (*s == 'R' && e - s > 1) want = 1;
+		else if ((*s != 'A' && *s != 'D') || e - s < 2)
+			return 0;
+		s = e + 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Load the delta cache, if we have one.
+ *
+ * Everything up to the first incomplete record is kept. If the
+ * cache was made for another migration_path, it's started over.
+ */
+static void cache_load(void)
+{
+	struct stat st;
+	struct buffer *b = &cache.data;
+	char *mem;
+	size_t size, off, end, hlen;
+
+	cache_free();
+	if (!*config.cache_file)
+		return;
+
+	/* The header is the magic number and the migration_path */
+	hlen = sizeof(cache_magic) + strlen(config.migration_path) + 1;
+	if (buffer_append(b, cache_magic, sizeof(cache_magic)) ||
+	    buffer_append(b, config.migration_path, hlen - sizeof(cache_magic)))
+		goto err;
+
+	/* It's fine if there isn't one yet */
+	if (stat(config.cache_file, &st) || !st.st_size ||
+	    !(mem = map_file(config.cache_file, &size)))
+		return;
+
+	if (size < hlen || memcmp(mem, b->buf, hlen))
+		goto ret;
+
+	/* Records are at the same offsets in the file and buffer */
+	for (off = hlen; (end = record_end(mem, size, off)); off = end);
+	if (buffer_append(b, mem + hlen, off - hlen))
+		goto err;
+
+	for (end = hlen; end < off; end = record_end(mem, size, end)) {
+		if (cache_insert(end))
+			goto err;
+	}
+
+	cache.saved = (off == size) ? b->len : 0;
+
 ret:
-	return retval;
+	unmap_file(mem, size);
+	return;
 
 err:
-	++retval;
-	goto ret;
+	error("warning: unable to load '%s': %s", config.cache_file,
+	      strerror(ENOMEM));
+	cache_free();
+}
+
+/**
+ * Write the delta cache, replacing the old one, if it has
+ * anything new in it.
+ *
+ * Failing to write the cache isn't fatal, since it only costs us
+ * diffing the commits again next time.
+ */
+static void cache_save(void)
+{
+	char tmp[sizeof(config.cache_file) + 4];
+	const struct buffer *b = &cache.data;
+	size_t off = 0;
+	ssize_t bw;
+	int fd;
+
+	if (!b->buf || b->len == cache.saved)
+		return;
+
+	sprintf(tmp, "%s.tmp", config.cache_file);
+	errno = 0;
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC,
+	          S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) goto err;
+
+	while (off < b->len) {
+		errno = 0;
+		if ((bw = write(fd, b->buf + off, b->len - off)) <= 0) {
+			if (bw < 0 && errno == EINTR)
+				continue;
+			close(fd);
+			goto unlink_err;
+		}
+
+		off += (size_t)bw;
+	}
+
+	if (close(fd) || rename(tmp, config.cache_file))
+		goto unlink_err;
+	cache.saved = b->len;
+	return;
+
+unlink_err:
+	unlink(tmp);
+err:
+	error("warning: unable to write '%s': %s", config.cache_file,
+	      errno ? strerror(errno) : "short write");
+}
+
+/* }}} */
+
+/* {{{ Repository */
+/**
+ * Open the repository, unless it's already open.
+ *
+ * \return 0 on success, non-zero on failure.
+ */
+static int open_repo(void)
+{
+	if (!repository &&
+	    git_repository_open(&repository, config.repo_path) != GIT_OK) {
+		repository = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Close the repository, and forget what we've resolved in it.
+ */
+static void close_repo(void)
+{
+	size_t i;
+
+	for (i = 0; i < REVCACHE_SIZE; i++)
+		free(revcache[i].spec);
+	memset(revcache, 0, sizeof(revcache));
+	git_repository_free(repository);
+	repository = NULL;
+}
+
+/**
+ * Is this revision a full object ID?
+ */
+static int is_oid(const char *spec)
+{
+	size_t len = strlen(spec);
+
+	return len == GIT_OID_HEXSZ &&
+	       strspn(spec, "0123456789abcdefABCDEF") == len;
+}
+
+/**
+ * Resolve a revision to an object, reusing what we resolved
+ * before where we can.
+ *
+ * A full object ID always resolves to the same object, and a
+ * revision relative to HEAD does while HEAD doesn't move. Anything
+ * else is resolved every time.
+ *
+ * \param[out] out  The object (which must be freed.)
+ * \param[in]  spec Revision
+ * \return 0 on success, non-zero on failure.
+ */
+static int revparse(git_object **out, const char *spec)
+{
+	git_oid head;
+	struct revcache *rc = NULL;
+	size_t i, len = strlen(spec);
+	int relative = !strncmp(spec, "HEAD", 4), cacheable;
+
+	*out = NULL;
+	if (open_repo())
+		return 1;
+
+	memset(&head, 0, sizeof(head));
+	cacheable = relative ?
+	    git_reference_name_to_id(&head, repository, "HEAD") == GIT_OK :
+	    is_oid(spec);
+
+	for (i = 0; cacheable && i < REVCACHE_SIZE; i++) {
+		if (!revcache[i].spec || strcmp(revcache[i].spec, spec))
+			continue;
+
+		rc = &revcache[i];
+		if ((!relative || git_oid_equal(&rc->head, &head)) &&
+		    git_object_lookup(out, repository, &rc->oid,
+		                      GIT_OBJ_ANY) == GIT_OK)
+			return 0;
+		break;
+	}
+
+	if (git_revparse_single(out, repository, spec) != GIT_OK)
+		return 1;
+
+	if (!cacheable || !*out)
+		return 0;
+
+	/* Replace what we had for this revision, or the oldest entry */
+	if (!rc) {
+		rc = &revcache[revcache_next++ % REVCACHE_SIZE];
+		free(rc->spec);
+		if (!(rc->spec = malloc(len + 1)))
+			return 0;
+		memcpy(rc->spec, spec, len + 1);
+	}
+
+	rc->oid  = *git_object_id(*out);
+	rc->head = head;
+	return 0;
+}
+/* }}} */
+
+/**
+ * Might the migrations differ between two trees?
+ *
+ * If the migration_path's subtree has the same ID in both trees (or
+ * isn't in either,) nothing under it changed, so there's no need to
+ * diff the trees.
+ *
+ * \param[in] a One tree
+ * \param[in] b The other tree
+ * \return 0 if the migrations are the same, 1 if they might differ.
+ */
+static int subtree_changed(const git_tree *a, const git_tree *b)
+{
+	git_tree_entry *ea = NULL, *eb = NULL;
+	int ra, rb, retval = 1;
+
+	if (!*subtree)
+		return retval;
+
+	ra = git_tree_entry_bypath(&ea, a, subtree);
+	rb = git_tree_entry_bypath(&eb, b, subtree);
+	if (ra == GIT_ENOTFOUND || rb == GIT_ENOTFOUND)
+		giterr_clear();
+
+	if ((ra == GIT_ENOTFOUND && rb == GIT_ENOTFOUND) ||
+	    (ra == GIT_OK && rb == GIT_OK &&
+	     git_oid_equal(git_tree_entry_id(ea), git_tree_entry_id(eb))))
+		retval = 0;
+
+	git_tree_entry_free(eb);
+	git_tree_entry_free(ea);
+	return retval;
 }
 
 /**
  * Generate a diff between a commit and its parent.
  *
- * \param[in] repo Git repository
- * \param[in] oid  Commit object ID
- * \return A pointer to a git_diff object, or NULL on failure.
+ * \param[in]  repo Git repository
+ * \param[in]  oid  Commit object ID
+ * \param[out] diff The diff, or NULL if the commit doesn't touch any
+ *                  migrations, or is a merge (or root) commit.
+ * \return 0 on success, non-zero on failure.
  */
-static git_diff *generate_diff(git_repository *repo, git_oid oid)
+static int generate_diff(git_repository *repo, const git_oid *oid,
+                         git_diff **diff)
 {
-	git_diff *diff = NULL;
 	git_commit *commit = NULL, *parent = NULL;
 	git_tree *tree = NULL, *parent_tree = NULL;
+	int retval = 1;
 
 	/**
 	 * Skip any revision which doesn't resolve to a commit
 	 */
-	if (git_commit_lookup(&commit, repo, &oid) != GIT_OK)
+	*diff = NULL;
+	if (git_commit_lookup(&commit, repo, oid) != GIT_OK || !commit)
 		goto ret;
 
 	/* Skip commits that don't have 1 parent */
-	if (!commit || git_commit_parentcount(commit) != 1)
+	if (git_commit_parentcount(commit) != 1) {
+		retval = 0;
 		goto ret;
+	}
 
 	if (git_commit_parent(&parent, commit, 0) != GIT_OK)
 		goto ret;
@@ -231,15 +914,22 @@ static git_diff *generate_diff(git_repository *repo, git_oid oid)
 	    || git_commit_tree(&parent_tree, parent) != GIT_OK)
 		goto ret;
 
-	if (git_diff_tree_to_tree(&diff, repo, parent_tree, tree,
+	/* Most commits don't touch the migrations */
+	if (!subtree_changed(parent_tree, tree)) {
+		retval = 0;
+		goto ret;
+	}
+
+	if (git_diff_tree_to_tree(diff, repo, parent_tree, tree,
 	                          &opts) != GIT_OK)
 		goto err;
 
-	if (git_diff_find_similar(diff, &findopts) != GIT_OK)
+	if (git_diff_find_similar(*diff, &findopts) != GIT_OK)
 		goto err;
 
 	/* Ensure we have some deltas in the diff */
-	if (git_diff_num_deltas(diff) < 1)
+	retval = 0;
+	if (git_diff_num_deltas(*diff) < 1)
 		goto err;
 
 ret:
@@ -247,94 +937,422 @@ ret:
 	git_tree_free(tree);
 	git_commit_free(parent);
 	git_commit_free(commit);
-	return diff;
+	return retval;
 
 err:
-	git_diff_free(diff);
-	diff = NULL;
+	git_diff_free(*diff);
+	*diff = NULL;
 	goto ret;
 }
 
 /**
- * Process the deltas in a diff.
+ * Allocate a new batch of migrations, and add it to the list.
  *
- * \param[in] diff Diff to process
- * \return The numeber of migrations added, or SIZE_MAX on fatal error
+ * \return The new batch, or NULL on failure.
  */
-static size_t process_diff(git_diff *diff)
+static struct mlist *new_batch(void)
 {
-	const git_diff_delta *delta;
 	struct mlist *ml;
-	char **tmp;
-	size_t size = 0, i, x;
 
-	/* Allocate a new mlist for this batch */
 	errno = 0;
-	ml = calloc(1, sizeof(struct mlist));
-	if (!ml) goto err;
+	if (!(ml = calloc(1, sizeof(struct mlist))))
+		return NULL;
 
-	/* Add this batch to the list */
 	if (!mlist_head) {
 		mlist_head = mlist_tail = ml;
 	} else {
+		ml->seq = mlist_tail->seq + 1;
 		mlist_tail->next = ml;
 		mlist_tail = ml;
 	}
 
-	for (i = 0; i < git_diff_num_deltas(diff); i++) {
-		delta = git_diff_get_delta(diff, i);
-		if (!delta) continue;
+	return ml;
+}
+
+/**
+ * Gather the deltas in a diff which affect the migration list.
+ *
+ * \param[in]  diff   Diff (or NULL, if there are no deltas.)
+ * \param[out] deltas Deltas, terminated by an empty string.
+ * \return 0 on success, non-zero on failure.
+ */
+static int diff_deltas(git_diff *diff, struct buffer *deltas)
+{
+	const git_diff_delta *delta;
+	size_t i;
+	char kind;
+
+	deltas->len = 0;
+	for (i = 0; diff && i < git_diff_num_deltas(diff); i++) {
+		if (!(delta = git_diff_get_delta(diff, i)))
+			continue;
 
 		switch (delta->status) {
-		case GIT_DELTA_ADDED:
-			if (is_duplicate(delta->new_file.path))
-				break;
+		case GIT_DELTA_ADDED:   kind = 'A'; break;
+		case GIT_DELTA_RENAMED: kind = 'R'; break;
+		case GIT_DELTA_DELETED: kind = 'D'; break;
+		default: continue;
+		}
 
-			ml->size++;
-			errno = 0;
-			tmp = realloc(ml->migrations,
-			              ml->size * sizeof(char *));
-			if (!tmp) goto err;
-			ml->migrations = tmp;
-
-			x = strlen(delta->new_file.path);
-			errno = 0;
-			tmp[ml->size - 1] = malloc(x + 1);
-			if (!tmp[ml->size - 1])
-				goto err;
-			memcpy(tmp[ml->size - 1], delta->new_file.path,
-			       x + 1);
-			break;
-		case GIT_DELTA_RENAMED:
-			if (modify_mlist(delta->old_file.path,
-			                 delta->new_file.path))
+		if (buffer_delta(deltas, kind, delta->old_file.path,
+		                 delta->new_file.path))
+			return 1;
+	}
+
+	return buffer_append(deltas, "", 1);
+}
+
+/**
+ * Apply a commit's deltas to the migration list.
+ *
+ * \param[in] s Deltas, terminated by an empty string.
+ * \return The numeber of migrations added, or SIZE_MAX on fatal error
+ */
+static size_t apply_deltas(const char *s)
+{
+	struct mlist *ml;
+	const char *old_path;
+
+	if (!*s) return 0;
+	if (!(ml = new_batch()))
+		goto err;
+
+	for (; *s; s += strlen(s) + 1) {
+		old_path = s + 1;
+		switch (*s) {
+		case 'A':
+			if (add_migration(ml, old_path))
 				goto err;
 			break;
-		case GIT_DELTA_DELETED:
-			if (modify_mlist(delta->old_file.path, NULL))
+		case 'R':
+			s += strlen(s) + 1;
+			if (modify_mlist(old_path, s))
 				goto err;
 			break;
 		default:
+			if (modify_mlist(old_path, NULL))
+				goto err;
 			break;
 		}
 	}
 
-	size = ml->size;
-ret:
-	return size;
+	return ml->size;
 
 err:
-	if (errno == ENOMEM) {
-		error("failed to allocate memory: %s",
-		      strerror(ENOMEM));
+	error("failed to allocate memory: %s", strerror(ENOMEM));
+	return SIZE_MAX;
+}
+
+/**
+ * Apply a commit's deltas, and add them to the delta cache.
+ *
+ * Failing to add them to the cache isn't fatal.
+ *
+ * \param[in] id     Commit ID
+ * \param[in] deltas Deltas
+ * \return The numeber of migrations added, or SIZE_MAX on fatal error
+ */
+static size_t process_deltas(const char *id, const struct buffer *deltas)
+{
+	size_t rec = cache.data.len;
+
+	if (cache.data.buf &&
+	    (buffer_append(&cache.data, id, strlen(id) + 1) ||
+	     buffer_append(&cache.data, deltas->buf, deltas->len) ||
+	     cache_insert(rec)))
+		cache.data.len = rec;
+
+	return apply_deltas(deltas->buf);
+}
+
+/**
+ * Process the deltas for a commit from the delta cache.
+ *
+ * \param[in] off Offset of the commit's deltas in the cache.
+ * \return The numeber of migrations added, or SIZE_MAX on fatal error
+ */
+static size_t process_cached(size_t off)
+{
+	return apply_deltas(cache.data.buf + off);
+}
+
+/* {{{ Workers */
+/**
+ * Most threads we'll use for diffing.
+ */
+#define MAX_THREADS 64
+
+/**
+ * A commit in the walk.
+ */
+struct job {
+	git_oid oid;          /**< Commit */
+	size_t cached;        /**< Offset of its deltas in the cache, or 0 */
+	struct buffer deltas; /**< Its deltas, once it's been diffed */
+	int state;            /**< JOB_* */
+};
+
+#define JOB_PENDING 0 /**< Not diffed yet */
+#define JOB_DONE    1 /**< Deltas are ready */
+#define JOB_SKIPPED 2 /**< Couldn't be diffed */
+#define JOB_FAILED  3 /**< Ran out of memory */
+
+/**
+ * The commits in the walk are claimed, in order, by the workers,
+ * which diff them concurrently. Their deltas are applied in order
+ * by the thread which started the workers, which diffs commits
+ * itself if it catches up with them. Each worker has its own handle
+ * on the repository, since libgit2 objects can't be shared between
+ * threads.
+ */
+static struct pool {
+	struct job *jobs; /**< Commits, in the order of the walk */
+	size_t n;         /**< Number of commits */
+	size_t cap;       /**< Size of jobs */
+	size_t next;      /**< Next commit to be claimed */
+#ifdef HAVE_LIBPTHREAD
+	int threaded;         /**< Non-zero if lock and done are set up */
+	pthread_mutex_t lock; /**< Guards next, and the jobs' states */
+	pthread_cond_t done;  /**< Signalled when a job is done */
+#endif
+} pool;
+
+/**
+ * The lock and condition only exist while there are workers to
+ * share the jobs with, otherwise there's nothing to guard.
+ */
+#ifdef HAVE_LIBPTHREAD
+#define POOL_LOCK()   \
+	((void)(pool.threaded && pthread_mutex_lock(&pool.lock)))
+#define POOL_UNLOCK() \
+	((void)(pool.threaded && pthread_mutex_unlock(&pool.lock)))
+#define POOL_WAIT()   \
+	((void)(pool.threaded && pthread_cond_wait(&pool.done, &pool.lock)))
+#define POOL_DONE()   \
+	((void)(pool.threaded && pthread_cond_broadcast(&pool.done)))
+#else
+#define POOL_LOCK()   ((void)0)
+#define POOL_UNLOCK() ((void)0)
+#define POOL_WAIT()   ((void)0)
+#define POOL_DONE()   ((void)0)
+#endif
+
+/**
+ * Add a commit to the list of jobs.
+ *
+ * \param[in] oid Commit
+ * \return 0 on success, non-zero on failure.
+ */
+static int add_job(const git_oid *oid)
+{
+	struct job *tmp, *job;
+	size_t cap = pool.cap ? pool.cap * 2 : 64;
+	char id[50];
+
+	if (pool.n == pool.cap) {
+		errno = 0;
+		if (!(tmp = realloc(pool.jobs, cap * sizeof(struct job))))
+			return 1;
+		pool.jobs = tmp;
+		pool.cap  = cap;
 	}
 
-	size = SIZE_MAX;
-	goto ret;
+	job = &pool.jobs[pool.n++];
+	memset(job, 0, sizeof(struct job));
+	job->oid = *oid;
+	git_oid_tostr(id, sizeof(id), oid);
+	if ((job->cached = cache_find(id)))
+		job->state = JOB_DONE;
+	return 0;
+}
+
+/**
+ * Free the jobs.
+ */
+static void free_jobs(void)
+{
+	while (pool.n)
+		free(pool.jobs[--pool.n].deltas.buf);
+	free(pool.jobs);
+	pool.jobs = NULL;
+	pool.cap  = pool.next = 0;
+}
+
+/**
+ * Diff a commit, and gather its deltas.
+ *
+ * \param[in] repo Repository
+ * \param[in] job  Job
+ */
+static void run_job(git_repository *repo, struct job *job)
+{
+	git_diff *diff;
+	int state = JOB_SKIPPED;
+
+	if (!generate_diff(repo, &job->oid, &diff)) {
+		state = diff_deltas(diff, &job->deltas) ? JOB_FAILED : JOB_DONE;
+		git_diff_free(diff);
+	}
+
+	POOL_LOCK();
+	job->state = state;
+	POOL_DONE();
+	POOL_UNLOCK();
+}
+
+#ifdef HAVE_LIBPTHREAD
+/**
+ * Claim the next commit which needs to be diffed.
+ *
+ * \return The job, or NULL if there's nothing left to do.
+ */
+static struct job *claim_job(void)
+{
+	struct job *job = NULL;
+
+	POOL_LOCK();
+	while (pool.next < pool.n && pool.jobs[pool.next].cached)
+		++pool.next;
+	if (pool.next < pool.n)
+		job = &pool.jobs[pool.next++];
+	POOL_UNLOCK();
+	return job;
+}
+
+/**
+ * Diff commits until there are none left.
+ *
+ * A worker which can't open the repository leaves the commits to
+ * the others.
+ */
+static void *worker(void *arg)
+{
+	git_repository *repo = NULL;
+	struct job *job;
+
+	(void)arg;
+	if (git_repository_open(&repo, config.repo_path) != GIT_OK)
+		return NULL;
+
+	while ((job = claim_job()))
+		run_job(repo, job);
+	git_repository_free(repo);
+	return NULL;
+}
+#endif
+
+/**
+ * Wait for a commit to be diffed, or diff it ourselves if no worker
+ * has claimed it yet.
+ *
+ * \param[in] i Index of the job
+ * \return The state of the job.
+ */
+static int wait_job(size_t i)
+{
+	int state;
+
+	POOL_LOCK();
+	if (i >= pool.next) {
+		pool.next = i + 1;
+		POOL_UNLOCK();
+		run_job(repository, &pool.jobs[i]);
+		POOL_LOCK();
+	}
+
+	while ((state = pool.jobs[i].state) == JOB_PENDING)
+		POOL_WAIT();
+	POOL_UNLOCK();
+	return state;
+}
+
+/**
+ * Diff the commits in the walk, and apply their deltas in order.
+ *
+ * The result is the same no matter how many threads are used.
+ *
+ * \return The number of migrations added, or SIZE_MAX on fatal error.
+ */
+static size_t run_jobs(void)
+{
+#ifdef HAVE_LIBPTHREAD
+	pthread_t workers[MAX_THREADS - 1];
+	size_t nworkers = 0, want = 0;
+#endif
+	struct job *job;
+	size_t i, j, total = 0;
+	char id[50];
+
+#ifdef HAVE_LIBPTHREAD
+	/* Don't start more workers than there are commits to diff */
+	for (i = 0; i < pool.n; i++)
+		want += !pool.jobs[i].cached;
+	if (want > config.threads) want = config.threads;
+	if (want > MAX_THREADS) want = MAX_THREADS;
+
+	if (want > 1) {
+		pthread_mutex_init(&pool.lock, NULL);
+		pthread_cond_init(&pool.done, NULL);
+		pool.threaded = 1;
+		while (nworkers < want - 1 &&
+		       !pthread_create(&workers[nworkers], NULL, worker, NULL))
+			++nworkers;
+	}
+#endif
+
+	for (i = 0; i < pool.n; i++) {
+		job = &pool.jobs[i];
+		if (job->cached) {
+			j = process_cached(job->cached);
+		} else {
+			switch (wait_job(i)) {
+			case JOB_SKIPPED:
+				continue;
+			case JOB_FAILED:
+				error("failed to allocate memory: %s",
+				      strerror(ENOMEM));
+				j = SIZE_MAX;
+				break;
+			default:
+				git_oid_tostr(id, sizeof(id), &job->oid);
+				j = process_deltas(id, &job->deltas);
+				break;
+			}
+
+			free(job->deltas.buf);
+			memset(&job->deltas, 0, sizeof(struct buffer));
+		}
+
+		if (j == SIZE_MAX) {
+			total = SIZE_MAX;
+			break;
+		}
+
+		total += j;
+	}
+
+#ifdef HAVE_LIBPTHREAD
+	/* Stop the workers, in case we gave up early */
+	if (want > 1) {
+		POOL_LOCK();
+		pool.next = pool.n;
+		POOL_UNLOCK();
+
+		while (nworkers)
+			pthread_join(workers[--nworkers], NULL);
+		pool.threaded = 0;
+		pthread_cond_destroy(&pool.done);
+		pthread_mutex_destroy(&pool.lock);
+	}
+#endif
+
+	return total;
 }
+/* }}} */
 
 /**
- * Flatten the migration list into an array
+ * Flatten the migration list into an array, and release the list,
+ * and the paths.
  *
  * \param[in]  maxlen Maximum length of the array
  * \param[out] size   Actial size of the array
@@ -342,68 +1360,63 @@ err:
  */
 static char **flatten_mlist(size_t maxlen, size_t *size)
 {
-	size_t i, j = 0, k = 0;
+	size_t i, j = 0, k, len;
 	struct mlist *ml;
-	char **migrations = NULL, **tmp;
+	char **migrations = NULL, *name;
 
+	*size = 0;
 	if (!maxlen) goto ret;
 
-	++maxlen;
 	errno = 0;
 	migrations = malloc(maxlen * sizeof(char *));
 	if (!migrations) goto malloc_err;
 
-	/* Copy the migrations, sorting each batch. */
+	/* Gather the migrations, sorting each batch. */
 	for (ml = mlist_head; ml; ml = ml->next) {
 		k = j;
 		for (i = 0; i < ml->size; i++) {
-			if (!is_path_sql(ml->migrations[i]))
+			if (!ml->migrations[i] ||
+			    !is_path_sql(ml->migrations[i]->name))
 				continue;
-			migrations[j++] = ml->migrations[i];
+			migrations[j++] = ml->migrations[i]->name;
 		}
 
-		if (j > k) bubblesort(&migrations[k], j - k);
+		if (j > k) sort_migrations(&migrations[k], j - k);
 	}
 
-	/* Shrink the array if necessary */
-	if (j) {
-		if (maxlen > j) {
-			errno = 0;
-			tmp = realloc(migrations, j * sizeof(char *));
-			if (!tmp) goto malloc_err;
-			migrations = tmp;
-		}
+	/* Copy them out of the arena */
+	for (; *size < j; ++*size) {
+		len = strlen(migrations[*size]) + 1;
+		errno = 0;
+		if (!(name = malloc(len)))
+			goto malloc_err;
+		memcpy(name, migrations[*size], len);
+		migrations[*size] = name;
+	}
 
-		*size = j;
-	} else {
+	if (!j) {
 		free(migrations);
 		migrations = NULL;
-		*size = 0;
 	}
 
 ret:
-	if (mlist_head) {
-		for (ml = mlist_head; ml; ml = mlist_tail) {
-			mlist_tail = ml->next;
-			free(ml->migrations);
-			free(ml);
-		}
-
-		mlist_head = mlist_tail = NULL;
+	for (ml = mlist_head; ml; ml = mlist_tail) {
+		mlist_tail = ml->next;
+		free(ml->migrations);
+		free(ml);
 	}
 
+	mlist_head = mlist_tail = NULL;
+	arena_free();
 	return migrations;
 
 malloc_err:
 	if (errno == ENOMEM)
 		error("failed to allocate memory: %s", strerror(errno));
 
-	if (migrations) {
-		while (*size) free(migrations[--*size]);
-		free(migrations);
-		migrations = NULL;
-	} else *size = 0;
-
+	while (*size) free(migrations[--*size]);
+	free(migrations);
+	migrations = NULL;
 	goto ret;
 }
 
@@ -423,10 +1436,8 @@ static char **git_find_migrations(const char *cur_rev,
                                   const char *prev_rev, size_t *size)
 {
 	git_oid oid;
-	git_repository *repo = NULL;
 	git_object *head = NULL, *prev = NULL;
 	git_revwalk *walk = NULL;
-	git_diff *diff = NULL;
 	char **migrations = NULL;
 	size_t i, j;
 
@@ -445,22 +1456,15 @@ static char **git_find_migrations(const char *cur_rev,
 		config.migration_path[i] = '\0';
 	}
 
-	if (git_repository_open(&repo, config.repo_path) != GIT_OK)
-		goto ret;
+	set_subtree();
 
 	if (prev_rev) {
-		if (git_revparse_single(&head, repo, cur_rev) != GIT_OK)
-			goto ret;
-
-		if (git_revparse_single(&prev, repo, prev_rev) != GIT_OK)
+		if (revparse(&head, cur_rev) || revparse(&prev, prev_rev))
 			goto ret;
 	} else {
 		prev_rev = "HEAD^{commit}";
-		if (git_revparse_single(&head, repo, prev_rev) != GIT_OK)
-			goto ret;
-
-		if (cur_rev &&
-		    git_revparse_single(&prev, repo, cur_rev) != GIT_OK)
+		if (revparse(&head, prev_rev) ||
+		    (cur_rev && revparse(&prev, cur_rev)))
 			goto ret;
 	}
 
@@ -474,7 +1478,7 @@ static char **git_find_migrations(const char *cur_rev,
 	initialize_diff_options();
 
 	/* Walk all revisions between the previous and current HEAD */
-	if (git_revwalk_new(&walk, repo) != GIT_OK ||
+	if (git_revwalk_new(&walk, repository) != GIT_OK ||
 	    git_revwalk_push(walk, git_object_id(head)) != GIT_OK ||
 	    (prev &&
 	     git_revwalk_hide(walk, git_object_id(prev)) != GIT_OK)) {
@@ -486,23 +1490,21 @@ static char **git_find_migrations(const char *cur_rev,
 
 	git_revwalk_sorting(walk, GIT_SORT_TOPOLOGICAL |
 	                    GIT_SORT_REVERSE);
-	i = 0;
 
-	while (!git_revwalk_next(&oid, walk)) {
-		diff = generate_diff(repo, oid);
-		if (!diff) continue;
+	/* Only diff the commits which aren't in the delta cache */
+	cache_load();
+	for (j = 0; !j && !git_revwalk_next(&oid, walk); )
+		j = (size_t)add_job(&oid);
 
-		j = process_diff(diff);
-		if (j == SIZE_MAX) {
-			i = 0;
-			git_diff_free(diff);
-			break;
-		}
+	if (j) {
+		error("failed to allocate memory: %s", strerror(ENOMEM));
+		i = 0;
+	} else if ((i = run_jobs()) == SIZE_MAX) i = 0;
 
-		i += j;
-		git_diff_free(diff);
-	}
 	migrations = flatten_mlist(i, size);
+	free_jobs();
+	cache_save();
+	cache_free();
 
 ret:
 	if (giterr_last())
@@ -510,7 +1512,6 @@ ret:
 	git_revwalk_free(walk);
 	git_object_free(prev);
 	git_object_free(head);
-	git_repository_free(repo);
 	return migrations;
 }
 
@@ -525,11 +1526,20 @@ ret:
  *
  * repo_path - Path to the git repository.
  *   Vaiid values are a string less than 1024 bytes.
+ *
+ * cache_file - Path to the delta cache (optional.)
+ *
+ * threads - Number of threads used for diffing commits.
+ *
+ * read_blobs - If non-zero, read migrations from the repository.
  */
 static void git_configure(void)
 {
 	CONFIG_SET_STRING("repo_path", 9, config.repo_path);
 	CONFIG_SET_STRING("migration_path", 14, config.migration_path);
+	CONFIG_SET_STRING("cache_file", 10, config.cache_file);
+	CONFIG_SET_NUMBER("threads", 7, config.threads);
+	CONFIG_SET_NUMBER("read_blobs", 10, config.read_blobs);
 }
 
 /**
@@ -552,35 +1562,22 @@ static const char *git_get_head(void)
  */
 static const char *git_get_file_revision(const char *file)
 {
-	git_repository *repo = NULL;
 	git_object *rev = NULL;
 	char *tmprev = NULL;
 
 	if (!file || !(tmprev = malloc(strlen(file) + 6)))
-		goto err;
+		return NULL;
 	sprintf(tmprev, "HEAD:%s", file);
 
-	if (git_repository_open(&repo, config.repo_path) != GIT_OK)
-		goto err;
-
-	if (git_revparse_single(&rev, repo, tmprev) != GIT_OK)
-		goto err;
-
 	*file_rev = '\0';
-	if (rev && git_object_id(rev)) {
+	if (!revparse(&rev, tmprev) && rev && git_object_id(rev)) {
 		git_oid_tostr(file_rev, sizeof(file_rev),
 		              git_object_id(rev));
 	}
 
 	git_object_free(rev);
-	git_repository_free(repo);
 	free(tmprev);
 	return !*file_rev ? NULL : file_rev;
-
-err:
-	if (tmprev) free(tmprev);
-	if (repo)   git_repository_free(repo);
-	return NULL;
 }
 
 /**
@@ -593,6 +1590,127 @@ static const char *git_get_migration_path(void)
 	return config.repo_path;
 }
 
+/**
+ * Get the paths to watch for new revisions.
+ *
+ * These are the repository's git directory, where HEAD is kept,
+ * the directory holding the branch HEAD is on, which is what moves
+ * when something is committed, and (for a worktree) the common
+ * directory, where packed-refs is kept. packed-refs is replaced
+ * rather than written in place, so it's watched through the
+ * directory it's in.
+ *
+ * \return The paths, or NULL if the git directory couldn't be found.
+ */
+static const char *const *git_get_watch_paths(void)
+{
+	git_reference *head = NULL;
+	const char *path, *target, *slash;
+	size_t len, n = 0;
+
+	if (open_repo() || !(path = git_repository_path(repository)) ||
+	    (len = strlen(path)) >= sizeof(git_dir))
+		return NULL;
+
+	memcpy(git_dir, path, len + 1);
+	watch_paths[n++] = git_dir;
+
+	/* Worktrees share their refs with the repository they're from */
+#if LIBGIT2_VER_MAJOR > 0 ||\
+    (LIBGIT2_VER_MAJOR == 0 && LIBGIT2_VER_MINOR > 25)
+	if ((path = git_repository_commondir(repository)) &&
+	    (len = strlen(path)) < sizeof(common_dir) &&
+	    strcmp(path, git_dir)) {
+		memcpy(common_dir, path, len + 1);
+		watch_paths[n++] = common_dir;
+	}
+#endif
+
+	/* Nothing to add if HEAD is detached */
+	path = watch_paths[n - 1];
+	len  = strlen(path);
+	if (git_reference_lookup(&head, repository, "HEAD") == GIT_OK &&
+	    (target = git_reference_symbolic_target(head)) &&
+	    (slash = strrchr(target, '/')) &&
+	    len + (size_t)(slash - target) < sizeof(ref_dir)) {
+		memcpy(ref_dir, path, len);
+		memcpy(ref_dir + len, target, (size_t)(slash - target));
+		ref_dir[len + (size_t)(slash - target)] = '\0';
+		watch_paths[n++] = ref_dir;
+	}
+
+	git_reference_free(head);
+	watch_paths[n] = NULL;
+	return watch_paths;
+}
+
+/**
+ * Get the contents of a migration.
+ *
+ * Migrations are read from the working tree, unless read_blobs is
+ * set, or the repository is bare. In that case, they're read from
+ * the repository as of the revision the migrations were last found
+ * at, which is the revision being rolled back when rolling back.
+ *
+ * \param[in]  file Migration name.
+ * \param[out] size Size of the migration.
+ * \return The migration, or NULL on error.
+ */
+static char *git_load_migration(const char *file, size_t *size)
+{
+	git_object *obj = NULL;
+	const char *rev = *local_head ? local_head : "HEAD";
+	char *spec, *mem = NULL;
+	size_t len = strlen(config.repo_path);
+
+	*size = 0;
+	if (!config.read_blobs &&
+	    (open_repo() || !git_repository_is_bare(repository))) {
+		errno = 0;
+		if (!(spec = malloc(len + strlen(file) + 2)))
+			goto err;
+
+		sprintf(spec, "%s/%s", config.repo_path, file);
+		mem = map_file(spec, size);
+		free(spec);
+		return mem;
+	}
+
+	errno = 0;
+	if (!(spec = malloc(strlen(rev) + strlen(file) + 2)))
+		goto err;
+
+	sprintf(spec, "%s:%s", rev, file);
+	if (revparse(&obj, spec) || !obj ||
+	    git_object_type(obj) != GIT_OBJ_BLOB) {
+		error("'%s' isn't in revision %s", file, rev);
+		giterr_clear();
+	} else {
+		*size = (size_t)git_blob_rawsize((git_blob *)obj);
+		mem   = copy_file(file, git_blob_rawcontent((git_blob *)obj),
+		                  size);
+	}
+
+	git_object_free(obj);
+	free(spec);
+	return mem;
+
+err:
+	error("failed to allocate memory: %s", strerror(ENOMEM));
+	return NULL;
+}
+
+/**
+ * Give back a migration from git_load_migration().
+ *
+ * \param[in] mem  Migration.
+ * \param[in] size Size of the migration.
+ */
+static void git_unload_migration(char *mem, size_t size)
+{
+	unmap_file(mem, size);
+}
+
 /**
  * Initialize the git source backend.
  *
@@ -605,6 +1723,7 @@ static int git_init(void)
 	memset(&config, 0, sizeof(config));
 	config.repo_path[0] = '.';
 	memset(&local_head, 0, sizeof(local_head));
+	close_repo();
 	return git_libgit2_init() < 0;
 }
 
@@ -615,6 +1734,7 @@ static int git_init(void)
  */
 static int git_uninit(void)
 {
+	close_repo();
 	git_libgit2_shutdown();
 	return 0;
 }
@@ -627,6 +1747,10 @@ struct source_backend_vtable git_vtable = {
 	git_get_head,
 	git_get_file_revision,
 	git_get_migration_path,
+	git_get_watch_paths,
+	git_load_migration,
+	git_unload_migration,
+	NULL, /* git_get_scan_stats */
 	git_uninit
 };
 
@@ -0,0 +1,334 @@
+/**
+ * Minimal Migration Manager - Pack Migration Source
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+#ifndef IN_TESTS
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
+#include "backend.h"
+#include "../file.h"
+#include "../pack.h"
+#include "../utils.h"
+
+/* Configurable variables */
+static struct config {
+	char pack_file[256]; /**< Path to the pack. */
+} config;
+
+/**
+ * The pack is mapped once, and stays mapped for as long as the
+ * file doesn't change, so that migrations can be handed out
+ * straight from the mapping.
+ */
+static struct pack {
+	char *mem;           /**< Mapping */
+	size_t size;         /**< Size of the mapping */
+	size_t n;            /**< Number of migrations */
+	unsigned long dev;   /**< Device of the pack */
+	unsigned long ino;   /**< Inode of the pack */
+	unsigned long mtime; /**< Modification time of the pack */
+	unsigned long len;   /**< Size of the pack file */
+} pack;
+
+/* Local HEAD revision */
+static char local_head[50];
+
+/* Directory the pack lives in */
+static char pack_dir[256];
+static const char *watch_paths[2] = { pack_dir, NULL };
+
+/**
+ * Callback for receiving configuration key/value pairs.
+ *
+ * Valid values for this module are:
+ *
+ * pack_file - Path to the migration pack.
+ */
+static void pack_config(void)
+{
+	CONFIG_SET_STRING("pack_file", 9, config.pack_file);
+}
+
+/**
+ * Unmap the pack.
+ */
+static void close_pack(void)
+{
+	if (pack.mem) unmap_file(pack.mem, pack.size);
+	memset(&pack, 0, sizeof(pack));
+}
+
+/**
+ * Map the pack, unless it's already mapped and hasn't changed.
+ *
+ * \return 0 on success, non-zero on failure.
+ */
+static int open_pack(void)
+{
+	struct stat st;
+
+	if (!*config.pack_file) {
+		error("no pack_file specified");
+		return 1;
+	}
+
+	errno = 0;
+	if (stat(config.pack_file, &st)) {
+		error("unable to stat '%s': %s", config.pack_file,
+		      strerror(errno));
+		return 1;
+	}
+
+	if (pack.mem && pack.dev == (unsigned long)st.st_dev &&
+	    pack.ino == (unsigned long)st.st_ino &&
+	    pack.mtime == (unsigned long)st.st_mtime &&
+	    pack.len == (unsigned long)st.st_size)
+		return 0;
+
+	close_pack();
+	if (!(pack.mem = map_file(config.pack_file, &pack.size)))
+		return 1;
+
+	if (pack_check(pack.mem, pack.size, &pack.n)) {
+		error("'%s' isn't a valid migration pack", config.pack_file);
+		close_pack();
+		return 1;
+	}
+
+	pack.dev   = (unsigned long)st.st_dev;
+	pack.ino   = (unsigned long)st.st_ino;
+	pack.mtime = (unsigned long)st.st_mtime;
+	pack.len   = (unsigned long)st.st_size;
+	return 0;
+}
+
+/**
+ * Copy the numeric designation in the given filename to
+ * be used as the local HEAD revision.
+ *
+ * \param[in] head New HEAD revision.
+ */
+static void update_local_head(const char *head)
+{
+	size_t i = 0;
+
+	while (head[i] && head[i] >= '0' && head[i] <= '9')
+		i++;
+
+	i = (i >= sizeof(local_head)) ? sizeof(local_head) - 1 : i;
+	if (i) {
+		memcpy(local_head, head, i);
+		local_head[i] = '\0';
+	}
+}
+
+/**
+ * Get the designation of a revision.
+ *
+ * \return The designation, or ULONG_MAX if there isn't one.
+ */
+static unsigned long designation(const char *rev)
+{
+	unsigned long x;
+	char *tmp;
+
+	if (!rev) return ULONG_MAX;
+
+	errno = 0;
+	x = strtoul(rev, &tmp, 0);
+	if (!tmp || tmp == rev || errno == ERANGE)
+		return ULONG_MAX;
+	return x;
+}
+
+/**
+ * Provide an ordered list of the migrations in the pack, depending
+ * on whether or not they should be applied.
+ *
+ * NOTE: The returned list of migrations must be freed.
+ *
+ * \param[in]  cur_rev  Last applied revision
+ * \param[in]  prev_rev Previous revision (for rollbacks.)
+ * \param[out] size     Number of migrations in the list
+ * \returns array of pointers to strings representing an ordered
+ *          list of migration filenames.
+ */
+static char **pack_find_migrations(const char *cur_rev,
+                                   const char *prev_rev, size_t *size)
+{
+	char **m = NULL;
+	const char *name;
+	size_t i, len, first = 0, last;
+	unsigned long hnum, pnum;
+
+	if (size) *size = 0;
+	else return NULL;
+
+	if (open_pack()) return NULL;
+
+	/* Skip anything up to the previous revision, or current head */
+	hnum = designation(cur_rev);
+	pnum = designation(prev_rev);
+	last = pack.n;
+	if (pnum < ULONG_MAX) {
+		first = pack_upper(pack.mem, pack.n, pnum);
+		last  = pack_upper(pack.mem, pack.n, hnum);
+	} else if (hnum < ULONG_MAX) {
+		first = pack_upper(pack.mem, pack.n, hnum);
+	}
+
+	if (first < last) {
+		errno = 0;
+		if (!(m = malloc((last - first) * sizeof(char *))))
+			goto err;
+
+		for (i = first; i < last; i++) {
+			name = pack_name(pack.mem, i);
+			len  = strlen(name) + 1;
+			if (!(m[*size] = malloc(len))) goto err;
+			memcpy(m[(*size)++], name, len);
+		}
+
+		update_local_head(m[*size - 1]);
+	} else if (hnum != ULONG_MAX) update_local_head(cur_rev);
+
+	return m;
+
+err:
+	error("memory allocation failed: %s", strerror(ENOMEM));
+	while (m && *size) free(m[--*size]);
+	free(m);
+	return NULL;
+}
+
+/**
+ * Get a migration straight from the pack.
+ *
+ * \param[in]  file Migration name.
+ * \param[out] size Size of the migration.
+ * \return The migration, or NULL on error.
+ */
+static char *pack_load_migration(const char *file, size_t *size)
+{
+	char *mem;
+	size_t i;
+	unsigned long sum;
+
+	if (!pack.mem && open_pack())
+		return NULL;
+
+	if ((i = pack_find(pack.mem, pack.n, file)) == pack.n) {
+		error("'%s' isn't in '%s'", file, config.pack_file);
+		return NULL;
+	}
+
+	mem = pack_migration(pack.mem, i, size, &sum);
+	if (checksum(mem, *size) != sum) {
+		error("'%s' is damaged in '%s'", file, config.pack_file);
+		return NULL;
+	}
+
+	return mem;
+}
+
+/**
+ * Get the latest local revision.
+ *
+ * \return The latest local revision as a string, or "0" if
+ *         the local revision couldn't be determined.
+ */
+static const char *pack_get_head(void)
+{
+	return (*local_head ? local_head : "0");
+}
+
+/**
+ * Get the latest revision of a particular file
+ *
+ * \param[in] file   File name.
+ * \return "0" since this is only used for the seed file.
+ */
+static const char *pack_get_file_revision(const char *file)
+{
+	(void)file;
+	return "0";
+}
+
+/**
+ * Get the base path for migrations.
+ *
+ * \return The path to the pack.
+ */
+static const char *pack_get_migration_path(void)
+{
+	return config.pack_file;
+}
+
+/**
+ * Get the paths to watch for new migrations.
+ *
+ * Packs are usually replaced rather than written in place, so the
+ * directory the pack lives in is watched, rather than the pack.
+ *
+ * \return The directory containing the pack.
+ */
+static const char *const *pack_get_watch_paths(void)
+{
+	char *slash;
+
+	memcpy(pack_dir, config.pack_file, sizeof(pack_dir));
+	if (!(slash = strrchr(pack_dir, '/')))
+		memcpy(pack_dir, ".", 2);
+	else slash[slash == pack_dir] = '\0';
+	return watch_paths;
+}
+
+/**
+ * Initialize the pack source backend.
+ *
+ * \return 0 on success, non-zero on failure.
+ */
+static int pack_init(void)
+{
+	memset(&config, 0, sizeof(config));
+	memset(&pack, 0, sizeof(pack));
+	memset(&local_head, 0, sizeof(local_head));
+	return 0;
+}
+
+/**
+ * Uninitialize the pack source backend.
+ *
+ * \return 0 on success, non-zero on failure.
+ */
+static int pack_uninit(void)
+{
+	close_pack();
+	return 0;
+}
+
+struct source_backend_vtable pack_vtable = {
+	"pack",
+	pack_config,
+	pack_init,
+	pack_find_migrations,
+	pack_get_head,
+	pack_get_file_revision,
+	pack_get_migration_path,
+	pack_get_watch_paths,
+	pack_load_migration,
+	NULL, /* pack_unload_migration */
+	NULL, /* pack_get_scan_stats */
+	pack_uninit
+};
@@ -0,0 +1,373 @@
+/**
+ * Minimal Migration Manager - SQL Statement Scanner
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <string.h>
+#include <ctype.h>
+
+#include "copy.h"
+#include "scan.h"
+#include "sql.h"
+
+/**
+ * What we need to know about each driver's SQL dialect.
+ */
+static const struct dialect {
+	const char *driver;
+	unsigned int flags;
+} dialects[] = {
+	{ "mysql",   SQL_BACKSLASH | SQL_HASH | SQL_DELIMITER           },
+	{ "pgsql",   SQL_DOLLAR | SQL_ESTRING | SQL_NESTED | SQL_ATOMIC },
+	{ "sqlite3", SQL_TRIGGER                                        }
+};
+
+/**
+ * Bytes which could end each lexical state (other than IN_SQL.)
+ */
+static const char *stops[] = {
+	"", "'\\", "\"\\", "`", "\n", "*/", "$"
+};
+
+/**
+ * Get the scanner flags for a database driver's SQL dialect.
+ *
+ * \param[in] driver Driver name (may be NULL.)
+ * \return The flags for the driver's dialect.
+ */
+unsigned int sql_dialect(const char *driver)
+{
+	size_t i;
+
+	for (i = 0; driver && i < sizeof(dialects) / sizeof(*dialects); i++) {
+		if (!strcmp(driver, dialects[i].driver))
+			return dialects[i].flags;
+	}
+
+	return 0;
+}
+
+/**
+ * Initialize a scanner.
+ *
+ * \param[out] s     Scanner
+ * \param[in]  flags Scanner flags
+ */
+void sql_scan_init(struct sql_scanner *s, unsigned int flags)
+{
+	memset(s, 0, sizeof(*s));
+	s->flags = flags;
+	s->prev  = '\n';
+}
+
+/**
+ * Determine whether or not a byte can be part of an identifier.
+ */
+static int is_ident(char c)
+{
+	return isalnum((unsigned char)c) || c == '_' || c == '$';
+}
+
+/**
+ * Compare a word against an (uppercase) keyword.
+ *
+ * \param[in] w    Word
+ * \param[in] len  Length of the word
+ * \param[in] kw   Keyword
+ * \return 1 if they match, 0 otherwise.
+ */
+static int is_keyword(const char *w, size_t len, const char *kw)
+{
+	size_t i;
+
+	for (i = 0; i < len && kw[i]; i++) {
+		if (toupper((unsigned char)w[i]) != kw[i])
+			return 0;
+	}
+
+	return i == len && !kw[i];
+}
+
+/**
+ * Get the length of the dollar-quote tag at the start of a
+ * string, if there is one.
+ *
+ * \param[in] s   String (starting with '$')
+ * \param[in] len Number of bytes available
+ * \return The length of the tag (including both '$'), or 0.
+ */
+static size_t dollar_tag(const char *s, size_t len)
+{
+	size_t i = 1;
+
+	if (len > 1 && isdigit((unsigned char)s[1]))
+		return 0;
+
+	while (i < len && i < SQL_LOOKAHEAD - 1 && is_ident(s[i]) &&
+	       s[i] != '$') i++;
+	return (i < len && s[i] == '$') ? i + 1 : 0;
+}
+
+/**
+ * Track the keywords which decide where a statement with a body
+ * ends. SQLite trigger bodies and PostgreSQL's BEGIN ATOMIC
+ * function bodies are wrapped in BEGIN ... END, and any
+ * semicolons in them (or in a CASE ... END) don't end the
+ * statement.
+ */
+static void keyword(struct sql_scanner *s, const char *w, size_t len)
+{
+	if (!s->tokens) {
+		s->create = is_keyword(w, len, "CREATE");
+		return;
+	}
+
+	/* CREATE [OR REPLACE] [TEMP | TEMPORARY] <object> */
+	if (s->create == 1) {
+		if (is_keyword(w, len, "OR") || is_keyword(w, len, "REPLACE") ||
+		    is_keyword(w, len, "TEMP") || is_keyword(w, len, "TEMPORARY"))
+			return;
+
+		s->create = 2;
+		if ((s->flags & SQL_TRIGGER) && is_keyword(w, len, "TRIGGER"))
+			s->body = 1;
+		else if ((s->flags & SQL_ATOMIC) &&
+		         (is_keyword(w, len, "FUNCTION") ||
+		          is_keyword(w, len, "PROCEDURE")))
+			s->body = 1;
+		return;
+	}
+
+	if (!s->body) return;
+	if (is_keyword(w, len, "BEGIN") || is_keyword(w, len, "CASE"))
+		++s->depth;
+	else if (s->depth && is_keyword(w, len, "END"))
+		--s->depth;
+}
+
+/**
+ * Determine whether or not a custom DELIMITER starts at \a i.
+ */
+static int at_delimiter(const struct sql_scanner *s, const char *buf,
+                        size_t i, size_t len)
+{
+	return s->delim_len && buf[i] == *s->delim &&
+	       len - i >= s->delim_len &&
+	       !memcmp(buf + i, s->delim, s->delim_len);
+}
+
+/**
+ * Handle a "DELIMITER xx" line, which sets what ends a statement
+ * from then on. A DELIMITER without one is ignored, as is one too
+ * long to hold.
+ *
+ * \param[in] s   Scanner
+ * \param[in] buf Buffer
+ * \param[in] i   Offset just past the DELIMITER keyword
+ * \param[in] len Number of bytes in the buffer
+ * \return The offset just past the end of the line.
+ */
+static size_t delimiter(struct sql_scanner *s, const char *buf, size_t i,
+                        size_t len)
+{
+	size_t j;
+
+	while (i < len && (buf[i] == ' ' || buf[i] == '\t')) i++;
+	for (j = i; j < len && !isspace((unsigned char)buf[j]); j++);
+
+	if (j > i && j - i < SQL_LOOKAHEAD) {
+		memcpy(s->delim, buf + i, j - i);
+		s->delim_len = (j - i == 1 && buf[i] == ';') ? 0 : j - i;
+	}
+
+	while (j < len && buf[j] != '\n') j++;
+	return j < len ? j + 1 : j;
+}
+
+/**
+ * Handle a semicolon (or DELIMITER,) which usually ends a
+ * statement.
+ *
+ * \param[in] s   Scanner
+ * \param[in] end Offset of the end of the statement's text
+ * \param[in] pos Offset just past the terminator
+ * \return 1 if the statement ended, 0 otherwise.
+ */
+static int end_statement(struct sql_scanner *s, size_t end, size_t pos)
+{
+	if (s->depth || s->paren)
+		return 0;
+
+	if (s->tokens) ++s->n_stmts;
+	s->end      = end;
+	s->boundary = pos;
+	s->tokens   = 0;
+	s->create   = 0;
+	s->body     = 0;
+	return 1;
+}
+
+/**
+ * Scan a buffer for statement boundaries.
+ *
+ * Scanning starts at s->pos, and stops at limit (or just past the
+ * end of a statement with SQL_ONE, or at a copy marker with
+ * SQL_COPY.) Tokens which start before limit may extend up to len.
+ * Nothing at or beyond buf[len] is read, so the buffer needn't be
+ * NUL-terminated.
+ *
+ * \param[in] s     Scanner
+ * \param[in] buf   Buffer
+ * \param[in] limit Offset to stop scanning at
+ * \param[in] len   Number of bytes in the buffer
+ */
+void sql_scan(struct sql_scanner *s, const char *buf, size_t limit,
+              size_t len)
+{
+	size_t i, j;
+	char c, next;
+
+	for (i = s->pos; i < limit; i++) {
+		c    = buf[i];
+		next = (i + 1 < len) ? buf[i + 1] : '\0';
+
+		/* Skip ahead to whatever could end a comment or quote */
+		if (s->state != IN_SQL &&
+		    (j = scan_any(buf + i, limit - i, stops[s->state]))) {
+			i += j - 1;
+			continue;
+		}
+
+		switch (s->state) {
+		case IN_LINE_COMMENT:
+			if (c == '\n') s->state = IN_SQL;
+			continue;
+		case IN_BLOCK_COMMENT:
+			if (c == '*' && next == '/') {
+				if (s->comment) --s->comment;
+				else s->state = IN_SQL;
+				++i;
+			} else if (c == '/' && next == '*' &&
+			           (s->flags & SQL_NESTED)) {
+				++s->comment;
+				++i;
+			}
+			continue;
+		case IN_QUOTE:
+		case IN_IDENT:
+			if (c == '\\' && (s->escape || (s->flags & SQL_BACKSLASH))) {
+				if (i + 1 < len) ++i;
+			} else if (c == (s->state == IN_QUOTE ? '\'' : '"')) {
+				s->state = IN_SQL;
+			}
+			continue;
+		case IN_BACKTICK:
+			if (c == '`') s->state = IN_SQL;
+			continue;
+		case IN_DOLLAR:
+			if (c == '$' && len - i >= s->tag_len &&
+			    !memcmp(buf + i, s->tag, s->tag_len)) {
+				i += s->tag_len - 1;
+				s->state = IN_SQL;
+			}
+			continue;
+		default: break;
+		}
+
+		/* Plain SQL */
+		if (isspace((unsigned char)c)) {
+			i += scan_space(buf + i, limit - i) - 1;
+			s->prev = buf[i];
+			continue;
+		}
+
+		/* Copy sections end any statement before them */
+		if (c == '-' && (s->flags & SQL_COPY) && s->prev == '\n' &&
+		    len - i >= COPY_MARKER_LEN &&
+		    !memcmp(buf + i, COPY_MARKER, COPY_MARKER_LEN)) {
+			s->depth = s->paren = 0;
+			end_statement(s, i, i);
+			s->marker = 1;
+			break;
+		}
+
+		/* A DELIMITER ends a statement, no matter what's open */
+		if (at_delimiter(s, buf, i, len)) {
+			s->depth = s->paren = 0;
+			end_statement(s, i, i + s->delim_len);
+			s->prev = ' ';
+			i += s->delim_len;
+			if (s->flags & SQL_ONE) break;
+			--i;
+			continue;
+		}
+
+		if ((c == '-' && next == '-') ||
+		    (c == '#' && (s->flags & SQL_HASH))) {
+			s->state = IN_LINE_COMMENT;
+			s->prev  = '\n';
+			continue;
+		}
+
+		if (c == '/' && next == '*') {
+			s->state = IN_BLOCK_COMMENT;
+			s->prev  = ' ';
+			++i;
+			continue;
+		}
+
+		if (c == ';' && !s->delim_len) {
+			s->prev = c;
+			if (end_statement(s, i + 1, i + 1) &&
+			    (s->flags & SQL_ONE)) {
+				++i;
+				break;
+			}
+			continue;
+		}
+
+		if (!s->tokens) s->start = i;
+		if (c == '\'') {
+			s->state  = IN_QUOTE;
+			s->escape = (s->flags & SQL_ESTRING) &&
+			            (s->prev == 'E' || s->prev == 'e');
+		} else if (c == '"') s->state = IN_IDENT;
+		else if (c == '`') s->state = IN_BACKTICK;
+		else if (c == '(') ++s->paren;
+		else if (c == ')' && s->paren) --s->paren;
+		else if (c == '$' && (s->flags & SQL_DOLLAR) &&
+		         !is_ident(s->prev) &&
+		         (j = dollar_tag(buf + i, len - i))) {
+			memcpy(s->tag, buf + i, j);
+			s->tag_len = j;
+			s->state   = IN_DOLLAR;
+			i += j - 1;
+		}
+
+		if (isalpha((unsigned char)c) || c == '_') {
+			j = i + 1;
+			while (j < len && is_ident(buf[j]) &&
+			       !at_delimiter(s, buf, j, len)) j++;
+
+			/* DELIMITER lines are for us, not the server */
+			if (!s->tokens && (s->flags & SQL_DELIMITER) &&
+			    (s->flags & SQL_ONE) &&
+			    is_keyword(buf + i, j - i, "DELIMITER")) {
+				i = s->boundary = delimiter(s, buf, j, len);
+				s->prev = '\n';
+				break;
+			}
+
+			keyword(s, buf + i, j - i);
+			i = j - 1;
+		}
+
+		s->prev = buf[i];
+		++s->tokens;
+	}
+
+	s->pos = i;
+}
@@ -0,0 +1,117 @@
+/**
+ * \file sql.h
+ *
+ * Minimal Migration Manager - SQL Statement Scanner
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+#ifndef SQL_H
+#define SQL_H
+
+#include <stddef.h>
+
+/**
+ * \def SQL_LOOKAHEAD
+ *
+ * Bytes which must be held back when scanning part of a larger
+ * input, so that comment markers, escapes and dollar-quote tags
+ * are never split between scans.
+ */
+#define SQL_LOOKAHEAD 64
+
+/**
+ * \defgroup sql_flags Scanner flags
+ * @{
+ */
+#define SQL_BACKSLASH (1 << 0) /**< Backslash escapes in strings */
+#define SQL_HASH      (1 << 1) /**< '#' starts a comment */
+#define SQL_DOLLAR    (1 << 2) /**< $tag$ quoted strings */
+#define SQL_ESTRING   (1 << 3) /**< E'' strings with backslash escapes */
+#define SQL_NESTED    (1 << 4) /**< Block comments nest */
+#define SQL_TRIGGER   (1 << 5) /**< CREATE TRIGGER ... BEGIN ... END */
+#define SQL_ATOMIC    (1 << 6) /**< CREATE FUNCTION ... BEGIN ATOMIC */
+#define SQL_COPY      (1 << 7) /**< Stop at copy section markers */
+#define SQL_ONE       (1 << 8) /**< Stop after each statement */
+#define SQL_DELIMITER (1 << 9) /**< DELIMITER lines (with SQL_ONE) */
+/** @} */
+
+/**
+ * Lexical states.
+ */
+enum sql_state {
+	IN_SQL,
+	IN_QUOTE,
+	IN_IDENT,
+	IN_BACKTICK,
+	IN_LINE_COMMENT,
+	IN_BLOCK_COMMENT,
+	IN_DOLLAR
+};
+
+/**
+ * Scanner state, which is carried from one scan to the next.
+ */
+struct sql_scanner {
+	unsigned int flags;    /**< Scanner flags */
+	enum sql_state state;  /**< Lexical state */
+	size_t pos;            /**< Next byte to scan */
+	size_t boundary;       /**< End of the last complete statement */
+	size_t start;          /**< First token of the statement */
+	size_t end;            /**< End of its text, less any DELIMITER */
+	unsigned long n_stmts; /**< Number of complete statements */
+	int tokens;            /**< Tokens in the current statement */
+	int create;            /**< Where we are in a CREATE statement */
+	int body;              /**< Statement has a BEGIN ... END body */
+	int depth;             /**< BEGIN / CASE nesting depth */
+	int paren;             /**< Parenthesis nesting depth */
+	int comment;           /**< Block comment nesting depth */
+	int escape;            /**< The current string has escapes */
+	int marker;            /**< Stopped at a copy section marker */
+	char prev;             /**< Last byte scanned outside of quotes */
+	size_t tag_len;        /**< Length of the dollar-quote tag */
+	size_t delim_len;      /**< Length of the DELIMITER, if not ';' */
+	char tag[SQL_LOOKAHEAD];
+	char delim[SQL_LOOKAHEAD];
+};
+
+/**
+ * Get the scanner flags for a database driver's SQL dialect.
+ *
+ * \param[in] driver Driver name (may be NULL.)
+ * \return The flags for the driver's dialect.
+ */
+unsigned int sql_dialect(const char *driver);
+
+/**
+ * Initialize a scanner.
+ *
+ * \param[out] s     Scanner
+ * \param[in]  flags Scanner flags
+ */
+void sql_scan_init(struct sql_scanner *s, unsigned int flags);
+
+/**
+ * Scan a buffer for statement boundaries.
+ *
+ * Scanning starts at s->pos, and stops at limit (or just past the
+ * end of a statement with SQL_ONE, or at a copy marker with
+ * SQL_COPY.) Tokens which start before limit may extend up to len.
+ * Nothing at or beyond buf[len] is read, so the buffer needn't be
+ * NUL-terminated.
+ *
+ * With SQL_DELIMITER, a "DELIMITER xx" line is treated as the mysql
+ * client treats it: it changes what ends a statement, and isn't a
+ * statement itself. Since such lines must be left out of what's
+ * sent to the server, they're only recognized with SQL_ONE.
+ *
+ * \param[in] s     Scanner
+ * \param[in] buf   Buffer
+ * \param[in] limit Offset to stop scanning at
+ * \param[in] len   Number of bytes in the buffer
+ */
+void sql_scan(struct sql_scanner *s, const char *buf, size_t limit,
+              size_t len);
+
+#endif /* SQL_H */
@@ -6,56 +6,156 @@
  * See the LICENSE file for details.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 #include <time.h>
 
+#ifndef IN_TESTS
+#include <sys/time.h>
+#endif
+
 #include "db.h"
 #include "state.h"
 #include "stringbuf.h"
 #include "utils.h"
 
 /* Current version of the table schema */
-#define STATE_VERSION 0x00000001L
+#define STATE_VERSION 0x00000002L
 
 /**
- * The statement which will create our tracking table.
+ * Column definitions for our tracking table.
+ *
+ * States are keyed by a sequence number which is incremented
+ * with each new state. The time they were recorded (seconds and
+ * microseconds) is only informational, since the clocks of the
+ * hosts recording them needn't agree.
  *
  * Note: INTEGER is expected to be big enough to
  * hold a time_t. This likely won't be an issue
  * till 2038.
  *
- * This statement should work on any RDBMS
- * conforming to SQL-92 (Transitional) or better.
- *
+ * This should work on any RDBMS conforming to
+ * SQL-92 (Transitional) or better.
+ */
+#define STATE_COLUMNS "(\n"\
+    "  tstamp    INTEGER      NOT NULL,\n"\
+    "  usec      INTEGER      NOT NULL,\n"\
+    "  seq       INTEGER      NOT NULL,\n"\
+    "  version   INTEGER      NOT NULL,\n"\
+    "  revision  VARCHAR(50)  NOT NULL,\n"\
+    "  previous  VARCHAR(50)  NOT NULL,\n"\
+    "  PRIMARY KEY(seq)\n" ")"
+
+/**
+ * The statement which will create our tracking table.
  */
 static const char *create_state_table =
-    "CREATE TABLE mmm_state(\n"
-    "  tstamp    INTEGER      NOT NULL PRIMARY KEY,\n"
-    "  version   INTEGER      NOT NULL,\n"
-    "  revision  VARCHAR(50)  NOT NULL,\n"
-    "  previous  VARCHAR(50)  NOT NULL\n" ");";
+    "CREATE TABLE mmm_state" STATE_COLUMNS ";";
 
 /**
- * SQL-92 compliant queries to manage the current state.
+ * Queries to manage the current state.
+ *
+ * Everything but the version check is a prepared statement, since
+ * they're run repeatedly. The current state is fetched by walking
+ * the primary key backwards, and the LIMIT (which isn't SQL-92,
+ * but which all of our drivers support) is appended when the
+ * statement is prepared.
  */
+static const char *get_state_version =
+    "SELECT MAX(version) FROM mmm_state;";
+
 static const char *get_current_state =
-    "SELECT * FROM mmm_state ORDER BY tstamp DESC;";
+    "SELECT tstamp, usec, seq, version, revision, previous "
+    "FROM mmm_state ORDER BY seq DESC LIMIT";
 
 static const char *insert_state =
-    "INSERT INTO mmm_state(tstamp, version, revision, previous) "
-    "VALUES";
+    "INSERT INTO mmm_state(tstamp, usec, seq, version, revision, "
+    "previous) VALUES (?, ?, ?, ?, ?, ?)";
 
-static const char *delete_state = "DELETE FROM mmm_state WHERE tstamp <";
+static const char *delete_state = "DELETE FROM mmm_state WHERE seq < ?";
 
 static const char *drop_state = "DROP TABLE mmm_state;";
 
+/**
+ * The ledger of applied migrations.
+ *
+ * Each migration which has been applied gets a row here, along with
+ * the checksum of the file when it was applied, the time it was
+ * applied, and how long it took (in milliseconds.) Pending
+ * migrations are whatever the source has that the ledger doesn't.
+ */
+static const char create_ledger_table[] =
+    "CREATE TABLE mmm_applied(\n"
+    "  migration VARCHAR(255) NOT NULL,\n"
+    "  checksum  VARCHAR(8)   NOT NULL,\n"
+    "  applied   INTEGER      NOT NULL,\n"
+    "  duration  INTEGER      NOT NULL,\n"
+    "  PRIMARY KEY(migration)\n" ");";
+
+static const char *get_ledger =
+    "SELECT migration, checksum FROM mmm_applied;";
+
+static const char *insert_ledger =
+    "INSERT INTO mmm_applied(migration, checksum, applied, "
+    "duration) VALUES (?, ?, ?, ?)";
+
+static const char *delete_ledger =
+    "DELETE FROM mmm_applied WHERE migration = ?";
+
+static const char *drop_ledger = "DROP TABLE mmm_applied;";
+
+/**
+ * Version 1 tables were keyed on the timestamp alone, which
+ * forced us to wait a second between states. Since the primary
+ * key can't be altered portably, the table is rebuilt with the
+ * new key. The old timestamps are unique and ascending, so they
+ * seed the sequence.
+ *
+ * They had no ledger either. It starts out empty, and is
+ * backfilled the first time pending migrations are computed.
+ */
+static const char *const upgrade_v1[] = {
+	"CREATE TABLE mmm_state_v2" STATE_COLUMNS ";",
+	"INSERT INTO mmm_state_v2(tstamp, usec, seq, version, revision, "
+	"previous) SELECT tstamp, 0, tstamp, 2, revision, previous "
+	"FROM mmm_state;",
+	"DROP TABLE mmm_state;",
+	"ALTER TABLE mmm_state_v2 RENAME TO mmm_state;",
+	create_ledger_table,
+	NULL
+};
+
+/**
+ * Upgrade steps, indexed by (version - 1). Each step leaves the
+ * table at the following version.
+ */
+static const char *const *const upgrades[STATE_VERSION - 1] = {
+	upgrade_v1
+};
+
+/**
+ * Prepared statements, which are prepared the first time they're
+ * needed, and finalized by state_uninit().
+ */
+enum stmt_id {
+	STMT_GET_STATE,
+	STMT_INSERT_STATE,
+	STMT_DELETE_STATE,
+	STMT_INSERT_LEDGER,
+	STMT_DELETE_LEDGER,
+	N_STMTS
+};
+
+static struct db_stmt *stmts[N_STMTS];
+
 /**
  * Structure representing a state record.
  */
 struct state {
 	time_t timestamp;
+	long usec;
+	long seq;
 	long version;
 	char revision[50];
 	char previous[50];
@@ -63,12 +163,104 @@ struct state {
 
 /**
  * State records.
+ *
+ * There's one extra record beyond N_STATES, since
+ * state_add_revision() shifts the loaded states down
+ * before adding a new one.
  */
 #define N_STATES 10
-static struct state states[N_STATES];
+static struct state states[N_STATES + 1];
 static size_t states_allocated = 0;
 static size_t states_loaded = 0;
 
+/**
+ * Structure representing a ledger entry.
+ */
+struct applied {
+	char *migration;
+	char checksum[9];
+};
+
+/**
+ * Ledger entries, sorted by migration name.
+ */
+static struct applied *ledger = NULL;
+static size_t ledger_size = 0;
+static size_t ledger_allocated = 0;
+static int ledger_loaded = 0;
+
+/**
+ * Free the in-memory ledger.
+ */
+static void ledger_free(void)
+{
+	while (ledger_size)
+		free(ledger[--ledger_size].migration);
+	free(ledger);
+	ledger = NULL;
+	ledger_allocated = 0;
+	ledger_loaded = 0;
+}
+
+/**
+ * Finalize any prepared statements.
+ */
+static void finalize_stmts(void)
+{
+	int i;
+
+	for (i = 0; i < N_STMTS; i++) {
+		db_finalize(stmts[i]);
+		stmts[i] = NULL;
+	}
+}
+
+/**
+ * Execute one of our prepared statements, preparing it first
+ * if need be.
+ *
+ * \param[in] id       Statement ID
+ * \param[in] params   Parameter values
+ * \param[in] callback Callback function, to be called per-row returned.
+ * \param[in] userdata Userdata to be passed to the callback.
+ * \return 0 on success, non-zero on error.
+ */
+static int execute(enum stmt_id id, const char *const *params,
+                   db_row_callback_t callback, void *userdata)
+{
+	const char *query = NULL;
+	int retval = 1;
+
+	if (stmts[id])
+		goto exec;
+
+	switch (id) {
+	case STMT_GET_STATE:
+		sbuf_reset(0);
+		if (sbuf_add_str(get_current_state, SBUF_TSPACE, 0) ||
+		    sbuf_add_unum(states_allocated, 0)) {
+			error("Unable to build SELECT query");
+			goto ret;
+		}
+		query = sbuf_get_buffer();
+	break;
+	case STMT_INSERT_STATE:  query = insert_state;  break;
+	case STMT_DELETE_STATE:  query = delete_state;  break;
+	case STMT_INSERT_LEDGER: query = insert_ledger; break;
+	case STMT_DELETE_LEDGER: query = delete_ledger; break;
+	default: goto ret;
+	}
+
+	if (!(stmts[id] = db_prepare(query)))
+		goto ret;
+
+exec:
+	retval = db_execute(stmts[id], params, callback, userdata);
+
+ret:
+	return retval;
+}
+
 /**
  * \param[in] n_states Number of states to keep.
  * \return 0 on success, 1 on error.
@@ -89,64 +281,119 @@ int state_init(size_t n_states)
  */
 void state_uninit(void)
 {
+	finalize_stmts();
+	ledger_free();
 	states_allocated = 0;
 	states_loaded = 0;
 	memset(&states, 0, sizeof(states));
 }
 
 /**
- * This callback expects one row containing the
- * current state.
+ * This callback expects one row per state, with the
+ * columns in the order get_current_state selects them.
+ * A row that doesn't fit is flagged in userdata.
  */
-static int get_state_cb(void *userdata, int n_cols,
-                        char **fields, char **column_names)
+static int get_state_cb(void *userdata, const struct db_row *row)
 {
-	int i, retval = 0;
+	int retval = 0;
 	size_t len;
 	struct state *state;
-	(void)userdata;
+	char **fields = row->fields;
 
 	/* Fill-in the next state */
-	if (states_loaded >= states_allocated) {
-		++retval;
+	if (states_loaded >= states_allocated || row->n_cols < 6) {
+		retval = *(int *)userdata = 1;
 		goto ret;
 	} else state = &states[states_loaded++];
 
-	for (i = 0; i < n_cols; i++) {
-		if (!fields[i]) continue;
+	if (fields[0]) state->timestamp = strtol(fields[0], NULL, 10);
+	if (fields[1]) state->usec      = strtol(fields[1], NULL, 10);
+	if (fields[2]) state->seq       = strtol(fields[2], NULL, 10);
+	if (fields[3]) state->version   = strtol(fields[3], NULL, 10);
 
-		if (!strcmp(column_names[i], "tstamp"))
-			state->timestamp = strtol(fields[i], NULL, 10);
+	if (fields[4] && (len = row->lengths[4]) < sizeof(state->revision)) {
+		memcpy(state->revision, fields[4], len);
+		state->revision[len] = '\0';
+	}
 
-		if (!strcmp(column_names[i], "version"))
-			state->version = strtol(fields[i], NULL, 10);
+	if (fields[5] && (len = row->lengths[5]) < sizeof(state->previous)) {
+		memcpy(state->previous, fields[5], len);
+		state->previous[len] = '\0';
+	}
 
-		if (!strcmp(column_names[i], "revision")) {
-			len = strlen(fields[i]) + 1;
-			if (len < sizeof(state->revision))
-				memcpy(state->revision, fields[i], len);
-		}
+ret:
+	return retval;
+}
+
+/**
+ * This callback expects one row containing the
+ * version of the state table.
+ */
+static int get_version_cb(void *userdata, const struct db_row *row)
+{
+	if (row->n_cols > 0 && row->fields[0])
+		*(long *)userdata = strtol(row->fields[0], NULL, 10);
+	return 0;
+}
 
-		if (!strcmp(column_names[i], "previous")) {
-			len = strlen(fields[i]) + 1;
-			if (len < sizeof(state->previous))
-				memcpy(state->previous, fields[i], len);
+/**
+ * Bring an older state table up to STATE_VERSION.
+ *
+ * \return 0 on success, non-zero on error.
+ */
+static int upgrade_table(void)
+{
+	long version = STATE_VERSION;
+	const char *const *q;
+	int retval = 0;
+
+	/* An empty table has nothing worth upgrading */
+	if (db_query(get_state_version, get_version_cb, &version))
+		goto err;
+
+	if (version >= STATE_VERSION)
+		goto ret;
+
+	if (version < 1) {
+		error("unknown state table version: %ld", version);
+		goto err;
+	}
+
+	if (db_query("BEGIN", NULL, NULL))
+		goto err;
+
+	for (; version < STATE_VERSION; version++) {
+		for (q = upgrades[version - 1]; *q; q++) {
+			if (db_query(*q, NULL, NULL))
+				goto rollback;
 		}
 	}
 
+	if (db_query("COMMIT", NULL, NULL))
+		goto rollback;
+
 ret:
 	return retval;
+
+rollback:
+	db_query("ROLLBACK", NULL, NULL);
+
+err:
+	error("Unable to upgrade the state table");
+	++retval;
+	goto ret;
 }
 
 /**
- * Create the state tracking table, assuming it
- * doesn't exist.
+ * Create the state tracking table and the ledger,
+ * assuming they don't exist.
  *
  * \return 0 on success, non-zero on error.
  */
 int state_create(void)
 {
-	return db_query(create_state_table, NULL, NULL);
+	return db_query(create_state_table, NULL, NULL) ||
+	       db_query(create_ledger_table, NULL, NULL);
 }
 
 /**
@@ -159,6 +406,7 @@ int state_create(void)
 const char *state_get_current(void)
 {
 	const char *retval = NULL;
+	int failed = 0;
 
 	if (states_loaded)
 		goto ret;
@@ -166,7 +414,10 @@ const char *state_get_current(void)
 	if (!states_allocated)
 		goto err;
 
-	if (db_query(get_current_state, get_state_cb, NULL))
+	if (upgrade_table())
+		goto err;
+
+	if (execute(STMT_GET_STATE, NULL, get_state_cb, &failed) || failed)
 		goto err;
 
 ret:
@@ -199,6 +450,8 @@ const char *state_get_previous(void)
  */
 int state_cleanup_table(void)
 {
+	char seq[24];
+	const char *params[1];
 	int retval = 0;
 
 	if (!states_loaded)
@@ -207,13 +460,9 @@ int state_cleanup_table(void)
 	if (states_loaded < states_allocated)
 		goto ret;
 
-	sbuf_reset(0);
-	if (sbuf_add_str(delete_state, SBUF_TSPACE, 0) ||
-	    sbuf_add_snum(states[states_allocated - 1].timestamp,
-	                  SBUF_SCOLON)) {
-		error("Unable to build DELETE query");
-		++retval;
-	} else retval = db_query(sbuf_get_buffer(), NULL, NULL);
+	sprintf(seq, "%ld", states[states_allocated - 1].seq);
+	params[0] = seq;
+	retval = execute(STMT_DELETE_STATE, params, NULL, NULL);
 
 ret:
 	return retval;
@@ -229,6 +478,9 @@ int state_add_revision(const char *rev)
 {
 	size_t i;
 	int retval = 0;
+	struct timeval tv;
+	char nums[4][24];
+	const char *params[6];
 
 	if (!rev) goto err;
 	i = strlen(rev);
@@ -253,39 +505,283 @@ int state_add_revision(const char *rev)
 	memmove(states[0].revision, rev, i + 1);
 	memcpy(states[0].previous, &states[1].revision,
 	       sizeof(states[0].revision));
-	states[0].timestamp = time(NULL);
+	gettimeofday(&tv, NULL);
+	states[0].timestamp = tv.tv_sec;
+	states[0].usec = (long)tv.tv_usec;
+	states[0].seq = states[1].seq + 1;
 	states[0].version = STATE_VERSION;
 
-	/* ... build our insert query ... */
-	sbuf_reset(0);
-	if (sbuf_add_str(insert_state, SBUF_TSPACE, 0)
-	    || sbuf_add_snum(states[0].timestamp,
-	                     SBUF_LPAREN | SBUF_COMMA)
-	    || sbuf_add_snum(states[0].version, SBUF_COMMA)
-	    || sbuf_add_str(states[0].revision,
-	                    SBUF_QUOTE | SBUF_COMMA, 0)
-	    || sbuf_add_str(states[0].previous,
-	                    SBUF_QUOTE | SBUF_RPAREN | SBUF_SCOLON, 0)) {
-		error("Unable to build insert query");
-		++retval;
-	} else {
-		/* and send it to the database. */
-		retval = db_query(sbuf_get_buffer(), NULL, NULL);
+	/* ... and send it to the database. */
+	sprintf(nums[0], "%ld", (long)states[0].timestamp);
+	sprintf(nums[1], "%ld", states[0].usec);
+	sprintf(nums[2], "%ld", states[0].seq);
+	sprintf(nums[3], "%ld", states[0].version);
+	params[0] = nums[0];
+	params[1] = nums[1];
+	params[2] = nums[2];
+	params[3] = nums[3];
+	params[4] = states[0].revision;
+	params[5] = states[0].previous;
+	return execute(STMT_INSERT_STATE, params, NULL, NULL);
+
+err:
+	return ++retval;
+}
+
+/**
+ * Find a migration in the ledger.
+ *
+ * \param[in]  migration Migration name
+ * \param[out] pos       Where the entry is, or would be inserted
+ * \return 1 if the entry was found, 0 otherwise.
+ */
+static int ledger_find(const char *migration, size_t *pos)
+{
+	size_t lo = 0, hi = ledger_size, mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1);
+		cmp = strcmp(ledger[mid].migration, migration);
+		if (!cmp) {
+			*pos = mid;
+			return 1;
+		}
+
+		if (cmp < 0) lo = mid + 1;
+		else hi = mid;
 	}
 
-	sleep(1);
-	return retval;
+	*pos = lo;
+	return 0;
+}
+
+/**
+ * Insert an entry into the in-memory ledger.
+ *
+ * \param[in] migration Migration name
+ * \param[in] sum       Checksum
+ * \param[in] append    If non-zero, append the entry rather than
+ *                      keeping the ledger sorted
+ * \return 0 on success, non-zero on error.
+ */
+static int ledger_insert(const char *migration, const char *sum,
+                         int append)
+{
+	size_t pos, len;
+	char *name;
+	struct applied *tmp;
+
+	if (append) pos = ledger_size;
+	else if (ledger_find(migration, &pos))
+		goto set_sum;
+
+	if (ledger_size == ledger_allocated) {
+		len = ledger_allocated ? ledger_allocated << 1 : 64;
+		if (!(tmp = realloc(ledger, len * sizeof(struct applied))))
+			goto err;
+		ledger = tmp;
+		ledger_allocated = len;
+	}
+
+	len = strlen(migration) + 1;
+	if (!(name = malloc(len)))
+		goto err;
+
+	memcpy(name, migration, len);
+	memmove(&ledger[pos + 1], &ledger[pos],
+	        (ledger_size - pos) * sizeof(struct applied));
+	ledger[pos].migration = name;
+	++ledger_size;
+
+set_sum:
+	memset(ledger[pos].checksum, 0, sizeof(ledger[pos].checksum));
+	strncpy(ledger[pos].checksum, sum ? sum : "",
+	        sizeof(ledger[pos].checksum) - 1);
+	return 0;
 
 err:
-	return ++retval;
+	error("Out of memory");
+	return 1;
+}
+
+/**
+ * Remove an entry from the in-memory ledger.
+ *
+ * \param[in] migration Migration name
+ */
+static void ledger_delete(const char *migration)
+{
+	size_t pos;
+
+	if (ledger_find(migration, &pos)) {
+		free(ledger[pos].migration);
+		memmove(&ledger[pos], &ledger[pos + 1],
+		        (ledger_size - pos - 1) * sizeof(struct applied));
+		--ledger_size;
+	}
+}
+
+/**
+ * Comparator for sorting the ledger.
+ */
+static int ledger_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct applied *)a)->migration,
+	              ((const struct applied *)b)->migration);
+}
+
+/**
+ * This callback receives one row per applied migration. The rows
+ * are appended, and the ledger sorted once they've all been read.
+ * Since stopping isn't an error, a failure is flagged in userdata.
+ */
+static int get_ledger_cb(void *userdata, const struct db_row *row)
+{
+	if (row->n_cols < 2 || !row->fields[0])
+		return 0;
+	return *(int *)userdata = ledger_insert(row->fields[0],
+	                                        row->fields[1], 1);
+}
+
+/**
+ * Make sure a migration name will fit in the ledger.
+ *
+ * \param[in] migration Migration name
+ * \return 0 if the name is usable, non-zero otherwise.
+ */
+static int check_migration_name(const char *migration)
+{
+	if (!migration || !*migration) goto err;
+
+	if (strlen(migration) > 255) {
+		error("invalid migration name: %s", migration);
+		goto err;
+	}
+
+	return 0;
+
+err:
+	return 1;
+}
+
+/**
+ * Load the ledger of applied migrations.
+ *
+ * \return 0 on success, non-zero on error.
+ */
+int state_ledger_load(void)
+{
+	int retval = 0, failed = 0;
+
+	if (ledger_loaded)
+		goto ret;
+
+	if ((retval = db_query(get_ledger, get_ledger_cb, &failed) ||
+	              failed)) {
+		ledger_free();
+		error("Unable to load the migration ledger");
+		goto ret;
+	}
+
+	if (ledger_size)
+		qsort(ledger, ledger_size, sizeof(struct applied), ledger_cmp);
+	ledger_loaded = 1;
+
+ret:
+	return retval;
+}
+
+/**
+ * Get the number of migrations recorded in the ledger.
+ *
+ * \return Number of ledger entries.
+ */
+size_t state_ledger_size(void)
+{
+	return ledger_size;
+}
+
+/**
+ * Look up a migration in the ledger.
+ *
+ * \param[in] migration Migration name
+ * \return The checksum recorded for the migration, or NULL if it
+ *         isn't in the ledger.
+ */
+const char *state_ledger_lookup(const char *migration)
+{
+	size_t pos;
+
+	if (!migration || !ledger_find(migration, &pos))
+		return NULL;
+	return ledger[pos].checksum;
 }
 
 /**
- * Drop the state table.
+ * Record an applied migration in the ledger.
+ *
+ * \param[in] migration Migration name
+ * \param[in] sum       Checksum of the migration
+ * \param[in] duration  Time taken to apply it (in milliseconds)
+ * \return 0 on success, non-zero on error.
+ */
+int state_ledger_add(const char *migration, const char *sum,
+                     unsigned long duration)
+{
+	char applied[24], elapsed[24];
+	const char *params[4];
+	int retval = 1;
+
+	if (check_migration_name(migration) || !sum)
+		goto ret;
+
+	sprintf(applied, "%ld", (long)time(NULL));
+	sprintf(elapsed, "%lu", duration);
+	params[0] = migration;
+	params[1] = sum;
+	params[2] = applied;
+	params[3] = elapsed;
+
+	if (!(retval = execute(STMT_INSERT_LEDGER, params, NULL, NULL)))
+		retval = ledger_insert(migration, sum, 0);
+
+ret:
+	return retval;
+}
+
+/**
+ * Remove a migration from the ledger.
+ *
+ * \param[in] migration Migration name
+ * \return 0 on success, non-zero on error.
+ */
+int state_ledger_remove(const char *migration)
+{
+	int retval = 1;
+
+	if (check_migration_name(migration))
+		goto ret;
+
+	if (!(retval = execute(STMT_DELETE_LEDGER, &migration, NULL, NULL)))
+		ledger_delete(migration);
+
+ret:
+	return retval;
+}
+
+/**
+ * Drop the state table, and the ledger.
  *
  * \return 0 on success, non-zero on error.
  */
 int state_destroy(void)
 {
-	return db_query(drop_state, NULL, NULL);
+	int retval;
+
+	/* Our statements won't survive the tables */
+	finalize_stmts();
+	retval  = db_query(drop_ledger, NULL, NULL);
+	retval |= db_query(drop_state, NULL, NULL);
+	return retval;
 }
@@ -24,8 +24,8 @@ int state_init(size_t n_states);
 void state_uninit(void);
 
 /**
- * Create the state tracking table, assuming it
- * doesn't exist.
+ * Create the state tracking table and the ledger,
+ * assuming they don't exist.
  *
  * \return 0 on success, non-zero on error.
  */
@@ -66,7 +66,49 @@ int state_cleanup_table(void);
 int state_add_revision(const char *rev);
 
 /**
- * Drop the state table.
+ * Load the ledger of applied migrations.
+ *
+ * \return 0 on success, non-zero on error.
+ */
+int state_ledger_load(void);
+
+/**
+ * Get the number of migrations recorded in the ledger.
+ *
+ * \return Number of ledger entries.
+ */
+size_t state_ledger_size(void);
+
+/**
+ * Look up a migration in the ledger.
+ *
+ * \param[in] migration Migration name
+ * \return The checksum recorded for the migration, or NULL if it
+ *         isn't in the ledger.
+ */
+const char *state_ledger_lookup(const char *migration);
+
+/**
+ * Record an applied migration in the ledger.
+ *
+ * \param[in] migration Migration name
+ * \param[in] sum       Checksum of the migration
+ * \param[in] duration  Time taken to apply it (in milliseconds)
+ * \return 0 on success, non-zero on error.
+ */
+int state_ledger_add(const char *migration, const char *sum,
+                     unsigned long duration);
+
+/**
+ * Remove a migration from the ledger.
+ *
+ * \param[in] migration Migration name
+ * \return 0 on success, non-zero on error.
+ */
+int state_ledger_remove(const char *migration);
+
+/**
+ * Drop the state table, and the ledger.
  *
  * \return 0 on success, non-zero on error.
  */
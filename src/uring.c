@@ -0,0 +1,461 @@
+/**
+ * Minimal Migration Manager - Batched File Reading
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+/**
+ * syscall() is an extension.
+ */
+#ifndef IN_TESTS
+#undef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/**
+ * io_uring is used where the kernel headers are new enough to have
+ * openat, statx, and close (5.6 and up,) and the compiler has the
+ * atomic builtins (GCC 4.7 and up, or clang.) Whether the kernel we
+ * run on has it is only known once we try.
+ */
+#if defined(HAVE_LINUX_IO_URING_H) && !defined(IN_TESTS) && \
+    !defined(NO_IO_URING) && (defined(__clang__) || \
+    (defined(__GNUC__) && (__GNUC__ > 4 || \
+     (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))))
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/stat.h>
+#include <linux/io_uring.h>
+
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+/**
+ * \def URING_ENTRIES
+ *
+ * Number of operations submitted at once.
+ */
+#ifndef URING_ENTRIES
+#define URING_ENTRIES 64
+#endif
+
+/* Most a single read will give us (on Linux) */
+#define READ_MAX 0x7ffff000UL
+
+/* Operations, kept in the low bits of the user data */
+#define OP_OPEN  0
+#define OP_STAT  1
+#define OP_READ  2
+#define OP_CLOSE 3
+#define OP_BITS  2
+#define OP_MASK  3
+
+#define LOAD(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/**
+ * A ring, as mapped from the kernel.
+ */
+struct ring {
+	int fd;                    /**< Ring */
+	unsigned *sq_tail;         /**< Submission queue tail */
+	unsigned *sq_mask;         /**< Submission queue mask */
+	unsigned *sq_array;        /**< Submission queue indices */
+	unsigned *cq_head;         /**< Completion queue head */
+	unsigned *cq_tail;         /**< Completion queue tail */
+	unsigned *cq_mask;         /**< Completion queue mask */
+	struct io_uring_sqe *sqes; /**< Submission queue entries */
+	struct io_uring_cqe *cqes; /**< Completion queue entries */
+	void *sq;                  /**< Submission queue mapping */
+	void *cq;                  /**< Completion queue mapping */
+	size_t sq_len;             /**< Length of the submission queue */
+	size_t cq_len;             /**< Length of the completion queue */
+	unsigned entries;          /**< Number of submission queue entries */
+	unsigned tail;             /**< Where the next entry goes */
+	unsigned queued;           /**< Entries not yet submitted */
+	unsigned inflight;         /**< Entries submitted, not completed */
+};
+
+/**
+ * A file being read.
+ */
+struct file {
+	int fd;          /**< File descriptor, or -1 */
+	int stat;        /**< Non-zero if it was stat'd */
+	int closed;      /**< Non-zero if it was closed */
+	struct statx st; /**< Its status */
+};
+
+/**
+ * A batch of files being read.
+ */
+struct batch {
+	struct ring r;            /**< Ring */
+	struct file *f;           /**< Files being read */
+	struct uring_file *files; /**< Where they were read to */
+	char *buf;                /**< Where they're read to */
+	int unsupported;          /**< The kernel can't open files */
+};
+
+/* Set once we know io_uring can't be used */
+static int unusable = 0;
+
+/**
+ * Set up a ring.
+ *
+ * \return 0 on success, non-zero on failure.
+ */
+static int ring_init(struct ring *r)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+	long fd;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->fd = -1;
+	r->sq = r->cq = MAP_FAILED;
+	if ((fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+		return 1;
+
+	r->fd      = (int)fd;
+	r->entries = p.sq_entries;
+	r->sq_len  = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len  = p.cq_off.cqes +
+	             p.cq_entries * sizeof(struct io_uring_cqe);
+
+	/* Both queues may be in one mapping */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+		r->cq_len = 0;
+	}
+
+	r->sq = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+	             r->fd, IORING_OFF_SQ_RING);
+	if (r->sq == MAP_FAILED)
+		return 1;
+
+	r->cq = r->sq;
+	if (r->cq_len) {
+		r->cq = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+		             MAP_SHARED, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq == MAP_FAILED)
+			return 1;
+	}
+
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	               PROT_READ | PROT_WRITE, MAP_SHARED, r->fd,
+	               IORING_OFF_SQES);
+	if ((void *)r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		return 1;
+	}
+
+	sq = r->sq;
+	cq = r->cq;
+	r->sq_tail  = (unsigned *)(void *)(sq + p.sq_off.tail);
+	r->sq_mask  = (unsigned *)(void *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(void *)(sq + p.sq_off.array);
+	r->cq_head  = (unsigned *)(void *)(cq + p.cq_off.head);
+	r->cq_tail  = (unsigned *)(void *)(cq + p.cq_off.tail);
+	r->cq_mask  = (unsigned *)(void *)(cq + p.cq_off.ring_mask);
+	r->cqes     = (struct io_uring_cqe *)(void *)(cq + p.cq_off.cqes);
+	r->tail     = *r->sq_tail;
+	return 0;
+}
+
+/**
+ * Tear down a ring.
+ */
+static void ring_free(struct ring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+	if (r->cq != MAP_FAILED && r->cq != r->sq)
+		munmap(r->cq, r->cq_len);
+	if (r->sq != MAP_FAILED)
+		munmap(r->sq, r->sq_len);
+	if (r->fd > -1)
+		close(r->fd);
+}
+
+/**
+ * Handle a completed operation.
+ *
+ * \param[in] b   Batch
+ * \param[in] ud  User data (file index and operation)
+ * \param[in] res Result
+ */
+static void complete(struct batch *b, __u64 ud, int res)
+{
+	size_t i = (size_t)(ud >> OP_BITS);
+
+	switch ((int)(ud & OP_MASK)) {
+	case OP_OPEN:
+		if (res >= 0) b->f[i].fd = res;
+		else if (res == -EINVAL) b->unsupported = 1;
+		break;
+	case OP_STAT:
+		b->f[i].stat = !res;
+		break;
+	case OP_READ:
+		/* A short read means the file changed under us */
+		b->files[i].ok = res >= 0 && (size_t)res == b->files[i].size;
+		if (b->files[i].ok)
+			b->buf[b->files[i].off + b->files[i].size] = '\0';
+		break;
+	case OP_CLOSE:
+		b->f[i].closed = !res;
+		break;
+	default: break;
+	}
+}
+
+/**
+ * Submit whatever's queued, and wait for all of it to complete.
+ *
+ * If this fails, the kernel may still be working on what it was
+ * given, so whatever it was given must be left alone.
+ *
+ * \param[in] b Batch
+ * \return 0 on success, non-zero on failure.
+ */
+static int flush(struct batch *b)
+{
+	struct ring *r = &b->r;
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	long n;
+
+	STORE(r->sq_tail, r->tail);
+	while (r->queued || r->inflight) {
+		n = syscall(__NR_io_uring_enter, r->fd, r->queued, 1,
+		            IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n < 0) {
+			if (errno != EINTR) return 1;
+		} else if (n > 0) {
+			r->queued   -= (unsigned)n;
+			r->inflight += (unsigned)n;
+		} else if (!r->inflight) return 1;
+
+		head = *r->cq_head;
+		while (head != LOAD(r->cq_tail)) {
+			cqe = &r->cqes[head & *r->cq_mask];
+			complete(b, cqe->user_data, cqe->res);
+			--r->inflight;
+			++head;
+		}
+
+		STORE(r->cq_head, head);
+	}
+
+	return 0;
+}
+
+
+/**
+ * Queue an operation on a file, making room for it (and any
+ * operations linked to it, which must be submitted together) by
+ * submitting what's already queued if needs be.
+ *
+ * \param[in] b    Batch
+ * \param[in] op   OP_*
+ * \param[in] i    Index of the file
+ * \param[in] fd   File descriptor (or AT_FDCWD)
+ * \param[in] room Number of entries needed
+ * \return The entry, to be filled in further, or NULL on failure.
+ */
+static struct io_uring_sqe *queue(struct batch *b, int op, size_t i,
+                                  int fd, unsigned room)
+{
+	static const __u8 opcodes[4] = {
+		IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+		IORING_OP_CLOSE
+	};
+
+	struct ring *r = &b->r;
+	struct io_uring_sqe *sqe;
+	unsigned slot;
+
+	if (r->queued + room > r->entries && flush(b))
+		return NULL;
+
+	slot = r->tail++ & *r->sq_mask;
+	sqe  = &r->sqes[slot];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode    = opcodes[op];
+	sqe->fd        = fd;
+	sqe->user_data = ((__u64)i << OP_BITS) | (__u64)op;
+	r->sq_array[slot] = slot;
+	++r->queued;
+	return sqe;
+}
+
+/**
+ * Open and stat each file.
+ *
+ * \return 0 on success, non-zero on failure.
+ */
+static int open_all(struct batch *b, char **paths, size_t n)
+{
+	struct io_uring_sqe *sqe;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (!(sqe = queue(b, OP_OPEN, i, AT_FDCWD, 2)))
+			return 1;
+		sqe->addr       = (__u64)(unsigned long)paths[i];
+		sqe->open_flags = O_RDONLY;
+
+		sqe = queue(b, OP_STAT, i, AT_FDCWD, 1);
+		sqe->addr = (__u64)(unsigned long)paths[i];
+		sqe->len  = STATX_TYPE | STATX_SIZE;
+		sqe->off  = (__u64)(unsigned long)&b->f[i].st;
+	}
+
+	return flush(b);
+}
+
+/**
+ * Lay the files which can be read out one after the other, and get
+ * a buffer for them.
+ *
+ * \return The buffer, or NULL if there isn't enough memory for it.
+ */
+static char *lay_out(struct batch *b, size_t n)
+{
+	struct file *f;
+	size_t i, len = 0;
+
+	for (i = 0; i < n; i++) {
+		f = &b->f[i];
+		if (f->fd < 0 || !f->stat || !S_ISREG(f->st.stx_mode) ||
+		    !f->st.stx_size || f->st.stx_size > READ_MAX)
+			continue;
+
+		b->files[i].off  = len;
+		b->files[i].size = (size_t)f->st.stx_size;
+		len += b->files[i].size + 1;
+	}
+
+	return malloc(len + 1);
+}
+
+/**
+ * Read each file that was laid out, and close every file that was
+ * opened. Each close waits for the read before it, and is cancelled
+ * if the read fails.
+ *
+ * \return 0 on success, non-zero on failure.
+ */
+static int read_all(struct batch *b, size_t n)
+{
+	struct io_uring_sqe *sqe;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (b->f[i].fd < 0) continue;
+		if (b->files[i].size) {
+			if (!(sqe = queue(b, OP_READ, i, b->f[i].fd, 2)))
+				return 1;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->addr  = (__u64)(unsigned long)
+			             (b->buf + b->files[i].off);
+			sqe->len   = (__u32)b->files[i].size;
+		}
+
+		if (!queue(b, OP_CLOSE, i, b->f[i].fd, 1))
+			return 1;
+	}
+
+	return flush(b);
+}
+#endif /* HAVE_IO_URING */
+
+/**
+ * Read a number of files into one buffer, with io_uring.
+ *
+ * \param[in]  paths Paths to the files
+ * \param[in]  n     Number of files
+ * \param[out] files Where each file was read to
+ * \return The buffer, to be freed by the caller, or NULL if io_uring
+ *         can't be used (in which case none of the files were read.)
+ */
+char *uring_read_files(char **paths, size_t n, struct uring_file *files)
+{
+#ifdef HAVE_IO_URING
+	struct batch b;
+	size_t i;
+
+	if (!paths || !files || !n || unusable)
+		return NULL;
+
+	memset(files, 0, n * sizeof(struct uring_file));
+	memset(&b, 0, sizeof(b));
+	b.files = files;
+	if (!(b.f = calloc(n, sizeof(struct file))))
+		return NULL;
+
+	for (i = 0; i < n; i++)
+		b.f[i].fd = -1;
+
+	/* Kernels before 5.1 (or which won't let us) don't have it */
+	if (ring_init(&b.r)) {
+		unusable = 1;
+		goto ret;
+	}
+
+	if (open_all(&b, paths, n))
+		goto fail;
+
+	/* Kernels before 5.6 can't open files with it */
+	if (b.unsupported) {
+		unusable = 1;
+		goto ret;
+	}
+
+	if ((b.buf = lay_out(&b, n)) && read_all(&b, n))
+		goto fail;
+
+ret:
+	for (i = 0; i < n; i++) {
+		if (b.f[i].fd > -1 && !b.f[i].closed)
+			close(b.f[i].fd);
+	}
+
+	ring_free(&b.r);
+	free(b.f);
+	if (!b.buf) memset(files, 0, n * sizeof(struct uring_file));
+	return b.buf;
+
+fail:
+	/**
+	 * The kernel may still be using the buffers (and descriptors)
+	 * it was given, so they're left to it. This shouldn't happen.
+	 */
+	unusable = 1;
+	ring_free(&b.r);
+	memset(files, 0, n * sizeof(struct uring_file));
+	return NULL;
+#else
+	(void)paths;
+	(void)n;
+	(void)files;
+	return NULL;
+#endif
+}
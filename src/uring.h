@@ -0,0 +1,40 @@
+/**
+ * \file uring.h
+ *
+ * Minimal Migration Manager - Batched File Reading
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+
+/**
+ * Where a file ended up, once read.
+ */
+struct uring_file {
+	size_t off;  /**< Offset of the file in the buffer */
+	size_t size; /**< Size of the file */
+	int ok;      /**< Non-zero if the file was read */
+};
+
+/**
+ * Read a number of files into one buffer, with io_uring.
+ *
+ * The files are opened, stat'd, read, and closed a batch at a time,
+ * rather than with a few system calls each. Each file is followed by
+ * a NUL. Files which couldn't be read, for whatever reason, are left
+ * for the caller to read some other way (which can say why.)
+ *
+ * \param[in]  paths Paths to the files
+ * \param[in]  n     Number of files
+ * \param[out] files Where each file was read to
+ * \return The buffer, to be freed by the caller, or NULL if io_uring
+ *         can't be used (in which case none of the files were read.)
+ */
+char *uring_read_files(char **paths, size_t n, struct uring_file *files);
+
+#endif /* URING_H */
@@ -12,6 +12,7 @@
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
+#include <sys/time.h>
 #include "utils.h"
 
 /**
@@ -34,81 +35,201 @@ void error(const char *fmt, ...)
 }
 
 /**
- * Comparitor for bubblesort().
+ * Extensions which migrations (and seeds) may have.
+ */
+static const struct sql_ext {
+	const char *ext; /**< Extension */
+	size_t len;      /**< Length of the extension */
+} sql_exts[] = {
+	{ ".sql", 4 },
+#ifdef HAVE_LIBZ
+	{ ".sql.gz", 7 },
+#endif
+#ifdef HAVE_LIBZSTD
+	{ ".sql.zst", 8 },
+#endif
+	{ NULL, 0 }
+};
+
+/**
+ * Get the length of an SQL file's extension.
+ *
+ * \param[in] name File name (or path)
+ * \param[in] len  Length of the name
+ * \return The length of the extension, or 0 if the name doesn't
+ *         have one.
+ */
+size_t sql_ext(const char *name, size_t len)
+{
+	const struct sql_ext *e;
+
+	for (e = sql_exts; name && e->ext; e++) {
+		if (len >= e->len && !memcmp(name + len - e->len, e->ext, e->len))
+			return e->len;
+	}
+
+	return 0;
+}
+
+/**
+ * Sort key for a migration name, parsed once up-front.
+ */
+struct sort_key {
+	unsigned long num; /**< Numerical designation */
+	const char *rest;  /**< What follows it, or NULL if there's none */
+	int bare;          /**< Non-zero if the rest is just the extension */
+	char *name;        /**< The name itself */
+};
+
+/**
+ * Parse a name into a sort key.
+ *
+ * A name which lacks a numeric designation, or whose designation
+ * doesn't convert to an unsigned long, is compared as a whole
+ * with strcoll().
+ */
+static void make_key(struct sort_key *k, char *name)
+{
+	char *end;
+
+	k->name = name;
+	k->rest = NULL;
+	k->bare = 0;
+	k->num  = 0;
+	if (!name) return;
+
+	errno  = 0;
+	k->num = strtoul(name, &end, 0);
+	if (!end || end == name || (k->num == ULONG_MAX && errno == ERANGE))
+		return;
+
+	k->rest = end;
+	k->bare = sql_ext(end, strlen(end)) == strlen(end);
+}
+
+/**
+ * Compare two sort keys.
+ *
+ * \param[in] a Key a
+ * \param[in] b Key b
+ * \return < 0 if a < b, 0 if a == b, > 0 if a > b.
  *
- * \param[in] a String a
- * \param[in] b String b
- * \return -1 if a < b, 0 if a == b, 1 if a > b.
+ * Names are ordered by their designations. If the designations are
+ * equal, a name which only has the designation and an extension comes
+ * first, and the remainders of the names break the tie.
+ */
+static int key_cmp(const struct sort_key *a, const struct sort_key *b)
+{
+	if (!a->rest || !b->rest)
+		return strcoll(a->name, b->name);
+
+	if (a->num != b->num)
+		return a->num < b->num ? -1 : 1;
+
+	if (!*a->rest || !*b->rest)
+		return 0;
+
+	if (a->bare != b->bare)
+		return a->bare ? -1 : 1;
+	return strcoll(a->rest + 1, b->rest + 1);
+}
+
+/**
+ * Comparator for qsort(), for when there's no memory for the keys.
+ */
+static int name_cmp(const void *a, const void *b)
+{
+	struct sort_key x, y;
+
+	make_key(&x, *(char *const *)a);
+	make_key(&y, *(char *const *)b);
+	return key_cmp(&x, &y);
+}
+
+/**
+ * Merge sort an array of keys.
  *
- * This function is designed to compare two strings
- * which begin with an unsigned numerical designation.
- * If the function lacks a numeric designation, or if
- * the initial portion of the string doesn't convert
- * to an unsigned long, this implementation will fall
- * back to using strcoll() as a comparitor.
+ * \param[in] k   Keys
+ * \param[in] tmp Scratch space for as many keys
+ * \param[in] n   Number of keys
  */
-static int bscmp(char *a, char *b)
+static void merge_sort(struct sort_key *k, struct sort_key *tmp, size_t n)
 {
-	unsigned long x, y;
-	char *end1, *end2;
-	int retval = 0;
-
-	/* Compare the numerical designations. */
-	errno = 0;
-	x = strtoul(a, &end1, 0);
-
-	/* If the conversion failed, fallback to strcoll(). */
-	if (!end1 || end1 == a || (x == ULONG_MAX && errno == ERANGE))
-		goto use_strcoll;
-
-	/* Convert b. */
-	errno = 0;
-	y = strtoul(b, &end2, 0);
-
-	/* Check again for falling back to strcoll(). */
-	if (!end2 || end2 == b || (y == ULONG_MAX && errno == ERANGE))
-		goto use_strcoll;
-
-	/**
-	 * If the designations are equal, and there's
-	 * more to our two strings (as there should be
-	 * in the cases where this is used) compare
-	 * the remainder of the string with strcoll(),
-	 * after positively biasing a name that only
-	 * has the designation and ".sql" towards the
-	 * beginning of the array.
-	 */
-	if (x == y && *end1 && *end2) {
-		if (strlen(end1) == 4 && !memcmp(end1, ".sql", 4) &&
-		    (strlen(end2) != 4 || memcmp(end2, ".sql", 4))) {
-			retval = -1;
-			goto ret;
+	struct sort_key t;
+	size_t i, j, m = n / 2, o;
+
+	/* Insertion sort is faster for small arrays */
+	if (n < 8) {
+		for (i = 1; i < n; i++) {
+			t = k[i];
+			for (j = i; j && key_cmp(&k[j - 1], &t) > 0; j--)
+				k[j] = k[j - 1];
+			k[j] = t;
 		}
+		return;
+	}
+
+	merge_sort(k, tmp, m);
+	merge_sort(k + m, tmp, n - m);
+	if (key_cmp(&k[m - 1], &k[m]) <= 0)
+		return;
+
+	/* Merge the halves, keeping equal keys in order */
+	for (i = 0, j = m, o = 0; i < m && j < n; o++)
+		tmp[o] = key_cmp(&k[j], &k[i]) < 0 ? k[j++] : k[i++];
+	while (i < m) tmp[o++] = k[i++];
+	memcpy(k, tmp, o * sizeof(struct sort_key));
+}
+
+/**
+ * Radix sort an array of keys by their designations, and then
+ * sort each run of equal designations by the rest of the names.
+ *
+ * \param[in] k   Keys
+ * \param[in] tmp Scratch space for as many keys
+ * \param[in] n   Number of keys
+ */
+static void radix_sort(struct sort_key *k, struct sort_key *tmp, size_t n)
+{
+	struct sort_key *src = k, *dst = tmp, *swap;
+	size_t count[256], i, j, sum, c;
+	unsigned int shift;
+
+	for (shift = 0; shift < sizeof(unsigned long) * CHAR_BIT;
+	     shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			++count[(src[i].num >> shift) & 0xff];
+
+		/* Skip bytes which are the same in every key */
+		if (count[(src[0].num >> shift) & 0xff] == n)
+			continue;
 
-		if (strlen(end2) == 4 && !memcmp(end2, ".sql", 4) &&
-		    (strlen(end1) != 4 || memcmp(end1, ".sql", 4))) {
-			retval = 1;
-			goto ret;
+		for (i = sum = 0; i < 256; i++) {
+			c = count[i];
+			count[i] = sum;
+			sum += c;
 		}
 
-		a = end1 + 1;
-		b = end2 + 1;
-		goto use_strcoll;
-	}
+		for (i = 0; i < n; i++)
+			dst[count[(src[i].num >> shift) & 0xff]++] = src[i];
 
-	/* Otherwise return -1, 0, or 1 */
-	retval = (x < y) ? -1 : (x == y) ? 0 : 1;
+		swap = src;
+		src  = dst;
+		dst  = swap;
+	}
 
-ret:
-	return retval;
+	if (src != k)
+		memcpy(k, src, n * sizeof(struct sort_key));
 
-use_strcoll:
-	retval = strcoll(a, b);
-	goto ret;
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && k[j].num == k[i].num; j++);
+		if (j - i > 1) merge_sort(k + i, tmp, j - i);
+	}
 }
 
 /**
- * Bubblesort an array of strings, assuming that each string
+ * Sort an array of strings, assuming that each string
  * begins with a numeric designation.
  *
  * \param[in] a    Array of strings
@@ -117,25 +238,80 @@ use_strcoll:
  * If the strings don't begin with a numeric designation, they
  * will be sorted via strcoll().
  *
- * This runs in O(n^2) worst case time and  O(n) best case time,
- * with O(1) space complexity.
+ * Each name is parsed once, and the keys sorted in O(n log n)
+ * time (or O(n) time via a radix sort, if every name has a
+ * designation), with O(n) space complexity.
+ */
+void sort_migrations(char *a[], size_t size)
+{
+	struct sort_key *keys;
+	size_t i, n_num = 0;
+
+	if (!a || size < 2) return;
+	if (!(keys = malloc(size * 2 * sizeof(struct sort_key)))) {
+		qsort(a, size, sizeof(char *), name_cmp);
+		return;
+	}
+
+	for (i = 0; i < size; i++) {
+		make_key(&keys[i], a[i]);
+		if (keys[i].rest) ++n_num;
+	}
+
+	if (n_num == size)
+		radix_sort(keys, keys + size, size);
+	else merge_sort(keys, keys + size, size);
+
+	for (i = 0; i < size; i++)
+		a[i] = keys[i].name;
+	free(keys);
+}
+
+/**
+ * Compute the CRC-32 (as used by zlib, PNG, etc.) of a buffer.
+ *
+ * \param[in] buf Buffer
+ * \param[in] len Length of the buffer
+ * \return The CRC-32 of the buffer.
  */
-void bubblesort(char *a[], size_t size)
+unsigned long checksum(const char *buf, size_t len)
 {
-	char *tmp;
-	size_t i = size - 1, j;
-
-	if (!a || size < 2) goto ret;
-	do {
-		for (j = i - 1; j < size - 1; j++) {
-			if (bscmp(a[j], a[j + 1]) > 0) {
-				tmp = a[j + 1];
-				a[j + 1] = a[j];
-				a[j] = tmp;
-			}
+	static unsigned long table[256];
+	unsigned long c, crc = 0xffffffffUL;
+	size_t i;
+	int k;
+
+	/* Build the table on first use */
+	if (!table[1]) {
+		for (i = 0; i < 256; i++) {
+			c = (unsigned long)i;
+			for (k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+			table[i] = c;
 		}
-	} while (--i);
+	}
+
+	for (i = 0; buf && i < len; i++) {
+		crc = table[(crc ^ (unsigned char)buf[i]) & 0xff] ^
+		      (crc >> 8);
+	}
+
+	return (crc ^ 0xffffffffUL) & 0xffffffffUL;
+}
+
+/**
+ * Get the current time in milliseconds.
+ *
+ * The value wraps around, so it's only meaningful for
+ * measuring (unsigned) differences.
+ *
+ * \return The current time in milliseconds.
+ */
+unsigned long now_ms(void)
+{
+	struct timeval tv;
 
-ret:
-	return;
+	gettimeofday(&tv, NULL);
+	return (unsigned long)tv.tv_sec * 1000UL +
+	       (unsigned long)tv.tv_usec / 1000UL;
 }
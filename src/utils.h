@@ -42,11 +42,19 @@ void error(const char *fmt, ...);
 /**
  * \def PRINT
  * \def PRINT_1
+ * \def PRINT_2
+ * \def PRINT_3
  *
  * Simple output printing macros.
  */
 #define PRINT(msg) do { printf((msg)); } while (0);
 #define PRINT_1(fmt, arg1) do { printf((fmt), (arg1)); } while (0);
+#define PRINT_2(fmt, arg1, arg2) do {\
+	printf((fmt), (arg1), (arg2));\
+} while (0);
+#define PRINT_3(fmt, arg1, arg2, arg3) do {\
+	printf((fmt), (arg1), (arg2), (arg3));\
+} while (0);
 #else /* IN_TESTS */
 /**
  * During testing, output should be written to the static buffer
@@ -56,21 +64,61 @@ void error(const char *fmt, ...);
 #define PRINT_1(fmt, arg1) do {\
 	sprintf(errbuf, (fmt), (arg1));\
 } while (0);
+#define PRINT_2(fmt, arg1, arg2) do {\
+	sprintf(errbuf, (fmt), (arg1), (arg2));\
+} while (0);
+#define PRINT_3(fmt, arg1, arg2, arg3) do {\
+	sprintf(errbuf, (fmt), (arg1), (arg2), (arg3));\
+} while (0);
 #endif /* IN_TESTS }}} */
 
 /**
- * Bubblesort an array of strings, assuming that each string
+ * Get the length of an SQL file's extension.
+ *
+ * SQL files end in ".sql", or in ".sql.gz" or ".sql.zst" where mmm
+ * was built with support for reading them.
+ *
+ * \param[in] name File name (or path)
+ * \param[in] len  Length of the name
+ * \return The length of the extension, or 0 if the name doesn't
+ *         have one.
+ */
+size_t sql_ext(const char *name, size_t len);
+
+/**
+ * Sort an array of strings, assuming that each string
  * begins with a numeric designation.
  *
  * \param[in] a    Array of strings
  * \param[in] size Number of elements in the array
  *
- * If the strings don't begin with a numeric designation, they
- * will be sorted via strcoll().
+ * Strings are ordered by their designations, with a string that
+ * only has the designation and an extension first among its equals,
+ * and the rest of the strings breaking any ties. If the strings
+ * don't begin with a numeric designation, they will be sorted via
+ * strcoll().
+ *
+ * This runs in O(n log n) time, with O(n) space complexity.
+ */
+void sort_migrations(char *a[], size_t size);
+
+/**
+ * Compute the CRC-32 (as used by zlib, PNG, etc.) of a buffer.
+ *
+ * \param[in] buf Buffer
+ * \param[in] len Length of the buffer
+ * \return The CRC-32 of the buffer.
+ */
+unsigned long checksum(const char *buf, size_t len);
+
+/**
+ * Get the current time in milliseconds.
+ *
+ * The value wraps around, so it's only meaningful for
+ * measuring (unsigned) differences.
  *
- * This runs in O(n^2) worst case time and  O(n) best case time,
- * with O(1) space complexity.
+ * \return The current time in milliseconds.
  */
-void bubblesort(char *a[], size_t size);
+unsigned long now_ms(void);
 
 #endif /* UTILS_H */
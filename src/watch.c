@@ -0,0 +1,323 @@
+/**
+ * Minimal Migration Manager - Watching for Changes
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#ifndef IN_TESTS
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+#endif
+
+#include "utils.h"
+#include "watch.h"
+
+/**
+ * Time to wait for a burst of changes to settle (in milliseconds.)
+ */
+#define WATCH_SETTLE_MS 250
+
+/**
+ * Interval between checks, where we have to poll (in seconds.)
+ */
+#define WATCH_POLL_SECS 1
+
+/**
+ * Most paths watched at once.
+ */
+#define WATCH_MAX_PATHS 8
+
+/**
+ * Events which could mean that a migration was added, removed,
+ * or renamed.
+ */
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | \
+                      IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/**
+ * Events which mean that the watched directory is gone.
+ */
+#define WATCH_GONE (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)
+
+static volatile sig_atomic_t interrupted = 0;
+
+/**
+ * A path being watched.
+ */
+struct watched {
+	char *path;   /**< Path */
+	int wd;       /**< inotify watch descriptor */
+	time_t mtime; /**< Modification time (when polling) */
+};
+
+static struct watch {
+	struct watched paths[WATCH_MAX_PATHS]; /**< The first is required */
+	size_t n;                  /**< Number of paths being watched */
+	int fd;                    /**< inotify descriptor */
+	void (*old_int)(int);      /**< Previous SIGINT handler */
+	void (*old_term)(int);     /**< Previous SIGTERM handler */
+} w;
+
+/**
+ * Note that we've been asked to stop.
+ */
+static void on_signal(int sig)
+{
+	(void)sig;
+	interrupted = 1;
+}
+
+/**
+ * Start watching a path, unless it's already being watched.
+ *
+ * \param[in] path Path to watch.
+ * \return 0 on success, non-zero on failure.
+ */
+static int add_path(const char *path)
+{
+	struct watched *p = &w.paths[w.n];
+#ifndef __linux__
+	struct stat st;
+#endif
+	size_t i, len = strlen(path) + 1;
+
+	for (i = 0; i < w.n; i++)
+		if (!strcmp(w.paths[i].path, path)) return 0;
+
+	errno = 0;
+	if (w.n == WATCH_MAX_PATHS) {
+		errno = ENOSPC;
+		return 1;
+	}
+
+	if (!(p->path = malloc(len))) {
+		errno = ENOMEM;
+		return 1;
+	}
+
+#ifdef __linux__
+	if ((p->wd = inotify_add_watch(w.fd, path, WATCH_EVENTS)) < 0) {
+		free(p->path);
+		return 1;
+	}
+#else
+	if (stat(path, &st)) {
+		free(p->path);
+		return 1;
+	}
+
+	p->mtime = st.st_mtime;
+#endif
+
+	memcpy(p->path, path, len);
+	++w.n;
+	return 0;
+}
+
+/**
+ * Stop watching a path which went away.
+ *
+ * Only the first path has to stay; any others are dropped.
+ *
+ * \param[in] i Index of the path.
+ * \return 0 on success, or -1 if it was the first path.
+ */
+static int drop_path(size_t i)
+{
+	if (!i) {
+		error("watch: '%s' went away", w.paths[0].path);
+		return -1;
+	}
+
+	free(w.paths[i].path);
+	w.paths[i] = w.paths[--w.n];
+	return 0;
+}
+
+#ifdef __linux__
+/**
+ * Read a batch of inotify events.
+ *
+ * \return 1 if anything changed, 0 if not, or -1 on error.
+ */
+static int read_events(void)
+{
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	const struct inotify_event *ev;
+	size_t off, i;
+	ssize_t n;
+	int retval = 0;
+
+	errno = 0;
+	if ((n = read(w.fd, u.buf, sizeof(u.buf))) < 0) {
+		if (errno == EINTR) return 0;
+		error("watch: unable to read events: %s", strerror(errno));
+		return -1;
+	}
+
+	for (off = 0; off + sizeof(*ev) <= (size_t)n;
+	     off += sizeof(*ev) + ev->len) {
+		ev = (const struct inotify_event *)(void *)(u.buf + off);
+		for (i = 0; (ev->mask & WATCH_GONE) && i < w.n; i++) {
+			if (w.paths[i].wd != ev->wd) continue;
+			if (drop_path(i)) return -1;
+			break;
+		}
+
+		retval = 1;
+	}
+
+	return retval;
+}
+
+/**
+ * Wait for inotify to tell us something changed, and then until
+ * nothing has for WATCH_SETTLE_MS.
+ */
+static int wait_changes(void)
+{
+	struct pollfd pfd;
+	int timeout = -1, changed = 0, r;
+
+	pfd.fd     = w.fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		pfd.revents = 0;
+		errno = 0;
+		r = poll(&pfd, 1, timeout);
+		if (interrupted) return 0;
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			error("watch: %s", strerror(errno));
+			return -1;
+		}
+
+		if (!r) return changed;
+		if ((r = read_events()) < 0) return -1;
+		if (r) {
+			changed = 1;
+			timeout = WATCH_SETTLE_MS;
+		}
+	}
+}
+#else
+/**
+ * Without inotify, we check each directory's modification time
+ * every WATCH_POLL_SECS.
+ */
+static int wait_changes(void)
+{
+	struct stat st;
+	size_t i;
+	int changed = 0;
+
+	while (!changed) {
+		sleep(WATCH_POLL_SECS);
+		if (interrupted) return 0;
+		for (i = w.n; i-- > 0;) {
+			if (stat(w.paths[i].path, &st)) {
+				if (drop_path(i)) return -1;
+				changed = 1;
+			} else if (st.st_mtime != w.paths[i].mtime) {
+				w.paths[i].mtime = st.st_mtime;
+				changed = 1;
+			}
+		}
+	}
+
+	return 1;
+}
+#endif
+
+/**
+ * Start watching directories for changes.
+ *
+ * \param[in] paths NULL-terminated list of paths to watch.
+ * \return 0 on success, non-zero on failure.
+ */
+int watch_start(const char *const *paths)
+{
+	if (!paths || !*paths || w.n) return 1;
+
+	errno = 0;
+#ifdef __linux__
+	if ((w.fd = inotify_init()) < 0 || add_path(*paths)) {
+		error("watch: unable to watch '%s': %s", *paths,
+		      strerror(errno));
+		if (w.fd > -1) close(w.fd);
+		w.fd = -1;
+		return 1;
+	}
+#else
+	if (add_path(*paths)) {
+		error("watch: unable to watch '%s': %s", *paths,
+		      strerror(errno));
+		return 1;
+	}
+#endif
+
+	watch_add(paths + 1);
+	interrupted = 0;
+	w.old_int   = signal(SIGINT, on_signal);
+	w.old_term  = signal(SIGTERM, on_signal);
+	return 0;
+}
+
+/**
+ * Watch any of the given paths which aren't already being watched.
+ *
+ * \param[in] paths NULL-terminated list of paths to watch.
+ */
+void watch_add(const char *const *paths)
+{
+	if (!paths || !w.n) return;
+	while (*paths)
+		add_path(*paths++);
+}
+
+/**
+ * Wait for something in the watched directories to change.
+ *
+ * \return 1 if something changed, 0 if we were interrupted, or
+ *         -1 on error.
+ */
+int watch_wait(void)
+{
+	if (!w.n) return -1;
+	if (interrupted) return 0;
+	return wait_changes();
+}
+
+/**
+ * Stop watching, and restore the signal handlers.
+ */
+void watch_stop(void)
+{
+	if (!w.n) return;
+
+#ifdef __linux__
+	close(w.fd);
+	w.fd = -1;
+#endif
+
+	while (w.n)
+		free(w.paths[--w.n].path);
+
+	if (w.old_int != SIG_ERR) signal(SIGINT, w.old_int);
+	if (w.old_term != SIG_ERR) signal(SIGTERM, w.old_term);
+}
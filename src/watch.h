@@ -0,0 +1,53 @@
+/**
+ * \file watch.h
+ *
+ * Minimal Migration Manager - Watching for Changes
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+#ifndef WATCH_H
+#define WATCH_H
+
+/**
+ * Start watching directories for changes.
+ *
+ * The first path must be watchable. The rest are watched if they
+ * can be, and are dropped if they go away later (e.g. a directory
+ * of refs which was removed.)
+ *
+ * SIGINT and SIGTERM are caught until watch_stop() is called, so
+ * that whatever's running when one arrives can finish, and the next
+ * watch_wait() will return 0.
+ *
+ * \param[in] paths NULL-terminated list of paths to watch.
+ * \return 0 on success, non-zero on failure.
+ */
+int watch_start(const char *const *paths);
+
+/**
+ * Watch any of the given paths which aren't already being watched,
+ * if they can be.
+ *
+ * \param[in] paths NULL-terminated list of paths to watch.
+ */
+void watch_add(const char *const *paths);
+
+/**
+ * Wait for something in the watched directories to change.
+ *
+ * Changes tend to come in bursts (e.g. copying in a few migrations),
+ * so this only returns once things have settled down.
+ *
+ * \return 1 if something changed, 0 if we were interrupted, or
+ *         -1 on error.
+ */
+int watch_wait(void);
+
+/**
+ * Stop watching, and restore the signal handlers.
+ */
+void watch_stop(void);
+
+#endif /* WATCH_H */
@@ -16,14 +16,17 @@
 extern char errbuf[];
 
 /* {{{ stubs */
-typedef int (*db_row_callback_t)(void *userdata, int n_cols,
-                                 char **fields, char **column_names);
+struct db_row;
+typedef int (*db_row_callback_t)(void *userdata, const struct db_row *row);
 
-static char *map_file(const char *path, size_t *size);
-static void unmap_file(char *mem, size_t size);
+static int seed_load(const char *path);
 static int db_query(const char *query, db_row_callback_t cb,
                     void *userdata);
 static int db_has_transactional_ddl(void);
+static void db_pipeline_begin(void);
+static int db_pipeline_end(void);
+static int db_pipeline_sync(void);
+static int db_pipeline_label(const char *label);
 static int state_create(void);
 static const char *state_get_current(void);
 static const char *state_get_previous(void);
@@ -37,20 +40,58 @@ static char **source_find_migrations(const char *source,
 static const char *source_get_local_head(const char *source);
 static const char *source_get_file_revision(const char *source,
                                             const char *file);
-static const char *source_get_migration_path(const char *source);
-static int migration_upgrade(const char *path);
-static int migration_downgrade(const char *path);
-
-#define FILE_H
+static char *source_load_migration(const char *source, const char *file,
+                                   size_t *size);
+static void source_unload_migration(const char *source, char *mem,
+                                    size_t size);
+static const char *const *source_get_watch_paths(const char *source);
+static int source_get_scan_stats(const char *source,
+                                 unsigned long *scanned,
+                                 unsigned long *skipped);
+static int watch_start(const char *const *paths);
+static void watch_add(const char *const *paths);
+static int watch_wait(void);
+static void watch_stop(void);
+struct migration_section {
+	size_t off;
+	size_t len;
+};
+
+struct migration {
+	const char *name;
+	char *mem;
+	size_t size;
+	struct migration_section up, down;
+};
+
+static void migration_parse(struct migration *m, char *mem, size_t size);
+static int migration_upgrade(const struct migration *m);
+static int migration_downgrade(const struct migration *m);
+static int migration_checksum(const char *mem, size_t size, char *sum);
+static int prefetch_start(const char *source, char **migrations, size_t n);
+static const struct migration *prefetch_get(size_t i);
+static void prefetch_release(size_t i);
+static void prefetch_stop(void);
+static char *my_strdup(const char *s);
+static int state_ledger_load(void);
+static size_t state_ledger_size(void);
+static const char *state_ledger_lookup(const char *migration);
+static int state_ledger_add(const char *migration, const char *sum,
+                            unsigned long duration);
+static int state_ledger_remove(const char *migration);
+
+#define MIGRATION_CHECKSUM_LEN 9
+#define SEED_H
 #define CONFIG_H
 #define DB_H
 #define SOURCE_H
 #define STATE_H
 #define MIGRATION_H
+#define PREFETCH_H
+#define WATCH_H
 #include "../src/commands.c"
 
-static size_t map_file_returns_size = 0;
-static char *map_file_returns = NULL;
+static int seed_load_returns = 0;
 static int db_query_returns = 0;
 static int db_has_transactional_ddl_returns = 0;
 static int state_create_returns = 0;
@@ -61,13 +102,24 @@ static int state_add_revision_returns = 0;
 static int state_destroy_returns = 0;
 static char **source_find_migrations_returns = NULL;
 static size_t source_find_migrations_returns_size = 0;
+static char **source_find_migrations_range = NULL;
+static size_t source_find_migrations_range_size = 0;
+static const char *source_find_migrations_cur_rev = NULL;
 static char *source_get_local_head_returns = NULL;
-static char *source_get_migration_path_returns = NULL;
+static char *source_load_migration_returns = NULL;
+static const char *const *source_get_watch_paths_returns = NULL;
+static int source_get_scan_stats_called = 0;
+static int watch_start_returns = 0;
+static const int *watch_wait_returns = NULL;
 static int migration_upgrade_returns = 0;
 static int migration_downgrade_returns = 0;
+static int migration_checksum_returns = 0;
+static int state_ledger_load_returns = 0;
+static size_t state_ledger_size_returns = 1;
+static const char *state_ledger_applied[4];
+static int state_ledger_add_returns = 0;
 
-static int map_file_called = 0;
-static int unmap_file_called = 0;
+static int seed_load_called = 0;
 static int db_query_called = 0;
 static int db_has_transactional_ddl_called = 0;
 static int state_create_called = 0;
@@ -78,18 +130,28 @@ static int state_add_revision_called = 0;
 static int state_destroy_called = 0;
 static int source_find_migrations_called = 0;
 static int source_get_local_head_called = 0;
-static int source_get_migration_path_called = 0;
+static int source_load_migration_called = 0;
+static int source_unload_migration_called = 0;
+static int watch_add_called = 0;
+static int watch_wait_called = 0;
+static int watch_stop_called = 0;
 static int migration_upgrade_called = 0;
 static int migration_downgrade_called = 0;
+static int state_ledger_add_called = 0;
+static int state_ledger_remove_called = 0;
 
 static int db_query_begin_fails = 0;
 static int db_query_commit_fails = 0;
 static int db_query_rollback_fails = 0;
+static int db_pipelined = 0;
+static int db_pipeline_fails = 0;
+static int db_pipeline_sync_fails_at = 0;
+static int db_pipeline_synced = 0;
+static char db_pipeline_labelled[64];
 
 static void reset_stubs(void)
 {
-	map_file_returns_size = 0;
-	map_file_returns = NULL;
+	seed_load_returns = 0;
 	db_query_returns = 0;
 	db_has_transactional_ddl_returns = 0;
 	state_create_returns = 0;
@@ -100,13 +162,24 @@ static void reset_stubs(void)
 	state_destroy_returns = 0;
 	source_find_migrations_returns = NULL;
 	source_find_migrations_returns_size = 0;
+	source_find_migrations_range = NULL;
+	source_find_migrations_range_size = 0;
+	source_find_migrations_cur_rev = NULL;
 	source_get_local_head_returns = NULL;
-	source_get_migration_path_returns = NULL;
+	source_load_migration_returns = NULL;
+	source_get_watch_paths_returns = NULL;
+	source_get_scan_stats_called = 0;
+	watch_start_returns = 0;
+	watch_wait_returns = NULL;
 	migration_upgrade_returns = 0;
 	migration_downgrade_returns = 0;
+	migration_checksum_returns = 0;
+	state_ledger_load_returns = 0;
+	state_ledger_size_returns = 1;
+	memset(state_ledger_applied, 0, sizeof(state_ledger_applied));
+	state_ledger_add_returns = 0;
 
-	map_file_called = 0;
-	unmap_file_called = 0;
+	seed_load_called = 0;
 	db_query_called = 0;
 	db_has_transactional_ddl_called = 0;
 	state_create_called = 0;
@@ -117,29 +190,31 @@ static void reset_stubs(void)
 	state_destroy_called = 0;
 	source_find_migrations_called = 0;
 	source_get_local_head_called = 0;
-	source_get_migration_path_called = 0;
+	source_load_migration_called = 0;
+	source_unload_migration_called = 0;
+	watch_add_called = 0;
+	watch_wait_called = 0;
+	watch_stop_called = 0;
 	migration_upgrade_called = 0;
 	migration_downgrade_called = 0;
+	state_ledger_add_called = 0;
+	state_ledger_remove_called = 0;
 
 	db_query_begin_fails = 0;
 	db_query_commit_fails = 0;
 	db_query_rollback_fails = 0;
+	db_pipelined = 0;
+	db_pipeline_fails = 0;
+	db_pipeline_sync_fails_at = 0;
+	db_pipeline_synced = 0;
+	*db_pipeline_labelled = '\0';
 }
 
-static char *map_file(const char *path, size_t *size)
+static int seed_load(const char *path)
 {
 	(void)path;
-	++map_file_called;
-	*size = map_file_returns_size;
-	return map_file_returns;
-}
-
-static void unmap_file(char *mem, size_t size)
-{
-	(void)mem;
-	(void)size;
-	++unmap_file_called;
-	return;
+	++seed_load_called;
+	return seed_load_returns;
 }
 
 static int db_has_transactional_ddl(void)
@@ -148,6 +223,35 @@ static int db_has_transactional_ddl(void)
 	return db_has_transactional_ddl_returns;
 }
 
+static void db_pipeline_begin(void)
+{
+	db_pipelined = 1;
+}
+
+static int db_pipeline_end(void)
+{
+	int retval = db_pipelined && db_pipeline_fails;
+
+	db_pipelined = 0;
+	return retval;
+}
+
+/**
+ * Each sync is counted, and the given one fails.
+ */
+static int db_pipeline_sync(void)
+{
+	if (!db_pipelined) return 0;
+	return ++db_pipeline_synced == db_pipeline_sync_fails_at;
+}
+
+static int db_pipeline_label(const char *label)
+{
+	*db_pipeline_labelled = '\0';
+	if (label) strncat(db_pipeline_labelled, label, 63);
+	return db_pipelined;
+}
+
 static int db_query(const char *query, db_row_callback_t cb,
                     void *userdata)
 {
@@ -205,17 +309,36 @@ static int state_destroy(void)
 	return state_destroy_returns;
 }
 
+/**
+ * Since the caller takes ownership of the list, and it may be
+ * asked for more than once, hand out a copy each time. If a range
+ * is set, it's returned when a current revision is given.
+ */
 static char **source_find_migrations(const char *source,
                                      const char *cur_rev,
                                      const char *prev_rev,
                                      size_t *size)
 {
+	size_t i, n = source_find_migrations_returns_size;
+	char **migs = NULL, **src = source_find_migrations_returns;
 	(void)source;
-	(void)cur_rev;
 	(void)prev_rev;
 	++source_find_migrations_called;
-	if (size) *size = source_find_migrations_returns_size;
-	return source_find_migrations_returns;
+	source_find_migrations_cur_rev = cur_rev;
+
+	if (cur_rev && source_find_migrations_range) {
+		src = source_find_migrations_range;
+		n = source_find_migrations_range_size;
+	}
+
+	if (size) *size = n;
+	if (src) {
+		migs = malloc(n * sizeof(char *));
+		for (i = 0; i < n; i++)
+			migs[i] = my_strdup(src[i]);
+	}
+
+	return migs;
 }
 
 static const char *source_get_file_revision(const char *source,
@@ -233,16 +356,80 @@ static const char *source_get_local_head(const char *source)
 	return source_get_local_head_returns;
 }
 
-static const char *source_get_migration_path(const char *source)
+static char *source_load_migration(const char *source, const char *file,
+                                   size_t *size)
 {
 	(void)source;
-	++source_get_migration_path_called;
-	return source_get_migration_path_returns;
+	(void)file;
+	++source_load_migration_called;
+	*size = 0;
+	if (source_load_migration_returns)
+		*size = strlen(source_load_migration_returns);
+	return source_load_migration_returns;
 }
 
-static int migration_upgrade(const char *path)
+static void source_unload_migration(const char *source, char *mem,
+                                    size_t size)
 {
-	(void)path;
+	(void)source;
+	(void)mem;
+	(void)size;
+	++source_unload_migration_called;
+}
+
+static const char *const *source_get_watch_paths(const char *source)
+{
+	(void)source;
+	return source_get_watch_paths_returns;
+}
+
+static int source_get_scan_stats(const char *source,
+                                 unsigned long *scanned,
+                                 unsigned long *skipped)
+{
+	(void)source;
+	++source_get_scan_stats_called;
+	*scanned = 5;
+	*skipped = 2;
+	return 0;
+}
+
+static int watch_start(const char *const *paths)
+{
+	(void)paths;
+	return watch_start_returns;
+}
+
+static void watch_add(const char *const *paths)
+{
+	(void)paths;
+	++watch_add_called;
+}
+
+/**
+ * Each call returns the next value in the list, which should
+ * end with something other than 1.
+ */
+static int watch_wait(void)
+{
+	return watch_wait_returns[watch_wait_called++];
+}
+
+static void watch_stop(void)
+{
+	++watch_stop_called;
+}
+
+static void migration_parse(struct migration *m, char *mem, size_t size)
+{
+	memset(m, 0, sizeof(*m));
+	m->mem  = mem;
+	m->size = size;
+}
+
+static int migration_upgrade(const struct migration *m)
+{
+	(void)m;
 	++migration_upgrade_called;
 	if (migration_upgrade_returns > 1) {
 		--migration_upgrade_returns;
@@ -252,9 +439,9 @@ static int migration_upgrade(const char *path)
 	return migration_upgrade_returns;
 }
 
-static int migration_downgrade(const char *path)
+static int migration_downgrade(const struct migration *m)
 {
-	(void)path;
+	(void)m;
 	++migration_downgrade_called;
 	if (migration_downgrade_returns > 1) {
 		--migration_downgrade_returns;
@@ -264,6 +451,108 @@ static int migration_downgrade(const char *path)
 	return migration_downgrade_returns;
 }
 
+static int migration_checksum(const char *mem, size_t size, char *sum)
+{
+	(void)mem;
+	(void)size;
+	memcpy(sum, "01234567", MIGRATION_CHECKSUM_LEN);
+	return migration_checksum_returns;
+}
+
+/**
+ * Prefetch stubs, which load each migration when it's asked for.
+ */
+static struct {
+	const char *source;
+	char **names;
+	struct migration *m;
+	size_t n;
+} prefetched;
+
+static int prefetch_start(const char *source, char **migrations, size_t n)
+{
+	prefetched.source = source;
+	prefetched.names  = migrations;
+	prefetched.n      = n;
+	prefetched.m      = calloc(n, sizeof(struct migration));
+	ck_assert(prefetched.m != NULL);
+	return 0;
+}
+
+static const struct migration *prefetch_get(size_t i)
+{
+	char *mem;
+	size_t size;
+
+	ck_assert_uint_lt(i, prefetched.n);
+	if (!prefetched.m[i].mem) {
+		mem = source_load_migration(prefetched.source,
+		                            prefetched.names[i], &size);
+		if (!mem) return NULL;
+		migration_parse(&prefetched.m[i], mem, size);
+	}
+
+	return &prefetched.m[i];
+}
+
+static void prefetch_release(size_t i)
+{
+	if (prefetched.m[i].mem)
+		source_unload_migration(prefetched.source,
+		                        prefetched.m[i].mem,
+		                        prefetched.m[i].size);
+	memset(&prefetched.m[i], 0, sizeof(struct migration));
+}
+
+static void prefetch_stop(void)
+{
+	size_t i;
+
+	for (i = 0; prefetched.m && i < prefetched.n; i++)
+		prefetch_release(i);
+	free(prefetched.m);
+	memset(&prefetched, 0, sizeof(prefetched));
+}
+
+static int state_ledger_load(void)
+{
+	return state_ledger_load_returns;
+}
+
+static size_t state_ledger_size(void)
+{
+	return state_ledger_size_returns;
+}
+
+static const char *state_ledger_lookup(const char *migration)
+{
+	size_t i;
+
+	for (i = 0; i < 4 && state_ledger_applied[i]; i++) {
+		if (!strcmp(state_ledger_applied[i], migration))
+			return "01234567";
+	}
+
+	return NULL;
+}
+
+static int state_ledger_add(const char *migration, const char *sum,
+                            unsigned long duration)
+{
+	(void)migration;
+	(void)sum;
+	(void)duration;
+	++state_ledger_add_called;
+	return state_ledger_add_returns;
+}
+
+static int state_ledger_remove(const char *migration)
+{
+	(void)migration;
+	++state_ledger_remove_called;
+	return 0;
+}
+
 /**
  * A simple strdup(3) clone.
  *
@@ -283,7 +572,6 @@ static char *my_strdup(const char *s)
 }
 
 static char xxx[]         = "xxx";
-static char query[]       = "query";
 static char xtest[]       = "test";
 static char xseed[]       = "seed";
 static char xhead[]       = "head";
@@ -292,8 +580,12 @@ static char xmigrate[]    = "migrate";
 static char xpending[]    = "pending";
 static char xrollback[]   = "rollback";
 static char xassimilate[] = "assimilate";
+static char xwatch[]      = "watch";
 static char xtest_sql[]   = "test.sql";
+static char xtest2_sql[]  = "test2.sql";
+static char xtest3_sql[]  = "test3.sql";
 static char xtmp[]        = "/tmp";
+static const char *xwatch_paths[2] = { xtmp, NULL };
 
 /* }}} */
 
@@ -411,30 +703,16 @@ END_TEST
 
 /**
  * Test that the seed command returns EXIT_FAILURE if
- * the specifiied file cannot be mapped.
+ * loading the seed file fails.
  */
-START_TEST(seed_cant_map_file)
+START_TEST(seed_load_fails)
 {
 	char *argv[2] = { xseed, xtest_sql };
 
-	map_file_returns = NULL;
-	map_file_returns_size = 0;
-	ck_assert_int_eq(run_command("seed", 2, argv), EXIT_FAILURE);
-}
-END_TEST
-
-/**
- * Test that the seed command returns EXIT_FAILURE if
- * running the seed file fails.
- */
-START_TEST(seed_query_fails)
-{
-	char *argv[2] = { xseed, xtest_sql };
-
-	map_file_returns = query;
-	map_file_returns_size = 1;
-	db_query_returns = 1;
+	seed_load_returns = 1;
 	ck_assert_int_eq(run_command("seed", 2, argv), EXIT_FAILURE);
+	ck_assert_int_eq(seed_load_called, 1);
+	ck_assert_int_eq(state_create_called, 0);
 }
 END_TEST
 
@@ -446,9 +724,7 @@ START_TEST(seed_creating_state_fails)
 {
 	char *argv[2] = { xseed, xtest_sql };
 
-	map_file_returns = query;
-	map_file_returns_size = 1;
-	db_query_returns = 0;
+	seed_load_returns = 0;
 	state_create_returns = 1;
 	ck_assert_int_eq(run_command("seed", 2, argv), EXIT_FAILURE);
 }
@@ -461,9 +737,7 @@ START_TEST(test_seed)
 {
 	char *argv[2] = { xseed, xtest_sql };
 
-	map_file_returns = query;
-	map_file_returns_size = 1;
-	db_query_returns = 0;
+	seed_load_returns = 0;
 	state_create_returns = 0;
 	ck_assert_int_eq(run_command("seed", 2, argv), EXIT_SUCCESS);
 }
@@ -503,6 +777,107 @@ START_TEST(test_pending)
 
 	ck_assert_int_eq(run_command("pending", 1, argv), EXIT_SUCCESS);
 	ck_assert_str_eq(errbuf, "  + test.sql\n");
+	ck_assert_int_eq(source_get_scan_stats_called, 1);
+
+	/* With a ledger, only the current revision onward is listed */
+	ck_assert_int_eq(source_find_migrations_called, 1);
+	ck_assert_str_eq(source_find_migrations_cur_rev, "xxx");
+}
+END_TEST
+
+/**
+ * Test that pending skips applied migrations, and flags those
+ * which are older than the last applied migration.
+ */
+START_TEST(pending_out_of_order)
+{
+	char *migs[3];
+	char *argv[1] = { xpending };
+
+	*errbuf = '\0';
+	migs[0] = xtest_sql;
+	migs[1] = xtest2_sql;
+	migs[2] = xtest3_sql;
+	state_get_current_returns = "xxx";
+	state_ledger_applied[0] = "test2.sql";
+	source_find_migrations_returns = migs;
+	source_find_migrations_returns_size = 2;
+
+	ck_assert_int_eq(run_command("pending", 1, argv), EXIT_SUCCESS);
+	ck_assert_str_eq(errbuf, "  + test.sql (out of order)\n");
+
+	source_find_migrations_returns_size = 3;
+	ck_assert_int_eq(run_command("pending", 1, argv), EXIT_SUCCESS);
+	ck_assert_str_eq(errbuf, "  + test3.sql\n");
+}
+END_TEST
+
+/**
+ * Test that pending reports nothing when everything's applied.
+ */
+START_TEST(pending_all_applied)
+{
+	char *migs[2];
+	char *argv[1] = { xpending };
+
+	*errbuf = '\0';
+	migs[0] = xtest_sql;
+	migs[1] = xtest2_sql;
+	state_get_current_returns = "xxx";
+	state_ledger_applied[0] = "test.sql";
+	state_ledger_applied[1] = "test2.sql";
+	source_find_migrations_returns = migs;
+	source_find_migrations_returns_size = 2;
+
+	ck_assert_int_eq(run_command("pending", 1, argv), EXIT_SUCCESS);
+	ck_assert_str_eq(errbuf, "0 migrations pending:\n");
+}
+END_TEST
+
+/**
+ * Test that pending fails if the ledger can't be loaded.
+ */
+START_TEST(pending_ledger_load_fails)
+{
+	char *migs[1];
+	char *argv[1] = { xpending };
+
+	migs[0] = xtest_sql;
+	state_get_current_returns = "xxx";
+	state_ledger_load_returns = 1;
+	source_find_migrations_returns = migs;
+	source_find_migrations_returns_size = 1;
+
+	ck_assert_int_eq(run_command("pending", 1, argv), EXIT_FAILURE);
+}
+END_TEST
+
+/**
+ * Test that with an empty ledger, pending lists what's pending
+ * relative to the current revision, without writing anything.
+ */
+START_TEST(pending_unrecorded)
+{
+	char *migs[3], *range[1];
+	char *argv[1] = { xpending };
+
+	*errbuf = '\0';
+	migs[0] = xtest_sql;
+	migs[1] = xtest2_sql;
+	migs[2] = xtest3_sql;
+	range[0] = xtest3_sql;
+	state_get_current_returns = "xxx";
+	state_ledger_size_returns = 0;
+	source_find_migrations_returns = migs;
+	source_find_migrations_returns_size = 3;
+	source_find_migrations_range = range;
+	source_find_migrations_range_size = 1;
+
+	ck_assert_int_eq(run_command("pending", 1, argv), EXIT_SUCCESS);
+	ck_assert_str_eq(errbuf, "  + test3.sql\n");
+	ck_assert_int_eq(source_find_migrations_called, 2);
+	ck_assert_int_eq(state_ledger_add_called, 0);
+	ck_assert_int_eq(db_query_called, 0);
 }
 END_TEST
 
@@ -524,10 +899,10 @@ START_TEST(migrate_no_migrations)
 END_TEST
 
 /**
- * Test that migrate fails if the source doesn't report the
- * migration path.
+ * Test that the migrate command fails, and rolls back, if the
+ * migration can't be loaded.
  */
-START_TEST(migrate_no_migration_path)
+START_TEST(migrate_load_fails)
 {
 	char **migs;
 	char *argv[1] = { xmigrate };
@@ -538,10 +913,13 @@ START_TEST(migrate_no_migration_path)
 	state_get_current_returns = "xxx";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
-	source_get_migration_path_returns = NULL;
+	source_load_migration_returns = NULL;
+	db_has_transactional_ddl_returns = 1;
 
 	ck_assert_int_eq(run_command("migrate", 1, argv), EXIT_FAILURE);
-	ck_assert_str_eq(errbuf, "migrate: unable to get migration path\n");
+	ck_assert_str_eq(errbuf, " FAILED\n");
+	ck_assert(!migration_upgrade_called);
+	ck_assert(!state_ledger_add_called);
 }
 END_TEST
 
@@ -560,7 +938,7 @@ START_TEST(migrate_begin_fails)
 	state_get_current_returns = "xxx";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
-	source_get_migration_path_returns = xtmp;
+	source_load_migration_returns = xtmp;
 	db_query_begin_fails = 1;
 
 	ck_assert_int_eq(run_command("migrate", 1, argv), EXIT_FAILURE);
@@ -585,7 +963,7 @@ START_TEST(migrate_upgrade_fails)
 	state_get_current_returns = "xxx";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
-	source_get_migration_path_returns = xtmp;
+	source_load_migration_returns = xtmp;
 	migration_upgrade_returns = 1;
 	db_has_transactional_ddl_returns = 1;
 
@@ -611,7 +989,7 @@ START_TEST(migrate_rollback_fails)
 	state_get_current_returns = "xxx";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
-	source_get_migration_path_returns = xtmp;
+	source_load_migration_returns = xtmp;
 	migration_upgrade_returns = 1;
 	db_has_transactional_ddl_returns = 1;
 	db_query_rollback_fails = 1;
@@ -639,7 +1017,7 @@ START_TEST(migrate_rollback_no_transactional_ddl)
 	state_get_current_returns = "xxx";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
-	source_get_migration_path_returns = xtmp;
+	source_load_migration_returns = xtmp;
 	migration_upgrade_returns = 1;
 	db_has_transactional_ddl_returns = 0;
 	db_query_rollback_fails = 0;
@@ -670,7 +1048,7 @@ START_TEST(migrate_rollback_no_transactional_ddl_2)
 	state_get_current_returns = "xxx";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 3;
-	source_get_migration_path_returns = xtmp;
+	source_load_migration_returns = xtmp;
 	migration_upgrade_returns = 3;
 	db_has_transactional_ddl_returns = 0;
 	db_query_rollback_fails = 0;
@@ -680,6 +1058,11 @@ START_TEST(migrate_rollback_no_transactional_ddl_2)
 	ck_assert_str_eq(errbuf, " FAILED\n");
 	ck_assert_int_eq(db_query_called, 2);
 	ck_assert(!source_get_local_head_called);
+
+	/* The applied migrations aren't loaded again to roll them back */
+	ck_assert_int_eq(migration_downgrade_called, 2);
+	ck_assert_int_eq(source_load_migration_called, 3);
+	ck_assert_int_eq(source_unload_migration_called, 3);
 }
 END_TEST
 
@@ -698,7 +1081,7 @@ START_TEST(migrate_commit_fails)
 	state_get_current_returns = "xxx";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
-	source_get_migration_path_returns = xtmp;
+	source_load_migration_returns = xtmp;
 	migration_upgrade_returns = 0;
 	db_has_transactional_ddl_returns = 1;
 	db_query_commit_fails = 1;
@@ -725,7 +1108,7 @@ START_TEST(migrate_add_revision_fails)
 	state_get_current_returns = "xxx";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
-	source_get_migration_path_returns = xtmp;
+	source_load_migration_returns = xtmp;
 	source_get_local_head_returns = xtest;
 	migration_upgrade_returns = 0;
 	db_has_transactional_ddl_returns = 1;
@@ -753,7 +1136,7 @@ START_TEST(migrate_cleanup_table_fails)
 	state_get_current_returns = "xxx";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
-	source_get_migration_path_returns = xtmp;
+	source_load_migration_returns = xtmp;
 	migration_upgrade_returns = 0;
 	db_has_transactional_ddl_returns = 1;
 	state_add_revision_returns = 0;
@@ -779,7 +1162,7 @@ START_TEST(test_migrate)
 	state_get_current_returns = "xxx";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
-	source_get_migration_path_returns = xtmp;
+	source_load_migration_returns = xtmp;
 	migration_upgrade_returns = 0;
 	db_has_transactional_ddl_returns = 1;
 	state_add_revision_returns = 0;
@@ -787,10 +1170,190 @@ START_TEST(test_migrate)
 
 	ck_assert_int_eq(run_command("migrate", 1, argv), EXIT_SUCCESS);
 	ck_assert_int_eq(db_query_called, 2);
+	ck_assert_int_eq(state_ledger_add_called, 1);
 	ck_assert(!!source_get_local_head_called);
 }
 END_TEST
 
+/**
+ * Test that migrate records what was applied before there was a
+ * ledger in the same transaction as the pending migrations, even
+ * if nothing's pending.
+ */
+START_TEST(migrate_backfills_ledger)
+{
+	char *migs[3], *range[1];
+	char *argv[1] = { xmigrate };
+
+	migs[0] = xtest_sql;
+	migs[1] = xtest2_sql;
+	migs[2] = xtest3_sql;
+	range[0] = xtest3_sql;
+	state_get_current_returns = "xxx";
+	state_ledger_size_returns = 0;
+	source_find_migrations_returns = migs;
+	source_find_migrations_returns_size = 3;
+	source_find_migrations_range = range;
+	source_find_migrations_range_size = 1;
+	source_load_migration_returns = xtmp;
+	db_has_transactional_ddl_returns = 1;
+
+	ck_assert_int_eq(run_command("migrate", 1, argv), EXIT_SUCCESS);
+	ck_assert_int_eq(state_ledger_add_called, 3);
+	ck_assert_int_eq(migration_upgrade_called, 1);
+	ck_assert_int_eq(db_query_called, 2);
+
+	/* Nothing pending */
+	state_ledger_add_called = db_query_called = 0;
+	source_find_migrations_range_size = 0;
+	ck_assert_int_eq(run_command("migrate", 1, argv), EXIT_SUCCESS);
+	ck_assert_int_eq(state_ledger_add_called, 3);
+	ck_assert_int_eq(db_query_called, 2);
+}
+END_TEST
+
+/**
+ * Test that migrate rolls back if the ledger can't be populated.
+ */
+START_TEST(migrate_backfill_fails)
+{
+	char *migs[2], *range[1];
+	char *argv[1] = { xmigrate };
+
+	*errbuf = '\0';
+	migs[0] = xtest_sql;
+	migs[1] = xtest2_sql;
+	range[0] = xtest2_sql;
+	state_get_current_returns = "xxx";
+	state_ledger_size_returns = 0;
+	state_ledger_add_returns = 1;
+	source_find_migrations_returns = migs;
+	source_find_migrations_returns_size = 2;
+	source_find_migrations_range = range;
+	source_find_migrations_range_size = 1;
+	source_load_migration_returns = xtmp;
+	db_has_transactional_ddl_returns = 1;
+
+	ck_assert_int_eq(run_command("migrate", 1, argv), EXIT_FAILURE);
+	ck_assert_str_eq(errbuf, "Unable to populate the migration ledger\n");
+	ck_assert_int_eq(db_query_called, 2);
+	ck_assert_int_eq(migration_upgrade_called, 0);
+}
+END_TEST
+
+/**
+ * Test that the migrate command rolls back if the migration
+ * can't be recorded in the ledger.
+ */
+START_TEST(migrate_ledger_add_fails)
+{
+	char *migs[2];
+	char *argv[1] = { xmigrate };
+
+	*errbuf = '\0';
+	migs[0] = xtest_sql;
+	migs[1] = xtest2_sql;
+	state_get_current_returns = "xxx";
+	source_find_migrations_returns = migs;
+	source_find_migrations_returns_size = 2;
+	source_load_migration_returns = xtmp;
+	db_has_transactional_ddl_returns = 1;
+	state_ledger_add_returns = 1;
+
+	ck_assert_int_eq(run_command("migrate", 1, argv), EXIT_FAILURE);
+	ck_assert_str_eq(errbuf, " FAILED\n");
+	ck_assert_int_eq(migration_upgrade_called, 1);
+	ck_assert_int_eq(state_ledger_remove_called, 0);
+	ck_assert(!source_get_local_head_called);
+}
+END_TEST
+
+/**
+ * Test that migrate rolls back, and forgets everything it added to
+ * the ledger, when a pipelined statement fails.
+ */
+START_TEST(migrate_pipeline_fails)
+{
+	char *migs[2];
+	char *argv[1] = { xmigrate };
+
+	*errbuf = '\0';
+	migs[0] = xtest_sql;
+	migs[1] = xtest2_sql;
+	state_get_current_returns = "xxx";
+	source_find_migrations_returns = migs;
+	source_find_migrations_returns_size = 2;
+	source_load_migration_returns = xtmp;
+	db_has_transactional_ddl_returns = 1;
+	db_pipeline_fails = 1;
+
+	ck_assert_int_eq(run_command("migrate", 1, argv), EXIT_FAILURE);
+	ck_assert_str_eq(errbuf, "migrate: failed to apply migrations\n");
+	ck_assert_int_eq(migration_upgrade_called, 2);
+	ck_assert_int_eq(state_ledger_remove_called, 2);
+	ck_assert(!db_pipelined);
+	ck_assert(!source_get_local_head_called);
+}
+END_TEST
+
+/**
+ * Test that migrate waits for each migration, and its ledger entry,
+ * to have run before it goes on, and forgets the one it was on if
+ * it fails.
+ */
+START_TEST(migrate_pipeline_sync_fails)
+{
+	char *migs[2];
+	char *argv[1] = { xmigrate };
+
+	migs[0] = xtest_sql;
+	migs[1] = xtest2_sql;
+	state_get_current_returns = "xxx";
+	source_find_migrations_returns = migs;
+	source_find_migrations_returns_size = 2;
+	source_load_migration_returns = xtmp;
+	db_has_transactional_ddl_returns = 1;
+	db_pipeline_sync_fails_at = 4;
+
+	ck_assert_int_eq(run_command("migrate", 1, argv), EXIT_FAILURE);
+	ck_assert_int_eq(migration_upgrade_called, 2);
+	ck_assert_int_eq(state_ledger_add_called, 2);
+	ck_assert_int_eq(db_pipeline_synced, 4);
+	ck_assert_str_eq(db_pipeline_labelled, xtest2_sql);
+	ck_assert_int_eq(state_ledger_remove_called, 2);
+	ck_assert(!db_pipelined);
+	ck_assert(!source_get_local_head_called);
+}
+END_TEST
+
+/**
+ * Test that migrate applies out of order migrations first.
+ */
+START_TEST(migrate_out_of_order)
+{
+	char *migs[3];
+	char *argv[1] = { xmigrate };
+
+	*errbuf = '\0';
+	migs[0] = xtest_sql;
+	migs[1] = xtest2_sql;
+	migs[2] = xtest3_sql;
+	state_get_current_returns = "xxx";
+	state_ledger_applied[0] = "test2.sql";
+	source_find_migrations_returns = migs;
+	source_find_migrations_returns_size = 3;
+	source_load_migration_returns = xtmp;
+	db_has_transactional_ddl_returns = 1;
+	migration_upgrade_returns = 2;
+
+	ck_assert_int_eq(run_command("migrate", 1, argv), EXIT_FAILURE);
+	ck_assert_str_eq(errbuf, " FAILED\n");
+	ck_assert_int_eq(migration_upgrade_called, 2);
+	ck_assert_int_eq(state_ledger_add_called, 1);
+	ck_assert_int_eq(state_ledger_remove_called, 1);
+}
+END_TEST
+
 /**
  * Test that rollback defaults to the current revision's
  * previous revision if not specified.
@@ -846,10 +1409,9 @@ START_TEST(rollback_no_migrations)
 END_TEST
 
 /**
- * Test that rollback fails if the source doesn't report the
- * migration path.
+ * Test that rollback fails if the migration can't be loaded.
  */
-START_TEST(rollback_no_migration_path)
+START_TEST(rollback_load_fails)
 {
 	char **migs;
 	char *argv[2] = { xrollback, xxx };
@@ -858,12 +1420,17 @@ START_TEST(rollback_no_migration_path)
 	migs  = malloc(sizeof(char *));
 	*migs = my_strdup("test.sql");
 	state_get_current_returns = "yyy";
+	state_ledger_applied[0] = "test.sql";
+	state_ledger_applied[1] = "test2.sql";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
-	source_get_migration_path_returns = NULL;
+	source_load_migration_returns = NULL;
+	db_has_transactional_ddl_returns = 1;
 
 	ck_assert_int_eq(run_command("rollback", 2, argv), EXIT_FAILURE);
-	ck_assert_str_eq(errbuf, "rollback: unable to get migration path\n");
+	ck_assert_str_eq(errbuf, " FAILED\n");
+	ck_assert(!migration_downgrade_called);
+	ck_assert(!state_ledger_remove_called);
 }
 END_TEST
 
@@ -880,9 +1447,11 @@ START_TEST(rollback_begin_fails)
 	migs  = malloc(sizeof(char *));
 	*migs = my_strdup("test.sql");
 	state_get_current_returns = "yyy";
+	state_ledger_applied[0] = "test.sql";
+	state_ledger_applied[1] = "test2.sql";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
-	source_get_migration_path_returns = xtmp;
+	source_load_migration_returns = xtmp;
 	db_query_begin_fails = 1;
 
 	ck_assert_int_eq(run_command("rollback", 2, argv), EXIT_FAILURE);
@@ -904,9 +1473,11 @@ START_TEST(rollback_downgrade_fails)
 	migs  = malloc(sizeof(char *));
 	*migs = my_strdup("test.sql");
 	state_get_current_returns = "yyy";
+	state_ledger_applied[0] = "test.sql";
+	state_ledger_applied[1] = "test2.sql";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
-	source_get_migration_path_returns = xtmp;
+	source_load_migration_returns = xtmp;
 	migration_downgrade_returns = 1;
 	db_has_transactional_ddl_returns = 1;
 
@@ -931,9 +1502,11 @@ START_TEST(rollback_downgrade_no_transactional_ddl)
 	*migs = my_strdup("test.sql");
 	migs[1] = my_strdup("test2.sql");
 	state_get_current_returns = "yyy";
+	state_ledger_applied[0] = "test.sql";
+	state_ledger_applied[1] = "test2.sql";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 2;
-	source_get_migration_path_returns = xtmp;
+	source_load_migration_returns = xtmp;
 	migration_downgrade_returns = 2;
 	db_has_transactional_ddl_returns = 0;
 	db_query_rollback_fails = 0;
@@ -957,9 +1530,11 @@ START_TEST(rollback_rollback_fails)
 	migs  = malloc(sizeof(char *));
 	*migs = my_strdup("test.sql");
 	state_get_current_returns = "yyy";
+	state_ledger_applied[0] = "test.sql";
+	state_ledger_applied[1] = "test2.sql";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
-	source_get_migration_path_returns = xtmp;
+	source_load_migration_returns = xtmp;
 	migration_downgrade_returns = 1;
 	db_has_transactional_ddl_returns = 1;
 	db_query_rollback_fails = 1;
@@ -983,9 +1558,11 @@ START_TEST(rollback_commit_fails)
 	migs  = malloc(sizeof(char *));
 	*migs = my_strdup("test.sql");
 	state_get_current_returns = "yyy";
+	state_ledger_applied[0] = "test.sql";
+	state_ledger_applied[1] = "test2.sql";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
-	source_get_migration_path_returns = xtmp;
+	source_load_migration_returns = xtmp;
 	migration_downgrade_returns = 0;
 	db_has_transactional_ddl_returns = 1;
 	db_query_commit_fails = 1;
@@ -1008,9 +1585,11 @@ START_TEST(rollback_add_revision_fails)
 	migs  = malloc(sizeof(char *));
 	*migs = my_strdup("test.sql");
 	state_get_current_returns = "yyy";
+	state_ledger_applied[0] = "test.sql";
+	state_ledger_applied[1] = "test2.sql";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
-	source_get_migration_path_returns = xtmp;
+	source_load_migration_returns = xtmp;
 	migration_downgrade_returns = 0;
 	db_has_transactional_ddl_returns = 1;
 	state_add_revision_returns = 1;
@@ -1032,9 +1611,11 @@ START_TEST(rollback_cleanup_table_fails)
 	migs  = malloc(sizeof(char *));
 	*migs = my_strdup("test.sql");
 	state_get_current_returns = "yyy";
+	state_ledger_applied[0] = "test.sql";
+	state_ledger_applied[1] = "test2.sql";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
-	source_get_migration_path_returns = xtmp;
+	source_load_migration_returns = xtmp;
 	migration_downgrade_returns = 0;
 	db_has_transactional_ddl_returns = 1;
 	state_add_revision_returns = 0;
@@ -1056,9 +1637,11 @@ START_TEST(test_rollback)
 	migs  = malloc(sizeof(char *));
 	*migs = my_strdup("test.sql");
 	state_get_current_returns = "yyy";
+	state_ledger_applied[0] = "test.sql";
+	state_ledger_applied[1] = "test2.sql";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
-	source_get_migration_path_returns = xtmp;
+	source_load_migration_returns = xtmp;
 	migration_downgrade_returns = 0;
 	db_has_transactional_ddl_returns = 1;
 	state_add_revision_returns = 0;
@@ -1066,6 +1649,31 @@ START_TEST(test_rollback)
 
 	ck_assert_int_eq(run_command("rollback", 2, argv), EXIT_SUCCESS);
 	ck_assert_int_eq(db_query_called, 2);
+	ck_assert_int_eq(state_ledger_remove_called, 1);
+}
+END_TEST
+
+/**
+ * Test that the rollback command skips migrations which the
+ * ledger says were never applied.
+ */
+START_TEST(rollback_skips_unapplied)
+{
+	char *migs[2];
+	char *argv[2] = { xrollback, xxx };
+
+	migs[0] = xtest_sql;
+	migs[1] = xtest2_sql;
+	state_get_current_returns = "yyy";
+	state_ledger_applied[0] = "test2.sql";
+	source_find_migrations_returns = migs;
+	source_find_migrations_returns_size = 2;
+	source_load_migration_returns = xtmp;
+	db_has_transactional_ddl_returns = 1;
+
+	ck_assert_int_eq(run_command("rollback", 2, argv), EXIT_SUCCESS);
+	ck_assert_int_eq(migration_downgrade_called, 1);
+	ck_assert_int_eq(state_ledger_remove_called, 1);
 }
 END_TEST
 
@@ -1100,6 +1708,7 @@ START_TEST(assimilate_add_revision_fails)
 	state_get_current_returns = "yyy";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
+	source_load_migration_returns = xtmp;
 	state_create_returns = 0;
 	state_add_revision_returns = 1;
 
@@ -1122,14 +1731,151 @@ START_TEST(test_assimilate)
 	state_get_current_returns = "yyy";
 	source_find_migrations_returns = migs;
 	source_find_migrations_returns_size = 1;
+	source_load_migration_returns = xtmp;
 	state_create_returns = 0;
 	state_add_revision_returns = 0;
 
 	ck_assert_int_eq(run_command("assimilate", 1, argv), EXIT_SUCCESS);
+	ck_assert_int_eq(state_ledger_add_called, 1);
 	ck_assert(!state_destroy_called);
 }
 END_TEST
 
+/**
+ * Test that the assimilate command issues the appropriate
+ * error message if the ledger can't be populated.
+ */
+START_TEST(assimilate_ledger_add_fails)
+{
+	char *migs[1];
+	char *argv[1] = { xassimilate };
+
+	*errbuf = '\0';
+	migs[0] = xtest_sql;
+	source_find_migrations_returns = migs;
+	source_find_migrations_returns_size = 1;
+	source_load_migration_returns = xtmp;
+	state_ledger_add_returns = 1;
+
+	ck_assert_int_eq(run_command("assimilate", 1, argv), EXIT_FAILURE);
+	ck_assert_str_eq(errbuf, "assimilate: unable to populate the "
+	                 "migration ledger\n");
+	ck_assert(!!state_destroy_called);
+}
+END_TEST
+
+/**
+ * Test that watch fails if there's nothing to watch.
+ */
+START_TEST(watch_no_path)
+{
+	char *argv[1] = { xwatch };
+
+	*errbuf = '\0';
+	state_get_current_returns = "xxx";
+	ck_assert_int_eq(run_command("git", 1, argv), EXIT_FAILURE);
+	ck_assert_str_eq(errbuf, "watch: unable to watch for migrations\n");
+	ck_assert(!source_find_migrations_called);
+}
+END_TEST
+
+/**
+ * Test that watch fails if the watch can't be started.
+ */
+START_TEST(watch_start_fails)
+{
+	char *argv[1] = { xwatch };
+
+	*errbuf = '\0';
+	state_get_current_returns = "xxx";
+	source_get_watch_paths_returns = xwatch_paths;
+	watch_start_returns = 1;
+	ck_assert_int_eq(run_command("file", 1, argv), EXIT_FAILURE);
+	ck_assert_str_eq(errbuf, "watch: unable to watch for migrations\n");
+	ck_assert(!source_find_migrations_called);
+	ck_assert(!watch_stop_called);
+}
+END_TEST
+
+/**
+ * Test that watch applies the pending migrations once up front,
+ * and again after each change, until it's interrupted.
+ */
+START_TEST(test_watch)
+{
+	const int waits[3] = { 1, 1, 0 };
+	char *migs[1];
+	char *argv[1] = { xwatch };
+
+	*errbuf = '\0';
+	migs[0] = xtest_sql;
+	state_get_current_returns = "xxx";
+	source_get_watch_paths_returns = xwatch_paths;
+	source_find_migrations_returns = migs;
+	source_find_migrations_returns_size = 1;
+	source_load_migration_returns = xtmp;
+	db_has_transactional_ddl_returns = 1;
+	watch_wait_returns = waits;
+
+	ck_assert_int_eq(run_command("file", 1, argv), EXIT_SUCCESS);
+	ck_assert_int_eq(watch_wait_called, 3);
+	ck_assert_int_eq(watch_add_called, 2);
+	ck_assert_int_eq(migration_upgrade_called, 3);
+	ck_assert_int_eq(state_get_current_called, 1);
+	ck_assert_int_eq(watch_stop_called, 1);
+}
+END_TEST
+
+/**
+ * Test that watch says nothing when there's nothing to apply, and
+ * keeps watching after a migration fails.
+ */
+START_TEST(watch_keeps_going)
+{
+	const int waits[2] = { 1, 0 };
+	char *migs[1];
+	char *argv[1] = { xwatch };
+
+	*errbuf = '\0';
+	migs[0] = xtest_sql;
+	state_get_current_returns = "xxx";
+	source_get_watch_paths_returns = xwatch_paths;
+	source_load_migration_returns = xtmp;
+	db_has_transactional_ddl_returns = 1;
+	watch_wait_returns = waits;
+
+	source_find_migrations_returns = NULL;
+	ck_assert_int_eq(run_command("file", 1, argv), EXIT_SUCCESS);
+	ck_assert_str_eq(errbuf, "Watching /tmp...\n");
+
+	watch_wait_called = watch_stop_called = 0;
+	source_find_migrations_returns = migs;
+	source_find_migrations_returns_size = 1;
+	migration_upgrade_returns = 1;
+	ck_assert_int_eq(run_command("file", 1, argv), EXIT_SUCCESS);
+	ck_assert_int_eq(migration_upgrade_called, 2);
+	ck_assert_int_eq(watch_stop_called, 1);
+}
+END_TEST
+
+/**
+ * Test that watch fails if waiting for a change fails.
+ */
+START_TEST(watch_wait_fails)
+{
+	const int waits[1] = { -1 };
+	char *argv[1] = { xwatch };
+
+	state_get_current_returns = "xxx";
+	source_get_watch_paths_returns = xwatch_paths;
+	watch_wait_returns = waits;
+
+	ck_assert_int_eq(run_command("file", 1, argv), EXIT_FAILURE);
+	ck_assert_int_eq(source_find_migrations_called, 1);
+	ck_assert_int_eq(watch_stop_called, 1);
+}
+END_TEST
+
 Suite *commands_suite(void)
 {
 	Suite *s;
@@ -1155,8 +1901,7 @@ Suite *commands_suite(void)
 
 	t = tcase_create("seed");
 	tcase_add_checked_fixture(t, reset_stubs, NULL);
-	tcase_add_test(t, seed_cant_map_file);
-	tcase_add_test(t, seed_query_fails);
+	tcase_add_test(t, seed_load_fails);
 	tcase_add_test(t, seed_creating_state_fails);
 	tcase_add_test(t, test_seed);
 	tcase_set_timeout(t, 1);
@@ -1166,13 +1911,17 @@ Suite *commands_suite(void)
 	tcase_add_checked_fixture(t, reset_stubs, NULL);
 	tcase_add_test(t, pending_no_migrations);
 	tcase_add_test(t, test_pending);
+	tcase_add_test(t, pending_out_of_order);
+	tcase_add_test(t, pending_all_applied);
+	tcase_add_test(t, pending_ledger_load_fails);
+	tcase_add_test(t, pending_unrecorded);
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
 	t = tcase_create("migrate");
 	tcase_add_checked_fixture(t, reset_stubs, NULL);
 	tcase_add_test(t, migrate_no_migrations);
-	tcase_add_test(t, migrate_no_migration_path);
+	tcase_add_test(t, migrate_load_fails);
 	tcase_add_test(t, migrate_begin_fails);
 	tcase_add_test(t, migrate_upgrade_fails);
 	tcase_add_test(t, migrate_rollback_no_transactional_ddl);
@@ -1182,6 +1931,12 @@ Suite *commands_suite(void)
 	tcase_add_test(t, migrate_add_revision_fails);
 	tcase_add_test(t, migrate_cleanup_table_fails);
 	tcase_add_test(t, test_migrate);
+	tcase_add_test(t, migrate_backfills_ledger);
+	tcase_add_test(t, migrate_backfill_fails);
+	tcase_add_test(t, migrate_ledger_add_fails);
+	tcase_add_test(t, migrate_pipeline_fails);
+	tcase_add_test(t, migrate_pipeline_sync_fails);
+	tcase_add_test(t, migrate_out_of_order);
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
@@ -1190,7 +1945,7 @@ Suite *commands_suite(void)
 	tcase_add_test(t, rollback_to_previous);
 	tcase_add_test(t, rollback_no_target);
 	tcase_add_test(t, rollback_no_migrations);
-	tcase_add_test(t, rollback_no_migration_path);
+	tcase_add_test(t, rollback_load_fails);
 	tcase_add_test(t, rollback_begin_fails);
 	tcase_add_test(t, rollback_downgrade_fails);
 	tcase_add_test(t, rollback_downgrade_no_transactional_ddl);
@@ -1199,6 +1954,7 @@ Suite *commands_suite(void)
 	tcase_add_test(t, rollback_add_revision_fails);
 	tcase_add_test(t, rollback_cleanup_table_fails);
 	tcase_add_test(t, test_rollback);
+	tcase_add_test(t, rollback_skips_unapplied);
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
@@ -1207,6 +1963,17 @@ Suite *commands_suite(void)
 	tcase_add_test(t, assimilate_state_create_fails);
 	tcase_add_test(t, assimilate_add_revision_fails);
 	tcase_add_test(t, test_assimilate);
+	tcase_add_test(t, assimilate_ledger_add_fails);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("watch");
+	tcase_add_checked_fixture(t, reset_stubs, NULL);
+	tcase_add_test(t, watch_no_path);
+	tcase_add_test(t, watch_start_fails);
+	tcase_add_test(t, test_watch);
+	tcase_add_test(t, watch_keeps_going);
+	tcase_add_test(t, watch_wait_fails);
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 	return s;
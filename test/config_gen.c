@@ -21,6 +21,18 @@ extern char errbuf[];
 #include "../src/config_gen.h"
 #include "../src/config_gen.c"
 
+/**
+ * Get the size of the whole default config file.
+ */
+static ssize_t config_size(void)
+{
+	size_t i, size = 0;
+
+	for (i = 0; i < sizeof(default_config) / sizeof(*default_config); i++)
+		size += strlen(default_config[i]);
+	return (ssize_t)size;
+}
+
 /**
  * Test that generate_config() returns the correct error
  * message if stat() on "." is unsuccessful.
@@ -107,7 +119,7 @@ START_TEST(generate_config_write_interrupted)
 	*errbuf = '\0';
 	stat_fails_at  = 2;
 	open_returns   = 1;
-	write_returns  = (ssize_t)strlen(default_config_1);
+	write_returns  = (ssize_t)strlen(default_config[0]);
 	write_errno    = EINTR;
 	write_fails_at = 2;
 
@@ -132,8 +144,7 @@ START_TEST(generate_config_creating_migrations_dir_fails)
 	stat_fails_at = 2;
 	stat_returns_buf.st_mode = S_IFREG;
 	open_returns   = 1;
-	write_returns  = (ssize_t)strlen(default_config_1);
-	write_returns += (ssize_t)strlen(default_config_2);
+	write_returns  = config_size();
 
 	ck_assert_int_eq(generate_config("config", 0), 1);
 	ck_assert_int_eq(stat_called, 1);
@@ -154,8 +165,7 @@ START_TEST(generate_config_creates_migrations_dir)
 	stat_fails_at = 2;
 	stat_returns_buf.st_mode = S_IFREG;
 	open_returns   = 1;
-	write_returns  = (ssize_t)strlen(default_config_1);
-	write_returns += (ssize_t)strlen(default_config_2);
+	write_returns  = config_size();
 
 	ck_assert_int_eq(generate_config("config", 0), 0);
 	ck_assert_int_eq(stat_called, 1);
@@ -175,12 +185,11 @@ START_TEST(test_generate_config)
 	*errbuf = '\0';
 	stat_fails_at  = 2;
 	open_returns   = 1;
-	write_returns  = (ssize_t)strlen(default_config_1);
-	write_returns  += (ssize_t)strlen(default_config_2);
+	write_returns  = config_size();
 
 	ck_assert_int_eq(generate_config("config", 1), 0);
 	ck_assert_int_eq(close_called, 1);
-	ck_assert_int_eq(write_called, 2);
+	ck_assert_int_eq(write_called, 4);
 	ck_assert(!unlink_called);
 	ck_assert(!*errbuf);
 }
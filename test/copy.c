@@ -0,0 +1,157 @@
+/**
+ * Minimal Migration Manager - Bulk-load (copy) Section Tests
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+#include "tests.h"
+
+/* from test_runner.c */
+extern char errbuf[];
+
+#include "../src/copy.h"
+#include "../src/copy.c"
+
+/**
+ * Helper for calling copy_marker() on a string.
+ */
+static int marker(const char *line, char *target)
+{
+	return copy_marker(line, strlen(line), target);
+}
+
+/**
+ * Test that copy_marker() ignores lines which aren't copy markers.
+ */
+START_TEST(copy_marker_not_a_marker)
+{
+	char target[COPY_TARGET_MAX];
+
+	ck_assert_int_eq(copy_marker(NULL, 0, target), 0);
+	ck_assert_int_eq(marker("-- [up]", target), 0);
+	ck_assert_int_eq(marker("-- [copyright]", target), 0);
+	ck_assert_int_eq(marker("INSERT INTO t VALUES (1);", target), 0);
+	ck_assert_int_eq(marker(" -- [copy t]", target), 0);
+}
+END_TEST
+
+/**
+ * Test that copy_marker() rejects malformed markers.
+ */
+START_TEST(copy_marker_malformed)
+{
+	char target[COPY_TARGET_MAX], line[COPY_TARGET_MAX + 16];
+
+	*errbuf = '\0';
+	ck_assert_int_eq(marker("-- [copy t", target), -1);
+	ck_assert_str_eq(errbuf, "invalid copy section: '-- [copy t'\n");
+	ck_assert_int_eq(marker("-- [copy ]", target), -1);
+	ck_assert_int_eq(marker("-- [copy t] x", target), -1);
+	ck_assert_int_eq(marker("-- [copy t; DROP TABLE t]", target), -1);
+
+	strcpy(line, "-- [copy ");
+	memset(line + 9, 't', COPY_TARGET_MAX);
+	strcpy(line + 9 + COPY_TARGET_MAX, "]");
+	ck_assert_int_eq(marker(line, target), -1);
+}
+END_TEST
+
+/**
+ * Test that copy_marker() extracts the target.
+ */
+START_TEST(test_copy_marker)
+{
+	char target[COPY_TARGET_MAX];
+
+	ck_assert_int_eq(marker("-- [copy t]", target), 1);
+	ck_assert_str_eq(target, "t");
+	ck_assert_int_eq(marker("-- [copy   t(a, b) ]  \r", target), 1);
+	ck_assert_str_eq(target, "t(a, b)");
+}
+END_TEST
+
+/**
+ * Test that copy_rows() ends a section at "\.", the next marker,
+ * or the end of the file.
+ */
+START_TEST(copy_rows_end_of_section)
+{
+	const char *s;
+	size_t rows, next;
+
+	s = "1\tx\n2\ty\n\\.\nSELECT 1;";
+	ck_assert_int_eq(copy_rows(s, strlen(s), 0, &rows, &next), 1);
+	ck_assert_uint_eq(rows, 8);
+	ck_assert_uint_eq(next, 11);
+
+	s = "1\tx\r\n\\.\r\n";
+	ck_assert_int_eq(copy_rows(s, strlen(s), 0, &rows, &next), 1);
+	ck_assert_uint_eq(rows, 5);
+	ck_assert_uint_eq(next, 9);
+
+	s = "1\tx\n-- [down]\nDROP TABLE t;";
+	ck_assert_int_eq(copy_rows(s, strlen(s), 0, &rows, &next), 1);
+	ck_assert_uint_eq(rows, 4);
+	ck_assert_uint_eq(next, 4);
+
+	s = "1\tx\n2\ty";
+	ck_assert_int_eq(copy_rows(s, strlen(s), 1, &rows, &next), 1);
+	ck_assert_uint_eq(rows, 7);
+	ck_assert_uint_eq(next, 7);
+
+	s = "1\tx\n\\.";
+	ck_assert_int_eq(copy_rows(s, strlen(s), 1, &rows, &next), 1);
+	ck_assert_uint_eq(rows, 4);
+	ck_assert_uint_eq(next, 6);
+}
+END_TEST
+
+/**
+ * Test that copy_rows() only takes complete lines until the
+ * end of the file.
+ */
+START_TEST(copy_rows_partial)
+{
+	const char *s = "1\tx\n2\ty\n\\";
+	size_t rows, next;
+
+	ck_assert_int_eq(copy_rows(s, strlen(s), 0, &rows, &next), 0);
+	ck_assert_uint_eq(rows, 8);
+	ck_assert_uint_eq(next, 8);
+	ck_assert_int_eq(copy_rows(s, 2, 0, &rows, &next), 0);
+	ck_assert_uint_eq(rows, 0);
+	ck_assert_uint_eq(next, 0);
+	ck_assert_int_eq(copy_rows(s, 0, 0, &rows, &next), 0);
+	ck_assert_int_eq(copy_rows(s, 0, 1, &rows, &next), 1);
+	ck_assert_uint_eq(rows, 0);
+}
+END_TEST
+
+Suite *copy_suite(void)
+{
+	Suite *s;
+	TCase *t;
+
+	s = suite_create("Copy Sections");
+	t = tcase_create("copy_marker");
+	tcase_add_test(t, copy_marker_not_a_marker);
+	tcase_add_test(t, copy_marker_malformed);
+	tcase_add_test(t, test_copy_marker);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("copy_rows");
+	tcase_add_test(t, copy_rows_end_of_section);
+	tcase_add_test(t, copy_rows_partial);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	return s;
+}
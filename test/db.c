@@ -31,7 +31,14 @@ static int driver_init_called       = 0;
 static int driver_uninit_called     = 0;
 static int driver_connect_called    = 0;
 static int driver_query_called      = 0;
+static int driver_prepare_called    = 0;
+static int driver_execute_called    = 0;
+static int driver_finalize_called   = 0;
+static int driver_copy_called       = 0;
+static int driver_pipeline_enabled  = 0;
+static char driver_label[16];
 static int driver_disconnect_called = 0;
+static int driver_prepare_n_params  = 0;
 
 static int driver_init(void)
 {
@@ -74,7 +81,7 @@ static void *driver_connect(const char *host, const unsigned short port,
 	return (void *)1234;
 }
 
-static int driver_query(void *dbh, const char *query,
+static int driver_query(void *dbh, const char *query, size_t len,
                         db_row_callback_t callback,
                         void *userdata)
 {
@@ -85,11 +92,69 @@ static int driver_query(void *dbh, const char *query,
 	ck_assert(!callback);
 	ck_assert_ptr_null(userdata);
 
+	if (len == 4 && !memcmp(query, "fail", 4))
+		return 1;
+	return 0;
+}
+
+static void *driver_prepare(void *dbh, const char *query, int n_params)
+{
+	driver_prepare_called++;
+	driver_prepare_n_params = n_params;
+
+	ck_assert_ptr_eq(dbh, (void *)1234);
 	if (strlen(query) == 4 && !memcmp(query, "fail", 4))
+		return NULL;
+	return (void *)5678;
+}
+
+static int driver_execute(void *dbh, void *stmt, int n_params,
+                          const char *const *params,
+                          db_row_callback_t callback, void *userdata)
+{
+	driver_execute_called++;
+
+	ck_assert_ptr_eq(dbh, (void *)1234);
+	ck_assert_ptr_eq(stmt, (void *)5678);
+	ck_assert(!callback);
+	ck_assert_ptr_null(userdata);
+
+	if (n_params && !strcmp(params[0], "fail"))
 		return 1;
 	return 0;
 }
 
+static void driver_finalize(void *dbh, void *stmt)
+{
+	driver_finalize_called++;
+	ck_assert_ptr_eq(dbh, (void *)1234);
+	ck_assert_ptr_eq(stmt, (void *)5678);
+}
+
+static int driver_copy(void *dbh, const char *target, const char *rows,
+                       size_t len)
+{
+	driver_copy_called++;
+	ck_assert_ptr_eq(dbh, (void *)1234);
+	ck_assert_uint_eq(len, strlen(rows));
+	return !strcmp(target, "fail");
+}
+
+static int driver_pipeline(void *dbh, int enable)
+{
+	ck_assert_ptr_eq(dbh, (void *)1234);
+	driver_pipeline_enabled = enable;
+	return 0;
+}
+
+static int driver_pipeline_label(void *dbh, const char *label)
+{
+	ck_assert_ptr_eq(dbh, (void *)1234);
+	*driver_label = '\0';
+	if (label) strcpy(driver_label, label);
+	return driver_pipeline_enabled;
+}
+
 static void driver_disconnect(void *dbh)
 {
 	driver_disconnect_called++;
@@ -104,6 +169,12 @@ const struct db_driver_vtable driver_without_init = {
 	NULL, /* uninit */
 	NULL, /* driver_connect, */
 	NULL, /* driver_query, */
+	NULL, /* driver_prepare, */
+	NULL, /* driver_execute, */
+	NULL, /* driver_finalize, */
+	NULL, /* driver_copy, */
+	NULL, /* driver_pipeline, */
+	NULL, /* driver_pipeline_label, */
 	NULL  /* driver_disconnect */
 };
 
@@ -115,6 +186,12 @@ const struct db_driver_vtable driver_with_init = {
 	driver_uninit,
 	driver_connect,
 	driver_query,
+	driver_prepare,
+	driver_execute,
+	driver_finalize,
+	driver_copy,
+	driver_pipeline,
+	driver_pipeline_label,
 	driver_disconnect
 };
 /* }}} */
@@ -329,6 +406,241 @@ START_TEST(test_db_query)
 	ck_assert_int_eq(driver_query_called, 1);
 	ck_assert_int_eq(db_query("fail", NULL, NULL), 1);
 	ck_assert_int_eq(driver_query_called, 2);
+	ck_assert_int_eq(db_query_len("failure", 4, NULL, NULL), 1);
+	ck_assert_int_eq(driver_query_called, 3);
+}
+END_TEST
+
+/**
+ * Test that db_copy() calls the driver callback, unless there's
+ * nothing to load.
+ */
+START_TEST(test_db_copy)
+{
+	memset(drivers, 0, sizeof drivers);
+	drivers[1]   = &driver_without_init;
+	session.type = 1;
+	session.dbh  = (void *)1234;
+	ck_assert_int_ne(db_copy("t", "1\n", 2), 0);
+	ck_assert_int_ne(db_copy(NULL, "1\n", 2), 0);
+
+	drivers[1] = &driver_with_init;
+	ck_assert_int_eq(db_copy("t", "", 0), 0);
+	ck_assert_int_eq(driver_copy_called, 0);
+	ck_assert_int_eq(db_copy("t", "1\n", 2), 0);
+	ck_assert_int_eq(db_copy("fail", "1\n", 2), 1);
+	ck_assert_int_eq(driver_copy_called, 2);
+
+	session.dbh = NULL;
+	ck_assert_int_ne(db_copy("t", "1\n", 2), 0);
+	ck_assert_int_eq(driver_copy_called, 2);
+}
+END_TEST
+
+/**
+ * Test that db_pipeline_begin() and db_pipeline_end() call the
+ * driver callback, if it has one.
+ */
+START_TEST(test_db_pipeline)
+{
+	memset(drivers, 0, sizeof drivers);
+	drivers[1]   = &driver_without_init;
+	session.type = 1;
+	session.dbh  = (void *)1234;
+	db_pipeline_begin();
+	ck_assert_int_eq(db_pipeline_end(), 0);
+
+	drivers[1] = &driver_with_init;
+	db_pipeline_begin();
+	ck_assert_int_eq(driver_pipeline_enabled, 1);
+	ck_assert_int_eq(db_pipeline_end(), 0);
+	ck_assert_int_eq(driver_pipeline_enabled, 0);
+
+	session.dbh = NULL;
+	db_pipeline_begin();
+	ck_assert_int_eq(driver_pipeline_enabled, 0);
+}
+END_TEST
+
+/**
+ * Test that db_pipeline_label() passes the label on to the driver,
+ * and that db_pipeline_sync() only syncs while pipelining.
+ */
+START_TEST(test_db_pipeline_sync)
+{
+	memset(drivers, 0, sizeof drivers);
+	drivers[1]   = &driver_without_init;
+	session.type = 1;
+	session.dbh  = (void *)1234;
+	ck_assert_int_eq(db_pipeline_label("x"), 0);
+	ck_assert_int_eq(db_pipeline_sync(), 0);
+
+	drivers[1] = &driver_with_init;
+	driver_pipeline_enabled = 0;
+	ck_assert_int_eq(db_pipeline_label("x"), 0);
+	ck_assert_str_eq(driver_label, "x");
+	ck_assert_int_eq(db_pipeline_sync(), 0);
+	ck_assert_int_eq(driver_pipeline_enabled, 0);
+
+	db_pipeline_begin();
+	ck_assert_int_eq(db_pipeline_label("y"), 1);
+	ck_assert_str_eq(driver_label, "y");
+	ck_assert_int_eq(db_pipeline_sync(), 0);
+	ck_assert_int_eq(driver_pipeline_enabled, 1);
+	ck_assert_int_eq(db_pipeline_end(), 0);
+	session.dbh = NULL;
+}
+END_TEST
+
+/**
+ * Test that db_row_buffer() only grows the row buffer when it
+ * needs more columns, and that db_disconnect() frees it.
+ */
+START_TEST(test_db_row_buffer)
+{
+	struct db_row *row;
+	char **fields;
+
+	ck_assert_ptr_null(db_row_buffer(-1));
+	ck_assert_ptr_nonnull((row = db_row_buffer(4)));
+	ck_assert_int_eq(row->n_cols, 4);
+	ck_assert_ptr_eq(row->column_names, row->fields + 4);
+	fields = row->fields;
+
+	row->index = 10;
+	ck_assert_ptr_eq(db_row_buffer(2), row);
+	ck_assert_int_eq(row->n_cols, 2);
+	ck_assert_uint_eq(row->index, 0);
+	ck_assert_ptr_eq(row->fields, fields);
+	ck_assert_ptr_eq(row->column_names, row->fields + 2);
+
+	ck_assert_ptr_eq(db_row_buffer(8), row);
+	ck_assert_int_eq(session.row_cap, 8);
+
+	db_disconnect();
+	ck_assert_ptr_null(session.row.fields);
+	ck_assert_ptr_null(session.row.lengths);
+	ck_assert_int_eq(session.row_cap, 0);
+}
+END_TEST
+
+/**
+ * Test that db_prepare() returns NULL if there's no usable driver,
+ * or the driver fails to prepare the statement.
+ */
+START_TEST(db_prepare_fails)
+{
+	memset(drivers, 0, sizeof drivers);
+	session.type = 1;
+	session.dbh  = (void *)1234;
+	ck_assert_ptr_null(db_prepare("test"));
+
+	drivers[1] = &driver_without_init;
+	ck_assert_ptr_null(db_prepare("test"));
+
+	drivers[1] = &driver_with_init;
+	ck_assert_ptr_null(db_prepare(NULL));
+	ck_assert_ptr_null(db_prepare("fail"));
+	ck_assert_int_eq(driver_prepare_called, 1);
+
+	session.dbh = NULL;
+	ck_assert_ptr_null(db_prepare("test"));
+	ck_assert_int_eq(driver_prepare_called, 1);
+}
+END_TEST
+
+/**
+ * Test that db_prepare() counts the parameters, skipping over
+ * any quoted question marks.
+ */
+START_TEST(db_prepare_counts_params)
+{
+	struct db_stmt *stmt;
+
+	memset(drivers, 0, sizeof drivers);
+	drivers[1]   = &driver_with_init;
+	session.type = 1;
+	session.dbh  = (void *)1234;
+
+	stmt = db_prepare("SELECT '?', \"?\" FROM x WHERE a=? AND b=?");
+	ck_assert_ptr_nonnull(stmt);
+	ck_assert_int_eq(driver_prepare_n_params, 2);
+	ck_assert_int_eq(stmt->n_params, 2);
+	db_finalize(stmt);
+}
+END_TEST
+
+/**
+ * Test that db_execute() calls the driver callback, and returns
+ * the proper result.
+ */
+START_TEST(test_db_execute)
+{
+	struct db_stmt *stmt;
+	const char *ok[1]   = { "test" };
+	const char *fail[1] = { "fail" };
+
+	memset(drivers, 0, sizeof drivers);
+	drivers[1]   = &driver_with_init;
+	session.type = 1;
+	session.dbh  = (void *)1234;
+
+	stmt = db_prepare("SELECT ?");
+	ck_assert_ptr_nonnull(stmt);
+	ck_assert_int_ne(db_execute(NULL, ok, NULL, NULL), 0);
+	ck_assert_int_ne(db_execute(stmt, NULL, NULL, NULL), 0);
+	ck_assert_int_eq(driver_execute_called, 0);
+
+	ck_assert_int_eq(db_execute(stmt, ok, NULL, NULL), 0);
+	ck_assert_int_eq(db_execute(stmt, fail, NULL, NULL), 1);
+	ck_assert_int_eq(driver_execute_called, 2);
+
+	/* A statement from another session can't be used */
+	session.type = 0;
+	ck_assert_int_ne(db_execute(stmt, ok, NULL, NULL), 0);
+	ck_assert_int_eq(driver_execute_called, 2);
+	session.type = 1;
+
+	db_finalize(stmt);
+	db_finalize(NULL);
+	ck_assert_int_eq(driver_finalize_called, 1);
+}
+END_TEST
+
+/**
+ * Test that db_finalize() doesn't call the driver once the
+ * session is gone.
+ */
+START_TEST(db_finalize_after_disconnect)
+{
+	struct db_stmt *stmt;
+
+	memset(drivers, 0, sizeof drivers);
+	drivers[1]   = &driver_with_init;
+	session.type = 1;
+	session.dbh  = (void *)1234;
+
+	stmt = db_prepare("SELECT 1");
+	ck_assert_ptr_nonnull(stmt);
+	session.dbh = NULL;
+	db_finalize(stmt);
+	ck_assert_int_eq(driver_finalize_called, 0);
+}
+END_TEST
+
+/**
+ * Test that db_get_driver_name() works.
+ */
+START_TEST(test_db_get_driver_name)
+{
+	memset(drivers, 0, sizeof drivers);
+	drivers[1]   = &driver_with_init;
+	session.type = 1;
+	session.dbh  = NULL;
+	ck_assert_ptr_null(db_get_driver_name());
+
+	session.dbh = (void *)1234;
+	ck_assert_str_eq(db_get_driver_name(), "init");
 }
 END_TEST
 
@@ -490,8 +802,33 @@ Suite *db_suite(void)
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
+	t = tcase_create("db_copy");
+	tcase_add_test(t, test_db_copy);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("db_pipeline");
+	tcase_add_test(t, test_db_pipeline);
+	tcase_add_test(t, test_db_pipeline_sync);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("db_row_buffer");
+	tcase_add_test(t, test_db_row_buffer);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("db_prepare");
+	tcase_add_test(t, db_prepare_fails);
+	tcase_add_test(t, db_prepare_counts_params);
+	tcase_add_test(t, test_db_execute);
+	tcase_add_test(t, db_finalize_after_disconnect);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
 	t = tcase_create("db_has_transactional_ddl");
 	tcase_add_test(t, test_db_has_transactional_ddl);
+	tcase_add_test(t, test_db_get_driver_name);
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
@@ -22,19 +22,19 @@ extern char errbuf[];
 static int row_cb_returns = 1;
 static int row_cb_called  = 0;
 
-static int row_cb(void *userdata, int n_cols, char **fields,
-                  char **column_names)
+static int row_cb(void *userdata, const struct db_row *row)
 {
 	++row_cb_called;
 
-	if (userdata == (void *)1 && n_cols == 1) {
-		ck_assert_str_eq(column_names[0], "col");
-		ck_assert_ptr_null(fields[0]);
+	if (userdata == (void *)1 && row->n_cols == 1) {
+		ck_assert_str_eq(row->column_names[0], "col");
+		ck_assert_ptr_null(row->fields[0]);
 	}
 
-	if (userdata == (void *)2 && n_cols == 1) {
-		ck_assert_str_eq(column_names[0], "col");
-		ck_assert_str_eq(fields[0], "value");
+	if (userdata == (void *)2 && row->n_cols == 1) {
+		ck_assert_str_eq(row->column_names[0], "col");
+		ck_assert_str_eq(row->fields[0], "value");
+		ck_assert_uint_eq(row->lengths[0], 5);
 	}
 
 	return row_cb_returns;
@@ -148,6 +148,35 @@ START_TEST(test_mysql_connect)
 	ck_assert(mysql_init_called && mysql_options_called);
 	ck_assert(mysql_real_connect_called);
 	ck_assert(!mysql_error_called && !mysql_close_called);
+	ck_assert_ptr_nonnull(mysql_infile_init);
+}
+END_TEST
+
+/**
+ * Test that the connection's local infile handler refuses any file
+ * outside of a copy.
+ */
+START_TEST(mysql_connect_refuses_infile)
+{
+	char errmsg[] = "xxx";
+
+	mysql_init_returns         = (MYSQL *)1234;
+	mysql_real_connect_returns = mysql_init_returns;
+	mysql_error_returns        = errmsg;
+	ck_assert_ptr_nonnull(db_mysql_connect(NULL, 0, "u", "p", "db"));
+
+	mysql_real_query_returns = 0;
+	ck_assert_int_ne(db_mysql_query((MYSQL *)1234,
+	                 "LOAD DATA LOCAL INFILE 'mmm' INTO TABLE t", 41,
+	                 NULL, NULL), 0);
+	ck_assert_str_eq(mysql_infile_errmsg,
+	                 "LOAD DATA LOCAL INFILE refused");
+
+	mysql_infile_name = "/etc/passwd";
+	ck_assert_int_ne(db_mysql_query((MYSQL *)1234,
+	                 "LOAD DATA LOCAL INFILE 'mmm' INTO TABLE t", 41,
+	                 NULL, NULL), 0);
+	ck_assert_str_eq(mysql_infile_data, "");
 }
 END_TEST
 
@@ -160,8 +189,8 @@ START_TEST(mysql_query_invalid_args)
 	MYSQL *dbh = (MYSQL *)1234;
 
 	row_cb_called = 0;
-	ck_assert_int_eq(db_mysql_query(NULL, "test", row_cb, NULL), 1);
-	ck_assert_int_eq(db_mysql_query(dbh, NULL, row_cb, NULL), 1);
+	ck_assert_int_eq(db_mysql_query(NULL, "test", 4, row_cb, NULL), 1);
+	ck_assert_int_eq(db_mysql_query(dbh, NULL, 0, row_cb, NULL), 1);
 	ck_assert(!row_cb_called && !mysql_real_query_called);
 }
 END_TEST
@@ -175,7 +204,7 @@ START_TEST(mysql_query_fails)
 
 	mysql_real_query_returns = 1;
 	mysql_error_returns      = NULL;
-	ck_assert_int_eq(db_mysql_query(dbh, "test", row_cb, NULL), 1);
+	ck_assert_int_eq(db_mysql_query(dbh, "test", 4, row_cb, NULL), 1);
 	ck_assert(mysql_real_query_called && mysql_error_called);
 }
 END_TEST
@@ -192,7 +221,7 @@ START_TEST(mysql_query_fails_errmsg)
 	*errbuf = '\0';
 	mysql_real_query_returns = 1;
 	mysql_error_returns      = errmsg;
-	ck_assert_int_eq(db_mysql_query(dbh, "test", row_cb, NULL), 1);
+	ck_assert_int_eq(db_mysql_query(dbh, "test", 4, row_cb, NULL), 1);
 	ck_assert_str_eq(errbuf, "query failed: xxx\n");
 	ck_assert(mysql_real_query_called && mysql_error_called);
 }
@@ -207,11 +236,11 @@ START_TEST(mysql_query_no_results)
 	MYSQL *dbh = (MYSQL *)1234;
 
 	mysql_real_query_returns   = 0;
-	mysql_store_result_returns = NULL;
+	mysql_use_result_returns   = NULL;
 	mysql_next_result_returns  = -1;
-	ck_assert_int_eq(db_mysql_query(dbh, "test", row_cb, NULL), 0);
-	ck_assert(mysql_real_query_called  && mysql_store_result_called);
-	ck_assert(mysql_next_result_called && !mysql_num_rows_called);
+	ck_assert_int_eq(db_mysql_query(dbh, "test", 4, row_cb, NULL), 0);
+	ck_assert(mysql_real_query_called  && mysql_use_result_called);
+	ck_assert(mysql_next_result_called && !mysql_num_fields_called);
 }
 END_TEST
 
@@ -223,16 +252,21 @@ START_TEST(mysql_query_no_rows)
 {
 	MYSQL *dbh = (MYSQL *)1234;
 
+	MYSQL_FIELD fields[1];
+
 	mysql_real_query_returns   = 0;
-	mysql_store_result_returns = (MYSQL_RES *)1234;
+	mysql_use_result_returns   = (MYSQL_RES *)1234;
 	mysql_num_rows_returns     = 0;
 	mysql_num_fields_returns   = 1;
+	mysql_fetch_fields_returns = fields;
 	mysql_next_result_returns  = -1;
+	row_cb_called              = 0;
 
-	ck_assert_int_eq(db_mysql_query(dbh, "test", row_cb, NULL), 0);
-	ck_assert(mysql_real_query_called  && mysql_store_result_called);
-	ck_assert(mysql_num_rows_called    && mysql_num_fields_called);
-	ck_assert(mysql_next_result_called && !mysql_fetch_fields_called);
+	ck_assert_int_eq(db_mysql_query(dbh, "test", 4, row_cb, NULL), 0);
+	ck_assert(mysql_real_query_called  && mysql_use_result_called);
+	ck_assert(mysql_num_fields_called  && mysql_fetch_fields_called);
+	ck_assert_int_eq(mysql_fetch_row_called, 1);
+	ck_assert(mysql_next_result_called && !row_cb_called);
 }
 END_TEST
 
@@ -245,14 +279,14 @@ START_TEST(mysql_query_no_cols)
 	MYSQL *dbh = (MYSQL *)1234;
 
 	mysql_real_query_returns   = 0;
-	mysql_store_result_returns = (MYSQL_RES *)1234;
+	mysql_use_result_returns   = (MYSQL_RES *)1234;
 	mysql_num_rows_returns     = 1;
 	mysql_num_fields_returns   = 0;
 	mysql_next_result_returns  = -1;
 
-	ck_assert_int_eq(db_mysql_query(dbh, "test", row_cb, NULL), 0);
-	ck_assert(mysql_real_query_called  && mysql_store_result_called);
-	ck_assert(mysql_num_rows_called    && mysql_num_fields_called);
+	ck_assert_int_eq(db_mysql_query(dbh, "test", 4, row_cb, NULL), 0);
+	ck_assert(mysql_real_query_called  && mysql_use_result_called);
+	ck_assert(mysql_num_fields_called);
 	ck_assert(mysql_next_result_called && mysql_free_result_called);
 	ck_assert(!mysql_fetch_fields_called);
 }
@@ -267,16 +301,15 @@ START_TEST(mysql_query_no_cb)
 	MYSQL *dbh = (MYSQL *)1234;
 
 	mysql_real_query_returns   = 0;
-	mysql_store_result_returns = (MYSQL_RES *)1234;
+	mysql_use_result_returns   = (MYSQL_RES *)1234;
 	mysql_num_rows_returns     = 1;
 	mysql_num_fields_returns   = 1;
 	mysql_next_result_returns  = -1;
 
-	ck_assert_int_eq(db_mysql_query(dbh, "test", NULL, NULL), 0);
-	ck_assert(mysql_real_query_called  && mysql_store_result_called);
-	ck_assert(mysql_num_rows_called    && mysql_num_fields_called);
+	ck_assert_int_eq(db_mysql_query(dbh, "test", 4, NULL, NULL), 0);
+	ck_assert(mysql_real_query_called  && mysql_use_result_called);
 	ck_assert(mysql_next_result_called && mysql_free_result_called);
-	ck_assert(!mysql_fetch_fields_called);
+	ck_assert(!mysql_fetch_fields_called && !mysql_fetch_row_called);
 }
 END_TEST
 
@@ -289,15 +322,15 @@ START_TEST(mysql_query_no_fields)
 	MYSQL *dbh = (MYSQL *)1234;
 
 	mysql_real_query_returns   = 0;
-	mysql_store_result_returns = (MYSQL_RES *)1234;
+	mysql_use_result_returns   = (MYSQL_RES *)1234;
 	mysql_num_rows_returns     = 1;
 	mysql_num_fields_returns   = 1;
 	mysql_fetch_fields_returns = NULL;
 	mysql_next_result_returns  = -1;
 
-	ck_assert_int_eq(db_mysql_query(dbh, "test", row_cb, NULL), 0);
-	ck_assert(mysql_real_query_called   && mysql_store_result_called);
-	ck_assert(mysql_num_rows_called     && mysql_num_fields_called);
+	ck_assert_int_eq(db_mysql_query(dbh, "test", 4, row_cb, NULL), 0);
+	ck_assert(mysql_real_query_called   && mysql_use_result_called);
+	ck_assert(mysql_num_fields_called);
 	ck_assert(mysql_fetch_fields_called && !mysql_fetch_row_called);
 	ck_assert(mysql_next_result_called  && mysql_free_result_called);
 }
@@ -317,21 +350,84 @@ START_TEST(test_mysql_query)
 	fields[0].name = col;
 	row[0]         = val;
 	mysql_real_query_returns   = 0;
-	mysql_store_result_returns = (MYSQL_RES *)1234;
+	mysql_use_result_returns   = (MYSQL_RES *)1234;
 	mysql_num_rows_returns     = 1;
 	mysql_num_fields_returns   = 1;
 	mysql_fetch_fields_returns = fields;
 	mysql_fetch_row_returns    = (MYSQL_ROW)&row;
 	mysql_next_result_returns  = -1;
+	row_cb_returns             = 0;
 
-	ck_assert_int_eq(db_mysql_query(dbh, "test", row_cb, NULL), 0);
-	ck_assert(mysql_real_query_called   && mysql_store_result_called);
-	ck_assert(mysql_num_rows_called     && mysql_num_fields_called);
+	ck_assert_int_eq(db_mysql_query(dbh, "test", 4, row_cb, NULL), 0);
+	ck_assert(mysql_real_query_called   && mysql_use_result_called);
+	ck_assert(mysql_num_fields_called);
 	ck_assert(mysql_fetch_fields_called && mysql_fetch_row_called);
 	ck_assert(mysql_next_result_called  && mysql_free_result_called);
 }
 END_TEST
 
+/**
+ * Test that db_mysql_query() stops fetching rows when the callback
+ * asks it to, returns 0 as for any other successful query, and still
+ * frees the result.
+ */
+START_TEST(mysql_query_stops)
+{
+	char *row[1];
+	char col[] = "col";
+	char val[] = "val";
+	MYSQL_FIELD fields[1];
+
+	fields[0].name = col;
+	row[0]         = val;
+	mysql_use_result_returns   = (MYSQL_RES *)1234;
+	mysql_num_rows_returns     = 3;
+	mysql_num_fields_returns   = 1;
+	mysql_fetch_fields_returns = fields;
+	mysql_fetch_row_returns    = (MYSQL_ROW)&row;
+	mysql_next_result_returns  = -1;
+	row_cb_called              = 0;
+	row_cb_returns             = 0;
+
+	ck_assert_int_eq(db_mysql_query((MYSQL *)1234, "test", 4, row_cb,
+	                                NULL), 0);
+	ck_assert_int_eq(row_cb_called, 3);
+	ck_assert_int_eq(mysql_fetch_row_called, 4);
+
+	mysql_fetch_row_called = 0;
+	mysql_free_result_called = 0;
+	row_cb_called  = 0;
+	row_cb_returns = 1;
+	ck_assert_int_eq(db_mysql_query((MYSQL *)1234, "test", 4, row_cb,
+	                                NULL), 0);
+	ck_assert_int_eq(row_cb_called, 1);
+	ck_assert_int_eq(mysql_fetch_row_called, 1);
+	ck_assert_int_eq(mysql_free_result_called, 1);
+}
+END_TEST
+
+/**
+ * Test that db_mysql_query() fails if a row can't be fetched.
+ */
+START_TEST(mysql_query_fetch_fails)
+{
+	char errmsg[] = "xxx";
+	MYSQL_FIELD fields[1];
+
+	*errbuf = '\0';
+	mysql_use_result_returns   = (MYSQL_RES *)1234;
+	mysql_num_fields_returns   = 1;
+	mysql_fetch_fields_returns = fields;
+	mysql_errno_returns        = 2013;
+	mysql_error_returns        = errmsg;
+	ck_assert_int_eq(db_mysql_query((MYSQL *)1234, "test", 4, row_cb,
+	                                NULL), 1);
+	ck_assert_str_eq(errbuf, "query failed: xxx\n");
+	ck_assert_int_eq(mysql_free_result_called, 1);
+	ck_assert(!mysql_next_result_called);
+}
+END_TEST
+
 /**
  * Test that db_mysql_disconnect() works.
  */
@@ -344,6 +440,166 @@ START_TEST(test_mysql_disconnect)
 }
 END_TEST
 
+/**
+ * Test that db_mysql_prepare() returns NULL and reports the error
+ * if the statement can't be prepared.
+ */
+START_TEST(mysql_prepare_fails)
+{
+	*errbuf = '\0';
+	ck_assert_ptr_null(db_mysql_prepare(NULL, "test", 0));
+	ck_assert_ptr_null(db_mysql_prepare((void *)1234, "test", 0));
+
+	mysql_stmt_init_returns    = (MYSQL_STMT *)1234;
+	mysql_stmt_prepare_returns = 1;
+	ck_assert_ptr_null(db_mysql_prepare((void *)1234, "test", 0));
+	ck_assert_str_eq(errbuf, "prepare failed: stmt error\n");
+	ck_assert(mysql_stmt_close_called);
+}
+END_TEST
+
+/**
+ * Test that db_mysql_prepare() and db_mysql_finalize() work.
+ */
+START_TEST(test_mysql_prepare)
+{
+	mysql_stmt_init_returns = (MYSQL_STMT *)1234;
+	ck_assert_ptr_eq(db_mysql_prepare((void *)1234, "test", 0),
+	                 (void *)1234);
+	db_mysql_finalize(NULL, (void *)1234);
+	ck_assert(mysql_stmt_close_called);
+}
+END_TEST
+
+/**
+ * Test that db_mysql_execute() reports the error if the statement
+ * fails to execute.
+ */
+START_TEST(mysql_execute_fails)
+{
+	*errbuf = '\0';
+	mysql_stmt_execute_returns = 1;
+	ck_assert_int_eq(db_mysql_execute(NULL, (void *)1234, 0, NULL,
+	                                  NULL, NULL), 1);
+	ck_assert_int_eq(db_mysql_execute((void *)1234, (void *)1234, 0,
+	                                  NULL, NULL, NULL), 1);
+	ck_assert_str_eq(errbuf, "query failed: stmt error\n");
+}
+END_TEST
+
+/**
+ * Test that db_mysql_execute() binds text and NULL parameters.
+ */
+START_TEST(mysql_execute_binds_params)
+{
+	const char *params[2] = { "xyz", NULL };
+
+	ck_assert_int_eq(db_mysql_execute((void *)1234, (void *)1234, 2,
+	                                  params, row_cb, NULL), 0);
+	ck_assert_ptr_nonnull(mysql_stmt_bound_params);
+	ck_assert_int_eq(mysql_stmt_fetch_called, 0);
+}
+END_TEST
+
+/**
+ * Test that db_mysql_execute() passes each row to the callback.
+ */
+START_TEST(test_mysql_execute)
+{
+	char col[] = "col";
+	MYSQL_FIELD fields[1];
+
+	fields[0].name       = col;
+	fields[0].max_length = 5;
+	mysql_stmt_result_metadata_returns = (MYSQL_RES *)1234;
+	mysql_num_fields_returns   = 1;
+	mysql_fetch_fields_returns = fields;
+	mysql_stmt_fetch_rows      = 2;
+	row_cb_called              = 0;
+	row_cb_returns             = 0;
+
+	ck_assert_int_eq(db_mysql_execute((void *)1234, (void *)1234, 0,
+	                                  NULL, row_cb, (void *)2), 0);
+	ck_assert_int_eq(row_cb_called, 2);
+	ck_assert(mysql_stmt_free_result_called && mysql_free_result_called);
+
+	/* A fetch error is reported */
+	mysql_stmt_fetch_returns = 1;
+	ck_assert_int_eq(db_mysql_execute((void *)1234, (void *)1234, 0,
+	                                  NULL, row_cb, (void *)2), 1);
+}
+END_TEST
+
+/**
+ * Test that db_mysql_copy() streams the rows to LOAD DATA LOCAL
+ * INFILE from memory.
+ */
+START_TEST(test_mysql_copy)
+{
+	const char *rows = "1\tabc\n2\t\\N\n";
+
+	mysql_init_returns         = (MYSQL *)1234;
+	mysql_real_connect_returns = mysql_init_returns;
+	ck_assert_ptr_nonnull(db_mysql_connect(NULL, 0, "u", "p", "db"));
+
+	mysql_next_result_returns = -1;
+	ck_assert_int_eq(db_mysql_copy((MYSQL *)1234, "t(a, b)", rows,
+	                               strlen(rows)), 0);
+	ck_assert_str_eq(mysql_real_query_query,
+	                 "LOAD DATA LOCAL INFILE 'mmm' INTO TABLE t "
+	                 "CHARACTER SET utf8 (a, b)");
+	ck_assert_str_eq(mysql_infile_data, rows);
+
+	/* Without a column list */
+	ck_assert_int_eq(db_mysql_copy((MYSQL *)1234, "t", rows, 2), 0);
+	ck_assert_str_eq(mysql_real_query_query,
+	                 "LOAD DATA LOCAL INFILE 'mmm' INTO TABLE t "
+	                 "CHARACTER SET utf8 ");
+}
+END_TEST
+
+/**
+ * Test that db_mysql_copy() reports a failed load.
+ */
+START_TEST(mysql_copy_fails)
+{
+	char errmsg[] = "xxx";
+
+	*errbuf = '\0';
+	mysql_real_query_returns = 1;
+	mysql_error_returns      = errmsg;
+	ck_assert_int_ne(db_mysql_copy((MYSQL *)1234, "t", "1\n", 2), 0);
+	ck_assert_str_eq(errbuf, "query failed: xxx\n");
+}
+END_TEST
+
+/**
+ * Test that db_mysql_copy() fails if the load raised any warnings,
+ * and that the handler refuses a file other than the rows.
+ */
+START_TEST(mysql_copy_warnings)
+{
+	char errmsg[] = "xxx";
+
+	mysql_error_returns        = errmsg;
+	mysql_init_returns         = (MYSQL *)1234;
+	mysql_real_connect_returns = mysql_init_returns;
+	ck_assert_ptr_nonnull(db_mysql_connect(NULL, 0, "u", "p", "db"));
+
+	*errbuf = '\0';
+	mysql_next_result_returns   = -1;
+	mysql_warning_count_returns = 2;
+	ck_assert_int_ne(db_mysql_copy((MYSQL *)1234, "t(a)", "1\n", 2), 0);
+	ck_assert_str_eq(errbuf, "copy into t(a): 2 warnings\n");
+
+	*mysql_infile_data          = '\0';
+	mysql_warning_count_returns = 0;
+	mysql_infile_name           = "/etc/passwd";
+	ck_assert_int_ne(db_mysql_copy((MYSQL *)1234, "t", "1\n", 2), 0);
+	ck_assert_str_eq(mysql_infile_data, "");
+}
+END_TEST
+
 Suite *db_mysql_suite(void)
 {
 	Suite *s;
@@ -364,6 +620,7 @@ Suite *db_mysql_suite(void)
 	tcase_add_test(t, mysql_connect_fails_unix_socket);
 	tcase_add_test(t, mysql_connect_fails_default_host);
 	tcase_add_test(t, test_mysql_connect);
+	tcase_add_test(t, mysql_connect_refuses_infile);
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
@@ -378,6 +635,26 @@ Suite *db_mysql_suite(void)
 	tcase_add_test(t, mysql_query_no_cb);
 	tcase_add_test(t, mysql_query_no_fields);
 	tcase_add_test(t, test_mysql_query);
+	tcase_add_test(t, mysql_query_stops);
+	tcase_add_test(t, mysql_query_fetch_fails);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("db_mysql_prepare");
+	tcase_add_checked_fixture(t, reset_mysql_stubs, NULL);
+	tcase_add_test(t, mysql_prepare_fails);
+	tcase_add_test(t, test_mysql_prepare);
+	tcase_add_test(t, mysql_execute_fails);
+	tcase_add_test(t, mysql_execute_binds_params);
+	tcase_add_test(t, test_mysql_execute);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("db_mysql_copy");
+	tcase_add_checked_fixture(t, reset_mysql_stubs, NULL);
+	tcase_add_test(t, test_mysql_copy);
+	tcase_add_test(t, mysql_copy_fails);
+	tcase_add_test(t, mysql_copy_warnings);
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
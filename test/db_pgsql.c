@@ -22,19 +22,19 @@ extern char errbuf[];
 static int row_cb_returns = 1;
 static int row_cb_called  = 0;
 
-static int row_cb(void *userdata, int n_cols, char **fields,
-                  char **column_names)
+static int row_cb(void *userdata, const struct db_row *row)
 {
 	++row_cb_called;
 
-	if (userdata == (void *)1 && n_cols == 1) {
-		ck_assert_str_eq(column_names[0], "col");
-		ck_assert_ptr_null(fields[0]);
+	if (userdata == (void *)1 && row->n_cols == 1) {
+		ck_assert_str_eq(row->column_names[0], "col");
+		ck_assert_ptr_null(row->fields[0]);
 	}
 
-	if (userdata == (void *)2 && n_cols == 1) {
-		ck_assert_str_eq(column_names[0], "col");
-		ck_assert_str_eq(fields[0], "value");
+	if (userdata == (void *)2 && row->n_cols == 1) {
+		ck_assert_str_eq(row->column_names[0], "col");
+		ck_assert_str_eq(row->fields[0], "value");
+		ck_assert_uint_eq(row->lengths[0], 5);
 	}
 
 	return row_cb_returns;
@@ -113,9 +113,9 @@ START_TEST(pgsql_query_invalid_args)
 {
 	PGconn *dbh = (PGconn *)1234;
 
-	ck_assert_int_ne(db_pgsql_query(NULL, "test", NULL, NULL), 0);
-	ck_assert_int_ne(db_pgsql_query(dbh, NULL, NULL, NULL), 0);
-	ck_assert_int_ne(db_pgsql_query(NULL, NULL, NULL, NULL), 0);
+	ck_assert_int_ne(db_pgsql_query(NULL, "test", 4, NULL, NULL), 0);
+	ck_assert_int_ne(db_pgsql_query(dbh, NULL, 0, NULL, NULL), 0);
+	ck_assert_int_ne(db_pgsql_query(NULL, NULL, 0, NULL, NULL), 0);
 	ck_assert(!PQexec_called);
 }
 END_TEST
@@ -133,11 +133,11 @@ START_TEST(pgsql_query_fails)
 	PQerrorMessage_returns = NULL;
 	*errbuf = '\0';
 
-	ck_assert_int_ne(db_pgsql_query(dbh, "test", NULL, NULL), 0);
+	ck_assert_int_ne(db_pgsql_query(dbh, "test", 4, NULL, NULL), 0);
 	ck_assert(!*errbuf && !PQclear_called);
 
 	PQerrorMessage_returns = errmsg;
-	ck_assert_int_ne(db_pgsql_query(dbh, "test", NULL, NULL), 0);
+	ck_assert_int_ne(db_pgsql_query(dbh, "test", 4, NULL, NULL), 0);
 	ck_assert_str_eq(errbuf, "query failed: xxx\n");
 	ck_assert(!PQclear_called);
 }
@@ -158,12 +158,12 @@ START_TEST(pgsql_query_bad_status)
 	PQerrorMessage_returns = NULL;
 	*errbuf = '\0';
 
-	ck_assert_int_ne(db_pgsql_query(dbh, "test", NULL, NULL), 0);
+	ck_assert_int_ne(db_pgsql_query(dbh, "test", 4, NULL, NULL), 0);
 	ck_assert(!*errbuf && PQclear_called);
 
 	PQclear_called = 0;
 	PQerrorMessage_returns = errmsg;
-	ck_assert_int_ne(db_pgsql_query(dbh, "test", NULL, NULL), 0);
+	ck_assert_int_ne(db_pgsql_query(dbh, "test", 4, NULL, NULL), 0);
 	ck_assert_str_eq(errbuf, "query failed: xxx\n");
 	ck_assert(PQclear_called);
 }
@@ -179,7 +179,7 @@ START_TEST(pgsql_query_no_result)
 
 	PQexec_returns         = 1;
 	PQresultStatus_returns = PGRES_COMMAND_OK;
-	ck_assert_int_eq(db_pgsql_query(dbh, "test", NULL, NULL), 0);
+	ck_assert_int_eq(db_pgsql_query(dbh, "test", 4, NULL, NULL), 0);
 	ck_assert(PQclear_called);
 }
 END_TEST
@@ -197,14 +197,14 @@ START_TEST(pgsql_query_no_cols)
 	PQnfields_returns      = 1;
 	PQexec_returns         = 1;
 	PQresultStatus_returns = PGRES_TUPLES_OK;
-	ck_assert_int_eq(db_pgsql_query(dbh, "test", row_cb, NULL), 0);
+	ck_assert_int_eq(db_pgsql_query(dbh, "test", 4, row_cb, NULL), 0);
 	ck_assert(PQclear_called && !(PQfname_called || PQgetvalue_called));
 
 	PQntuples_returns = -1;
 	PQfname_called    = 0;
 	PQgetvalue_called = 0;
 	PQclear_called    = 0;
-	ck_assert_int_eq(db_pgsql_query(dbh, "test", row_cb, NULL), 0);
+	ck_assert_int_eq(db_pgsql_query(dbh, "test", 4, row_cb, NULL), 0);
 	ck_assert(PQclear_called && !(PQfname_called || PQgetvalue_called));
 }
 END_TEST
@@ -222,14 +222,14 @@ START_TEST(pgsql_query_no_rows)
 	PQnfields_returns      = 0;
 	PQexec_returns         = 1;
 	PQresultStatus_returns = PGRES_TUPLES_OK;
-	ck_assert_int_eq(db_pgsql_query(dbh, "test", row_cb, NULL), 0);
+	ck_assert_int_eq(db_pgsql_query(dbh, "test", 4, row_cb, NULL), 0);
 	ck_assert(PQclear_called && !(PQfname_called || PQgetvalue_called));
 
 	PQnfields_returns = -1;
 	PQfname_called    = 0;
 	PQgetvalue_called = 0;
 	PQclear_called    = 0;
-	ck_assert_int_eq(db_pgsql_query(dbh, "test", row_cb, NULL), 0);
+	ck_assert_int_eq(db_pgsql_query(dbh, "test", 4, row_cb, NULL), 0);
 	ck_assert(PQclear_called && !(PQfname_called || PQgetvalue_called));
 }
 END_TEST
@@ -247,7 +247,7 @@ START_TEST(pgsql_query_no_cb)
 	PQnfields_returns      = 1;
 	PQexec_returns         = 1;
 	PQresultStatus_returns = PGRES_TUPLES_OK;
-	ck_assert_int_eq(db_pgsql_query(dbh, "test", NULL, NULL), 0);
+	ck_assert_int_eq(db_pgsql_query(dbh, "test", 4, NULL, NULL), 0);
 	ck_assert(PQclear_called && !(PQfname_called || PQgetvalue_called));
 }
 END_TEST
@@ -270,7 +270,7 @@ START_TEST(pgsql_query_one_row_null_field)
 	PQgetisnull_returns    = 1;
 	row_cb_called          = 0;
 	row_cb_returns         = 0;
-	ck_assert_int_eq(db_pgsql_query(dbh, "test", row_cb, ud), 0);
+	ck_assert_int_eq(db_pgsql_query(dbh, "test", 4, row_cb, ud), 0);
 	ck_assert(PQclear_called && PQfname_called && PQgetisnull_called);
 	ck_assert(!PQgetvalue_called);
 	ck_assert(row_cb_called);
@@ -296,12 +296,116 @@ START_TEST(test_pgsql_query)
 	PQgetvalue_returns     = value;
 	row_cb_called          = 0;
 	row_cb_returns         = 1;
-	ck_assert_int_eq(db_pgsql_query(dbh, "test", row_cb, ud), 0);
+	ck_assert_int_eq(db_pgsql_query(dbh, "test", 4, row_cb, ud), 0);
 	ck_assert(PQclear_called && PQfname_called && PQgetvalue_called);
 	ck_assert(row_cb_called);
 }
 END_TEST
 
+/**
+ * Test that db_pgsql_query() passes rows to the callback as they
+ * arrive, one at a time.
+ */
+START_TEST(pgsql_query_streams)
+{
+	static const int script[] = {
+		PGRES_SINGLE_TUPLE, PGRES_SINGLE_TUPLE, PGRES_TUPLES_OK, 0
+	};
+	char fname[] = "col";
+	char value[] = "value";
+
+	memcpy(PQresult_script, script, sizeof script);
+	PQresult_script_len = sizeof script / sizeof *script;
+	PQntuples_returns   = 1;
+	PQnfields_returns   = 1;
+	PQfname_returns     = fname;
+	PQgetvalue_returns  = value;
+	row_cb_called       = 0;
+	row_cb_returns      = 0;
+	ck_assert_int_eq(db_pgsql_query((void *)1234, "test", 4, row_cb,
+	                                (void *)2), 0);
+	ck_assert(PQsendQuery_called && PQsetSingleRowMode_called);
+	ck_assert(!PQexec_called);
+	ck_assert_int_eq(row_cb_called, 3);
+	ck_assert_int_eq(PQclear_called, 3);
+	ck_assert(!PQcancel_called);
+}
+END_TEST
+
+/**
+ * Test that db_pgsql_query() cancels the rest of the query when the
+ * callback stops, unless that would abort the transaction or stop
+ * the statements after the one being read, and still collects
+ * every result.
+ */
+START_TEST(pgsql_query_stream_stops)
+{
+	static const int script[] = {
+		PGRES_SINGLE_TUPLE, PGRES_SINGLE_TUPLE, PGRES_FATAL_ERROR, 0
+	};
+	char fname[] = "col";
+	char value[] = "value";
+
+	*errbuf = '\0';
+	memcpy(PQresult_script, script, sizeof script);
+	PQresult_script_len = sizeof script / sizeof *script;
+	PQntuples_returns   = 1;
+	PQnfields_returns   = 1;
+	PQfname_returns     = fname;
+	PQgetvalue_returns  = value;
+	row_cb_called       = 0;
+	row_cb_returns      = 1;
+	PQtransactionStatus_returns = PQTRANS_INTRANS;
+	ck_assert_int_eq(db_pgsql_query((void *)1234, "test", 4, row_cb,
+	                                (void *)2), 0);
+	ck_assert_int_eq(row_cb_called, 1);
+	ck_assert_int_eq(PQclear_called, 3);
+	ck_assert(!PQcancel_called && !*errbuf);
+
+	PQresult_script_pos = 0;
+	PQtransactionStatus_returns = PQTRANS_IDLE;
+	ck_assert_int_eq(db_pgsql_query((void *)1234, "test", 4, row_cb,
+	                                (void *)2), 0);
+	ck_assert_int_eq(row_cb_called, 2);
+	ck_assert_int_eq(PQcancel_called, 1);
+	ck_assert(!*errbuf);
+
+	/* Cancelling would also stop the statements after the first */
+	PQresult_script_pos = 0;
+	ck_assert_int_eq(db_pgsql_query((void *)1234, "a; b;", 5, row_cb,
+	                                (void *)2), 0);
+	ck_assert_int_eq(row_cb_called, 3);
+	ck_assert_int_eq(PQcancel_called, 1);
+	ck_assert(!*errbuf);
+}
+END_TEST
+
+/**
+ * Test that db_pgsql_query() reports an error in the middle of
+ * a streamed result.
+ */
+START_TEST(pgsql_query_stream_fails)
+{
+	static const int script[] = {
+		PGRES_SINGLE_TUPLE, PGRES_FATAL_ERROR, 0
+	};
+	char errmsg[] = "xxx";
+
+	*errbuf = '\0';
+	memcpy(PQresult_script, script, sizeof script);
+	PQresult_script_len = sizeof script / sizeof *script;
+	PQntuples_returns      = 1;
+	PQnfields_returns      = 1;
+	PQerrorMessage_returns = errmsg;
+	row_cb_called          = 0;
+	row_cb_returns         = 0;
+	ck_assert_int_eq(db_pgsql_query((void *)1234, "test", 4, row_cb,
+	                                NULL), 1);
+	ck_assert_int_eq(row_cb_called, 1);
+	ck_assert_str_eq(errbuf, "query failed: xxx\n");
+}
+END_TEST
+
 /**
  * Test that db_pgsql_disconnect() calls PQfinish() if
  * dbh is not NULL.
@@ -315,6 +419,249 @@ START_TEST(test_pgsql_disconnect)
 }
 END_TEST
 
+/**
+ * Test that db_pgsql_prepare() returns NULL if the arguments are
+ * invalid, or if PQprepare() fails.
+ */
+START_TEST(pgsql_prepare_fails)
+{
+	ck_assert_ptr_null(db_pgsql_prepare(NULL, "test", 0));
+	ck_assert_ptr_null(db_pgsql_prepare((void *)1234, NULL, 0));
+	ck_assert_ptr_null(db_pgsql_prepare((void *)1234, "test", -1));
+	ck_assert(!PQprepare_called);
+
+	PQprepare_returns      = 1;
+	PQresultStatus_returns = PGRES_TUPLES_OK + 1;
+	ck_assert_ptr_null(db_pgsql_prepare((void *)1234, "test", 0));
+	ck_assert(PQprepare_called && PQclear_called);
+}
+END_TEST
+
+/**
+ * Test that db_pgsql_prepare() rewrites the parameter markers,
+ * leaving quoted question marks alone.
+ */
+START_TEST(test_pgsql_prepare)
+{
+	void *stmt;
+
+	PQprepare_returns      = 1;
+	PQresultStatus_returns = PGRES_COMMAND_OK;
+	stmt = db_pgsql_prepare((void *)1234, "SELECT '?', ? WHERE a=?", 2);
+	ck_assert_ptr_nonnull(stmt);
+	ck_assert_str_eq(PQprepare_query, "SELECT '?', $1 WHERE a=$2");
+	ck_assert_str_eq(stmt, "mmm_stmt_1");
+
+	db_pgsql_finalize((void *)1234, stmt);
+	ck_assert_int_eq(PQexec_called, 1);
+}
+END_TEST
+
+/**
+ * Test that db_pgsql_execute() works.
+ */
+START_TEST(test_pgsql_execute)
+{
+	char fname[] = "col";
+	char value[] = "value";
+	char name[]  = "mmm_stmt_1";
+	const char *params[1] = { "x" };
+
+	ck_assert_int_eq(db_pgsql_execute(NULL, name, 1, params,
+	                                  NULL, NULL), 1);
+	ck_assert(!PQexecPrepared_called);
+
+	PQntuples_returns      = 1;
+	PQnfields_returns      = 1;
+	PQexec_returns         = 1;
+	PQresultStatus_returns = PGRES_TUPLES_OK;
+	PQfname_returns        = fname;
+	PQgetvalue_returns     = value;
+	row_cb_called          = 0;
+	row_cb_returns         = 1;
+	ck_assert_int_eq(db_pgsql_execute((void *)1234, name, 1, params,
+	                                  row_cb, (void *)2), 0);
+	ck_assert(PQsendQueryPrepared_called && PQclear_called);
+	ck_assert(PQsetSingleRowMode_called);
+	ck_assert(row_cb_called);
+
+	PQresultStatus_returns = PGRES_COMMAND_OK;
+	ck_assert_int_eq(db_pgsql_execute((void *)1234, name, 1, params,
+	                                  NULL, NULL), 0);
+	ck_assert(PQexecPrepared_called);
+}
+END_TEST
+
+/**
+ * Test that db_pgsql_copy() fails if COPY doesn't start.
+ */
+START_TEST(pgsql_copy_fails)
+{
+	char errmsg[] = "xxx";
+
+	*errbuf = '\0';
+	PQexec_returns         = 1;
+	PQresultStatus_returns = 0;
+	PQerrorMessage_returns = errmsg;
+	ck_assert_int_eq(db_pgsql_copy((void *)1234, "t", "1\n", 2), 1);
+	ck_assert_str_eq(errbuf, "query failed: xxx\n");
+	ck_assert(!PQputCopyEnd_called);
+}
+END_TEST
+
+/**
+ * Test that db_pgsql_copy() aborts the COPY if it couldn't send
+ * all of the data.
+ */
+START_TEST(pgsql_copy_aborts)
+{
+	PQexec_returns         = 1;
+	PQresultStatus_returns = PGRES_COPY_IN;
+	PQputCopyData_returns  = -1;
+	PQgetResult_returns    = 1;
+	PQgetResult_status     = 0;
+	ck_assert_int_eq(db_pgsql_copy((void *)1234, "t", "1\n", 2), 1);
+	ck_assert_str_eq(PQcopy_error, "incomplete data");
+	ck_assert_int_eq(PQclear_called, 2);
+}
+END_TEST
+
+/**
+ * Test that db_pgsql_copy() sends the rows with COPY ... FROM STDIN,
+ * terminating the last one if need be.
+ */
+START_TEST(test_pgsql_copy)
+{
+	PQexec_returns         = 1;
+	PQresultStatus_returns = PGRES_COPY_IN;
+	PQgetResult_returns    = 1;
+	PQgetResult_status     = PGRES_COMMAND_OK;
+	ck_assert_int_eq(db_pgsql_copy((void *)1234, "t(a, b)", "1\tx\n2\ty",
+	                               7), 0);
+	ck_assert_str_eq(PQcopy_data, "1\tx\n2\ty\n");
+	ck_assert(!*PQcopy_error);
+	ck_assert_int_eq(PQputCopyEnd_called, 1);
+	ck_assert_int_eq(PQclear_called, 2);
+}
+END_TEST
+
+/**
+ * Test that queries are split into statements and pipelined, and
+ * that their results are collected when the pipeline ends.
+ */
+START_TEST(test_pgsql_pipeline)
+{
+	static const int script[] = {
+		PGRES_COMMAND_OK, 0, PGRES_COMMAND_OK, 0, PGRES_COMMAND_OK, 0,
+		PGRES_PIPELINE_SYNC
+	};
+	const char *params[1] = { "x" };
+	char stmt[] = "mmm_stmt_1";
+
+	memcpy(PQresult_script, script, sizeof script);
+	PQresult_script_len = sizeof script / sizeof *script;
+	ck_assert_int_eq(db_pgsql_pipeline((void *)1234, 1), 0);
+	ck_assert_int_eq(db_pgsql_query((void *)1234,
+	                                "SELECT ';'; ;\n-- x\nSELECT $$;$$", 31,
+	                                NULL, NULL), 0);
+	ck_assert_int_eq(db_pgsql_execute((void *)1234, stmt, 1,
+	                                  params, NULL, NULL), 0);
+	ck_assert_str_eq(PQsent, "SELECT ';';|\n-- x\nSELECT $$;$$|"
+	                 "mmm_stmt_1|");
+	ck_assert(!PQexec_called && !PQpipelineSync_called);
+
+	ck_assert_int_eq(db_pgsql_pipeline((void *)1234, 0), 0);
+	ck_assert_int_eq(PQpipelineSync_called, 1);
+	ck_assert_int_eq(PQexitPipelineMode_called, 1);
+	ck_assert_int_eq(PQclear_called, 4);
+}
+END_TEST
+
+/**
+ * Test that the first failed statement in the pipeline is
+ * reported, and fails the pipeline.
+ */
+START_TEST(pgsql_pipeline_fails)
+{
+	static const int script[] = {
+		PGRES_COMMAND_OK, 0, PGRES_FATAL_ERROR, 0,
+		PGRES_PIPELINE_ABORTED, 0, PGRES_PIPELINE_SYNC
+	};
+	char errmsg[] = "xxx";
+
+	*errbuf = '\0';
+	memcpy(PQresult_script, script, sizeof script);
+	PQresult_script_len = sizeof script / sizeof *script;
+	PQerrorMessage_returns = errmsg;
+	ck_assert_int_eq(db_pgsql_pipeline((void *)1234, 1), 0);
+	ck_assert_int_eq(db_pgsql_query((void *)1234, "SELECT 1;\n"
+	                                "SELECT\tx; SELECT 3;", 29, NULL,
+	                                NULL), 0);
+	ck_assert_int_eq(db_pgsql_pipeline((void *)1234, 0), 1);
+	ck_assert_str_eq(errbuf, "statement failed: SELECT x;\n");
+
+	/* Nothing more is sent once the pipeline has failed */
+	ck_assert_int_eq(db_pgsql_pipeline((void *)1234, 1), 0);
+	pipeline.failed = 1;
+	ck_assert_int_ne(db_pgsql_query((void *)1234, "SELECT 4;", 9, NULL,
+	                                NULL), 0);
+	ck_assert(!strstr(PQsent, "SELECT 4"));
+}
+END_TEST
+
+/**
+ * Test that a failed statement is reported with the label it was
+ * sent with, and that labels are only kept in pipeline mode.
+ */
+START_TEST(pgsql_pipeline_label)
+{
+	static const int script[] = {
+		PGRES_COMMAND_OK, 0, PGRES_FATAL_ERROR, 0, PGRES_PIPELINE_SYNC
+	};
+	char errmsg[] = "xxx";
+
+	*errbuf = '\0';
+	memcpy(PQresult_script, script, sizeof script);
+	PQresult_script_len = sizeof script / sizeof *script;
+	PQerrorMessage_returns = errmsg;
+	ck_assert_int_eq(db_pgsql_label((void *)1234, "x"), 0);
+	ck_assert_int_eq(db_pgsql_pipeline((void *)1234, 1), 0);
+	ck_assert_int_eq(db_pgsql_label((void *)1234, "1.sql: stmt 1"), 1);
+	ck_assert_int_eq(db_pgsql_query((void *)1234, "SELECT 1;", 9, NULL,
+	                                NULL), 0);
+	ck_assert_int_eq(db_pgsql_label((void *)1234, "1.sql: stmt 2"), 1);
+	ck_assert_int_eq(db_pgsql_query((void *)1234, "SELECT\nx;", 9, NULL,
+	                                NULL), 0);
+	ck_assert_int_eq(db_pgsql_pipeline((void *)1234, 0), 1);
+	ck_assert_str_eq(errbuf, "1.sql: stmt 2 failed: SELECT x;\n");
+}
+END_TEST
+
+/**
+ * Test that queries which need their results right away leave
+ * pipeline mode for as long as they run.
+ */
+START_TEST(pgsql_pipeline_pauses)
+{
+	static const int script[] = { PGRES_COMMAND_OK, 0,
+	                              PGRES_PIPELINE_SYNC };
+
+	memcpy(PQresult_script, script, sizeof script);
+	PQresult_script_len = sizeof script / sizeof *script;
+	PQexec_returns      = 1;
+	ck_assert_int_eq(db_pgsql_pipeline((void *)1234, 1), 0);
+	ck_assert_int_eq(db_pgsql_query((void *)1234, "SELECT 1", 8, NULL,
+	                                NULL), 0);
+	db_pgsql_query((void *)1234, "SELECT 2", 8, row_cb, NULL);
+	ck_assert_int_eq(PQpipelineSync_called, 1);
+	ck_assert_int_eq(PQexitPipelineMode_called, 1);
+	ck_assert_int_eq(PQenterPipelineMode_called, 2);
+	ck_assert_int_eq(PQsendQuery_called, 1);
+	ck_assert_int_eq(db_pgsql_pipeline((void *)1234, 0), 0);
+	ck_assert_int_eq(PQpipelineSync_called, 1);
+}
+END_TEST
+
 Suite *db_pgsql_suite(void)
 {
 	Suite *s;
@@ -341,6 +688,34 @@ Suite *db_pgsql_suite(void)
 	tcase_add_test(t, pgsql_query_no_cb);
 	tcase_add_test(t, pgsql_query_one_row_null_field);
 	tcase_add_test(t, test_pgsql_query);
+	tcase_add_test(t, pgsql_query_streams);
+	tcase_add_test(t, pgsql_query_stream_stops);
+	tcase_add_test(t, pgsql_query_stream_fails);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("db_pgsql_prepare");
+	tcase_add_checked_fixture(t, reset_libpq_stubs, NULL);
+	tcase_add_test(t, pgsql_prepare_fails);
+	tcase_add_test(t, test_pgsql_prepare);
+	tcase_add_test(t, test_pgsql_execute);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("db_pgsql_copy");
+	tcase_add_checked_fixture(t, reset_libpq_stubs, NULL);
+	tcase_add_test(t, pgsql_copy_fails);
+	tcase_add_test(t, pgsql_copy_aborts);
+	tcase_add_test(t, test_pgsql_copy);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("db_pgsql_pipeline");
+	tcase_add_checked_fixture(t, reset_libpq_stubs, NULL);
+	tcase_add_test(t, test_pgsql_pipeline);
+	tcase_add_test(t, pgsql_pipeline_fails);
+	tcase_add_test(t, pgsql_pipeline_label);
+	tcase_add_test(t, pgsql_pipeline_pauses);
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
@@ -90,9 +90,15 @@ END_TEST
  */
 START_TEST(sqlite3_query_fails)
 {
-	sqlite3_exec_errmsg  = NULL;
-	sqlite3_exec_returns = ~SQLITE_OK;
-	ck_assert_int_eq(db_sqlite3_query(NULL, "test", NULL, NULL), 1);
+	sqlite3_errmsg_returns  = "xxx";
+	sqlite3_prepare_returns = ~SQLITE_OK;
+	ck_assert_int_eq(db_sqlite3_query(NULL, "test", 4, NULL, NULL), 1);
+
+	sqlite3_prepare_stmt    = (void *)1234;
+	sqlite3_prepare_returns = SQLITE_OK;
+	sqlite3_step_returns    = ~SQLITE_DONE;
+	ck_assert_int_eq(db_sqlite3_query(NULL, "test", 4, NULL, NULL), 1);
+	ck_assert_int_eq(sqlite3_finalize_called, 1);
 }
 END_TEST
 
@@ -102,35 +108,260 @@ END_TEST
  */
 START_TEST(sqlite3_query_fails_with_error_message)
 {
-	char errmsg[] = "xxx";
 	*errbuf = '\0';
-	sqlite3_exec_errmsg  = errmsg;
-	sqlite3_exec_returns = ~SQLITE_OK;
-	ck_assert_int_eq(db_sqlite3_query(NULL, "test", NULL, NULL), 1);
+	sqlite3_errmsg_returns  = "xxx";
+	sqlite3_prepare_returns = ~SQLITE_OK;
+	ck_assert_int_eq(db_sqlite3_query(NULL, "test", 4, NULL, NULL), 1);
 	ck_assert_str_eq(errbuf, "query failed: xxx\n");
 }
 END_TEST
 
 /**
- * Test that db_sqlite3_query() return 0 if the
- * callback causes SQLITE_ABORT to be returned.
+ * Test that db_sqlite3_query() works, and only runs what it's
+ * given of the query.
  */
-START_TEST(sqlite3_query_callback_abort)
+START_TEST(test_sqlite3_query)
 {
-	sqlite3_exec_errmsg  = NULL;
-	sqlite3_exec_returns = SQLITE_ABORT;
-	ck_assert_int_eq(db_sqlite3_query(NULL, "test", NULL, NULL), 0);
+	sqlite3_prepare_stmt    = (void *)1234;
+	sqlite3_prepare_returns = SQLITE_OK;
+	ck_assert_int_eq(db_sqlite3_query(NULL, "a; b; c", 4, NULL, NULL), 0);
+	ck_assert_str_eq(sqlite3_queries, "a;| b|");
+	ck_assert_int_eq(sqlite3_finalize_called, 2);
 }
 END_TEST
 
+static int rows_seen = 0;
+static int row_cb(void *userdata, const struct db_row *row)
+{
+	ck_assert_int_eq(row->n_cols, 1);
+	ck_assert_uint_eq(row->index, (unsigned long)rows_seen);
+	ck_assert_str_eq(row->fields[0], "value");
+	ck_assert_uint_eq(row->lengths[0], 5);
+	ck_assert_str_eq(row->column_names[0], "column");
+	return ++rows_seen == *(int *)userdata;
+}
+
 /**
- * Test that db_sqlite3_query() works.
+ * Test that db_sqlite3_query() steps through each statement when
+ * given a callback, and doesn't run the rest once it stops.
  */
-START_TEST(test_sqlite3_query)
+START_TEST(sqlite3_query_callback_stops)
+{
+	int stop_at = 0;
+
+	sqlite3_prepare_stmt    = (void *)1234;
+	sqlite3_prepare_returns = SQLITE_OK;
+	sqlite3_step_rows       = 2;
+	ck_assert_int_eq(db_sqlite3_query(NULL, "a; b; c", 7, row_cb,
+	                                  &stop_at), 0);
+	ck_assert_int_eq(sqlite3_prepare_v2_called, 3);
+	ck_assert_int_eq(sqlite3_finalize_called, 3);
+	ck_assert_int_eq(rows_seen, 2);
+
+	rows_seen         = 0;
+	stop_at           = 1;
+	sqlite3_step_rows = 2;
+	ck_assert_int_eq(db_sqlite3_query(NULL, "a; b; c", 7, row_cb,
+	                                  &stop_at), 0);
+	ck_assert_int_eq(sqlite3_prepare_v2_called, 4);
+	ck_assert_int_eq(rows_seen, 1);
+	ck_assert_str_eq(sqlite3_queries, "a;| b;| c|a;|");
+}
+END_TEST
+
+/**
+ * Test that db_sqlite3_query() reports a failed step when given
+ * a callback.
+ */
+START_TEST(sqlite3_query_callback_step_fails)
+{
+	int stop_at = 0;
+
+	*errbuf = '\0';
+	sqlite3_errmsg_returns  = "xxx";
+	sqlite3_prepare_stmt    = (void *)1234;
+	sqlite3_prepare_returns = SQLITE_OK;
+	sqlite3_step_returns    = ~SQLITE_DONE;
+	ck_assert_int_eq(db_sqlite3_query(NULL, "a; b", 4, row_cb,
+	                                  &stop_at), 1);
+	ck_assert_int_eq(sqlite3_prepare_v2_called, 1);
+	ck_assert_int_eq(sqlite3_finalize_called, 1);
+	ck_assert_str_eq(errbuf, "query failed: xxx\n");
+}
+END_TEST
+
+/**
+ * Test that db_sqlite3_prepare() reports errors from sqlite.
+ */
+START_TEST(sqlite3_prepare_fails)
+{
+	*errbuf = '\0';
+	sqlite3_errmsg_returns  = "xxx";
+	sqlite3_prepare_stmt    = (void *)1234;
+	sqlite3_prepare_returns = ~SQLITE_OK;
+	ck_assert_ptr_null(db_sqlite3_prepare(NULL, "test", 0));
+	ck_assert_str_eq(errbuf, "prepare failed: xxx\n");
+}
+END_TEST
+
+/**
+ * Test that db_sqlite3_prepare() and db_sqlite3_finalize() work.
+ */
+START_TEST(test_sqlite3_prepare)
+{
+	sqlite3_prepare_stmt    = (void *)1234;
+	sqlite3_prepare_returns = SQLITE_OK;
+	ck_assert_ptr_eq(db_sqlite3_prepare(NULL, "test", 0), (void *)1234);
+	db_sqlite3_finalize(NULL, (void *)1234);
+	ck_assert_int_eq(sqlite3_finalize_called, 1);
+}
+END_TEST
+
+/**
+ * Test that db_sqlite3_execute() returns 1 if binding a parameter
+ * fails, and still resets the statement.
+ */
+START_TEST(sqlite3_execute_bind_fails)
+{
+	const char *params[2] = { "a", "b" };
+
+	*errbuf = '\0';
+	sqlite3_errmsg_returns = "xxx";
+	sqlite3_bind_returns   = ~SQLITE_OK;
+	ck_assert_int_eq(db_sqlite3_execute(NULL, NULL, 2, params,
+	                                    NULL, NULL), 1);
+	ck_assert_int_eq(sqlite3_bind_called, 1);
+	ck_assert_int_eq(sqlite3_reset_called, 1);
+	ck_assert_str_eq(errbuf, "query failed: xxx\n");
+}
+END_TEST
+
+/**
+ * Test that db_sqlite3_execute() returns 1 if a step fails.
+ */
+START_TEST(sqlite3_execute_step_fails)
+{
+	sqlite3_errmsg_returns = "xxx";
+	sqlite3_step_rows      = 1;
+	sqlite3_step_returns   = SQLITE_ABORT;
+	ck_assert_int_eq(db_sqlite3_execute(NULL, NULL, 0, NULL,
+	                                    NULL, NULL), 1);
+	ck_assert_int_eq(sqlite3_reset_called, 1);
+}
+END_TEST
+
+/**
+ * Test that db_sqlite3_execute() passes each row to the callback,
+ * stopping when the callback returns non-zero.
+ */
+START_TEST(test_sqlite3_execute)
+{
+	const char *params[2] = { "a", "b" };
+	int stop_at = 2;
+
+	sqlite3_bind_returns = SQLITE_OK;
+	sqlite3_step_rows    = 3;
+	sqlite3_step_returns = SQLITE_DONE;
+	ck_assert_int_eq(db_sqlite3_execute(NULL, NULL, 2, params,
+	                                    row_cb, &stop_at), 0);
+	ck_assert_int_eq(sqlite3_bind_called, 2);
+	ck_assert_int_eq(rows_seen, 2);
+	ck_assert_int_eq(sqlite3_reset_called, 1);
+
+	stop_at   = 0;
+	rows_seen = 0;
+	sqlite3_step_rows = 3;
+	ck_assert_int_eq(db_sqlite3_execute(NULL, NULL, 2, params,
+	                                    row_cb, &stop_at), 0);
+	ck_assert_int_eq(rows_seen, 3);
+}
+END_TEST
+
+/**
+ * Test that db_sqlite3_copy() inserts each row with a prepared
+ * statement, inside of a savepoint.
+ */
+START_TEST(test_sqlite3_copy)
+{
+	const char *rows = "1\ta\\tb\\\\\n\\N\tc\n";
+
+	sqlite3_prepare_stmt    = (void *)1234;
+	sqlite3_prepare_returns = SQLITE_OK;
+	ck_assert_int_eq(db_sqlite3_copy(NULL, "t(x, y)", rows,
+	                                 strlen(rows)), 0);
+	ck_assert_str_eq(sqlite3_prepare_query,
+	                 "INSERT INTO t(x, y) VALUES (?,?)");
+	ck_assert_str_eq(sqlite3_bound, "1|a\tb\\|NULL|c|");
+	ck_assert_str_eq(sqlite3_exec_queries,
+	                 "SAVEPOINT mmm_copy|RELEASE mmm_copy|");
+	ck_assert_int_eq(sqlite3_reset_called, 2);
+	ck_assert_int_eq(sqlite3_finalize_called, 1);
+}
+END_TEST
+
+/**
+ * Test that db_sqlite3_copy() drops the CR from rows ending in CRLF,
+ * but keeps escaped ones.
+ */
+START_TEST(sqlite3_copy_crlf)
+{
+	const char *rows = "1\ta\\r\r\n\\N\t\\N\r\n2\tb";
+
+	sqlite3_prepare_stmt    = (void *)1234;
+	sqlite3_prepare_returns = SQLITE_OK;
+	ck_assert_int_eq(db_sqlite3_copy(NULL, "t", rows, strlen(rows)), 0);
+	ck_assert_str_eq(sqlite3_bound, "1|a\r|NULL|NULL|2|b|");
+	ck_assert_int_eq(sqlite3_reset_called, 3);
+}
+END_TEST
+
+/**
+ * Test that db_sqlite3_copy() rolls back if a row has the wrong
+ * number of fields.
+ */
+START_TEST(sqlite3_copy_bad_row)
 {
-	sqlite3_exec_errmsg  = NULL;
-	sqlite3_exec_returns = SQLITE_OK;
-	ck_assert_int_eq(db_sqlite3_query(NULL, "test", NULL, NULL), 0);
+	const char *rows = "1\t2\n3\n";
+
+	*errbuf = '\0';
+	sqlite3_prepare_stmt    = (void *)1234;
+	sqlite3_prepare_returns = SQLITE_OK;
+	ck_assert_int_eq(db_sqlite3_copy(NULL, "t", rows, strlen(rows)), 1);
+	ck_assert_str_eq(errbuf, "copy failed: row 2 doesn't have 2 fields\n");
+	ck_assert_str_eq(sqlite3_exec_queries,
+	                 "SAVEPOINT mmm_copy|"
+	                 "ROLLBACK TO mmm_copy; RELEASE mmm_copy|");
+	ck_assert_int_eq(sqlite3_finalize_called, 1);
+
+	/* ... or too many */
+	*errbuf = '\0';
+	rows = "1\t2\n3\t4\t5";
+	ck_assert_int_eq(db_sqlite3_copy(NULL, "t", rows, strlen(rows)), 1);
+	ck_assert_str_eq(errbuf, "copy failed: row 2 doesn't have 2 fields\n");
+}
+END_TEST
+
+/**
+ * Test that db_sqlite3_copy() rolls back if an insert fails.
+ */
+START_TEST(sqlite3_copy_step_fails)
+{
+	*errbuf = '\0';
+	sqlite3_errmsg_returns  = "xxx";
+	sqlite3_prepare_stmt    = (void *)1234;
+	sqlite3_prepare_returns = SQLITE_OK;
+	sqlite3_step_returns    = SQLITE_ABORT;
+	ck_assert_int_eq(db_sqlite3_copy(NULL, "t", "1", 1), 1);
+	ck_assert_str_eq(errbuf, "copy failed: row 1: xxx\n");
+	ck_assert(strstr(sqlite3_exec_queries, "ROLLBACK TO"));
+
+	/* Nothing is inserted if the statement can't be prepared */
+	*errbuf = '\0';
+	*sqlite3_exec_queries   = '\0';
+	sqlite3_prepare_returns = ~SQLITE_OK;
+	ck_assert_int_eq(db_sqlite3_copy(NULL, "t", "1", 1), 1);
+	ck_assert_str_eq(errbuf, "prepare failed: xxx\n");
+	ck_assert(strstr(sqlite3_exec_queries, "ROLLBACK TO"));
 }
 END_TEST
 
@@ -156,8 +387,26 @@ Suite *db_sqlite3_suite(void)
 	t = tcase_create("db_sqlite3_query");
 	tcase_add_test(t, sqlite3_query_fails);
 	tcase_add_test(t, sqlite3_query_fails_with_error_message);
-	tcase_add_test(t, sqlite3_query_callback_abort);
 	tcase_add_test(t, test_sqlite3_query);
+	tcase_add_test(t, sqlite3_query_callback_stops);
+	tcase_add_test(t, sqlite3_query_callback_step_fails);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("db_sqlite3_prepare");
+	tcase_add_test(t, sqlite3_prepare_fails);
+	tcase_add_test(t, test_sqlite3_prepare);
+	tcase_add_test(t, sqlite3_execute_bind_fails);
+	tcase_add_test(t, sqlite3_execute_step_fails);
+	tcase_add_test(t, test_sqlite3_execute);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("db_sqlite3_copy");
+	tcase_add_test(t, test_sqlite3_copy);
+	tcase_add_test(t, sqlite3_copy_crlf);
+	tcase_add_test(t, sqlite3_copy_bad_row);
+	tcase_add_test(t, sqlite3_copy_step_fails);
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
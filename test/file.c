@@ -17,10 +17,106 @@
 /* from test_runner.c */
 extern char errbuf[];
 
+#define HAVE_LIBZ
+#define HAVE_LIBZSTD
 #include "posix_stubs.h"
+#include "zlib_stubs.h"
+#include "zstd_stubs.h"
+
+/* {{{ uring stubs */
+struct uring_file {
+	size_t off;
+	size_t size;
+	int ok;
+};
+
+static char *uring_read_files(char **paths, size_t n,
+                              struct uring_file *files);
+/* }}} */
+
+#define URING_H
+#define FILE_BATCH_MIN 2
 #include "../src/file.h"
 #include "../src/file.c"
 
+static const char gz_data[]   = "\x1f\x8bSELECT$\x1f\x8b 1;$";
+static const char zstd_data[] = "\x28\xb5\x2f\xfdSELECT 1;$";
+
+/* Contents of each file read with io_uring (NULL if it couldn't be) */
+static const char *uring_data[3];
+static int uring_available = 1;
+static int uring_read_files_called = 0;
+
+/* {{{ uring stubs */
+static char *uring_read_files(char **paths, size_t n,
+                              struct uring_file *files)
+{
+	size_t i, len = 0;
+	char *buf;
+
+	(void)paths;
+	++uring_read_files_called;
+	if (!uring_available) return NULL;
+
+	ck_assert_uint_le(n, 3);
+	for (i = 0; i < n; i++) {
+		files[i].ok   = uring_data[i] != NULL;
+		files[i].off  = len;
+		files[i].size = files[i].ok ? strlen(uring_data[i]) : 0;
+		len += files[i].size + 1;
+	}
+
+	ck_assert((buf = malloc(len)) != NULL);
+	for (i = 0; i < n; i++) {
+		if (files[i].ok)
+			memcpy(buf + files[i].off, uring_data[i],
+			       files[i].size + 1);
+	}
+
+	return buf;
+}
+/* }}} */
+
+static void reset_all_stubs(void)
+{
+	memset(uring_data, 0, sizeof(uring_data));
+	uring_available = 1;
+	uring_read_files_called = 0;
+	reset_stubs();
+	reset_zlib_stubs();
+	reset_zstd_stubs();
+}
+
+/**
+ * Read a whole file, a few bytes at a time.
+ *
+ * \param[in]  path Path to the file
+ * \param[out] buf  Buffer of at least 64 bytes
+ * \return 0 on success, non-zero on failure.
+ */
+static int read_all(const char *path, char *buf)
+{
+	struct file_reader *f;
+	size_t len = 0, n;
+	int retval = 1;
+
+	if (!(f = file_open(path)))
+		return retval;
+
+	do {
+		if (file_read(f, buf + len, 4, &n))
+			goto ret;
+		len += n;
+	} while (n && len < 60);
+
+	buf[len] = '\0';
+	retval = 0;
+
+ret:
+	file_close(f);
+	return retval;
+}
+
 /**
  * Test that map_file() returns NULL when given
  * a NULL path argument.
@@ -220,6 +316,362 @@ START_TEST(test_map_file)
 }
 END_TEST
 
+/**
+ * Test that map_file() decompresses compressed files, and that
+ * unmap_file() frees them.
+ */
+START_TEST(map_file_compressed)
+{
+	size_t size;
+	char *buf = NULL;
+
+	open_returns  = 1;
+	read_data     = zstd_data;
+	read_data_len = sizeof(zstd_data) - 1;
+	stat_returns_buf.st_mode = S_IFREG;
+	stat_returns_buf.st_size = (off_t)read_data_len;
+
+	ck_assert_ptr_nonnull(buf = map_file("test.sql.zst", &size));
+	ck_assert_uint_eq(size, 9);
+	ck_assert_str_eq(buf, "SELECT 1;");
+	ck_assert_ptr_eq(inflated->mem, buf);
+	ck_assert_int_eq(ZSTD_freeDStream_called, 1);
+
+	unmap_file(buf, size);
+	ck_assert_ptr_null(inflated);
+}
+END_TEST
+
+/**
+ * Test that map_file() fails if a compressed file can't be
+ * decompressed.
+ */
+START_TEST(map_file_compressed_fails)
+{
+	size_t size;
+
+	open_returns  = 1;
+	read_data     = gz_data;
+	read_data_len = 8;
+	stat_returns_buf.st_mode = S_IFREG;
+	stat_returns_buf.st_size = 8;
+
+	*errbuf = '\0';
+	ck_assert_ptr_null(map_file("test.sql.gz", &size));
+	ck_assert_uint_eq(size, 0);
+	ck_assert_str_eq(errbuf, "failed to read 'test.sql.gz': "
+	                 "unexpected end of file\n");
+	ck_assert_int_eq(inflateEnd_called, 1);
+	ck_assert_ptr_null(inflated);
+}
+END_TEST
+
+/**
+ * Test that copy_file() copies files which are already in memory,
+ * decompressing them if need be, and that unmap_file() frees them.
+ */
+START_TEST(test_copy_file)
+{
+	size_t size = 9;
+	char *buf;
+
+	ck_assert_ptr_nonnull(buf = copy_file("test.sql", "SELECT 1;xx", &size));
+	ck_assert_uint_eq(size, 9);
+	ck_assert_str_eq(buf, "SELECT 1;");
+	ck_assert_ptr_eq(inflated->mem, buf);
+	unmap_file(buf, size);
+	ck_assert_ptr_null(inflated);
+
+	size = sizeof(zstd_data) - 1;
+	ck_assert_ptr_nonnull(buf = copy_file("test.sql.zst", zstd_data,
+	                                      &size));
+	ck_assert_uint_eq(size, 9);
+	ck_assert_str_eq(buf, "SELECT 1;");
+	unmap_file(buf, size);
+	ck_assert_ptr_null(inflated);
+
+	size = 0;
+	*errbuf = '\0';
+	ck_assert_ptr_null(copy_file("test.sql", "", &size));
+	ck_assert_str_eq(errbuf, "failed to map 'test.sql'\n");
+}
+END_TEST
+
+/**
+ * Test that map_files() maps a single file by itself.
+ */
+START_TEST(map_files_one)
+{
+	static char path_buf[] = "test.sql.zst";
+	char *paths[1], *mem;
+	size_t size;
+
+	paths[0]      = path_buf;
+	open_returns  = 1;
+	read_data     = zstd_data;
+	read_data_len = sizeof(zstd_data) - 1;
+	stat_returns_buf.st_mode = S_IFREG;
+	stat_returns_buf.st_size = (off_t)read_data_len;
+
+	ck_assert_uint_eq(map_files(paths, 1, &mem, &size), 1);
+	ck_assert(!uring_read_files_called);
+	ck_assert_str_eq(mem, "SELECT 1;");
+	ck_assert_uint_eq(size, 9);
+	unmap_file(mem, size);
+	ck_assert_ptr_null(inflated);
+}
+END_TEST
+
+/**
+ * Test that map_files() hands out the files read into an arena,
+ * decompressing them if need be; that it maps any which couldn't be
+ * read that way; and that the arena is freed with the last of them.
+ */
+START_TEST(test_map_files)
+{
+	static char path_buf[3][16] = { "1.sql", "2.sql.zst", "3.sql.zst" };
+	char *paths[3], *mem[3];
+	size_t size[3];
+	struct arena *a;
+
+	paths[0]      = path_buf[0];
+	paths[1]      = path_buf[1];
+	paths[2]      = path_buf[2];
+	uring_data[0] = "SELECT 1;";
+	uring_data[2] = zstd_data;
+	open_returns  = 1;
+	read_data     = zstd_data;
+	read_data_len = sizeof(zstd_data) - 1;
+	stat_returns_buf.st_mode = S_IFREG;
+	stat_returns_buf.st_size = (off_t)read_data_len;
+
+	*errbuf = '\0';
+	ck_assert_uint_eq(map_files(paths, 3, mem, size), 3);
+	ck_assert_int_eq(uring_read_files_called, 1);
+	ck_assert_int_eq(open_called, 1);
+	ck_assert(!*errbuf);
+
+	ck_assert_str_eq(mem[0], "SELECT 1;");
+	ck_assert_str_eq(mem[1], "SELECT 1;");
+	ck_assert_str_eq(mem[2], "SELECT 1;");
+	ck_assert_uint_eq(size[0], 9);
+	ck_assert_uint_eq(size[2], 9);
+
+	/* Only the first is still in the arena */
+	unmap_file(mem[2], size[2]);
+	unmap_file(mem[1], size[1]);
+	ck_assert_ptr_eq(inflated->mem, mem[0]);
+	ck_assert_ptr_nonnull(a = inflated->arena);
+	ck_assert_uint_eq(a->refs, 1);
+	unmap_file(mem[0], size[0]);
+	ck_assert_ptr_null(inflated);
+}
+END_TEST
+
+/**
+ * Test that map_files() maps each file itself if io_uring can't be
+ * used.
+ */
+START_TEST(map_files_without_uring)
+{
+	static char path_buf[2][8] = { "1.sql", "2.sql" };
+	char *paths[2], *mem[2];
+	size_t size[2];
+
+	paths[0]        = path_buf[0];
+	paths[1]        = path_buf[1];
+	uring_available = 0;
+	open_returns    = -1;
+
+	*errbuf = '\0';
+	ck_assert_uint_eq(map_files(paths, 2, mem, size), 0);
+	ck_assert_int_eq(uring_read_files_called, 1);
+	ck_assert_int_eq(open_called, 2);
+	ck_assert(!mem[0] && !mem[1]);
+	ck_assert(!size[0] && !size[1]);
+	ck_assert_str_eq(errbuf, "failed to map '2.sql'\n");
+	ck_assert_ptr_null(inflated);
+}
+END_TEST
+
+/**
+ * Test that file_open() fails if the file can't be opened.
+ */
+START_TEST(file_open_fails)
+{
+	char err[128];
+
+	ck_assert_ptr_null(file_open(NULL));
+
+	*errbuf = '\0';
+	open_errno = ENOENT;
+	sprintf(err, "unable to open 'x.sql': %s\n", strerror(ENOENT));
+	ck_assert_ptr_null(file_open("x.sql"));
+	ck_assert_str_eq(errbuf, err);
+	ck_assert(!close_called);
+}
+END_TEST
+
+/**
+ * Test that file_open() fails if the decompressor can't be set up.
+ */
+START_TEST(file_open_codec_fails)
+{
+	open_returns  = 3;
+	read_data     = gz_data;
+	read_data_len = sizeof(gz_data) - 1;
+	inflateInit2_returns = Z_MEM_ERROR;
+
+	*errbuf = '\0';
+	ck_assert_ptr_null(file_open("x.sql.gz"));
+	ck_assert_str_eq(errbuf, "failed to read 'x.sql.gz': unable to "
+	                 "decompress gzip data\n");
+	ck_assert_int_eq(close_called, 1);
+	ck_assert(!inflateEnd_called);
+}
+END_TEST
+
+/**
+ * Test that file_read() reads plain files as they are.
+ */
+START_TEST(file_read_plain)
+{
+	char buf[64];
+	size_t n;
+
+	ck_assert_int_ne(file_read(NULL, buf, 1, &n), 0);
+
+	open_returns  = 3;
+	read_data     = "SELECT 1;";
+	read_data_len = 9;
+	stat_returns_buf.st_size = 9;
+	ck_assert_int_eq(read_all("x.sql", buf), 0);
+	ck_assert_str_eq(buf, "SELECT 1;");
+	ck_assert_int_eq(read_called, 2);
+	ck_assert_int_eq(close_called, 1);
+}
+END_TEST
+
+/**
+ * Test that file_read() reports read errors.
+ */
+START_TEST(file_read_fails)
+{
+	struct file_reader *f;
+	char buf[64], err[128];
+	size_t n;
+
+	open_returns = 3;
+	stat_returns_buf.st_size = 9;
+	ck_assert_ptr_nonnull(f = file_open("x.sql"));
+	ck_assert_uint_eq(file_size(f), 9);
+
+	/* What was read up front comes first */
+	ck_assert_int_eq(file_read(f, buf, sizeof(buf), &n), 0);
+	ck_assert_uint_eq(n, 0);
+
+	*errbuf = '\0';
+	read_errno = EIO;
+	sprintf(err, "failed to read 'x.sql': %s\n", strerror(EIO));
+	ck_assert_int_ne(file_read(f, buf, sizeof(buf), &n), 0);
+	ck_assert_str_eq(errbuf, err);
+	file_close(f);
+}
+END_TEST
+
+/**
+ * Test that file_read() decompresses gzip data, including files
+ * with more than one member.
+ */
+START_TEST(file_read_gzip)
+{
+	struct file_reader *f;
+	char buf[64];
+
+	open_returns  = 3;
+	read_data     = gz_data;
+	read_data_len = sizeof(gz_data) - 1;
+	stat_returns_buf.st_size = (off_t)read_data_len;
+	ck_assert_int_eq(read_all("x.sql.gz", buf), 0);
+	ck_assert_str_eq(buf, "SELECT 1;");
+	ck_assert_int_eq(inflateReset_called, 1);
+	ck_assert_int_eq(inflateEnd_called, 1);
+
+	/* The size of the contents isn't known */
+	read_data     = gz_data;
+	read_data_len = sizeof(gz_data) - 1;
+	ck_assert_ptr_nonnull(f = file_open("x.sql.gz"));
+	ck_assert_uint_eq(file_size(f), 0);
+	file_close(f);
+}
+END_TEST
+
+/**
+ * Test that file_read() reports corrupt gzip data.
+ */
+START_TEST(file_read_gzip_corrupt)
+{
+	char buf[64];
+
+	open_returns  = 3;
+	read_data     = "\x1f\x8bSEL!ECT 1;$";
+	read_data_len = 15;
+
+	*errbuf = '\0';
+	ck_assert_int_ne(read_all("x.sql.gz", buf), 0);
+	ck_assert_str_eq(errbuf, "failed to read 'x.sql.gz': "
+	                 "invalid stub data\n");
+	ck_assert_int_eq(inflateEnd_called, 1);
+}
+END_TEST
+
+/**
+ * Test that file_read() decompresses zstd data.
+ */
+START_TEST(file_read_zstd)
+{
+	char buf[64];
+
+	open_returns  = 3;
+	read_data     = zstd_data;
+	read_data_len = sizeof(zstd_data) - 1;
+	ck_assert_int_eq(read_all("x.sql.zst", buf), 0);
+	ck_assert_str_eq(buf, "SELECT 1;");
+	ck_assert_int_eq(ZSTD_freeDStream_called, 1);
+}
+END_TEST
+
+/**
+ * Test that file_read() reports truncated or corrupt zstd data.
+ */
+START_TEST(file_read_zstd_fails)
+{
+	char buf[64];
+
+	open_returns  = 3;
+	read_data     = zstd_data;
+	read_data_len = 8;
+
+	*errbuf = '\0';
+	ck_assert_int_ne(read_all("x.sql.zst", buf), 0);
+	ck_assert_str_eq(errbuf, "failed to read 'x.sql.zst': "
+	                 "unexpected end of file\n");
+
+	read_data     = "\x28\xb5\x2f\xfdSEL!";
+	read_data_len = 8;
+	ck_assert_int_ne(read_all("x.sql.zst", buf), 0);
+	ck_assert_str_eq(errbuf, "failed to read 'x.sql.zst': "
+	                 "Corrupted block detected\n");
+
+	ZSTD_createDStream_fails = 1;
+	read_data     = zstd_data;
+	read_data_len = sizeof(zstd_data) - 1;
+	ck_assert_ptr_null(file_open("x.sql.zst"));
+	ck_assert_str_eq(errbuf, "failed to read 'x.sql.zst': unable to "
+	                 "decompress zstd data\n");
+}
+END_TEST
+
 Suite *file_suite(void)
 {
 	Suite *s;
@@ -227,7 +679,7 @@ Suite *file_suite(void)
 
 	s = suite_create("File Mapping");
 	t = tcase_create("map_file");
-	tcase_add_checked_fixture(t, reset_stubs, NULL);
+	tcase_add_checked_fixture(t, reset_all_stubs, NULL);
 	tcase_add_test(t, map_file_invalid_args);
 	tcase_add_test(t, map_file_cant_stat);
 	tcase_add_test(t, map_file_empty_file);
@@ -236,6 +688,30 @@ Suite *file_suite(void)
 	tcase_add_test(t, map_file_read_fails);
 	tcase_add_test(t, map_file_read_premature_eof);
 	tcase_add_test(t, test_map_file);
+	tcase_add_test(t, map_file_compressed);
+	tcase_add_test(t, map_file_compressed_fails);
+	tcase_add_test(t, test_copy_file);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("map_files");
+	tcase_add_checked_fixture(t, reset_all_stubs, NULL);
+	tcase_add_test(t, map_files_one);
+	tcase_add_test(t, test_map_files);
+	tcase_add_test(t, map_files_without_uring);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("file_reader");
+	tcase_add_checked_fixture(t, reset_all_stubs, NULL);
+	tcase_add_test(t, file_open_fails);
+	tcase_add_test(t, file_open_codec_fails);
+	tcase_add_test(t, file_read_plain);
+	tcase_add_test(t, file_read_fails);
+	tcase_add_test(t, file_read_gzip);
+	tcase_add_test(t, file_read_gzip_corrupt);
+	tcase_add_test(t, file_read_zstd);
+	tcase_add_test(t, file_read_zstd_fails);
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
@@ -26,10 +26,14 @@
 #define LIBGIT2_VER_MINOR 9999
 
 #define GIT_OK 0
+#define GIT_ENOTFOUND -3
 #define GIT_SORT_REVERSE 1
 #define GIT_SORT_TOPOLOGICAL 2
 #define GIT_DIFF_OPTIONS_VERSION 1
 #define GIT_DIFF_FIND_OPTIONS_VERSION 1
+#define GIT_OID_HEXSZ 40
+#define GIT_OBJ_ANY -2
+#define GIT_OBJ_BLOB 3
 
 typedef struct git_sa {
 	char **strings;
@@ -88,6 +92,9 @@ typedef int git_object;
 typedef int git_revwalk;
 typedef int git_commit;
 typedef int git_tree;
+typedef int git_tree_entry;
+typedef int git_blob;
+typedef int git_reference;
 
 static struct git_err {
 	const char *message;
@@ -103,7 +110,8 @@ static git_commit *git_commit_parent_commit = NULL;
 static git_tree *git_commit_tree_tree = NULL;
 static git_tree *git_commit_tree_parent_tree = NULL;
 static git_diff *git_diff_tree_to_tree_diff = NULL;
-static git_repository *git_repository_open_repo = NULL;
+static git_repository stub_repo = 0;
+static git_repository *git_repository_open_repo = &stub_repo;
 static git_object *git_revparse_single_out = NULL;
 static git_object *git_revparse_single_out_head = NULL;
 static int git_commit_lookup_returns = GIT_OK;
@@ -114,12 +122,30 @@ static int git_commit_tree_parent_returns = GIT_OK;
 static int git_diff_tree_to_tree_returns = GIT_OK;
 static int git_diff_find_similar_returns = GIT_OK;
 static int git_repository_open_returns = GIT_OK;
+static const char *git_repository_path_returns = "./.git/";
+static const char *git_repository_commondir_returns = "./.git/";
+static int git_reference_lookup_returns = GIT_OK;
+static const char *git_reference_symbolic_target_returns =
+	"refs/heads/master";
 static int git_revparse_single_returns = GIT_OK;
 static int git_revparse_single_returns_head = GIT_OK;
 static int git_revwalk_new_returns = GIT_OK;
 static int git_revwalk_push_returns = GIT_OK;
 static int git_revwalk_hide_returns = GIT_OK;
 static int git_revwalk_next_returns = 1;
+static int git_commit_lookup_called = 0;
+static int git_repository_open_called = 0;
+static int git_revparse_single_called = 0;
+static int git_object_lookup_called = 0;
+static int git_reference_name_to_id_returns = GIT_OK;
+static git_oid git_reference_name_to_id_oid = 1;
+static int git_tree_entry_bypath_returns = GIT_OK;
+static int git_tree_entry_bypath_same = 0;
+static int git_tree_entry_bypath_called = 0;
+static int git_diff_tree_to_tree_called = 0;
+static int git_object_type_returns = GIT_OBJ_BLOB;
+static const char *git_blob_rawcontent_returns = "-- [up]\nONE;\n";
+static int git_repository_is_bare_returns = 0;
 
 static void reset_libgit2_stubs(void)
 {
@@ -130,7 +156,7 @@ static void reset_libgit2_stubs(void)
 	git_commit_tree_tree = NULL;
 	git_commit_tree_parent_tree = NULL;
 	git_diff_tree_to_tree_diff = NULL;
-	git_repository_open_repo = NULL;
+	git_repository_open_repo = &stub_repo;
 	git_revparse_single_out = NULL;
 	git_revparse_single_out_head = NULL;
 	git_commit_lookup_returns = GIT_OK;
@@ -141,12 +167,29 @@ static void reset_libgit2_stubs(void)
 	git_diff_tree_to_tree_returns = GIT_OK;
 	git_diff_find_similar_returns = GIT_OK;
 	git_repository_open_returns = GIT_OK;
+	git_repository_path_returns = "./.git/";
+	git_repository_commondir_returns = "./.git/";
+	git_reference_lookup_returns = GIT_OK;
+	git_reference_symbolic_target_returns = "refs/heads/master";
 	git_revparse_single_returns = GIT_OK;
 	git_revparse_single_returns_head = GIT_OK;
 	git_revwalk_new_returns = GIT_OK;
 	git_revwalk_push_returns = GIT_OK;
 	git_revwalk_hide_returns = GIT_OK;
 	git_revwalk_next_returns = -1;
+	git_commit_lookup_called = 0;
+	git_repository_open_called = 0;
+	git_revparse_single_called = 0;
+	git_object_lookup_called = 0;
+	git_reference_name_to_id_returns = GIT_OK;
+	git_reference_name_to_id_oid = 1;
+	git_tree_entry_bypath_returns = GIT_OK;
+	git_tree_entry_bypath_same = 0;
+	git_tree_entry_bypath_called = 0;
+	git_diff_tree_to_tree_called = 0;
+	git_object_type_returns = GIT_OBJ_BLOB;
+	git_blob_rawcontent_returns = "-- [up]\nONE;\n";
+	git_repository_is_bare_returns = 0;
 }
 /* }}} */
 
@@ -174,8 +217,9 @@ static void git_diff_find_init_options(git_diff_find_options *opts,
 }
 
 static int git_commit_lookup(git_commit **c, git_repository *repo,
-                             git_oid *oid)
+                             const git_oid *oid)
 {
+	++git_commit_lookup_called;
 	*c = git_commit_lookup_commit;
 	return git_commit_lookup_returns;
 }
@@ -210,18 +254,116 @@ static int git_diff_find_similar(git_diff *diff,
 
 static int git_repository_open(git_repository **repo, const char *path)
 {
+	++git_repository_open_called;
 	*repo = git_repository_open_repo;
 	return git_repository_open_returns;
 }
 
-static git_oid git_object_id(git_object *obj)
+static const char *git_repository_path(git_repository *repo)
 {
-	return *obj;
+	return git_repository_path_returns;
 }
 
-static void git_oid_tostr(char *buf, size_t bufsize, git_oid oid)
+static const char *git_repository_commondir(git_repository *repo)
 {
-	sprintf(buf, "%d", oid);
+	return git_repository_commondir_returns;
+}
+
+static int git_repository_is_bare(git_repository *repo)
+{
+	return git_repository_is_bare_returns;
+}
+
+static int git_object_type(const git_object *obj)
+{
+	return git_object_type_returns;
+}
+
+static const void *git_blob_rawcontent(const git_blob *blob)
+{
+	return git_blob_rawcontent_returns;
+}
+
+static size_t git_blob_rawsize(const git_blob *blob)
+{
+	return strlen(git_blob_rawcontent_returns);
+}
+
+static const git_oid *git_object_id(git_object *obj)
+{
+	return obj;
+}
+
+static void git_oid_tostr(char *buf, size_t bufsize, const git_oid *oid)
+{
+	sprintf(buf, "%d", *oid);
+}
+
+static int git_oid_equal(const git_oid *a, const git_oid *b)
+{
+	return *a == *b;
+}
+
+static int git_reference_lookup(git_reference **out, git_repository *repo,
+                                const char *name)
+{
+	static git_reference ref = 1;
+
+	*out = git_reference_lookup_returns == GIT_OK ? &ref : NULL;
+	return git_reference_lookup_returns;
+}
+
+static const char *git_reference_symbolic_target(const git_reference *ref)
+{
+	return git_reference_symbolic_target_returns;
+}
+
+static void git_reference_free(git_reference *ref)
+{
+}
+
+static int git_reference_name_to_id(git_oid *out, git_repository *repo,
+                                    const char *name)
+{
+	*out = git_reference_name_to_id_oid;
+	return git_reference_name_to_id_returns;
+}
+
+/* Objects are represented by their IDs */
+static int git_object_lookup(git_object **out, git_repository *repo,
+                             const git_oid *oid, int type)
+{
+	static git_object obj;
+
+	++git_object_lookup_called;
+	obj  = *oid;
+	*out = &obj;
+	return GIT_OK;
+}
+
+/* Entries are represented by their IDs, which differ unless told not to */
+static int git_tree_entry_bypath(git_tree_entry **out, const git_tree *root,
+                                 const char *path)
+{
+	static git_tree_entry entries[2];
+
+	++git_tree_entry_bypath_called;
+	entries[git_tree_entry_bypath_called & 1] =
+	    git_tree_entry_bypath_same ? 1 : git_tree_entry_bypath_called;
+	*out = NULL;
+	if (git_tree_entry_bypath_returns == GIT_OK)
+		*out = &entries[git_tree_entry_bypath_called & 1];
+	return git_tree_entry_bypath_returns;
+}
+
+static const git_oid *git_tree_entry_id(const git_tree_entry *entry)
+{
+	return entry;
+}
+
+static void git_tree_entry_free(git_tree_entry *entry)
+{
+	return;
 }
 
 static int git_revwalk_new(git_revwalk **walk, git_repository *repo)
@@ -229,12 +371,12 @@ static int git_revwalk_new(git_revwalk **walk, git_repository *repo)
 	return git_revwalk_new_returns;
 }
 
-static int git_revwalk_push(git_revwalk *walk, git_oid oid)
+static int git_revwalk_push(git_revwalk *walk, const git_oid *oid)
 {
 	return git_revwalk_push_returns;
 }
 
-static int git_revwalk_hide(git_revwalk *walk, git_oid o)
+static int git_revwalk_hide(git_revwalk *walk, const git_oid *o)
 {
 	return git_revwalk_hide_returns;
 }
@@ -291,6 +433,7 @@ static int git_revparse_single(git_object **out, git_repository *repo,
 {
 	int retval = git_revparse_single_returns_head;
 
+	++git_revparse_single_called;
 	if (*rev == 'H' && *(rev+1) == 'E') {
 		*out = git_revparse_single_out_head;
 	} else {
@@ -305,6 +448,7 @@ static int git_diff_tree_to_tree(git_diff **diff, git_repository *repo,
                                  git_tree *pt, git_tree *t,
                                  git_diff_options *ppts)
 {
+	++git_diff_tree_to_tree_called;
 	*diff = git_diff_tree_to_tree_diff;
 	return git_diff_tree_to_tree_returns;
 }
@@ -319,8 +463,10 @@ static git_diff_delta *git_diff_get_delta(git_diff *diff, size_t i)
 	return &diff->deltas[i];
 }
 
+/* Each commit's ID is the number of commits left to walk */
 static int git_revwalk_next(git_oid *o, git_revwalk *walk)
 {
+	*o = git_revwalk_next_returns - 1;
 	return (--git_revwalk_next_returns == 0);
 }
 
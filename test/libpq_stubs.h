@@ -26,9 +26,19 @@
 #define CONNECTION_OK 1
 #define PGRES_COMMAND_OK 2
 #define PGRES_TUPLES_OK 3
+#define PGRES_COPY_IN 4
+#define PGRES_FATAL_ERROR 5
+#define PGRES_PIPELINE_SYNC 6
+#define PGRES_PIPELINE_ABORTED 7
+#define PGRES_SINGLE_TUPLE 8
+#define PQTRANS_IDLE 0
+#define PQTRANS_ACTIVE 1
+#define PQTRANS_INTRANS 2
+#define LIBPQ_HAS_PIPELINING 1
 
 typedef int PGconn;
 typedef int PGresult;
+typedef int PGcancel;
 
 static PGconn *PQconnectdb_returns = NULL;
 static int PQstatus_returns = 0;
@@ -40,6 +50,19 @@ static int PQnfields_returns = 0;
 static char *PQfname_returns = NULL;
 static char *PQgetvalue_returns = NULL;
 static int PQgetisnull_returns = 0;
+static int PQprepare_returns = 0;
+static char PQprepare_query[64];
+static int PQputCopyData_returns = 1;
+static int PQgetResult_returns = 0;
+static int PQgetResult_status = 0;
+static char PQcopy_data[256];
+static char PQcopy_error[32];
+static int PQresult_script[16];
+static int PQresult_script_len = 0;
+static int PQresult_script_pos = 0;
+static char PQsent[256];
+static int PQtransactionStatus_returns = PQTRANS_IDLE;
+static int PQbusy = 0;
 
 /* call counters */
 static int PQconnectdb_called = 0;
@@ -54,6 +77,16 @@ static int PQfname_called = 0;
 static int PQgetvalue_called = 0;
 static int PQgetisnull_called = 0;
 static int PQfinish_called = 0;
+static int PQprepare_called = 0;
+static int PQexecPrepared_called = 0;
+static int PQputCopyEnd_called = 0;
+static int PQenterPipelineMode_called = 0;
+static int PQexitPipelineMode_called = 0;
+static int PQpipelineSync_called = 0;
+static int PQsendQuery_called = 0;
+static int PQsendQueryPrepared_called = 0;
+static int PQsetSingleRowMode_called = 0;
+static int PQcancel_called = 0;
 
 static void reset_libpq_stubs(void)
 {
@@ -79,6 +112,29 @@ static void reset_libpq_stubs(void)
 	PQgetvalue_called = 0;
 	PQgetisnull_called = 0;
 	PQfinish_called = 0;
+	PQprepare_returns = 0;
+	*PQprepare_query = '\0';
+	PQprepare_called = 0;
+	PQexecPrepared_called = 0;
+	PQputCopyData_returns = 1;
+	PQgetResult_returns = 0;
+	PQgetResult_status = 0;
+	*PQcopy_data = '\0';
+	*PQcopy_error = '\0';
+	PQputCopyEnd_called = 0;
+	memset(PQresult_script, 0, sizeof PQresult_script);
+	PQresult_script_len = 0;
+	PQresult_script_pos = 0;
+	*PQsent = '\0';
+	PQenterPipelineMode_called = 0;
+	PQexitPipelineMode_called = 0;
+	PQpipelineSync_called = 0;
+	PQtransactionStatus_returns = PQTRANS_IDLE;
+	PQbusy = 0;
+	PQsendQuery_called = 0;
+	PQsendQueryPrepared_called = 0;
+	PQsetSingleRowMode_called = 0;
+	PQcancel_called = 0;
 }
 /* }}} */
 
@@ -149,10 +205,171 @@ static char *PQgetisnull(PGresult *res, int row, int col)
 	return PQgetisnull_returns;
 }
 
+static int PQgetlength(PGresult *res, int row, int col)
+{
+	return PQgetvalue_returns ? (int)strlen(PQgetvalue_returns) : 0;
+}
+
 static void PQfinish(PGconn *conn)
 {
 	++PQfinish_called;
 }
+
+static PGresult *PQprepare(PGconn *conn, const char *name,
+                           const char *query, int n_params,
+                           const void *types)
+{
+	++PQprepare_called;
+	strncpy(PQprepare_query, query, sizeof PQprepare_query - 1);
+	return PQprepare_returns;
+}
+
+static PGresult *PQexecPrepared(PGconn *conn, const char *name,
+                                int n_params, const char *const *values,
+                                const int *lengths, const int *formats,
+                                int result_format)
+{
+	++PQexecPrepared_called;
+	return PQexec_returns;
+}
+
+static int PQputCopyData(PGconn *conn, const char *buf, int len)
+{
+	size_t n = strlen(PQcopy_data);
+
+	if (PQputCopyData_returns == 1) {
+		memcpy(PQcopy_data + n, buf, (size_t)len);
+		PQcopy_data[n + (size_t)len] = '\0';
+	}
+	return PQputCopyData_returns;
+}
+
+static int PQputCopyEnd(PGconn *conn, const char *errormsg)
+{
+	++PQputCopyEnd_called;
+	if (errormsg)
+		strncpy(PQcopy_error, errormsg, sizeof PQcopy_error - 1);
+	return 1;
+}
+
+/**
+ * Hands out PQgetResult_returns once, with PQgetResult_status
+ * as its status.
+ *
+ * If there's a script, each call returns a result with the next
+ * status in it instead (or NULL for a status of 0.)
+ */
+static PGresult *PQgetResult(PGconn *conn)
+{
+	int res = PQgetResult_returns;
+
+	if (PQresult_script_len) {
+		if (PQresult_script_pos >= PQresult_script_len)
+			return PQbusy = 0;
+		res = PQresult_script[PQresult_script_pos++];
+		PQresultStatus_returns = res;
+		return res ? 1 : (PQbusy = 0);
+	}
+
+	if (!res) PQbusy = 0;
+	PQgetResult_returns    = 0;
+	PQresultStatus_returns = PQgetResult_status;
+	return res;
+}
+
+static int PQsetSingleRowMode(PGconn *conn)
+{
+	++PQsetSingleRowMode_called;
+	return 1;
+}
+
+/**
+ * Like libpq, this says PQTRANS_ACTIVE from the time a query is
+ * sent until its results have all been collected.
+ */
+static int PQtransactionStatus(PGconn *conn)
+{
+	return PQbusy ? PQTRANS_ACTIVE : PQtransactionStatus_returns;
+}
+
+static PGcancel *PQgetCancel(PGconn *conn)
+{
+	return 1;
+}
+
+static int PQcancel(PGcancel *cancel, char *errbuf, int len)
+{
+	++PQcancel_called;
+	return 1;
+}
+
+static void PQfreeCancel(PGcancel *cancel)
+{
+}
+
+static char *PQresultErrorMessage(PGresult *res)
+{
+	return PQerrorMessage_returns;
+}
+
+static int PQenterPipelineMode(PGconn *conn)
+{
+	++PQenterPipelineMode_called;
+	return 1;
+}
+
+static int PQexitPipelineMode(PGconn *conn)
+{
+	++PQexitPipelineMode_called;
+	return 1;
+}
+
+static int PQpipelineSync(PGconn *conn)
+{
+	++PQpipelineSync_called;
+	return 1;
+}
+
+/**
+ * Records each query sent, followed by a '|'.
+ */
+static int PQsendQueryParams(PGconn *conn, const char *query,
+                             int n_params, const void *types,
+                             const char *const *values,
+                             const int *lengths, const int *formats,
+                             int result_format)
+{
+	ck_assert(strlen(PQsent) + strlen(query) + 2 < sizeof PQsent);
+	strcat(PQsent, query);
+	strcat(PQsent, "|");
+	return 1;
+}
+
+/**
+ * Sends a query, which results in what PQexec() would have
+ * returned, if there's no script.
+ */
+static int PQsendQuery(PGconn *conn, const char *query)
+{
+	++PQsendQuery_called;
+	PQbusy = 1;
+	PQgetResult_returns = PQexec_returns;
+	PQgetResult_status  = PQresultStatus_returns;
+	return 1;
+}
+
+static int PQsendQueryPrepared(PGconn *conn, const char *name,
+                               int n_params, const char *const *values,
+                               const int *lengths, const int *formats,
+                               int result_format)
+{
+	++PQsendQueryPrepared_called;
+	PQbusy = 1;
+	PQgetResult_returns = PQexec_returns;
+	PQgetResult_status  = PQresultStatus_returns;
+	return PQsendQueryParams(conn, name, n_params, NULL, values,
+	                         lengths, formats, result_format);
+}
 /* }}} */
 
 #endif /* TEST_LIBPQ_STUBS_H */
@@ -17,54 +17,132 @@
 /* from test_runner.c */
 extern char errbuf[];
 
-/* {{{ DB / file stubs */
-static int db_query(const char *query, void *cb, void *userdata);
-static char *map_file(const char *path, size_t *size);
-static void unmap_file(char *mem, size_t size);
+/* {{{ DB stubs */
+static int db_query_len(const char *query, size_t len, void *cb,
+                        void *userdata);
+static int db_copy(const char *target, const char *rows, size_t len);
+static const char *db_get_driver_name(void);
+static int db_pipeline_sync(void);
+static int db_pipeline_label(const char *label);
+
+#define now_ms now_ms_stub
 
 #define DB_H
-#define FILE_H
 #include "../src/migration.h"
 #include "../src/migration.c"
 
+/**
+ * Clock stub, which moves on by now_ms_tick with each call.
+ */
+static unsigned long now_ms_tick = 0;
+static unsigned long now_ms_returns = 0;
+unsigned long now_ms_stub(void)
+{
+	return now_ms_returns += now_ms_tick;
+}
+
 static const char *expected_query = NULL;
-static size_t map_file_returns_size = 0;
-static char *map_file_returns = NULL;
+static const char *driver = NULL;
 static int db_query_called = 0;
+static int db_query_fails_at = 0;
+static int db_copy_returns = 0;
+static char queries[256];
+static char copied[256];
+static char shown[256];
+static int pipelined = 0;
+static int db_pipeline_synced = 0;
+static char labelled[128];
 
 /**
  * Database query stub
  */
-static int db_query(const char *query, void *cb, void *userdata)
+static int db_query_len(const char *query, size_t len, void *cb,
+                        void *userdata)
 {
 	(void)cb;
 	(void)userdata;
 	++db_query_called;
-	if (!query || !strlen(query))
+	if (!query || !len)
 		return 1;
 
 	/* Check the query */
-	if (expected_query)
-		ck_assert_str_eq(query, expected_query);
-	return 0;
+	if (expected_query) {
+		ck_assert_uint_eq(len, strlen(expected_query));
+		ck_assert(!memcmp(query, expected_query, len));
+	}
+
+	/* Keep whatever was printed before it */
+	strcat(shown, errbuf);
+	*errbuf = '\0';
+
+	ck_assert(strlen(queries) + len + 2 < sizeof(queries));
+	strncat(queries, query, len);
+	strcat(queries, "|");
+	return db_query_called == db_query_fails_at;
 }
 
-static char *map_file(const char *path, size_t *size)
+/**
+ * Driver name stub
+ */
+static const char *db_get_driver_name(void)
 {
-	(void)path;
-	*size = map_file_returns_size;
-	return map_file_returns;
+	return driver;
 }
 
-static void unmap_file(char *mem, size_t size)
+/**
+ * Bulk-load stub, which records "target:rows|"
+ */
+static int db_copy(const char *target, const char *rows, size_t len)
 {
-	(void)mem;
-	(void)size;
-	return;
+	strcat(copied, target);
+	strcat(copied, ":");
+	strncat(copied, rows, len);
+	strcat(copied, "|");
+	return db_copy_returns;
 }
 
+/**
+ * Pipeline stubs, which keep the last label, and count the syncs
+ */
+static int db_pipeline_sync(void)
+{
+	if (pipelined) {
+		++db_pipeline_synced;
+		strcat(queries, "sync|");
+	}
+
+	return 0;
+}
+
+static int db_pipeline_label(const char *label)
+{
+	strcpy(labelled, label);
+	return pipelined;
+}
 /* }}} */
 
+/**
+ * Parse a migration, and run its "up" portion.
+ */
+static int upgrade(char *mem)
+{
+	struct migration m;
+
+	migration_parse(&m, mem, strlen(mem));
+	return migration_upgrade(&m);
+}
+
+/**
+ * Parse a migration, and run its "down" portion.
+ */
+static int downgrade(char *mem)
+{
+	struct migration m;
+
+	migration_parse(&m, mem, strlen(mem));
+	return migration_downgrade(&m);
+}
+
 /* {{{ migration test data */
 static char migration_up_only[] =
 	"-- [up]\n"
@@ -98,6 +176,51 @@ static char migration_down_works_no_space[] =
 	"-- [up]\n"
 	"CREATE TABLE test(xxx VARCHAR(5));";
 
+static char migration_up_copy[] =
+	"-- [up]\n"
+	"CREATE TABLE t(a, b);\n"
+	"-- [copy t(a, b)]\n"
+	"1\tx\n"
+	"2\t\\N\n"
+	"\\.\n"
+	"CREATE INDEX i ON t(a);\n"
+	"-- [copy t]\n"
+	"3\ty\n"
+	"-- [down]\n"
+	"DROP TABLE t;";
+
+static char migration_up_bad_copy[] =
+	"-- [up]\n"
+	"CREATE TABLE t(a, b);\n"
+	"-- [copy t\n"
+	"1\tx\n";
+
+static char migration_up_copy_quoted[] =
+	"-- [up]\n"
+	"CREATE FUNCTION f() RETURNS text AS $$\n"
+	"-- [copy t]\n"
+	"$$ LANGUAGE sql;\n"
+	"INSERT INTO t VALUES ('\n"
+	"-- [copy t]\n"
+	"');\n";
+
+static char migration_up_statements[] =
+	"-- [up]\n"
+	"CREATE TABLE t(a); -- ;\n"
+	"/* ; */ INSERT INTO t VALUES (';');\n"
+	";\n"
+	"INSERT INTO t VALUES (1)\n"
+	"-- [down]\n"
+	"DROP TABLE t;";
+
+static char migration_up_delimiter[] =
+	"-- [up]\n"
+	"DELIMITER //\n"
+	"CREATE TRIGGER t BEFORE INSERT ON t FOR EACH ROW\n"
+	"BEGIN SET NEW.a = 1; END//\n"
+	"DELIMITER ;\n"
+	"INSERT INTO t VALUES (1);";
+
 static char migration_up_down_expected_query_up[] =
 	"CREATE TABLE test(xxx VARCHAR(5));";
 
@@ -106,15 +229,12 @@ static char migration_up_down_expected_query_down[] =
 /* }}} */
 
 /**
- * Test the behavior of migration_upgrade() when map_file()
- * fails.
+ * Test that migration_upgrade() fails without a migration.
  */
-START_TEST(migration_upgrade_map_file_fails)
+START_TEST(migration_upgrade_no_migration)
 {
-	db_query_called       = 0;
-	map_file_returns      = NULL;
-	map_file_returns_size = 0;
-	ck_assert_int_ne(migration_upgrade("test"), 0);
+	db_query_called = 0;
+	ck_assert_int_ne(migration_upgrade(NULL), 0);
 	ck_assert(!db_query_called);
 }
 END_TEST
@@ -125,11 +245,9 @@ END_TEST
  */
 START_TEST(migration_upgrade_up_only)
 {
-	db_query_called       = 0;
-	map_file_returns      = migration_up_only;
-	map_file_returns_size = strlen(migration_up_only);
-	expected_query        = migration_up_only + up_len + 1;
-	ck_assert_int_eq(migration_upgrade("test"), 0);
+	db_query_called = 0;
+	expected_query  = migration_up_only + up_len + 1;
+	ck_assert_int_eq(upgrade(migration_up_only), 0);
 	ck_assert(db_query_called);
 }
 END_TEST
@@ -140,11 +258,9 @@ END_TEST
  */
 START_TEST(migration_upgrade_down_only)
 {
-	db_query_called       = 0;
-	map_file_returns      = migration_down_only;
-	map_file_returns_size = strlen(migration_down_only);
-	expected_query        = NULL;
-	ck_assert_int_eq(migration_upgrade("test"), 0);
+	db_query_called = 0;
+	expected_query  = NULL;
+	ck_assert_int_eq(upgrade(migration_down_only), 0);
 	ck_assert(!db_query_called);
 }
 END_TEST
@@ -155,11 +271,9 @@ END_TEST
  */
 START_TEST(migration_upgrade_no_space_before_down)
 {
-	db_query_called       = 0;
-	map_file_returns      = migration_up_works_no_space;
-	map_file_returns_size = strlen(migration_up_works_no_space);
-	expected_query        = migration_up_down_expected_query_up;
-	ck_assert_int_eq(migration_upgrade("test"), 0);
+	db_query_called = 0;
+	expected_query  = migration_up_down_expected_query_up;
+	ck_assert_int_eq(upgrade(migration_up_works_no_space), 0);
 	ck_assert(db_query_called);
 }
 END_TEST
@@ -169,25 +283,20 @@ END_TEST
  */
 START_TEST(test_migration_upgrade)
 {
-	db_query_called       = 0;
-	map_file_returns      = migration_up_works;
-	map_file_returns_size = strlen(migration_up_works);
-	expected_query        = migration_up_down_expected_query_up;
-	ck_assert_int_eq(migration_upgrade("test"), 0);
+	db_query_called = 0;
+	expected_query  = migration_up_down_expected_query_up;
+	ck_assert_int_eq(upgrade(migration_up_works), 0);
 	ck_assert(db_query_called);
 }
 END_TEST
 
 /**
- * Test the behavior of migration_downgrade() when map_file()
- * fails.
+ * Test that migration_downgrade() fails without a migration.
  */
-START_TEST(migration_downgrade_map_file_fails)
+START_TEST(migration_downgrade_no_migration)
 {
-	db_query_called       = 0;
-	map_file_returns      = NULL;
-	map_file_returns_size = 0;
-	ck_assert_int_ne(migration_downgrade("test"), 0);
+	db_query_called = 0;
+	ck_assert_int_ne(migration_downgrade(NULL), 0);
 	ck_assert(!db_query_called);
 }
 END_TEST
@@ -198,12 +307,10 @@ END_TEST
  */
 START_TEST(migration_downgrade_up_only)
 {
-	db_query_called       = 0;
-	map_file_returns      = migration_up_only;
-	map_file_returns_size = strlen(migration_up_only);
-	expected_query        = NULL;
+	db_query_called = 0;
+	expected_query  = NULL;
 
-	ck_assert_int_eq(migration_downgrade("test"), 0);
+	ck_assert_int_eq(downgrade(migration_up_only), 0);
 	ck_assert(!db_query_called);
 }
 END_TEST
@@ -214,11 +321,9 @@ END_TEST
  */
 START_TEST(migration_downgrade_down_only)
 {
-	db_query_called       = 0;
-	map_file_returns      = migration_down_only;
-	map_file_returns_size = strlen(migration_down_only);
-	expected_query        = migration_down_only + down_len + 1;
-	ck_assert_int_eq(migration_downgrade("test"), 0);
+	db_query_called = 0;
+	expected_query  = migration_down_only + down_len + 1;
+	ck_assert_int_eq(downgrade(migration_down_only), 0);
 	ck_assert(db_query_called);
 }
 END_TEST
@@ -229,11 +334,9 @@ END_TEST
  */
 START_TEST(migration_downgrade_no_space_before_up)
 {
-	db_query_called       = 0;
-	map_file_returns      = migration_down_works_no_space;
-	map_file_returns_size = strlen(migration_down_works_no_space);
-	expected_query        = migration_up_down_expected_query_down;
-	ck_assert_int_eq(migration_downgrade("test"), 0);
+	db_query_called = 0;
+	expected_query  = migration_up_down_expected_query_down;
+	ck_assert_int_eq(downgrade(migration_down_works_no_space), 0);
 	ck_assert(db_query_called);
 }
 END_TEST
@@ -243,15 +346,261 @@ END_TEST
  */
 START_TEST(test_migration_downgrade)
 {
-	db_query_called       = 0;
-	map_file_returns      = migration_down_works;
-	map_file_returns_size = strlen(migration_down_works);
-	expected_query        = migration_up_down_expected_query_down;
-	ck_assert_int_eq(migration_downgrade("test"), 0);
+	db_query_called = 0;
+	expected_query  = migration_up_down_expected_query_down;
+	ck_assert_int_eq(downgrade(migration_down_works), 0);
 	ck_assert(db_query_called);
 }
 END_TEST
 
+/**
+ * Test that migration_parse() finds both sections in one pass,
+ * without needing (or touching) a terminator.
+ */
+START_TEST(test_migration_parse)
+{
+	struct migration m;
+	char mem[] = "-- [up]\nA;\n-- [up]\nB;\n-- [down]\n C; \n-- [up]X";
+	char copy[sizeof(mem)];
+
+	migration_parse(&m, NULL, 0);
+	ck_assert(!m.mem && !m.up.len && !m.down.len);
+	ck_assert_int_ne(migration_upgrade(&m), 0);
+
+	/* The first marker of each kind counts */
+	memcpy(copy, mem, sizeof(copy));
+	migration_parse(&m, mem, sizeof(mem) - 1);
+	ck_assert(m.mem == mem);
+	ck_assert_uint_eq(m.up.off, 8);
+	ck_assert_uint_eq(m.up.len, 13);
+	ck_assert_uint_eq(m.down.off, 33);
+	ck_assert_uint_eq(m.down.len, 2);
+	ck_assert(!memcmp(copy, mem, sizeof(copy)));
+
+	/* ... and nothing past the end is read */
+	migration_parse(&m, mem, 22);
+	ck_assert_uint_eq(m.up.len, 13);
+	ck_assert(!m.down.len);
+
+	migration_parse(&m, mem, 26);
+	ck_assert_uint_eq(m.up.len, 18);
+	ck_assert(!m.down.len);
+}
+END_TEST
+
+/**
+ * Test that migration_checksum() fails without a migration, or
+ * somewhere to put the checksum.
+ */
+START_TEST(migration_checksum_invalid_params)
+{
+	char sum[MIGRATION_CHECKSUM_LEN];
+
+	ck_assert_int_ne(migration_checksum(NULL, 0, sum), 0);
+	ck_assert_int_ne(migration_checksum("test", 4, NULL), 0);
+}
+END_TEST
+
+/**
+ * Test that migration_checksum() works.
+ */
+START_TEST(test_migration_checksum)
+{
+	char sum[MIGRATION_CHECKSUM_LEN];
+	char data[] = "123456789";
+
+	ck_assert_int_eq(migration_checksum(data, strlen(data), sum), 0);
+	ck_assert_str_eq(sum, "cbf43926");
+}
+END_TEST
+
+/**
+ * Test that migration_upgrade() bulk-loads copy sections, and
+ * runs the SQL around them.
+ */
+START_TEST(migration_upgrade_copy)
+{
+	expected_query = NULL;
+	ck_assert_int_eq(upgrade(migration_up_copy), 0);
+	ck_assert_str_eq(queries, "CREATE TABLE t(a, b);|"
+	                          "CREATE INDEX i ON t(a);|");
+	ck_assert_str_eq(copied, "t(a, b):1\tx\n2\t\\N\n|t:3\ty|");
+}
+END_TEST
+
+/**
+ * Test that migration_upgrade() fails if a copy section is
+ * malformed, or can't be loaded.
+ */
+START_TEST(migration_upgrade_copy_fails)
+{
+	*errbuf = '\0';
+	expected_query = NULL;
+	ck_assert_int_ne(upgrade(migration_up_bad_copy), 0);
+	ck_assert_str_eq(errbuf, "invalid copy section: '-- [copy t'\n");
+	ck_assert_str_eq(queries, "CREATE TABLE t(a, b);|");
+	ck_assert(!*copied);
+
+	*queries = '\0';
+	db_copy_returns = 1;
+	ck_assert_int_ne(upgrade(migration_up_copy), 0);
+	ck_assert_str_eq(queries, "CREATE TABLE t(a, b);|");
+}
+END_TEST
+
+/**
+ * Test that migration_upgrade() doesn't take a copy marker inside a
+ * dollar-quoted body or a string for a copy section.
+ */
+START_TEST(migration_upgrade_copy_quoted)
+{
+	expected_query = NULL;
+	driver = "pgsql";
+	ck_assert_int_eq(upgrade(migration_up_copy_quoted), 0);
+	ck_assert_str_eq(queries, "CREATE FUNCTION f() RETURNS text AS $$\n"
+	                          "-- [copy t]\n$$ LANGUAGE sql;|"
+	                          "INSERT INTO t VALUES ('\n"
+	                          "-- [copy t]\n');|");
+	ck_assert(!*copied);
+}
+END_TEST
+
+/**
+ * Test that migration_upgrade() runs each statement on its own,
+ * skipping empty statements and comments.
+ */
+START_TEST(migration_upgrade_statements)
+{
+	expected_query = NULL;
+	ck_assert_int_eq(upgrade(migration_up_statements), 0);
+	ck_assert_int_eq(db_query_called, 3);
+	ck_assert_str_eq(queries, "CREATE TABLE t(a);|"
+	                          "INSERT INTO t VALUES (';');|"
+	                          "INSERT INTO t VALUES (1)|");
+	ck_assert(!*shown);
+}
+END_TEST
+
+/**
+ * Test that migration_upgrade() honors the mysql client's DELIMITER
+ * lines, and leaves them out of what's sent.
+ */
+START_TEST(migration_upgrade_delimiter)
+{
+	expected_query = NULL;
+	driver = "mysql";
+	ck_assert_int_eq(upgrade(migration_up_delimiter), 0);
+	ck_assert_str_eq(queries, "CREATE TRIGGER t BEFORE INSERT ON t FOR "
+	                          "EACH ROW\nBEGIN SET NEW.a = 1; END|"
+	                          "INSERT INTO t VALUES (1);|");
+
+	/* Other drivers don't have DELIMITER */
+	*queries = '\0';
+	driver = "pgsql";
+	ck_assert_int_eq(upgrade(migration_up_delimiter), 0);
+	ck_assert(!strncmp(queries, "DELIMITER //\n", 13));
+}
+END_TEST
+
+/**
+ * Test that migration_upgrade() stops at the first statement which
+ * fails, and says which one it was.
+ */
+START_TEST(migration_upgrade_statement_fails)
+{
+	expected_query = NULL;
+	db_query_fails_at = 2;
+	ck_assert_int_ne(upgrade(migration_up_statements), 0);
+	ck_assert_int_eq(db_query_called, 2);
+	ck_assert_str_eq(errbuf, "statement 2 (line 3) failed: "
+	                 "INSERT INTO t VALUES (';');\n");
+
+	db_query_fails_at = 3;
+	ck_assert_int_ne(upgrade(migration_up_delimiter), 0);
+	ck_assert_str_eq(errbuf, "statement 1 (line 2) failed: "
+	                 "DELIMITER //...\n");
+}
+END_TEST
+
+/**
+ * Test that each statement is labelled with the migration, and
+ * where it is within it, and that a pipelined statement's failure
+ * is left to the driver to report.
+ */
+START_TEST(migration_upgrade_labels)
+{
+	struct migration m;
+
+	*errbuf = '\0';
+	expected_query = NULL;
+	migration_parse(&m, migration_up_statements,
+	                strlen(migration_up_statements));
+	m.name = "1-x.sql";
+	db_query_fails_at = 2;
+	ck_assert_int_ne(migration_upgrade(&m), 0);
+	ck_assert_str_eq(labelled, "1-x.sql: statement 2 (line 3)");
+	ck_assert_str_eq(errbuf, "1-x.sql: statement 2 (line 3) failed: "
+	                 "INSERT INTO t VALUES (';');\n");
+
+	*errbuf = '\0';
+	db_query_called = 0;
+	pipelined = 1;
+	ck_assert_int_ne(migration_upgrade(&m), 0);
+	ck_assert_str_eq(errbuf, "");
+	ck_assert_int_eq(db_pipeline_synced, 0);
+}
+END_TEST
+
+/**
+ * Test that each statement is reported as it's run, once the
+ * migration has been running for a while.
+ */
+START_TEST(migration_upgrade_progress)
+{
+	*errbuf = '\0';
+	expected_query = NULL;
+	now_ms_tick = MIGRATION_PROGRESS_MS / 2;
+	ck_assert_int_eq(upgrade(migration_up_statements), 0);
+	ck_assert_str_eq(shown, "\n  statement 2 (line 3)..."
+	                        "\n  statement 3 (line 5)...");
+	ck_assert_str_eq(errbuf, " 1000 ms");
+}
+END_TEST
+
+/**
+ * Test that pipelined statements are waited on before they're
+ * reported, so that they're timed by how long they took to run.
+ */
+START_TEST(migration_upgrade_progress_pipelined)
+{
+	*errbuf = '\0';
+	expected_query = NULL;
+	pipelined = 1;
+	now_ms_tick = MIGRATION_PROGRESS_MS / 2;
+	ck_assert_int_eq(upgrade(migration_up_statements), 0);
+	ck_assert_str_eq(queries, "CREATE TABLE t(a);|sync|"
+	                          "INSERT INTO t VALUES (';');|sync|"
+	                          "INSERT INTO t VALUES (1)|sync|");
+	ck_assert_int_eq(db_pipeline_synced, 3);
+}
+END_TEST
+
+/**
+ * Test that the migration is put back the way it was found, once
+ * it's been run.
+ */
+START_TEST(migration_left_as_found)
+{
+	char copy[sizeof(migration_up_copy)];
+
+	memcpy(copy, migration_up_copy, sizeof(copy));
+	ck_assert_int_eq(upgrade(migration_up_copy), 0);
+	ck_assert(!memcmp(copy, migration_up_copy, sizeof(copy)));
+	ck_assert_int_eq(downgrade(migration_up_copy), 0);
+	ck_assert(!memcmp(copy, migration_up_copy, sizeof(copy)));
+}
+END_TEST
+
 Suite *migration_suite(void)
 {
 	Suite *s;
@@ -259,16 +608,26 @@ Suite *migration_suite(void)
 
 	s = suite_create("Migration Handling");
 	t = tcase_create("migration_upgrade");
-	tcase_add_test(t, migration_upgrade_map_file_fails);
+	tcase_add_test(t, migration_upgrade_no_migration);
 	tcase_add_test(t, migration_upgrade_up_only);
 	tcase_add_test(t, migration_upgrade_down_only);
 	tcase_add_test(t, migration_upgrade_no_space_before_down);
 	tcase_add_test(t, test_migration_upgrade);
+	tcase_add_test(t, migration_upgrade_copy);
+	tcase_add_test(t, migration_upgrade_copy_fails);
+	tcase_add_test(t, migration_upgrade_copy_quoted);
+	tcase_add_test(t, migration_left_as_found);
+	tcase_add_test(t, migration_upgrade_statements);
+	tcase_add_test(t, migration_upgrade_delimiter);
+	tcase_add_test(t, migration_upgrade_statement_fails);
+	tcase_add_test(t, migration_upgrade_labels);
+	tcase_add_test(t, migration_upgrade_progress);
+	tcase_add_test(t, migration_upgrade_progress_pipelined);
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
 	t = tcase_create("migration_downgrade");
-	tcase_add_test(t, migration_downgrade_map_file_fails);
+	tcase_add_test(t, migration_downgrade_no_migration);
 	tcase_add_test(t, migration_downgrade_up_only);
 	tcase_add_test(t, migration_downgrade_down_only);
 	tcase_add_test(t, migration_downgrade_no_space_before_up);
@@ -276,6 +635,17 @@ Suite *migration_suite(void)
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
+	t = tcase_create("migration_parse");
+	tcase_add_test(t, test_migration_parse);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("migration_checksum");
+	tcase_add_test(t, migration_checksum_invalid_params);
+	tcase_add_test(t, test_migration_checksum);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
 	return s;
 }
 
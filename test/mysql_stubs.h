@@ -26,29 +26,65 @@
 #define MYSQL_READ_DEFAULT_GROUP 1
 #define MYSQL_SET_CHARSET_NAME 2
 #define MYSQL_OPT_RECONNECT 3
+#define MYSQL_OPT_LOCAL_INFILE 5
 #define CLIENT_COMPRESS 4
 #define CLIENT_MULTI_STATEMENTS 8
+#define STMT_ATTR_UPDATE_MAX_LENGTH 0
+#define MYSQL_TYPE_STRING 254
+#define MYSQL_TYPE_NULL 6
+#define MYSQL_NO_DATA 100
+#define CR_UNKNOWN_ERROR 2000
 
 typedef struct mysql_field {
 	char *name;
+	unsigned long max_length;
 } MYSQL_FIELD;
 
 typedef int my_bool;
 typedef int MYSQL;
 typedef int MYSQL_RES;
+typedef int MYSQL_STMT;
+
+typedef struct mysql_bind {
+	unsigned long *length;
+	my_bool *is_null;
+	void *buffer;
+	unsigned long buffer_length;
+	int buffer_type;
+	my_bool is_null_value;
+} MYSQL_BIND;
 typedef char ** MYSQL_ROW;
 
 static int mysql_library_init_returns = 0;
 static MYSQL *mysql_init_returns = NULL;
 static MYSQL *mysql_real_connect_returns = NULL;
 static int mysql_real_query_returns = 0;
-static MYSQL_RES *mysql_store_result_returns = NULL;
+static MYSQL_RES *mysql_use_result_returns = NULL;
 static unsigned long mysql_num_rows_returns = 0;
+static unsigned int mysql_errno_returns = 0;
 static unsigned int mysql_num_fields_returns = 0;
 static MYSQL_FIELD *mysql_fetch_fields_returns = NULL;
 static MYSQL_ROW mysql_fetch_row_returns = NULL;
 static int mysql_next_result_returns = 0;
 static char *mysql_error_returns = NULL;
+static MYSQL_STMT *mysql_stmt_init_returns = NULL;
+static int mysql_stmt_prepare_returns = 0;
+static int mysql_stmt_execute_returns = 0;
+static MYSQL_RES *mysql_stmt_result_metadata_returns = NULL;
+static int mysql_stmt_fetch_rows = 0;
+static int mysql_stmt_fetch_returns = MYSQL_NO_DATA;
+static MYSQL_BIND *mysql_stmt_bound_params = NULL;
+static MYSQL_BIND *mysql_stmt_bound_result = NULL;
+static char mysql_real_query_query[128];
+static char mysql_infile_data[128];
+static int (*mysql_infile_init)(void **, const char *, void *) = NULL;
+static int (*mysql_infile_read)(void *, char *, unsigned int) = NULL;
+static void (*mysql_infile_end)(void *) = NULL;
+static int (*mysql_infile_error)(void *, char *, unsigned int) = NULL;
+static void *mysql_infile_userdata = NULL;
+static const char *mysql_infile_name = "mmm";
+static char mysql_infile_errmsg[64];
+static unsigned int mysql_warning_count_returns = 0;
 
 /* call counters */
 static int mysql_library_init_called = 0;
@@ -58,14 +94,16 @@ static int mysql_options_called = 0;
 static int mysql_real_connect_called = 0;
 static int mysql_close_called = 0;
 static int mysql_real_query_called = 0;
-static int mysql_store_result_called = 0;
-static int mysql_num_rows_called = 0;
+static int mysql_use_result_called = 0;
 static int mysql_num_fields_called = 0;
 static int mysql_fetch_fields_called = 0;
 static int mysql_fetch_row_called = 0;
 static int mysql_next_result_called = 0;
 static int mysql_free_result_called = 0;
 static int mysql_error_called = 0;
+static int mysql_stmt_close_called = 0;
+static int mysql_stmt_fetch_called = 0;
+static int mysql_stmt_free_result_called = 0;
 
 static void reset_mysql_stubs(void)
 {
@@ -73,8 +111,9 @@ static void reset_mysql_stubs(void)
 	mysql_init_returns = NULL;
 	mysql_real_connect_returns = NULL;
 	mysql_real_query_returns = 0;
-	mysql_store_result_returns = NULL;
+	mysql_use_result_returns = NULL;
 	mysql_num_rows_returns = 0;
+	mysql_errno_returns = 0;
 	mysql_num_fields_returns = 0;
 	mysql_fetch_fields_returns = NULL;
 	mysql_fetch_row_returns = NULL;
@@ -86,14 +125,34 @@ static void reset_mysql_stubs(void)
 	mysql_real_connect_called = 0;
 	mysql_close_called = 0;
 	mysql_real_query_called = 0;
-	mysql_store_result_called = 0;
-	mysql_num_rows_called = 0;
+	mysql_use_result_called = 0;
 	mysql_num_fields_called = 0;
 	mysql_fetch_fields_called = 0;
 	mysql_fetch_row_called = 0;
 	mysql_next_result_called = 0;
 	mysql_free_result_called = 0;
 	mysql_error_called = 0;
+	mysql_stmt_init_returns = NULL;
+	mysql_stmt_prepare_returns = 0;
+	mysql_stmt_execute_returns = 0;
+	mysql_stmt_result_metadata_returns = NULL;
+	mysql_stmt_fetch_rows = 0;
+	mysql_stmt_fetch_returns = MYSQL_NO_DATA;
+	mysql_stmt_bound_params = NULL;
+	mysql_stmt_bound_result = NULL;
+	mysql_stmt_close_called = 0;
+	mysql_stmt_fetch_called = 0;
+	mysql_stmt_free_result_called = 0;
+	*mysql_real_query_query = '\0';
+	*mysql_infile_data = '\0';
+	mysql_infile_init = NULL;
+	mysql_infile_read = NULL;
+	mysql_infile_end = NULL;
+	mysql_infile_error = NULL;
+	mysql_infile_userdata = NULL;
+	mysql_infile_name = "mmm";
+	*mysql_infile_errmsg = '\0';
+	mysql_warning_count_returns = 0;
 }
 /* }}} */
 
@@ -144,22 +203,63 @@ static void mysql_close(MYSQL *dbh)
 	return mysql_error_returns;
 }
 
+/**
+ * Like the server, this reads a LOAD DATA LOCAL INFILE through the
+ * installed handler (a few bytes at a time,) asking for the file
+ * named by mysql_infile_name.
+ */
 static int mysql_real_query(MYSQL *dbh, const char *query, size_t len)
 {
+	void *ptr;
+	char buf[4];
+	int n;
+
 	++mysql_real_query_called;
+	if (len >= sizeof mysql_real_query_query)
+		len = sizeof mysql_real_query_query - 1;
+	memcpy(mysql_real_query_query, query, len);
+	mysql_real_query_query[len] = '\0';
+
+	if (mysql_infile_init && !strncmp(query, "LOAD DATA LOCAL", 15)) {
+		if (mysql_infile_init(&ptr, mysql_infile_name,
+		                      mysql_infile_userdata)) {
+			mysql_infile_error(ptr, mysql_infile_errmsg,
+			                   sizeof mysql_infile_errmsg);
+			mysql_infile_end(ptr);
+			return 1;
+		}
+
+		while ((n = mysql_infile_read(ptr, buf, sizeof buf)) > 0)
+			strncat(mysql_infile_data, buf, (size_t)n);
+		mysql_infile_end(ptr);
+	}
+
 	return mysql_real_query_returns;
 }
 
-static MYSQL_RES *mysql_store_result(MYSQL *dbh)
+static void mysql_set_local_infile_handler(MYSQL *dbh,
+	int (*init)(void **, const char *, void *),
+	int (*read)(void *, char *, unsigned int),
+	void (*end)(void *),
+	int (*error)(void *, char *, unsigned int),
+	void *userdata)
 {
-	++mysql_store_result_called;
-	return mysql_store_result_returns;
+	mysql_infile_init     = init;
+	mysql_infile_read     = read;
+	mysql_infile_end      = end;
+	mysql_infile_error    = error;
+	mysql_infile_userdata = userdata;
 }
 
-static unsigned long mysql_num_rows(MYSQL_RES *res)
+static unsigned int mysql_warning_count(MYSQL *dbh)
 {
-	++mysql_num_rows_called;
-	return mysql_num_rows_returns;
+	return mysql_warning_count_returns;
+}
+
+static MYSQL_RES *mysql_use_result(MYSQL *dbh)
+{
+	++mysql_use_result_called;
+	return mysql_use_result_returns;
 }
 
 static unsigned int mysql_num_fields(MYSQL_RES *res)
@@ -174,12 +274,28 @@ static MYSQL_FIELD *mysql_fetch_fields(MYSQL_RES *res)
 	return mysql_fetch_fields_returns;
 }
 
+/**
+ * Returns mysql_fetch_row_returns for the first
+ * mysql_num_rows_returns calls, and NULL after that.
+ */
 static MYSQL_ROW mysql_fetch_row(MYSQL_RES *res)
 {
-	++mysql_fetch_row_called;
+	if ((unsigned long)mysql_fetch_row_called++ >= mysql_num_rows_returns)
+		return NULL;
 	return mysql_fetch_row_returns;
 }
 
+static unsigned long *mysql_fetch_lengths(MYSQL_RES *res)
+{
+	static unsigned long lengths[] = { 5, 5, 5, 5 };
+	return lengths;
+}
+
+static unsigned int mysql_errno(MYSQL *dbh)
+{
+	return mysql_errno_returns;
+}
+
 static void mysql_free_result(MYSQL_RES *res)
 {
 	++mysql_free_result_called;
@@ -191,6 +307,80 @@ static int mysql_next_result(MYSQL *dbh)
 	return mysql_next_result_returns;
 }
 
+static MYSQL_STMT *mysql_stmt_init(MYSQL *dbh)
+{
+	return mysql_stmt_init_returns;
+}
+
+static int mysql_stmt_prepare(MYSQL_STMT *stmt, const char *query,
+                              unsigned long len)
+{
+	return mysql_stmt_prepare_returns;
+}
+
+static const char *mysql_stmt_error(MYSQL_STMT *stmt)
+{
+	return "stmt error";
+}
+
+static int mysql_stmt_close(MYSQL_STMT *stmt)
+{
+	++mysql_stmt_close_called;
+	return 0;
+}
+
+static int mysql_stmt_bind_param(MYSQL_STMT *stmt, MYSQL_BIND *bind)
+{
+	mysql_stmt_bound_params = bind;
+	return 0;
+}
+
+static int mysql_stmt_execute(MYSQL_STMT *stmt)
+{
+	return mysql_stmt_execute_returns;
+}
+
+static MYSQL_RES *mysql_stmt_result_metadata(MYSQL_STMT *stmt)
+{
+	return mysql_stmt_result_metadata_returns;
+}
+
+static int mysql_stmt_attr_set(MYSQL_STMT *stmt, int attr,
+                               const void *value)
+{
+	return 0;
+}
+
+static int mysql_stmt_store_result(MYSQL_STMT *stmt)
+{
+	return 0;
+}
+
+static int mysql_stmt_bind_result(MYSQL_STMT *stmt, MYSQL_BIND *bind)
+{
+	mysql_stmt_bound_result = bind;
+	return 0;
+}
+
+static int mysql_stmt_fetch(MYSQL_STMT *stmt)
+{
+	++mysql_stmt_fetch_called;
+	if (!mysql_stmt_fetch_rows)
+		return mysql_stmt_fetch_returns;
+
+	--mysql_stmt_fetch_rows;
+	strcpy(mysql_stmt_bound_result[0].buffer, "value");
+	*mysql_stmt_bound_result[0].length = 5;
+	mysql_stmt_bound_result[0].is_null_value = 0;
+	return 0;
+}
+
+static int mysql_stmt_free_result(MYSQL_STMT *stmt)
+{
+	++mysql_stmt_free_result_called;
+	return 0;
+}
+
 /* }}} */
 
 #endif /* TEST_MYSQL_STUBS_H */
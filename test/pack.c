@@ -0,0 +1,322 @@
+/**
+ * Minimal Migration Manager - Migration Pack Tests
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <check.h>
+#include "tests.h"
+
+/* from test_runner.c */
+extern char errbuf[];
+
+#include "posix_stubs.h"
+
+/* {{{ source stubs */
+#define SOURCE_H
+static char **source_find_migrations(const char *source,
+                                     const char *cur_rev,
+                                     const char *prev_rev, size_t *size);
+static char *source_load_migration(const char *source, const char *file,
+                                   size_t *size);
+static void source_unload_migration(const char *source, char *mem,
+                                    size_t size);
+/* }}} */
+
+#include "../src/pack.c"
+
+static const char *migrations[4] = {
+	"1.sql", "2_a.sql", "2_b.sql", "10.sql"
+};
+
+static const char *bodies[4] = {
+	"-- [up]\nONE;\n", "-- [up]\nTWO A;\n",
+	"-- [up]\nTWO B;\n", "-- [up]\nTEN;\n"
+};
+
+static const char **source_find_migrations_returns = migrations;
+static size_t source_find_migrations_size = 4;
+static int source_load_migration_fails_at = 0;
+static int source_unload_migration_called = 0;
+
+static char pack_buf[1024];
+
+/* {{{ source stubs */
+static char **source_find_migrations(const char *source,
+                                     const char *cur_rev,
+                                     const char *prev_rev, size_t *size)
+{
+	char **m;
+	size_t i;
+
+	(void)source;
+	(void)cur_rev;
+	(void)prev_rev;
+
+	*size = 0;
+	if (!source_find_migrations_size) return NULL;
+	m = malloc(source_find_migrations_size * sizeof(char *));
+	ck_assert(m != NULL);
+	for (i = 0; i < source_find_migrations_size; i++) {
+		m[i] = malloc(strlen(source_find_migrations_returns[i]) + 1);
+		ck_assert(m[i] != NULL);
+		strcpy(m[i], source_find_migrations_returns[i]);
+	}
+
+	*size = source_find_migrations_size;
+	return m;
+}
+
+static char *source_load_migration(const char *source, const char *file,
+                                   size_t *size)
+{
+	size_t i;
+
+	(void)source;
+	if (!--source_load_migration_fails_at) return NULL;
+	for (i = 0; i < 4 && strcmp(migrations[i], file); i++);
+	ck_assert(i < 4);
+	*size = strlen(bodies[i]);
+	return (char *)(uintptr_t)bodies[i];
+}
+
+static void source_unload_migration(const char *source, char *mem,
+                                    size_t size)
+{
+	(void)source;
+	(void)mem;
+	(void)size;
+	++source_unload_migration_called;
+}
+/* }}} */
+
+static void reset(void)
+{
+	reset_stubs();
+	source_find_migrations_returns = migrations;
+	source_find_migrations_size    = 4;
+	source_load_migration_fails_at = 0;
+	source_unload_migration_called = 0;
+
+	memset(pack_buf, 0, sizeof(pack_buf));
+	write_data  = pack_buf;
+	open_returns = 3;
+	*errbuf = '\0';
+}
+
+/**
+ * Test that pack_build() fails if it isn't given a path, or if the
+ * path is too long.
+ */
+START_TEST(pack_build_invalid_params)
+{
+	char path[1024];
+
+	ck_assert_int_ne(pack_build("file", NULL), 0);
+	ck_assert_str_eq(errbuf, "pack: no pack_file specified\n");
+	ck_assert_int_ne(pack_build("file", ""), 0);
+	ck_assert_str_eq(errbuf, "pack: no pack_file specified\n");
+
+	memset(path, 'x', sizeof(path) - 1);
+	path[sizeof(path) - 1] = '\0';
+	ck_assert_int_ne(pack_build("file", path), 0);
+	ck_assert(!strncmp(errbuf, "pack: path too long: ", 21));
+	ck_assert(!open_called);
+}
+END_TEST
+
+/**
+ * Test that pack_build() fails if there aren't any migrations.
+ */
+START_TEST(pack_build_no_migrations)
+{
+	source_find_migrations_size = 0;
+	ck_assert_int_ne(pack_build("file", "test.pak"), 0);
+	ck_assert_str_eq(errbuf, "pack: no migrations found\n");
+	ck_assert(!open_called);
+}
+END_TEST
+
+/**
+ * Test that pack_build() refuses migrations which aren't sorted.
+ */
+START_TEST(pack_build_out_of_order)
+{
+	static const char *m[2] = { "2.sql", "1.sql" };
+
+	source_find_migrations_returns = m;
+	source_find_migrations_size    = 2;
+	ck_assert_int_ne(pack_build("file", "test.pak"), 0);
+	ck_assert_str_eq(errbuf, "pack: '1.sql' is out of order\n");
+	ck_assert(!open_called);
+}
+END_TEST
+
+/**
+ * Test that pack_build() fails if the pack can't be created.
+ */
+START_TEST(pack_build_open_fails)
+{
+	open_errno = EACCES;
+	ck_assert_int_ne(pack_build("file", "test.pak"), 0);
+	ck_assert_str_eq(errbuf, "pack: unable to write 'test.pak.tmp': "
+	                 "Permission denied\n");
+	ck_assert(!close_called);
+	ck_assert(!rename_called);
+}
+END_TEST
+
+/**
+ * Test that pack_build() removes the temporary file if writing
+ * the pack fails.
+ */
+START_TEST(pack_build_write_fails)
+{
+	write_fails_at = 3;
+	ck_assert_int_ne(pack_build("file", "test.pak"), 0);
+	ck_assert_str_eq(errbuf, "pack: unable to write 'test.pak.tmp': "
+	                 "short write\n");
+	ck_assert_int_eq(source_unload_migration_called, 1);
+	ck_assert_int_eq(close_called, 1);
+	ck_assert_int_eq(unlink_called, 1);
+	ck_assert(!rename_called);
+}
+END_TEST
+
+/**
+ * Test that pack_build() removes the temporary file if a migration
+ * can't be loaded.
+ */
+START_TEST(pack_build_load_fails)
+{
+	source_load_migration_fails_at = 2;
+	ck_assert_int_ne(pack_build("file", "test.pak"), 0);
+	ck_assert_int_eq(source_unload_migration_called, 1);
+	ck_assert_int_eq(close_called, 1);
+	ck_assert_int_eq(unlink_called, 1);
+	ck_assert(!rename_called);
+}
+END_TEST
+
+/**
+ * Test that pack_build() builds a pack which can be read back.
+ */
+START_TEST(test_pack_build)
+{
+	size_t i, n, size;
+	unsigned long sum;
+	char *mem;
+
+	ck_assert_int_eq(pack_build("file", "test.pak"), 0);
+	ck_assert_str_eq(errbuf, "Packed 4 migrations into test.pak\n");
+	ck_assert_int_eq(source_unload_migration_called, 4);
+	ck_assert_int_eq(lseek_called, 1);
+	ck_assert_int_eq(close_called, 1);
+	ck_assert_int_eq(rename_called, 1);
+	ck_assert(!unlink_called);
+
+	ck_assert_int_eq(pack_check(pack_buf, write_data_len, &n), 0);
+	ck_assert_uint_eq(n, 4);
+	for (i = 0; i < n; i++) {
+		ck_assert_str_eq(pack_name(pack_buf, i), migrations[i]);
+		mem = pack_migration(pack_buf, i, &size, &sum);
+		ck_assert_uint_eq(size, strlen(bodies[i]));
+		ck_assert_str_eq(mem, bodies[i]);
+		ck_assert_uint_eq(sum, checksum(bodies[i], size));
+	}
+}
+END_TEST
+
+/**
+ * Test that pack_upper() and pack_find() find the right migrations.
+ */
+START_TEST(test_pack_find)
+{
+	size_t n;
+
+	ck_assert_int_eq(pack_build("file", "test.pak"), 0);
+	ck_assert_int_eq(pack_check(pack_buf, write_data_len, &n), 0);
+
+	ck_assert_uint_eq(pack_upper(pack_buf, n, 0), 0);
+	ck_assert_uint_eq(pack_upper(pack_buf, n, 1), 1);
+	ck_assert_uint_eq(pack_upper(pack_buf, n, 2), 3);
+	ck_assert_uint_eq(pack_upper(pack_buf, n, 5), 3);
+	ck_assert_uint_eq(pack_upper(pack_buf, n, 10), 4);
+
+	ck_assert_uint_eq(pack_find(pack_buf, n, "1.sql"), 0);
+	ck_assert_uint_eq(pack_find(pack_buf, n, "2_b.sql"), 2);
+	ck_assert_uint_eq(pack_find(pack_buf, n, "10.sql"), 3);
+	ck_assert_uint_eq(pack_find(pack_buf, n, "2_c.sql"), n);
+	ck_assert_uint_eq(pack_find(pack_buf, n, "3.sql"), n);
+}
+END_TEST
+
+/**
+ * Test that pack_check() rejects things which aren't packs, and
+ * packs which have been damaged.
+ */
+START_TEST(pack_check_damaged)
+{
+	size_t n, size;
+	unsigned long sum;
+	char *mem;
+
+	ck_assert_int_ne(pack_check(NULL, 0, &n), 0);
+	ck_assert_int_ne(pack_check("mmmpak1", 8, &n), 0);
+	ck_assert_int_ne(pack_check("-- [up]\nONE;\n", 13, &n), 0);
+
+	ck_assert_int_eq(pack_build("file", "test.pak"), 0);
+	ck_assert_int_eq(pack_check(pack_buf, write_data_len, &n), 0);
+	ck_assert_int_ne(pack_check(pack_buf, write_data_len - 1, &n), 0);
+
+	/* A missing terminator */
+	mem = pack_migration(pack_buf, 1, &size, &sum);
+	mem[size] = ' ';
+	ck_assert_int_ne(pack_check(pack_buf, write_data_len, &n), 0);
+	mem[size] = '\0';
+
+	/* An index which isn't sorted */
+	pack_buf[PACK_HEADER + 7] = 11;
+	ck_assert_int_ne(pack_check(pack_buf, write_data_len, &n), 0);
+	pack_buf[PACK_HEADER + 7] = 1;
+
+	/* More migrations than fit */
+	pack_buf[11] = 100;
+	ck_assert_int_ne(pack_check(pack_buf, write_data_len, &n), 0);
+	pack_buf[11] = 4;
+	ck_assert_int_eq(pack_check(pack_buf, write_data_len, &n), 0);
+}
+END_TEST
+
+Suite *pack_suite(void)
+{
+	Suite *s;
+	TCase *t;
+
+	s = suite_create("Pack");
+	t = tcase_create("pack_build");
+	tcase_add_checked_fixture(t, reset, NULL);
+	tcase_add_test(t, pack_build_invalid_params);
+	tcase_add_test(t, pack_build_no_migrations);
+	tcase_add_test(t, pack_build_out_of_order);
+	tcase_add_test(t, pack_build_open_fails);
+	tcase_add_test(t, pack_build_write_fails);
+	tcase_add_test(t, pack_build_load_fails);
+	tcase_add_test(t, test_pack_build);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("pack_read");
+	tcase_add_checked_fixture(t, reset, NULL);
+	tcase_add_test(t, test_pack_find);
+	tcase_add_test(t, pack_check_damaged);
+	suite_add_tcase(s, t);
+
+	return s;
+}
@@ -36,6 +36,10 @@ typedef void DIR;
 #define S_ISDIR(m) ((m) & S_IFDIR)
 
 /* stat: Permissions bits for mode */
+#define S_IRUSR 0400
+#define S_IWUSR 0200
+#define S_IRGRP 0040
+#define S_IROTH 0004
 #define S_IXUSR 0100
 #define S_IXGRP 0010
 #define S_IXOTH 0001
@@ -43,6 +47,12 @@ typedef void DIR;
 #define S_IRWXG 0070
 #define S_IRWXO 0007
 
+/* readdir: d_type values */
+#define DT_UNKNOWN 0
+#define DT_DIR     4
+#define DT_REG     8
+#define DT_LNK     10
+
 /* lseek: whence values */
 #define SEEK_SET 0
 
@@ -53,23 +63,29 @@ typedef void DIR;
 struct stat {
 	off_t st_size;
 	mode_t st_mode;
+	unsigned long st_dev;
+	unsigned long st_ino;
+	long st_mtime;
 };
 
 struct dirent {
 	char d_name[50];
 	struct dirent *next;
+	unsigned char d_type;
 };
 /* }}} */
 
 /* {{{ Function called counters */
 static int stat_called   = 0;
 static int fstat_called  = 0;
+static int fstatat_called = 0;
 static int open_called   = 0;
 static int close_called  = 0;
 static int write_called  = 0;
 static int read_called   = 0;
 static int mkdir_called  = 0;
 static int unlink_called = 0;
+static int rename_called = 0;
 static int lseek_called   = 0;
 static int opendir_called = 0;
 static int readdir_called = 0;
@@ -79,12 +95,14 @@ static int closedir_called = 0;
 /* {{{ Function failure counters */
 static int stat_fails_at    = 0;
 static int fstat_fails_at   = 0;
+static int fstatat_fails_at = 0;
 static int open_fails_at    = 0;
 static int close_fails_at   = 0;
 static int write_fails_at   = 0;
 static int read_fails_at    = 0;
 static int mkdir_fails_at   = 0;
 static int unlink_fails_at  = 0;
+static int rename_fails_at  = 0;
 static int lseek_fails_at   = 0;
 static int opendir_fails_at = 0;
 static int readdir_fails_at = 0;
@@ -95,27 +113,36 @@ static int closedir_fails_at = 0;
 static struct stat stat_returns_buf;
 static int stat_returns      = 0;
 static int fstat_returns     = 0;
+static int fstatat_returns   = 0;
 static int open_returns      = 0;
 static int close_returns     = 0;
 static ssize_t write_returns = 0;
 static ssize_t read_returns  = 0;
 static int mkdir_returns     = 0;
 static int unlink_returns    = 0;
+static int rename_returns    = 0;
 static int lseek_returns     = 0;
 static void *opendir_returns = NULL;
 static struct dirent *readdir_returns = NULL;
 static int closedir_returns  = 0;
+static const char *read_data = NULL;
+static size_t read_data_len  = 0;
+static char *write_data      = NULL;
+static size_t write_data_pos = 0;
+static size_t write_data_len = 0;
 /* }}} */
 
 /* {{{ Stub errno values */
 static int stat_errno    = -1;
 static int fstat_errno    = -1;
+static int fstatat_errno  = -1;
 static int open_errno    = -1;
 static int close_errno   = -1;
 static int write_errno   = -1;
 static int read_errno    = -1;
 static int mkdir_errno   = -1;
 static int unlink_errno  = -1;
+static int rename_errno  = -1;
 static int lseek_errno   = -1;
 static int opendir_errno = -1;
 static int readdir_errno = -1;
@@ -129,19 +156,27 @@ static void reset_stubs(void)
 	stat_returns   = 0; open_returns  = 0; close_returns = 0;
 	write_returns  = 0; read_returns  = 0; mkdir_returns = 0;
 	unlink_returns = 0; lseek_returns = 0; fstat_returns = 0;
+	fstatat_returns = 0; rename_returns = 0;
 	opendir_returns = NULL;
 	readdir_returns = NULL;
 	closedir_returns = 0;
+	read_data = NULL;
+	read_data_len = 0;
+	write_data = NULL;
+	write_data_pos = 0;
+	write_data_len = 0;
 
 	/* Called couters, errno, etc. */
 	stat_called    = 0; stat_fails_at    = 0; stat_errno    = -1;
 	fstat_called   = 0; fstat_fails_at   = 0; fstat_errno   = -1;
+	fstatat_called = 0; fstatat_fails_at = 0; fstatat_errno = -1;
 	open_called    = 0; open_fails_at    = 0; open_errno    = -1;
 	close_called   = 0; close_fails_at   = 0; close_errno   = -1;
 	write_called   = 0; write_fails_at   = 0; write_errno   = -1;
 	read_called    = 0; read_fails_at    = 0; read_errno    = -1;
 	mkdir_called   = 0; mkdir_fails_at   = 0; mkdir_errno   = -1;
 	unlink_called  = 0; unlink_fails_at  = 0; unlink_errno  = -1;
+	rename_called  = 0; rename_fails_at  = 0; rename_errno  = -1;
 	lseek_called   = 0; lseek_fails_at   = 0; lseek_errno   = -1;
 	opendir_called = 0; opendir_fails_at = 0; opendir_errno = -1;
 	readdir_called = 0; readdir_fails_at = 0; readdir_errno = -1;
@@ -200,6 +235,15 @@ static int fstat(int fd, struct stat *buf)
 }
 /* }}} */
 
+/* {{{ fstatat */
+static int fstatat(int fd, const char *pathname, struct stat *buf,
+                   int flags)
+{
+	if (buf) memcpy(buf, &stat_returns_buf, sizeof(struct stat));
+	DO_STUB(fstatat);
+}
+/* }}} */
+
 /* {{{ open */
 static int open(const char *pathname, int flags, ...)
 {
@@ -214,16 +258,37 @@ static int close(int fd)
 }
 /* }}} */
 
-/* {{{ write */
+/* {{{ write: Captures everything into write_data if it's set */
 static ssize_t write(int fd, const void *buf, size_t count)
 {
+	if (write_data) {
+		write_called++;
+		if (!--write_fails_at) return -1;
+		memcpy(write_data + write_data_pos, buf, count);
+		write_data_pos += count;
+		if (write_data_pos > write_data_len)
+			write_data_len = write_data_pos;
+		return (ssize_t)count;
+	}
+
 	DO_STUB(write);
 }
 /* }}} */
 
-/* {{{ read */
+/* {{{ read: Hands out read_data if it's set, or zeros otherwise */
 static ssize_t read(int fd, void *buf, size_t count)
 {
+	size_t n = read_data_len < count ? read_data_len : count;
+
+	if (read_data) {
+		read_called++;
+		memcpy(buf, read_data, n);
+		read_data     += n;
+		read_data_len -= n;
+		return (ssize_t)n;
+	}
+
+	memset(buf, 0, count);
 	DO_STUB(read);
 }
 /* }}} */
@@ -242,9 +307,19 @@ static int unlink(const char *pathname)
 }
 /* }}} */
 
-/* {{{ lseek */
+/* {{{ rename: stdio.h declares this one, so it's renamed */
+static int rename_stub(const char *oldpath, const char *newpath)
+{
+	DO_STUB(rename);
+}
+#define rename rename_stub
+/* }}} */
+
+/* {{{ lseek: Moves the write_data position (for SEEK_SET) */
 static off_t lseek(int fd, off_t offset, int whence)
 {
+	if (write_data && whence == SEEK_SET)
+		write_data_pos = (size_t)offset;
 	DO_STUB(lseek);
 }
 /* }}} */
@@ -282,6 +357,13 @@ static struct dirent *readdir(DIR *dirp)
 }
 /* }}} */
 
+/* {{{ dirfd */
+static int dirfd(DIR *dirp)
+{
+	return 3;
+}
+/* }}} */
+
 /* {{{ closedir */
 static int closedir(DIR *dirp)
 {
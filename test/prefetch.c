@@ -0,0 +1,295 @@
+/**
+ * Minimal Migration Manager - Prefetch Tests
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+#include "tests.h"
+
+/* from test_runner.c */
+extern char errbuf[];
+
+/* {{{ source / migration stubs */
+struct migration_section {
+	size_t off;
+	size_t len;
+};
+
+struct migration {
+	const char *name;
+	char *mem;
+	size_t size;
+	struct migration_section up, down;
+};
+
+static void migration_parse(struct migration *m, char *mem, size_t size);
+static char *source_load_migration(const char *source, const char *file,
+                                   size_t *size);
+static char **source_get_migration_paths(const char *source, char **files,
+                                         size_t n);
+static void source_unload_migration(const char *source, char *mem,
+                                    size_t size);
+static size_t map_files(char **paths, size_t n, char **mem, size_t *size);
+
+#define MIGRATION_H
+#define SOURCE_H
+#define FILE_H
+#define PREFETCH_DEPTH 1
+#define PREFETCH_BATCH 3
+#include "../src/prefetch.c"
+
+static char names_buf[6][8] = {
+	"1.sql", "2.sql", "3.sql", "4.sql", "5.sql", "6.sql"
+};
+
+static char *names[6] = {
+	names_buf[0], names_buf[1], names_buf[2],
+	names_buf[3], names_buf[4], names_buf[5]
+};
+
+static char bodies[6][16] = {
+	"-- [up]\nONE;", "-- [up]\nTWO;", "-- [up]\nTHREE;",
+	"-- [up]\nFOUR;", "-- [up]\nFIVE;", "-- [up]\nSIX;"
+};
+
+static size_t source_load_migration_called = 0;
+static size_t source_load_migration_fails_at = 0;
+static size_t source_unload_migration_called = 0;
+
+/* Each batch read by map_files(), by its first migration and size */
+static size_t map_files_called = 0;
+static size_t map_files_first[6];
+static size_t map_files_n[6];
+
+static void migration_parse(struct migration *m, char *mem, size_t size)
+{
+	memset(m, 0, sizeof(*m));
+	m->mem    = mem;
+	m->size   = size;
+	m->up.off = 8;
+	m->up.len = size - 8;
+}
+
+static char *source_load_migration(const char *source, const char *file,
+                                   size_t *size)
+{
+	size_t i;
+
+	ck_assert(!strcmp(source, "file") || !strcmp(source, "pack"));
+	if (++source_load_migration_called == source_load_migration_fails_at)
+		return NULL;
+
+	for (i = 0; i < 6 && strcmp(names[i], file); i++);
+	ck_assert_uint_lt(i, 6);
+	*size = strlen(bodies[i]);
+	return bodies[i];
+}
+
+/**
+ * Migrations from the "file" source are read from files, which are
+ * named for them here. Those from the "pack" source aren't.
+ */
+static char **source_get_migration_paths(const char *source, char **files,
+                                         size_t n)
+{
+	char **paths;
+
+	if (strcmp(source, "file")) return NULL;
+	ck_assert(files == names);
+	ck_assert_uint_eq(n, 6);
+	paths = malloc(n * sizeof(char *));
+	memcpy(paths, files, n * sizeof(char *));
+	return paths;
+}
+
+/**
+ * This may be called from the prefetcher, and so only notes what
+ * was asked for, to be checked once it's stopped.
+ */
+static size_t map_files(char **paths, size_t n, char **mem, size_t *size)
+{
+	size_t i, retval = 0;
+
+	map_files_first[map_files_called] = (size_t)(*paths[0] - '1');
+	map_files_n[map_files_called++]   = n;
+	for (i = 0; i < n; i++) {
+		size[i] = 0;
+		mem[i]  = source_load_migration("file", paths[i], &size[i]);
+		if (mem[i]) ++retval;
+	}
+
+	return retval;
+}
+
+static void source_unload_migration(const char *source, char *mem,
+                                    size_t size)
+{
+	ck_assert(!strcmp(source, "file") || !strcmp(source, "pack"));
+	ck_assert(mem != NULL);
+	ck_assert_uint_eq(size, strlen(mem));
+	++source_unload_migration_called;
+}
+/* }}} */
+
+static void reset(void)
+{
+	source_load_migration_called   = 0;
+	source_load_migration_fails_at = 0;
+	source_unload_migration_called = 0;
+	map_files_called = 0;
+}
+
+/**
+ * Test that there's nothing to get without any migrations.
+ */
+START_TEST(prefetch_nothing)
+{
+	ck_assert_int_eq(prefetch_start("file", NULL, 0), 0);
+	ck_assert(!prefetch_get(0));
+	prefetch_release(0);
+	prefetch_stop();
+	ck_assert(!source_load_migration_called);
+}
+END_TEST
+
+/**
+ * Test that migrations are handed out in order, parsed, and read in
+ * PREFETCH_BATCH at a time, with only the first read by this thread.
+ */
+START_TEST(test_prefetch)
+{
+	const struct migration *m;
+	size_t i, next;
+
+	ck_assert_int_eq(prefetch_start("file", names, 6), 0);
+	ck_assert(!source_load_migration_called);
+
+	for (i = 0; i < 6; i++) {
+		ck_assert((m = prefetch_get(i)) != NULL);
+		ck_assert_ptr_eq(m->mem, bodies[i]);
+		ck_assert_uint_eq(m->up.len, strlen(bodies[i]) - 8);
+		prefetch_release(i);
+		ck_assert_uint_eq(source_unload_migration_called, i + 1);
+	}
+
+	prefetch_stop();
+	ck_assert_uint_eq(source_load_migration_called, 6);
+	ck_assert_uint_eq(source_unload_migration_called, 6);
+
+	/* Each was read once, in order */
+	ck_assert_uint_eq(map_files_n[0], 1);
+	for (i = next = 0; i < map_files_called; i++) {
+		ck_assert_uint_eq(map_files_first[i], next);
+		ck_assert_uint_le(map_files_n[i], PREFETCH_BATCH);
+		next += map_files_n[i];
+	}
+
+	ck_assert_uint_eq(next, 6);
+}
+END_TEST
+
+/**
+ * Test that migrations a source provides itself are loaded by this
+ * thread, only PREFETCH_DEPTH ahead, PREFETCH_BATCH at a time.
+ */
+START_TEST(prefetch_from_source)
+{
+	static const size_t loaded[6] = { 2, 3, 4, 5, 6, 6 };
+	size_t i;
+
+	ck_assert_int_eq(prefetch_start("pack", names, 6), 0);
+	for (i = 0; i < 6; i++) {
+		ck_assert_ptr_eq(prefetch_get(i)->mem, bodies[i]);
+		ck_assert_uint_eq(source_load_migration_called, loaded[i]);
+		prefetch_release(i);
+	}
+
+	prefetch_stop();
+	ck_assert(!map_files_called);
+	ck_assert_uint_eq(source_unload_migration_called, 6);
+}
+END_TEST
+
+/**
+ * Test that no more than PREFETCH_DEPTH migrations are loaded
+ * ahead of the one being run.
+ */
+START_TEST(prefetch_depth)
+{
+	ck_assert_int_eq(prefetch_start("file", names, 6), 0);
+	ck_assert(prefetch_get(0) != NULL);
+	ck_assert_uint_eq(pf.loaded, PREFETCH_DEPTH + 1);
+	ck_assert(prefetch_get(1) != NULL);
+	ck_assert_uint_eq(pf.loaded, PREFETCH_DEPTH + 2);
+	prefetch_stop();
+}
+END_TEST
+
+/**
+ * Test that migrations which aren't given back can be had again,
+ * and are unloaded when we stop.
+ */
+START_TEST(prefetch_kept)
+{
+	const struct migration *m;
+
+	ck_assert_int_eq(prefetch_start("file", names, 6), 0);
+	ck_assert((m = prefetch_get(0)) != NULL);
+	ck_assert((m = prefetch_get(5)) != NULL);
+	ck_assert_ptr_eq(m->mem, bodies[5]);
+	ck_assert_ptr_eq(prefetch_get(5), m);
+	ck_assert_ptr_eq(prefetch_get(2)->mem, bodies[2]);
+	ck_assert(!prefetch_get(6));
+
+	ck_assert(!source_unload_migration_called);
+	prefetch_stop();
+	ck_assert_uint_eq(source_load_migration_called, 6);
+	ck_assert_uint_eq(source_unload_migration_called, 6);
+}
+END_TEST
+
+/**
+ * Test that a migration which couldn't be loaded is reported as
+ * such, without holding up the rest.
+ */
+START_TEST(prefetch_load_fails)
+{
+	ck_assert_int_eq(prefetch_start("file", names, 6), 0);
+	source_load_migration_fails_at = 3;
+	ck_assert(prefetch_get(0) != NULL);
+	ck_assert(prefetch_get(1) != NULL);
+	ck_assert(!prefetch_get(2));
+	ck_assert_ptr_eq(prefetch_get(3)->mem, bodies[3]);
+
+	/* Only those up to PREFETCH_DEPTH past the last were loaded */
+	prefetch_stop();
+	ck_assert_uint_eq(source_unload_migration_called, 4);
+}
+END_TEST
+
+Suite *prefetch_suite(void)
+{
+	Suite *s;
+	TCase *t;
+
+	s = suite_create("Prefetch");
+	t = tcase_create("prefetch");
+	tcase_add_checked_fixture(t, reset, NULL);
+	tcase_add_test(t, prefetch_nothing);
+	tcase_add_test(t, test_prefetch);
+	tcase_add_test(t, prefetch_from_source);
+	tcase_add_test(t, prefetch_depth);
+	tcase_add_test(t, prefetch_kept);
+	tcase_add_test(t, prefetch_load_fails);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	return s;
+}
@@ -0,0 +1,147 @@
+/**
+ * Minimal Migration Manager - Scanning Primitive Tests
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+#include "tests.h"
+
+#include "../src/scan.h"
+#include "../src/scan.c"
+
+/* Long enough to cross a few 32-byte blocks */
+#define BUF_LEN 100
+
+/**
+ * Get each set of primitives this CPU can run.
+ */
+static size_t impls(const struct scan_impl **v)
+{
+	size_t n = 0;
+
+	v[n++] = &portable;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) v[n++] = &sse2;
+	if (__builtin_cpu_supports("avx2")) v[n++] = &avx2;
+#endif
+	return n;
+}
+
+/**
+ * Test that the best primitives are chosen once, and used after.
+ */
+START_TEST(scan_selects_impl)
+{
+	const struct scan_impl *v[3];
+	size_t n = impls(v);
+
+	ck_assert(!impl);
+	ck_assert_uint_eq(scan_space("  x", 3), 2);
+	ck_assert_ptr_eq(impl, v[n - 1]);
+}
+END_TEST
+
+/**
+ * Test that each version of scan_space() stops at the first byte
+ * which isn't whitespace, wherever it is.
+ */
+START_TEST(test_scan_space)
+{
+	const struct scan_impl *v[3];
+	static const char ws[] = " \t\n\v\f\r";
+	static const char not_ws[] = "x\b\016\037!\177\200\240";
+	char buf[BUF_LEN];
+	size_t i, j, k, n = impls(v);
+
+	for (k = 0; k < n; k++) {
+		ck_assert_uint_eq(v[k]->space(buf, 0), 0);
+		for (i = 0; i < BUF_LEN; i++) {
+			for (j = 0; j < i; j++)
+				buf[j] = ws[j % (sizeof(ws) - 1)];
+
+			buf[i] = not_ws[i % (sizeof(not_ws) - 1)];
+			ck_assert_uint_eq(v[k]->space(buf, BUF_LEN), i);
+			ck_assert_uint_eq(v[k]->space(buf, i), i);
+		}
+	}
+}
+END_TEST
+
+/**
+ * Test that each version of scan_any() finds the first of the
+ * given bytes, wherever it is.
+ */
+START_TEST(test_scan_any)
+{
+	const struct scan_impl *v[3];
+	char buf[BUF_LEN];
+	size_t i, k, n = impls(v);
+
+	for (k = 0; k < n; k++) {
+		memset(buf, 'a', sizeof(buf));
+		ck_assert_uint_eq(v[k]->any(buf, BUF_LEN, "'\\\"`"), BUF_LEN);
+		for (i = 0; i < BUF_LEN; i++) {
+			buf[i] = "'\\\"`"[i & 3];
+			ck_assert_uint_eq(v[k]->any(buf, BUF_LEN, "'\\\"`"), i);
+			ck_assert_uint_eq(v[k]->any(buf, BUF_LEN, "xy"),
+			                  BUF_LEN);
+			ck_assert_uint_eq(v[k]->any(buf, i, "'\\\"`"), i);
+			buf[i] = 'a';
+		}
+	}
+
+	ck_assert_uint_eq(scan_any("abc\n", 4, "\n"), 3);
+	ck_assert_uint_eq(scan_any("abc", 3, "\n"), 3);
+	ck_assert_uint_eq(scan_any("a'c", 3, "'\\"), 1);
+}
+END_TEST
+
+/**
+ * Test that each version of scan_marker() finds "-- [" wherever it
+ * is, and ignores things which only look like it.
+ */
+START_TEST(test_scan_marker)
+{
+	const struct scan_impl *v[3];
+	char buf[BUF_LEN];
+	size_t i, k, n = impls(v);
+
+	for (k = 0; k < n; k++) {
+		for (i = 0; i + 4 <= BUF_LEN; i++) {
+			memset(buf, '-', sizeof(buf));
+			memcpy(buf + i, "-- [", 4);
+			if (i) buf[i - 1] = ' ';
+			ck_assert_uint_eq(v[k]->marker(buf, BUF_LEN), i);
+			ck_assert_uint_eq(v[k]->marker(buf, i + 3), i + 3);
+
+			memcpy(buf + i, "- -[", 4);
+			ck_assert_uint_eq(v[k]->marker(buf, BUF_LEN), BUF_LEN);
+		}
+	}
+}
+END_TEST
+
+Suite *scan_suite(void)
+{
+	Suite *s;
+	TCase *t;
+
+	s = suite_create("Scanning Primitives");
+	t = tcase_create("scan");
+	tcase_add_test(t, scan_selects_impl);
+	tcase_add_test(t, test_scan_space);
+	tcase_add_test(t, test_scan_any);
+	tcase_add_test(t, test_scan_marker);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	return s;
+}
@@ -0,0 +1,573 @@
+/**
+ * Minimal Migration Manager - Streaming Seed Loader Tests
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <check.h>
+#include "tests.h"
+
+/* from test_runner.c */
+extern char errbuf[];
+
+/* {{{ File / DB stubs */
+struct file_reader;
+
+static struct file_reader *file_open(const char *path);
+static int file_read(struct file_reader *f, char *buf, size_t len,
+                     size_t *n);
+static unsigned long file_size(const struct file_reader *f);
+static void file_close(struct file_reader *f);
+static int db_query(const char *query, void *cb, void *userdata);
+static int db_query_len(const char *query, size_t len, void *cb,
+                        void *userdata);
+static const char *db_get_driver_name(void);
+static int db_copy(const char *target, const char *rows, size_t len);
+static void db_pipeline_begin(void);
+static int db_pipeline_end(void);
+static int db_pipeline_label(const char *label);
+/* }}} */
+
+/* Keep the buffers small, so that the tests cross chunks */
+#define SEED_CHUNK 128UL
+#define SEED_MAX_STATEMENT 512UL
+
+#define DB_H
+#define FILE_H
+#include "../src/seed.h"
+#include "../src/seed.c"
+
+static const char *seed_data = NULL;
+static size_t seed_offset = 0;
+static size_t read_max = 0;
+static int open_fails = 0;
+static int read_fails = 0;
+static int size_unknown = 0;
+static const char *driver_name = NULL;
+
+/* Queries run, separated by '|' */
+static char executed[8192];
+static int n_executed = 0;
+static int fail_query_at = 0;
+static int copy_fails = 0;
+static int pipelined = 0;
+static int pipeline_fails = 0;
+static int pipeline_reports = 0; /* The driver reports failures */
+static char labelled[64];
+
+/**
+ * file_open() stub
+ */
+static struct file_reader *file_open(const char *path)
+{
+	(void)path;
+
+	seed_offset = 0;
+	if (open_fails) return NULL;
+	return (struct file_reader *)(void *)&seed_offset;
+}
+
+/**
+ * file_size() stub, which pretends the file is compressed if
+ * size_unknown is set.
+ */
+static unsigned long file_size(const struct file_reader *f)
+{
+	(void)f;
+	return size_unknown ? 0 : (unsigned long)strlen(seed_data);
+}
+
+/**
+ * file_close() stub
+ */
+static void file_close(struct file_reader *f)
+{
+	(void)f;
+}
+
+/**
+ * file_read() stub, which hands out at most read_max bytes of
+ * seed_data at a time.
+ */
+static int file_read(struct file_reader *f, char *buf, size_t len,
+                     size_t *n)
+{
+	(void)f;
+
+	*n = strlen(seed_data + seed_offset);
+	if (read_fails) return 1;
+	if (*n > len) *n = len;
+	if (read_max && *n > read_max) *n = read_max;
+	memcpy(buf, seed_data + seed_offset, *n);
+	seed_offset += *n;
+	return 0;
+}
+
+/**
+ * Database query stubs
+ */
+static int db_query_len(const char *query, size_t len, void *cb,
+                        void *userdata)
+{
+	size_t n = strlen(executed);
+
+	(void)cb;
+	(void)userdata;
+
+	ck_assert(n + len + 2 < sizeof(executed));
+	memcpy(executed + n, query, len);
+	strcpy(executed + n + len, "|");
+	return ++n_executed == fail_query_at;
+}
+
+static int db_query(const char *query, void *cb, void *userdata)
+{
+	return db_query_len(query, strlen(query), cb, userdata);
+}
+
+/**
+ * Bulk-load stub, which records "target:rows|" with the queries
+ */
+static int db_copy(const char *target, const char *rows, size_t len)
+{
+	ck_assert(strlen(executed) + strlen(target) + len + 3 <
+	          sizeof(executed));
+	sprintf(executed + strlen(executed), "%s:%.*s|", target, (int)len,
+	        rows);
+	return copy_fails;
+}
+
+/**
+ * Pipeline stubs, which only track whether we're pipelining
+ */
+static void db_pipeline_begin(void)
+{
+	pipelined = 1;
+}
+
+static int db_pipeline_end(void)
+{
+	int retval = pipelined && pipeline_fails;
+
+	pipelined = 0;
+	return retval;
+}
+
+static int db_pipeline_label(const char *label)
+{
+	strcpy(labelled, label);
+	return pipelined && pipeline_reports;
+}
+
+static const char *db_get_driver_name(void)
+{
+	return driver_name;
+}
+
+static void reset_seed_stubs(void)
+{
+	seed_data      = "";
+	read_max       = 0;
+	open_fails     = 0;
+	read_fails     = 0;
+	size_unknown   = 0;
+	driver_name    = NULL;
+	fail_query_at  = 0;
+	copy_fails     = 0;
+	pipelined      = 0;
+	pipeline_fails = 0;
+	pipeline_reports = 0;
+	*labelled      = '\0';
+	n_executed     = 0;
+	*executed      = '\0';
+	*errbuf        = '\0';
+}
+
+/**
+ * Make sure each batch ends with a complete statement, and that
+ * the batches add up to the whole seed (less any trailing
+ * whitespace.)
+ */
+static void check_batches(const char *data, int last_complete)
+{
+	char *p, *q, all[8192];
+	size_t len;
+
+	*all = '\0';
+	for (p = executed; (q = strchr(p, '|')); p = q + 1) {
+		if (last_complete || q[1])
+			ck_assert_int_eq(q[-1], ';');
+		strncat(all, p, (size_t)(q - p));
+	}
+
+	len = strlen(data);
+	while (len && isspace((unsigned char)data[len - 1])) --len;
+	ck_assert_uint_eq(strlen(all), len);
+	ck_assert(!memcmp(all, data, len));
+}
+
+/**
+ * Test that seed_load() fails if the file can't be opened.
+ */
+START_TEST(seed_load_open_fails)
+{
+	open_fails = 1;
+	ck_assert_int_ne(seed_load("x.sql"), 0);
+	ck_assert_int_eq(seed_load(NULL), 1);
+	ck_assert_int_eq(n_executed, 0);
+}
+END_TEST
+
+/**
+ * Test that seed_load() stops if the file can't be read.
+ */
+START_TEST(seed_load_read_fails)
+{
+	seed_data  = "SELECT 1;";
+	read_fails = 1;
+	ck_assert_int_ne(seed_load("x.sql"), 0);
+	ck_assert_int_eq(n_executed, 0);
+}
+END_TEST
+
+/**
+ * Test that seed_load() works on a small seed, and reports
+ * its progress.
+ */
+START_TEST(test_seed_load)
+{
+	seed_data = "CREATE TABLE a(x INTEGER);\n"
+	            "INSERT INTO a VALUES (1);\n";
+	ck_assert_int_eq(seed_load("x.sql"), 0);
+	ck_assert_int_eq(n_executed, 1);
+	ck_assert_str_eq(errbuf, "  53 of 53 bytes, 2 statements\n");
+	check_batches(seed_data, 0);
+}
+END_TEST
+
+/**
+ * Test that seed_load() reports its progress without a total if
+ * the size of the file isn't known.
+ */
+START_TEST(seed_load_size_unknown)
+{
+	seed_data = "CREATE TABLE a(x INTEGER);\n"
+	            "INSERT INTO a VALUES (1);\n";
+	size_unknown = 1;
+	ck_assert_int_eq(seed_load("x.sql.gz"), 0);
+	ck_assert_int_eq(n_executed, 1);
+	ck_assert_str_eq(errbuf, "  53 bytes, 2 statements\n");
+}
+END_TEST
+
+/**
+ * Test that seed_load() cuts large seeds into batches at
+ * statement boundaries.
+ */
+START_TEST(seed_load_batches)
+{
+	int i;
+	char data[2048];
+
+	*data = '\0';
+	for (i = 0; i < 50; i++)
+		strcat(data, "INSERT INTO t VALUES ('x;y', \"a;b\");\n");
+
+	seed_data = data;
+	read_max  = 50;
+	ck_assert_int_eq(seed_load("x.sql"), 0);
+	ck_assert_int_gt(n_executed, 10);
+	check_batches(data, 0);
+	ck_assert(strstr(errbuf, " 50 statements"));
+}
+END_TEST
+
+/**
+ * Test that seed_load() grows the buffer for a statement which
+ * is larger than a chunk.
+ */
+START_TEST(seed_load_large_statement)
+{
+	char data[512];
+
+	memset(data, 0, sizeof(data));
+	strcpy(data, "SELECT 1;\nINSERT INTO t VALUES ('");
+	memset(data + strlen(data), 'x', 300);
+	strcat(data, "');\nSELECT 2;\n");
+
+	seed_data = data;
+	ck_assert_int_eq(seed_load("x.sql"), 0);
+	check_batches(data, 0);
+	ck_assert(strstr(errbuf, " 3 statements"));
+}
+END_TEST
+
+/**
+ * Test that seed_load() gives up on a statement which is
+ * too large.
+ */
+START_TEST(seed_load_statement_too_large)
+{
+	char data[1024];
+
+	memset(data, 0, sizeof(data));
+	strcpy(data, "SELECT 1;\nINSERT INTO t VALUES ('");
+	memset(data + strlen(data), 'x', 700);
+	strcat(data, "');\n");
+
+	seed_data = data;
+	ck_assert_int_ne(seed_load("x.sql"), 0);
+	ck_assert_str_eq(errbuf, "seed: statement at byte 9 is larger than "
+	                         "512 bytes\n");
+	ck_assert_str_eq(executed, "SELECT 1;|");
+}
+END_TEST
+
+/**
+ * Test that seed_load() runs a final statement which has no
+ * semicolon, but skips trailing comments.
+ */
+START_TEST(seed_load_final_statement)
+{
+	seed_data = "SELECT 1;\nSELECT 2\n";
+	ck_assert_int_eq(seed_load("x.sql"), 0);
+	ck_assert_str_eq(executed, "SELECT 1;|\nSELECT 2\n|");
+	ck_assert_str_eq(errbuf, "  19 of 19 bytes, 2 statements\n");
+
+	reset_seed_stubs();
+	seed_data = "SELECT 1;\n-- done;\n/* ; */\n";
+	ck_assert_int_eq(seed_load("x.sql"), 0);
+	ck_assert_str_eq(executed, "SELECT 1;|");
+	ck_assert(strstr(errbuf, " 1 statements"));
+}
+END_TEST
+
+/**
+ * Test that seed_load() ignores semicolons in comments.
+ */
+START_TEST(seed_load_comments)
+{
+	seed_data = "-- a; b\nSELECT /* ; */ 1;\n# c; d\nSELECT 2;\n";
+	ck_assert_int_eq(seed_load("x.sql"), 0);
+	ck_assert(strstr(errbuf, " 3 statements"));
+	check_batches("-- a; b\nSELECT /* ; */ 1;\n# c; d\nSELECT 2;", 1);
+
+	/* MySQL treats '#' as a comment */
+	reset_seed_stubs();
+	driver_name = "mysql";
+	seed_data = "-- a; b\nSELECT /* ; */ 1;\n# c; d\nSELECT 2;\n";
+	ck_assert_int_eq(seed_load("x.sql"), 0);
+	ck_assert(strstr(errbuf, " 2 statements"));
+}
+END_TEST
+
+/**
+ * Test that seed_load() honors backslash escapes for MySQL.
+ */
+START_TEST(seed_load_backslash_escapes)
+{
+	seed_data = "SELECT 'a\\'; SELECT 2;";
+	ck_assert_int_eq(seed_load("x.sql"), 0);
+	ck_assert(strstr(errbuf, " 2 statements"));
+
+	reset_seed_stubs();
+	driver_name = "mysql";
+	seed_data = "SELECT 'a\\'; SELECT 2;' FROM `x;y`;";
+	ck_assert_int_eq(seed_load("x.sql"), 0);
+	ck_assert(strstr(errbuf, " 1 statements"));
+}
+END_TEST
+
+/**
+ * Test that seed_load() handles PostgreSQL's dollar quoting, and
+ * loads the seed in a transaction.
+ */
+START_TEST(seed_load_dollar_quotes)
+{
+	driver_name = "pgsql";
+	seed_data = "CREATE FUNCTION f() RETURNS int AS $body$ SELECT 1; "
+	            "$x$ $body$ LANGUAGE sql;\nSELECT a$b$c; SELECT $1;\n";
+	ck_assert_int_eq(seed_load("x.sql"), 0);
+	ck_assert(strstr(errbuf, " 3 statements"));
+	ck_assert(!strncmp(executed, "BEGIN|CREATE", 12));
+	ck_assert(!strcmp(executed + strlen(executed) - 7, "COMMIT|"));
+}
+END_TEST
+
+/**
+ * Test that seed_load() rolls back a PostgreSQL seed when a
+ * pipelined statement fails.
+ */
+START_TEST(seed_load_pipeline_fails)
+{
+	driver_name    = "pgsql";
+	seed_data      = "SELECT 1;";
+	pipeline_fails = 1;
+	ck_assert_int_ne(seed_load("x.sql"), 0);
+	ck_assert_str_eq(executed, "BEGIN|SELECT 1;|ROLLBACK|");
+	ck_assert_int_eq(pipelined, 0);
+}
+END_TEST
+
+/**
+ * Test that seed_load() rolls back a failed PostgreSQL seed.
+ */
+START_TEST(seed_load_query_fails)
+{
+	driver_name   = "pgsql";
+	seed_data     = "SELECT 1;";
+	fail_query_at = 2;
+	ck_assert_int_ne(seed_load("x.sql"), 0);
+	ck_assert_str_eq(executed, "BEGIN|SELECT 1;|ROLLBACK|");
+	ck_assert_str_eq(errbuf, "seed: failed to load bytes 0-9\n");
+	ck_assert_str_eq(labelled, "seed: bytes 0-9");
+
+	/* ... which is left to the driver, if it was pipelined */
+	reset_seed_stubs();
+	driver_name      = "pgsql";
+	seed_data        = "SELECT 1;";
+	fail_query_at    = 2;
+	pipeline_reports = 1;
+	ck_assert_int_ne(seed_load("x.sql"), 0);
+	ck_assert_str_eq(errbuf, "");
+
+	/* Nothing to roll back for the others */
+	reset_seed_stubs();
+	seed_data     = "SELECT 1;";
+	fail_query_at = 1;
+	ck_assert_int_ne(seed_load("x.sql"), 0);
+	ck_assert_str_eq(executed, "SELECT 1;|");
+}
+END_TEST
+
+/**
+ * Test that seed_load() keeps SQLite trigger bodies together.
+ */
+START_TEST(seed_load_triggers)
+{
+	driver_name = "sqlite3";
+	seed_data = "CREATE TRIGGER t AFTER INSERT ON a BEGIN\n"
+	            "  UPDATE a SET x = 1; DELETE FROM b;\nEND;\n"
+	            "CREATE TEMP TRIGGER u AFTER DELETE ON a BEGIN "
+	            "DELETE FROM b; end ;\n"
+	            "CREATE TABLE end_(x); SELECT 1;\n";
+	read_max = 30;
+	ck_assert_int_eq(seed_load("x.sql"), 0);
+	ck_assert(strstr(errbuf, " 4 statements"));
+	check_batches(seed_data, 0);
+}
+END_TEST
+
+/**
+ * Test that seed_load() bulk-loads copy sections, and runs the
+ * SQL around them.
+ */
+START_TEST(seed_load_copy)
+{
+	seed_data = "CREATE TABLE t(a, b);\n"
+	            "-- [copy t(a, b)]\n1\tx\n2\t\\N\n\\.\n"
+	            "SELECT 1\n"
+	            "-- [copy t]\n3\ty";
+	ck_assert_int_eq(seed_load("x.sql"), 0);
+	ck_assert_str_eq(executed, "CREATE TABLE t(a, b);\n|"
+	                           "t(a, b):1\tx\n2\t\\N\n|"
+	                           "SELECT 1\n|t:3\ty|");
+	ck_assert(strstr(errbuf, " 4 statements"));
+
+	/* Copy sections end at the next marker, too */
+	reset_seed_stubs();
+	seed_data = "-- [copy t]\n1\n-- [copy u]\n2\n";
+	ck_assert_int_eq(seed_load("x.sql"), 0);
+	ck_assert_str_eq(executed, "t:1\n|u:2\n|");
+}
+END_TEST
+
+/**
+ * Test that seed_load() loads large copy sections a chunk at a
+ * time, in whole rows.
+ */
+START_TEST(seed_load_copy_batches)
+{
+	char data[2048], rows[2048], *p, *q;
+	int i;
+
+	*rows = '\0';
+	for (i = 0; i < 100; i++)
+		sprintf(rows + strlen(rows), "%d\trow %d\n", i, i);
+	sprintf(data, "-- [copy t]\n%s\\.\nSELECT 1;\n", rows);
+
+	seed_data = data;
+	read_max  = 50;
+	ck_assert_int_eq(seed_load("x.sql"), 0);
+
+	/* Put the rows back together */
+	*data = '\0';
+	for (p = executed; !strncmp(p, "t:", 2); p = q + 1) {
+		ck_assert_ptr_nonnull(q = strchr(p, '|'));
+		ck_assert_int_eq(q[-1], '\n');
+		strncat(data, p + 2, (size_t)(q - p - 2));
+	}
+
+	ck_assert_str_eq(data, rows);
+	ck_assert_str_eq(p, "SELECT 1;|");
+}
+END_TEST
+
+/**
+ * Test that seed_load() fails on a malformed copy section, or
+ * one which can't be loaded.
+ */
+START_TEST(seed_load_copy_fails)
+{
+	seed_data = "SELECT 1;\n-- [copy t\n1\n";
+	ck_assert_int_ne(seed_load("x.sql"), 0);
+	ck_assert_str_eq(errbuf, "invalid copy section: '-- [copy t'\n");
+	ck_assert_str_eq(executed, "SELECT 1;\n|");
+
+	reset_seed_stubs();
+	driver_name = "pgsql";
+	copy_fails  = 1;
+	seed_data   = "SELECT 1;\n-- [copy t]\n1\n";
+	ck_assert_int_ne(seed_load("x.sql"), 0);
+	ck_assert_str_eq(errbuf, "seed: failed to load bytes 22-24\n");
+	ck_assert_str_eq(executed, "BEGIN|SELECT 1;\n|t:1\n|ROLLBACK|");
+}
+END_TEST
+
+Suite *seed_suite(void)
+{
+	Suite *s;
+	TCase *t;
+
+	s = suite_create("Seed Loader");
+	t = tcase_create("seed_load");
+	tcase_add_checked_fixture(t, reset_seed_stubs, NULL);
+	tcase_add_test(t, seed_load_open_fails);
+	tcase_add_test(t, seed_load_read_fails);
+	tcase_add_test(t, seed_load_size_unknown);
+	tcase_add_test(t, test_seed_load);
+	tcase_add_test(t, seed_load_batches);
+	tcase_add_test(t, seed_load_large_statement);
+	tcase_add_test(t, seed_load_statement_too_large);
+	tcase_add_test(t, seed_load_final_statement);
+	tcase_add_test(t, seed_load_comments);
+	tcase_add_test(t, seed_load_backslash_escapes);
+	tcase_add_test(t, seed_load_dollar_quotes);
+	tcase_add_test(t, seed_load_pipeline_fails);
+	tcase_add_test(t, seed_load_query_fails);
+	tcase_add_test(t, seed_load_triggers);
+	tcase_add_test(t, seed_load_copy);
+	tcase_add_test(t, seed_load_copy_batches);
+	tcase_add_test(t, seed_load_copy_fails);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	return s;
+}
@@ -17,9 +17,34 @@
 /* from test_runner.c */
 extern char errbuf[];
 
+/* {{{ file stubs */
+static char *map_file(const char *path, size_t *size);
+static void unmap_file(char *mem, size_t size);
+/* }}} */
+
+#define FILE_H
 #include "../src/source.h"
 #include "../src/source.c"
 
+static char map_file_path[64];
+static int unmap_file_called = 0;
+
+/* {{{ file stubs */
+static char *map_file(const char *path, size_t *size)
+{
+	strcpy(map_file_path, path);
+	*size = 4;
+	return (char *)(uintptr_t)"test";
+}
+
+static void unmap_file(char *mem, size_t size)
+{
+	(void)mem;
+	(void)size;
+	++unmap_file_called;
+}
+/* }}} */
+
 /* {{{ Source backend stubs */
 /**
  * This is a test-controllable instance of a source
@@ -82,6 +107,36 @@ static const char *backend_get_migration_path(void)
 	return ".";
 }
 
+static const char *const *backend_get_watch_paths(void)
+{
+	static const char *paths[3] = { "./.git", "./.git/refs/heads", NULL };
+	return paths;
+}
+
+static int backend_unload_migration_called = 0;
+
+static int backend_get_scan_stats(unsigned long *scanned,
+                                  unsigned long *skipped)
+{
+	*scanned = 12;
+	*skipped = 3;
+	return 0;
+}
+
+static char *backend_load_migration(const char *file, size_t *size)
+{
+	ck_assert_str_eq(file, "1.sql");
+	*size = 6;
+	return (char *)(uintptr_t)"packed";
+}
+
+static void backend_unload_migration(char *mem, size_t size)
+{
+	(void)mem;
+	(void)size;
+	++backend_unload_migration_called;
+}
+
 const struct source_backend_vtable backend_without_init = {
 	"no-init",
 	NULL, /* backend_config */
@@ -90,6 +145,10 @@ const struct source_backend_vtable backend_without_init = {
 	NULL, /* backend_get_head  */
 	NULL, /* backend_get_file_revision */
 	NULL, /* backend_get_migration_path */
+	NULL, /* backend_get_watch_paths */
+	NULL, /* backend_load_migration */
+	NULL, /* backend_unload_migration */
+	NULL, /* backend_get_scan_stats */
 	NULL  /* backend_uninit, */
 };
 
@@ -101,8 +160,42 @@ const struct source_backend_vtable backend_with_init = {
 	backend_get_head,
 	NULL,
 	backend_get_migration_path,
+	NULL,
+	NULL,
+	NULL,
+	backend_get_scan_stats,
 	backend_uninit
 };
+
+const struct source_backend_vtable backend_with_watch = {
+	"watch",
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	backend_get_migration_path,
+	backend_get_watch_paths,
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
+
+const struct source_backend_vtable backend_with_loader = {
+	"loader",
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	backend_get_migration_path,
+	NULL,
+	backend_load_migration,
+	backend_unload_migration,
+	NULL,
+	NULL
+};
 /* }}} */
 
 /**
@@ -339,6 +432,206 @@ START_TEST(test_source_get_migration_path)
 }
 END_TEST
 
+/**
+ * Test that source_get_scan_stats() only returns counts from
+ * backends which keep them.
+ */
+START_TEST(test_source_get_scan_stats)
+{
+	unsigned long scanned = 0, skipped = 0;
+
+	memset(sources, 0, sizeof sources);
+	sources[0] = &backend_with_init;
+	sources[1] = &backend_with_watch;
+	ck_assert_int_ne(source_get_scan_stats(NULL, &scanned, &skipped), 0);
+	ck_assert_int_ne(source_get_scan_stats("init", NULL, &skipped), 0);
+	ck_assert_int_ne(source_get_scan_stats("watch", &scanned, &skipped),
+	                 0);
+	ck_assert_int_eq(source_get_scan_stats("init", &scanned, &skipped),
+	                 0);
+	ck_assert_uint_eq(scanned, 12);
+	ck_assert_uint_eq(skipped, 3);
+}
+END_TEST
+
+/**
+ * Test that source_get_watch_paths() returns NULL if passed
+ * invalid parameters, or no backends are usable.
+ */
+START_TEST(source_get_watch_paths_invalid_params)
+{
+	memset(sources, 0, sizeof sources);
+	ck_assert_ptr_null(source_get_watch_paths(NULL));
+	ck_assert_ptr_null(source_get_watch_paths("init"));
+}
+END_TEST
+
+/**
+ * Test that source_get_watch_paths() falls back to the migration
+ * path if the backend doesn't provide one.
+ */
+START_TEST(source_get_watch_paths_uses_migration_path)
+{
+	const char *const *paths;
+	backend_get_migration_path_called = 0;
+	memset(sources, 0, sizeof sources);
+	sources[0] = &backend_with_init;
+
+	ck_assert_ptr_nonnull(paths = source_get_watch_paths("init"));
+	ck_assert_str_eq(paths[0], ".");
+	ck_assert_ptr_null(paths[1]);
+	ck_assert(backend_get_migration_path_called);
+}
+END_TEST
+
+/**
+ * Test that source_get_watch_paths() calls the specified backend's
+ * callback, and returns the result.
+ */
+START_TEST(test_source_get_watch_paths)
+{
+	const char *const *paths;
+	backend_get_migration_path_called = 0;
+	memset(sources, 0, sizeof sources);
+	sources[0] = &backend_with_watch;
+
+	ck_assert_ptr_nonnull(paths = source_get_watch_paths("watch"));
+	ck_assert_str_eq(paths[0], "./.git");
+	ck_assert_str_eq(paths[1], "./.git/refs/heads");
+	ck_assert_ptr_null(paths[2]);
+	ck_assert(!backend_get_migration_path_called);
+}
+END_TEST
+
+/**
+ * Test that source_load_migration() returns NULL if passed invalid
+ * parameters, or no backends are usable.
+ */
+START_TEST(source_load_migration_invalid_params)
+{
+	size_t size;
+
+	memset(sources, 0, sizeof sources);
+	ck_assert_ptr_null(source_load_migration("init", "1.sql", &size));
+
+	sources[0] = &backend_with_init;
+	ck_assert_ptr_null(source_load_migration(NULL, "1.sql", &size));
+	ck_assert_ptr_null(source_load_migration("init", NULL, &size));
+	ck_assert_ptr_null(source_load_migration("init", "1.sql", NULL));
+}
+END_TEST
+
+/**
+ * Test that source_load_migration() fails if the backend doesn't
+ * provide a migration path.
+ */
+START_TEST(source_load_migration_no_migration_path)
+{
+	size_t size;
+
+	*errbuf = '\0';
+	memset(sources, 0, sizeof sources);
+	sources[0] = &backend_without_init;
+	ck_assert_ptr_null(source_load_migration("no-init", "1.sql", &size));
+	ck_assert_str_eq(errbuf, "unable to get migration path\n");
+}
+END_TEST
+
+/**
+ * Test that source_load_migration() maps the migration from the
+ * migration path, and that source_unload_migration() unmaps it.
+ */
+START_TEST(source_load_migration_maps_file)
+{
+	char *mem;
+	size_t size = 0;
+
+	unmap_file_called = 0;
+	memset(sources, 0, sizeof sources);
+	sources[0] = &backend_with_init;
+	ck_assert_ptr_nonnull(mem = source_load_migration("init", "1.sql",
+	                                                  &size));
+	ck_assert_str_eq(map_file_path, "./1.sql");
+	ck_assert_uint_eq(size, 4);
+
+	source_unload_migration("init", mem, size);
+	ck_assert_int_eq(unmap_file_called, 1);
+}
+END_TEST
+
+/**
+ * Test that source_load_migration() and source_unload_migration()
+ * call the backend's callbacks, where it has them.
+ */
+START_TEST(test_source_load_migration)
+{
+	char *mem;
+	size_t size = 0;
+
+	unmap_file_called = 0;
+	backend_unload_migration_called = 0;
+	memset(sources, 0, sizeof sources);
+	sources[0] = &backend_with_loader;
+	ck_assert_ptr_nonnull(mem = source_load_migration("loader", "1.sql",
+	                                                  &size));
+	ck_assert_str_eq(mem, "packed");
+	ck_assert_uint_eq(size, 6);
+
+	source_unload_migration("loader", mem, size);
+	ck_assert_int_eq(backend_unload_migration_called, 1);
+	ck_assert(!unmap_file_called);
+}
+END_TEST
+
+/**
+ * Test that source_get_migration_paths() gives the paths to the
+ * migrations in the migration path.
+ */
+START_TEST(test_source_get_migration_paths)
+{
+	static char names_buf[2][8] = { "1.sql", "2.sql" };
+	char *names[2], **paths;
+
+	names[0] = names_buf[0];
+	names[1] = names_buf[1];
+	memset(sources, 0, sizeof sources);
+	ck_assert_ptr_null(source_get_migration_paths("init", names, 2));
+
+	sources[0] = &backend_with_init;
+	ck_assert_ptr_null(source_get_migration_paths(NULL, names, 2));
+	ck_assert_ptr_null(source_get_migration_paths("init", NULL, 2));
+	ck_assert_ptr_null(source_get_migration_paths("init", names, 0));
+	ck_assert_ptr_nonnull(paths = source_get_migration_paths("init",
+	                                                         names, 2));
+	ck_assert_str_eq(paths[0], "./1.sql");
+	ck_assert_str_eq(paths[1], "./2.sql");
+	free(paths);
+
+	*errbuf = '\0';
+	sources[0] = &backend_without_init;
+	ck_assert_ptr_null(source_get_migration_paths("no-init", names, 2));
+	ck_assert_str_eq(errbuf, "unable to get migration path\n");
+}
+END_TEST
+
+/**
+ * Test that source_get_migration_paths() gives nothing for a backend
+ * which provides the migrations itself.
+ */
+START_TEST(source_get_migration_paths_from_backend)
+{
+	static char names_buf[1][8] = { "1.sql" };
+	char *names[1];
+
+	names[0] = names_buf[0];
+	memset(sources, 0, sizeof sources);
+	sources[0] = &backend_with_loader;
+	*errbuf = '\0';
+	ck_assert_ptr_null(source_get_migration_paths("loader", names, 1));
+	ck_assert_str_eq(errbuf, "");
+}
+END_TEST
+
 /**
  * Test that source_uninit() skips a backend without an
  * uninit callback.
@@ -415,6 +708,24 @@ Suite *source_suite(void)
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
+	t = tcase_create("source_get_watch_paths");
+	tcase_add_test(t, source_get_watch_paths_invalid_params);
+	tcase_add_test(t, source_get_watch_paths_uses_migration_path);
+	tcase_add_test(t, test_source_get_watch_paths);
+	tcase_add_test(t, test_source_get_scan_stats);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("source_load_migration");
+	tcase_add_test(t, source_load_migration_invalid_params);
+	tcase_add_test(t, source_load_migration_no_migration_path);
+	tcase_add_test(t, source_load_migration_maps_file);
+	tcase_add_test(t, test_source_load_migration);
+	tcase_add_test(t, test_source_get_migration_paths);
+	tcase_add_test(t, source_get_migration_paths_from_backend);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
 	t = tcase_create("source_uninit");
 	tcase_add_test(t, source_uninit_skips_backends_without_uninit);
 	tcase_add_test(t, source_uninit_fails_to_uninit_backend);
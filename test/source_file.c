@@ -17,6 +17,28 @@
 extern char errbuf[];
 
 #include "posix_stubs.h"
+
+/* {{{ map_file stubs */
+#define FILE_H
+static char *map_file_returns = NULL;
+static size_t map_file_len = 0;
+static int unmap_file_called = 0;
+
+static char *map_file(const char *path, size_t *size)
+{
+	(void)path;
+	*size = map_file_len;
+	return map_file_returns;
+}
+
+static void unmap_file(char *mem, size_t len)
+{
+	(void)mem;
+	(void)len;
+	++unmap_file_called;
+}
+/* }}} */
+
 #include "../src/source/file.c"
 
 /* {{{ Test cases for file_find_migrations() */
@@ -24,19 +46,22 @@ extern char errbuf[];
 /* File after current head */
 static struct dirent mig_after_head = {
 	"100.sql",
-	NULL
+	NULL,
+	DT_UNKNOWN
 };
 
 /* File before current head */
 static struct dirent mig_before_head = {
 	"1.sql",
-	&mig_after_head
+	&mig_after_head,
+	DT_UNKNOWN
 };
 
 /* No .sql extension */
 static struct dirent mig_no_sql = {
 	"999999",
-	&mig_before_head
+	&mig_before_head,
+	DT_UNKNOWN
 };
 
 /* No numeric designation */
@@ -46,19 +71,22 @@ static const char *err_no_num =
 
 static struct dirent mig_no_num = {
 	"yyyyyy",
-	&mig_no_sql
+	&mig_no_sql,
+	DT_UNKNOWN
 };
 
 /* Filename too small */
 static struct dirent mig_name_too_small = {
 	"xxx",
-	&mig_no_num
+	&mig_no_num,
+	DT_UNKNOWN
 };
 
 /* File with an empty name */
 static struct dirent mig_empty_name = {
 	"\0",
-	NULL
+	NULL,
+	DT_UNKNOWN
 };
 
 /* Designation out of range */
@@ -69,7 +97,8 @@ const char *err_des_range =
 
 static struct dirent mig_des_range = {
 	"999999999999999999999999999.sql",
-	NULL
+	NULL,
+	DT_UNKNOWN
 };
 /* }}} */
 
@@ -223,7 +252,7 @@ START_TEST(file_find_migrations_stat_fails)
 
 	opendir_returns = (DIR *)1234;
 	readdir_returns = &mig_after_head;
-	stat_returns = -1;
+	fstatat_returns = -1;
 	stat_returns_buf.st_mode = S_IFREG;
 	memcpy(config.migration_path, "/tmp", 5);
 
@@ -254,6 +283,111 @@ START_TEST(file_find_migrations_not_regular_file)
 }
 END_TEST
 
+/**
+ * Test that file_find_migrations() trusts the type of a directory
+ * entry when there is one, and only stats the rest.
+ */
+START_TEST(file_find_migrations_uses_d_type)
+{
+	static struct dirent mig_dir   = { "102.sql", NULL, DT_DIR };
+	static struct dirent mig_link  = { "101.sql", &mig_dir, DT_LNK };
+	static struct dirent mig_reg   = { "100.sql", &mig_link, DT_REG };
+	static struct dirent mig_early = { "1.sql", &mig_reg, DT_UNKNOWN };
+	unsigned long scanned, skipped;
+	char **m = NULL;
+	size_t size = 0;
+
+	opendir_returns = (DIR *)1234;
+	readdir_returns = &mig_early;
+	stat_returns_buf.st_mode = S_IFREG;
+	memcpy(config.migration_path, "/tmp", 5);
+
+	ck_assert_ptr_nonnull(m = file_find_migrations("2", NULL, &size));
+	ck_assert_uint_eq(size, 2);
+	if (m) {
+		ck_assert_str_eq(m[0], "100.sql");
+		ck_assert_str_eq(m[1], "101.sql");
+	}
+
+	/* Only the symlink needed a stat() */
+	ck_assert_int_eq(fstatat_called, 1);
+	ck_assert_uint_eq(scan_stats.stats, 1);
+	ck_assert_uint_eq(scan_stats.scanned, 4);
+	ck_assert_uint_eq(scan_stats.skipped, 2);
+	ck_assert_int_eq(file_get_scan_stats(&scanned, &skipped), 0);
+	ck_assert_uint_eq(scanned, 4);
+	ck_assert_uint_eq(skipped, 2);
+	while (m && size) free(m[--size]);
+	free(m);
+}
+END_TEST
+
+/**
+ * Test that file_find_migrations() picks up compressed migrations,
+ * as long as it knows how to read them.
+ */
+START_TEST(file_find_migrations_compressed)
+{
+	static struct dirent mig_bz2   = { "4.sql.bz2", NULL, DT_REG };
+	static struct dirent mig_zst   = { "3.sql.zst", &mig_bz2, DT_REG };
+	static struct dirent mig_gz    = { "2.sql.gz", &mig_zst, DT_REG };
+	static struct dirent mig_plain = { "1.sql", &mig_gz, DT_REG };
+	char **m = NULL;
+	size_t size = 0;
+
+	opendir_returns = (DIR *)1234;
+	readdir_returns = &mig_plain;
+	memcpy(config.migration_path, "/tmp", 5);
+
+	ck_assert_ptr_nonnull(m = file_find_migrations(NULL, NULL, &size));
+	ck_assert_uint_eq(size, 3);
+	if (m) {
+		ck_assert_str_eq(m[0], "1.sql");
+		ck_assert_str_eq(m[1], "2.sql.gz");
+		ck_assert_str_eq(m[2], "3.sql.zst");
+	}
+
+	while (m && size) free(m[--size]);
+	free(m);
+}
+END_TEST
+
+/**
+ * Test that file_find_migrations() can collect more migrations
+ * than its list initially has room for.
+ */
+START_TEST(file_find_migrations_grows_list)
+{
+	static struct dirent d[100];
+	char **m = NULL;
+	size_t size = 0, i;
+
+	for (i = 0; i < 100; i++) {
+		sprintf(d[i].d_name, "%lu.sql", (unsigned long)(100 - i));
+		d[i].next   = i < 99 ? &d[i + 1] : NULL;
+		d[i].d_type = DT_REG;
+	}
+
+	opendir_returns = (DIR *)1234;
+	readdir_returns = d;
+	memcpy(config.migration_path, "/tmp", 5);
+
+	ck_assert_ptr_nonnull(m = file_find_migrations("xxx", NULL, &size));
+	ck_assert_uint_eq(size, 100);
+	ck_assert_str_eq(local_head, "100");
+	if (m) {
+		ck_assert_str_eq(m[0], "1.sql");
+		ck_assert_str_eq(m[99], "100.sql");
+	}
+
+	ck_assert_int_eq(fstatat_called, 0);
+	ck_assert_uint_eq(scan_stats.scanned, 100);
+	ck_assert_uint_eq(scan_stats.skipped, 0);
+	while (m && size) free(m[--size]);
+	free(m);
+}
+END_TEST
+
 /**
  * Test that file_find_migrations() skips files with a
  * numeric designation that can't be represented as an
@@ -351,6 +485,200 @@ START_TEST(test_file_find_migrations)
 }
 END_TEST
 
+/* {{{ Migration index */
+static char idx_1[]   = "1.sql";
+static char idx_2[]   = "2-a.sql";
+static char idx_2b[]  = "2-b.sql";
+static char idx_10[]  = "10.sql";
+static char *idx_migrations[] = { idx_1, idx_2, idx_2b, idx_10 };
+
+/**
+ * Build an index of idx_migrations for a directory.
+ */
+static char *build_index(const struct stat *st, size_t *len)
+{
+	return index_build(idx_migrations, 4, st, len);
+}
+/* }}} */
+
+/**
+ * Test that index_lookup() finds the migrations in range.
+ */
+START_TEST(test_index_lookup)
+{
+	struct stat st;
+	char *buf, **m = NULL;
+	size_t len, size;
+
+	memset(&st, 0, sizeof(st));
+	st.st_ino   = 42;
+	st.st_mtime = 1234;
+	ck_assert_ptr_nonnull((buf = build_index(&st, &len)));
+
+	/* Everything */
+	ck_assert_int_eq(index_lookup(buf, len, &st, ULONG_MAX, ULONG_MAX,
+	                              &m, &size), 0);
+	ck_assert_uint_eq(size, 4);
+	ck_assert_str_eq(m[0], idx_1);
+	ck_assert_str_eq(m[3], idx_10);
+	while (size) free(m[--size]);
+	free(m);
+
+	/* Pending after 1 */
+	ck_assert_int_eq(index_lookup(buf, len, &st, 1, ULONG_MAX, &m,
+	                              &size), 0);
+	ck_assert_uint_eq(size, 3);
+	ck_assert_str_eq(m[0], idx_2);
+	ck_assert_str_eq(m[1], idx_2b);
+	while (size) free(m[--size]);
+	free(m);
+
+	/* Rolling back from 10 to 1 */
+	ck_assert_int_eq(index_lookup(buf, len, &st, 10, 1, &m, &size), 0);
+	ck_assert_uint_eq(size, 3);
+	ck_assert_str_eq(m[2], idx_10);
+	while (size) free(m[--size]);
+	free(m);
+
+	/* Nothing pending */
+	ck_assert_int_eq(index_lookup(buf, len, &st, 10, ULONG_MAX, &m,
+	                              &size), 0);
+	ck_assert_uint_eq(size, 0);
+	ck_assert_ptr_null(m);
+	free(buf);
+}
+END_TEST
+
+/**
+ * Test that index_lookup() rejects an index which is stale or
+ * truncated.
+ */
+START_TEST(index_lookup_rejects_stale_index)
+{
+	struct stat st;
+	char *buf, **m = NULL;
+	size_t len, size;
+
+	memset(&st, 0, sizeof(st));
+	st.st_mtime = 1234;
+	ck_assert_ptr_nonnull((buf = build_index(&st, &len)));
+
+	ck_assert_int_ne(index_lookup(NULL, 0, &st, ULONG_MAX, ULONG_MAX,
+	                              &m, &size), 0);
+	ck_assert_int_ne(index_lookup(buf, len - 1, &st, ULONG_MAX,
+	                              ULONG_MAX, &m, &size), 0);
+
+	st.st_mtime = 1235;
+	ck_assert_int_ne(index_lookup(buf, len, &st, ULONG_MAX, ULONG_MAX,
+	                              &m, &size), 0);
+
+	st.st_mtime = 1234;
+	st.st_ino   = 1;
+	ck_assert_int_ne(index_lookup(buf, len, &st, ULONG_MAX, ULONG_MAX,
+	                              &m, &size), 0);
+	ck_assert_ptr_null(m);
+	free(buf);
+}
+END_TEST
+
+/**
+ * Test that file_find_migrations() uses an up-to-date index
+ * without reading the directory.
+ */
+START_TEST(file_find_migrations_uses_index)
+{
+	unsigned long scanned, skipped;
+	char **m = NULL;
+	size_t size = 0;
+
+	stat_returns_buf.st_size  = 1;
+	stat_returns_buf.st_mtime = 1234;
+	map_file_returns = build_index(&stat_returns_buf, &map_file_len);
+	memcpy(config.migration_path, "/tmp", 5);
+	memcpy(config.index_file, "/tmp.idx", 9);
+
+	ck_assert_ptr_nonnull(m = file_find_migrations("1", NULL, &size));
+	ck_assert_uint_eq(size, 3);
+	ck_assert_str_eq(local_head, "10");
+	ck_assert_int_eq(opendir_called, 0);
+	ck_assert_int_eq(unmap_file_called, 1);
+	ck_assert_int_eq(open_called, 0);
+	ck_assert_int_ne(file_get_scan_stats(&scanned, &skipped), 0);
+	while (m && size) free(m[--size]);
+	free(m);
+	free(map_file_returns);
+}
+END_TEST
+
+/**
+ * Test that file_find_migrations() rebuilds a stale index, and
+ * writes it out.
+ */
+START_TEST(file_find_migrations_rebuilds_index)
+{
+	char *found[2], **m = NULL;
+	size_t size = 0, len;
+
+	stat_returns_buf.st_size  = 1;
+	stat_returns_buf.st_mode  = S_IFREG;
+	stat_returns_buf.st_mtime = 1234;
+	map_file_returns = build_index(&stat_returns_buf, &map_file_len);
+
+	/* The directory has changed since */
+	found[0] = mig_before_head.d_name;
+	found[1] = mig_after_head.d_name;
+	stat_returns_buf.st_mtime = 1235;
+	free(index_build(found, 2, &stat_returns_buf, &len));
+
+	opendir_returns = (DIR *)1234;
+	readdir_returns = &mig_name_too_small;
+	open_returns    = 5;
+	write_returns   = (ssize_t)len;
+	memcpy(config.migration_path, "/tmp", 5);
+	memcpy(config.index_file, "/tmp.idx", 9);
+
+	ck_assert_ptr_nonnull(m = file_find_migrations("1", NULL, &size));
+	ck_assert_uint_eq(size, 1);
+	ck_assert_str_eq(m[0], mig_after_head.d_name);
+	ck_assert(opendir_called && readdir_called && closedir_called);
+	ck_assert_int_eq(open_called, 1);
+	ck_assert_int_eq(write_called, 1);
+	ck_assert_int_eq(rename_called, 1);
+	while (m && size) free(m[--size]);
+	free(m);
+	free(map_file_returns);
+}
+END_TEST
+
+/**
+ * Test that file_find_migrations() carries on if the index can't
+ * be written.
+ */
+START_TEST(file_find_migrations_index_write_fails)
+{
+	char **m = NULL;
+	size_t size = 0;
+
+	stat_returns_buf.st_mode = S_IFREG;
+	opendir_returns = (DIR *)1234;
+	readdir_returns = &mig_after_head;
+	open_returns    = 5;
+	rename_errno    = EACCES;
+	write_returns   = 1000;
+	*errbuf = '\0';
+	memcpy(config.migration_path, "/tmp", 5);
+	memcpy(config.index_file, "/tmp.idx", 9);
+
+	ck_assert_ptr_nonnull(m = file_find_migrations("1", NULL, &size));
+	ck_assert_uint_eq(size, 1);
+	ck_assert_int_eq(unlink_called, 1);
+	ck_assert_str_eq(errbuf, "warning: unable to write '/tmp.idx': "
+	                         "Permission denied\n");
+	while (m && size) free(m[--size]);
+	free(m);
+}
+END_TEST
+
 Suite *source_file_suite(void)
 {
 	Suite *s;
@@ -385,6 +713,9 @@ Suite *source_file_suite(void)
 	tcase_add_test(t, file_find_migrations_empty_filename);
 	tcase_add_test(t, file_find_migrations_stat_fails);
 	tcase_add_test(t, file_find_migrations_not_regular_file);
+	tcase_add_test(t, file_find_migrations_uses_d_type);
+	tcase_add_test(t, file_find_migrations_compressed);
+	tcase_add_test(t, file_find_migrations_grows_list);
 	tcase_add_test(t, file_find_migrations_designation_out_of_range);
 	tcase_add_test(t, file_find_migrations_no_prev_rev);
 	tcase_add_test(t, file_find_migrations_prev_rev_out_of_range);
@@ -392,6 +723,16 @@ Suite *source_file_suite(void)
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
+	t = tcase_create("migration_index");
+	tcase_add_checked_fixture(t, reset_stubs, NULL);
+	tcase_add_test(t, test_index_lookup);
+	tcase_add_test(t, index_lookup_rejects_stale_index);
+	tcase_add_test(t, file_find_migrations_uses_index);
+	tcase_add_test(t, file_find_migrations_rebuilds_index);
+	tcase_add_test(t, file_find_migrations_index_write_fails);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
 	return s;
 }
 
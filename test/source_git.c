@@ -16,9 +16,59 @@
 /* from test_runner.c */
 extern char errbuf[];
 
+#include "posix_stubs.h"
 #include "libgit2_stubs.h"
+
+/* {{{ map_file stubs */
+#define FILE_H
+static char *map_file_returns = NULL;
+static size_t map_file_len = 0;
+static int unmap_file_called = 0;
+static char map_file_path[512];
+static const char *copy_file_mem = NULL;
+static char copy_file_buf[64];
+
+static char *map_file(const char *path, size_t *size)
+{
+	strcpy(map_file_path, path);
+	*size = map_file_len;
+	return map_file_returns;
+}
+
+static char *copy_file(const char *path, const char *mem, size_t *size)
+{
+	(void)path;
+	copy_file_mem = mem;
+	memcpy(copy_file_buf, mem, *size);
+	copy_file_buf[*size] = '\0';
+	return copy_file_buf;
+}
+
+static void unmap_file(char *mem, size_t len)
+{
+	(void)mem;
+	(void)len;
+	++unmap_file_called;
+}
+/* }}} */
+
 #include "../src/source/git.c"
 
+static void reset(void)
+{
+	reset_stubs();
+	reset_libgit2_stubs();
+	close_repo();
+	map_file_returns  = NULL;
+	map_file_len      = 0;
+	unmap_file_called = 0;
+	*map_file_path    = '\0';
+	copy_file_mem     = NULL;
+	*config.cache_file = '\0';
+	config.threads    = 0;
+	config.read_blobs = 0;
+}
+
 /* {{{ Diff test inputs */
 
 static git_diff diff_0_deltas = {
@@ -143,6 +193,82 @@ START_TEST(test_git_get_migration_path)
 }
 END_TEST
 
+/**
+ * Test that git_get_watch_paths() returns NULL if the repo can't be
+ * opened, or its path is too long.
+ */
+START_TEST(git_get_watch_paths_fails)
+{
+	char path[sizeof(git_dir) + 1];
+
+	git_repository_open_returns = ~GIT_OK;
+	ck_assert_ptr_null(git_get_watch_paths());
+
+	memset(path, 'x', sizeof(path) - 1);
+	path[sizeof(path) - 1] = '\0';
+	git_repository_open_returns = GIT_OK;
+	git_repository_path_returns = path;
+	ck_assert_ptr_null(git_get_watch_paths());
+}
+END_TEST
+
+/**
+ * Test that git_get_watch_paths() returns the git directory, and
+ * the directory of the branch HEAD is on.
+ */
+START_TEST(test_git_get_watch_paths)
+{
+	const char *const *watched;
+
+	ck_assert_ptr_nonnull(watched = git_get_watch_paths());
+	ck_assert_str_eq(watched[0], "./.git/");
+	ck_assert_str_eq(watched[1], "./.git/refs/heads");
+	ck_assert_ptr_null(watched[2]);
+
+	git_reference_symbolic_target_returns = "refs/heads/topic/x";
+	ck_assert_ptr_nonnull(watched = git_get_watch_paths());
+	ck_assert_str_eq(watched[1], "./.git/refs/heads/topic");
+	ck_assert_ptr_null(watched[2]);
+}
+END_TEST
+
+/**
+ * Test that git_get_watch_paths() only returns the git directory
+ * if HEAD is detached.
+ */
+START_TEST(git_get_watch_paths_detached)
+{
+	const char *const *watched;
+
+	git_reference_symbolic_target_returns = NULL;
+	ck_assert_ptr_nonnull(watched = git_get_watch_paths());
+	ck_assert_str_eq(watched[0], "./.git/");
+	ck_assert_ptr_null(watched[1]);
+
+	git_reference_lookup_returns = GIT_ENOTFOUND;
+	ck_assert_ptr_nonnull(watched = git_get_watch_paths());
+	ck_assert_ptr_null(watched[1]);
+}
+END_TEST
+
+/**
+ * Test that git_get_watch_paths() watches the common directory of a
+ * worktree, which is where its branches (and packed-refs) are kept.
+ */
+START_TEST(git_get_watch_paths_worktree)
+{
+	const char *const *watched;
+
+	git_repository_path_returns      = "./.git/worktrees/wt/";
+	git_repository_commondir_returns = "./.git/";
+	ck_assert_ptr_nonnull(watched = git_get_watch_paths());
+	ck_assert_str_eq(watched[0], "./.git/worktrees/wt/");
+	ck_assert_str_eq(watched[1], "./.git/");
+	ck_assert_str_eq(watched[2], "./.git/refs/heads");
+	ck_assert_ptr_null(watched[3]);
+}
+END_TEST
+
 /**
  * Test that git_find_migrations() returns NULL if
  * size is NULL.
@@ -807,6 +933,590 @@ START_TEST(git_find_migrations_add_del_empty_filename)
 }
 END_TEST
 
+/**
+ * Set up a walk over one commit, which adds 1.sql, with a delta
+ * cache.
+ */
+static void setup_cache_walk(int *head, char *buf)
+{
+	giterr_last_returns            = NULL;
+	git_revparse_single_out_head   = head;
+	git_revparse_single_out        = head;
+	git_revwalk_next_returns       = 2;
+	git_commit_lookup_commit       = (git_commit *)1234;
+	git_commit_parent_commit       = (git_commit *)5678;
+	git_commit_parentcount_returns = 1;
+	git_diff_tree_to_tree_diff     = &diff_1_add;
+	memcpy(config.migration_path, "/tmp", 5);
+	memcpy(config.cache_file, "cache", 6);
+	*local_head = '\0';
+
+	write_data   = buf;
+	open_returns = 3;
+}
+
+/**
+ * Test that git_find_migrations() writes the deltas of the commits
+ * it diffs to the delta cache.
+ */
+START_TEST(git_find_migrations_cache_records)
+{
+	/* The string's own NUL ends the record */
+	static const char expected[] = "mmmgdc1\0/tmp/\0" "1\0A1.sql\0";
+	char buf[256], **migrations;
+	size_t size;
+	int head = 1234;
+
+	setup_cache_walk(&head, buf);
+	ck_assert_ptr_nonnull(migrations = git_find_migrations("1", NULL, &size));
+	ck_assert_uint_eq(size, 1);
+	ck_assert_str_eq(*migrations, "1.sql");
+	ck_assert_int_eq(git_commit_lookup_called, 1);
+	ck_assert_uint_eq(write_data_len, sizeof(expected));
+	ck_assert(!memcmp(buf, expected, sizeof(expected)));
+	ck_assert_int_eq(rename_called, 1);
+	free(*migrations);
+	free(migrations);
+}
+END_TEST
+
+/**
+ * Test that commits which don't touch any migrations are cached.
+ */
+START_TEST(git_find_migrations_cache_records_no_deltas)
+{
+	static const char expected[] = "mmmgdc1\0/tmp/\0" "1\0";
+	char buf[256];
+	size_t size;
+	int head = 1234;
+
+	setup_cache_walk(&head, buf);
+	git_diff_tree_to_tree_diff = &diff_0_deltas;
+	ck_assert_ptr_null(git_find_migrations("1", NULL, &size));
+	ck_assert_uint_eq(size, 0);
+	ck_assert_uint_eq(write_data_len, sizeof(expected));
+	ck_assert(!memcmp(buf, expected, sizeof(expected)));
+}
+END_TEST
+
+/**
+ * Test that git_find_migrations() doesn't diff commits which are
+ * in the delta cache, and doesn't rewrite the cache.
+ */
+START_TEST(git_find_migrations_cache_hit)
+{
+	static char cached[] = "mmmgdc1\0/tmp/\0" "1\0A5.sql\0A7.sql\0"
+	                       "R5.sql\0" "6.sql\0D7.sql\0";
+	char buf[256], **migrations;
+	size_t size;
+	int head = 1234;
+
+	setup_cache_walk(&head, buf);
+	stat_returns_buf.st_size = sizeof(cached);
+	map_file_returns = cached;
+	map_file_len     = sizeof(cached);
+
+	ck_assert_ptr_nonnull(migrations = git_find_migrations("1", NULL, &size));
+	ck_assert_uint_eq(size, 1);
+	ck_assert_str_eq(*migrations, "6.sql");
+	ck_assert(!git_commit_lookup_called);
+	ck_assert_int_eq(unmap_file_called, 1);
+	ck_assert(!open_called);
+	free(*migrations);
+	free(migrations);
+}
+END_TEST
+
+/**
+ * Test that git_find_migrations() ignores a delta cache made for
+ * another migration_path, or an incomplete record.
+ */
+START_TEST(git_find_migrations_cache_invalid)
+{
+	static char other[] = "mmmgdc1\0/other/\0" "1\0A5.sql\0";
+	static char partial[] = "mmmgdc1\0/tmp/\0" "1\0A5.sql\0R5.sql";
+	char buf[256], **migrations;
+	size_t size;
+	int head = 1234;
+
+	setup_cache_walk(&head, buf);
+	stat_returns_buf.st_size = sizeof(other);
+	map_file_returns = other;
+	map_file_len     = sizeof(other);
+
+	ck_assert_ptr_nonnull(migrations = git_find_migrations("1", NULL, &size));
+	ck_assert_str_eq(*migrations, "1.sql");
+	ck_assert_int_eq(git_commit_lookup_called, 1);
+	ck_assert_int_eq(rename_called, 1);
+	free(*migrations);
+	free(migrations);
+
+	setup_cache_walk(&head, buf);
+	stat_returns_buf.st_size = sizeof(partial);
+	map_file_returns = partial;
+	map_file_len     = sizeof(partial);
+
+	ck_assert_ptr_nonnull(migrations = git_find_migrations("1", NULL, &size));
+	ck_assert_str_eq(*migrations, "1.sql");
+	ck_assert_int_eq(git_commit_lookup_called, 2);
+	ck_assert_int_eq(rename_called, 2);
+	free(*migrations);
+	free(migrations);
+}
+END_TEST
+
+/**
+ * Test that a delta cache which can't be written only warns.
+ */
+START_TEST(git_find_migrations_cache_write_fails)
+{
+	char buf[256], **migrations;
+	size_t size;
+	int head = 1234;
+
+	setup_cache_walk(&head, buf);
+	open_errno = EACCES;
+	*errbuf = '\0';
+
+	ck_assert_ptr_nonnull(migrations = git_find_migrations("1", NULL, &size));
+	ck_assert_uint_eq(size, 1);
+	ck_assert_str_eq(errbuf, "warning: unable to write 'cache': "
+	                 "Permission denied\n");
+	free(*migrations);
+	free(migrations);
+}
+END_TEST
+
+/**
+ * Test that set_subtree() only uses plain paths to directories.
+ */
+START_TEST(test_set_subtree)
+{
+	static const char *cases[7][2] = {
+		{ "migrations/", "migrations" },
+		{ "db/migrations//", "db/migrations" },
+		{ ".migrations/..x/", ".migrations/..x" },
+		{ "/tmp/", "" },
+		{ "db/../migrations/", "" },
+		{ "./migrations/", "" },
+		{ "db/*.sql", "" }
+	};
+	size_t i;
+
+	for (i = 0; i < 7; i++) {
+		strcpy(config.migration_path, cases[i][0]);
+		set_subtree();
+		ck_assert_str_eq(subtree, cases[i][1]);
+	}
+}
+END_TEST
+
+/**
+ * Set up a walk over one commit, which adds 1.sql, with a plain
+ * migration_path.
+ */
+static void setup_subtree_walk(int *head)
+{
+	giterr_last_returns            = NULL;
+	git_revparse_single_out_head   = head;
+	git_revparse_single_out        = head;
+	git_revwalk_next_returns       = 2;
+	git_commit_lookup_commit       = (git_commit *)1234;
+	git_commit_parent_commit       = (git_commit *)5678;
+	git_commit_parentcount_returns = 1;
+	git_diff_tree_to_tree_diff     = &diff_1_add;
+	memcpy(config.migration_path, "db/migrations", 14);
+	*local_head = '\0';
+	*errbuf     = '\0';
+}
+
+/**
+ * Test that commits which don't change the migration_path's subtree
+ * aren't diffed.
+ */
+START_TEST(git_find_migrations_subtree_unchanged)
+{
+	size_t size;
+	int head = 1234;
+
+	setup_subtree_walk(&head);
+	git_tree_entry_bypath_same = 1;
+	ck_assert_ptr_null(git_find_migrations("1", NULL, &size));
+	ck_assert_uint_eq(size, 0);
+	ck_assert_int_eq(git_tree_entry_bypath_called, 2);
+	ck_assert(!git_diff_tree_to_tree_called);
+}
+END_TEST
+
+/**
+ * Test that commits which change the migration_path's subtree
+ * are diffed.
+ */
+START_TEST(git_find_migrations_subtree_changed)
+{
+	char **migrations;
+	size_t size;
+	int head = 1234;
+
+	setup_subtree_walk(&head);
+	ck_assert_ptr_nonnull(migrations = git_find_migrations("1", NULL, &size));
+	ck_assert_uint_eq(size, 1);
+	ck_assert_str_eq(*migrations, "1.sql");
+	ck_assert_int_eq(git_diff_tree_to_tree_called, 1);
+	free(*migrations);
+	free(migrations);
+}
+END_TEST
+
+/**
+ * Test that commits without the migration_path aren't diffed, and
+ * that not finding it isn't an error.
+ */
+START_TEST(git_find_migrations_subtree_missing)
+{
+	size_t size;
+	int head = 1234;
+
+	setup_subtree_walk(&head);
+	git_tree_entry_bypath_returns = GIT_ENOTFOUND;
+	last_giterr.message = "the path 'db' does not exist";
+	giterr_last_returns = &last_giterr;
+	ck_assert_ptr_null(git_find_migrations("1", NULL, &size));
+	ck_assert_uint_eq(size, 0);
+	ck_assert(!git_diff_tree_to_tree_called);
+	ck_assert_str_eq(errbuf, "");
+}
+END_TEST
+
+/**
+ * Set up a walk over 5 commits with the given number of threads.
+ * Commits 4 and 2 are in the delta cache, and the rest add 1.sql.
+ */
+static void setup_threads_walk(size_t threads, char *buf)
+{
+	static char cached[] = "mmmgdc1\0/tmp/\0" "4\0A5.sql\0\0"
+	                       "2\0R5.sql\0" "6.sql\0";
+	static int head = 1234;
+
+	reset();
+	memset(buf, 0, 256);
+	setup_cache_walk(&head, buf);
+	git_revwalk_next_returns = 6;
+	stat_returns_buf.st_size = sizeof(cached);
+	map_file_returns = cached;
+	map_file_len     = sizeof(cached);
+	config.threads   = threads;
+}
+
+/**
+ * Test that git_find_migrations() gives the same result, and the
+ * same delta cache, no matter how many threads diff the commits.
+ */
+START_TEST(git_find_migrations_threads)
+{
+	static const char expected[] = "mmmgdc1\0/tmp/\0" "4\0A5.sql\0\0"
+	                               "2\0R5.sql\0" "6.sql\0\0"
+	                               "5\0A1.sql\0\0" "3\0A1.sql\0\0"
+	                               "1\0A1.sql\0";
+	static const size_t threads[4] = { 0, 1, 4, 100 };
+	char buf[256], **migrations;
+	size_t i, size;
+
+	for (i = 0; i < 4; i++) {
+		setup_threads_walk(threads[i], buf);
+		migrations = git_find_migrations("1", NULL, &size);
+		ck_assert_ptr_nonnull(migrations);
+		ck_assert_uint_eq(size, 2);
+		ck_assert_str_eq(migrations[0], "1.sql");
+		ck_assert_str_eq(migrations[1], "6.sql");
+		ck_assert_uint_eq(write_data_len, sizeof(expected));
+		ck_assert(!memcmp(buf, expected, sizeof(expected)));
+#ifdef HAVE_LIBPTHREAD
+		ck_assert(!pool.threaded);
+#endif
+		while (size) free(migrations[--size]);
+		free(migrations);
+	}
+}
+END_TEST
+
+/**
+ * Test that commits which can't be diffed by the workers are
+ * skipped, and aren't cached.
+ */
+START_TEST(git_find_migrations_threads_skip)
+{
+	char buf[256], **migrations;
+	size_t size;
+
+	setup_threads_walk(4, buf);
+	git_commit_lookup_returns = -1;
+	ck_assert_ptr_nonnull(migrations = git_find_migrations("1", NULL, &size));
+	ck_assert_uint_eq(size, 1);
+	ck_assert_str_eq(*migrations, "6.sql");
+	ck_assert(!open_called);
+	free(*migrations);
+	free(migrations);
+}
+END_TEST
+
+/**
+ * Test that git_load_migration() reads migrations from the working
+ * tree by default.
+ */
+START_TEST(git_load_migration_working_tree)
+{
+	static char mem[] = "-- [up]\nTWO;\n";
+	size_t size;
+
+	strcpy(config.repo_path, "repo");
+	map_file_returns = mem;
+	map_file_len     = sizeof(mem) - 1;
+	ck_assert_ptr_eq(git_load_migration("db/2.sql", &size), mem);
+	ck_assert_uint_eq(size, sizeof(mem) - 1);
+	ck_assert_str_eq(map_file_path, "repo/db/2.sql");
+	ck_assert_ptr_null(copy_file_mem);
+
+	git_unload_migration(mem, size);
+	ck_assert_int_eq(unmap_file_called, 1);
+}
+END_TEST
+
+/**
+ * Test that git_load_migration() reads migrations from the
+ * repository at the revision they were found at, if asked to.
+ */
+START_TEST(git_load_migration_blob)
+{
+	int obj = 5;
+	size_t size;
+	char *mem;
+
+	config.read_blobs = 1;
+	strcpy(local_head, "abc");
+	git_revparse_single_out = &obj;
+	ck_assert_ptr_nonnull(mem = git_load_migration("db/1.sql", &size));
+	ck_assert_str_eq(mem, "-- [up]\nONE;\n");
+	ck_assert_uint_eq(size, 13);
+	ck_assert_ptr_eq(copy_file_mem, git_blob_rawcontent_returns);
+	ck_assert(!*map_file_path);
+
+	git_unload_migration(mem, size);
+	ck_assert_int_eq(unmap_file_called, 1);
+}
+END_TEST
+
+/**
+ * Test that git_load_migration() reads migrations from the
+ * repository at HEAD if the repository is bare.
+ */
+START_TEST(git_load_migration_bare)
+{
+	int obj = 5;
+	size_t size;
+
+	*local_head = '\0';
+	git_repository_is_bare_returns = 1;
+	git_revparse_single_out_head   = &obj;
+	ck_assert_ptr_nonnull(git_load_migration("db/1.sql", &size));
+	ck_assert_ptr_eq(copy_file_mem, git_blob_rawcontent_returns);
+	ck_assert_int_eq(git_revparse_single_called, 1);
+}
+END_TEST
+
+/**
+ * Test that git_load_migration() fails if the migration isn't a
+ * blob at that revision.
+ */
+START_TEST(git_load_migration_not_blob)
+{
+	int obj = 5;
+	size_t size;
+
+	config.read_blobs = 1;
+	strcpy(local_head, "abc");
+	git_revparse_single_out = &obj;
+	git_object_type_returns = GIT_OBJ_BLOB + 1;
+	*errbuf = '\0';
+	ck_assert_ptr_null(git_load_migration("db/1.sql", &size));
+	ck_assert_uint_eq(size, 0);
+	ck_assert_str_eq(errbuf, "'db/1.sql' isn't in revision abc\n");
+	ck_assert_ptr_null(copy_file_mem);
+
+	git_revparse_single_returns = -1;
+	ck_assert_ptr_null(git_load_migration("db/1.sql", &size));
+	ck_assert_ptr_null(copy_file_mem);
+}
+END_TEST
+
+/**
+ * Test that the repository is only opened once, until the backend
+ * is uninitialized.
+ */
+START_TEST(repo_opened_once)
+{
+	size_t size;
+	int head = 1234;
+
+	giterr_last_returns          = NULL;
+	git_revparse_single_out_head = &head;
+	git_revwalk_next_returns     = 1;
+	memcpy(config.migration_path, "/tmp", 5);
+
+	ck_assert_ptr_null(git_find_migrations(NULL, NULL, &size));
+	ck_assert_ptr_nonnull(git_get_file_revision("1.sql"));
+	ck_assert_ptr_nonnull(git_get_watch_paths());
+	ck_assert_int_eq(git_repository_open_called, 1);
+
+	ck_assert_int_eq(git_uninit(), 0);
+	ck_assert_ptr_nonnull(git_get_watch_paths());
+	ck_assert_int_eq(git_repository_open_called, 2);
+}
+END_TEST
+
+/**
+ * Test that revisions relative to HEAD are only resolved again
+ * once HEAD moves.
+ */
+START_TEST(revparse_relative)
+{
+	int head = 1234;
+
+	git_revparse_single_out_head = &head;
+	ck_assert_str_eq(git_get_file_revision("1.sql"), "1234");
+	ck_assert_str_eq(git_get_file_revision("1.sql"), "1234");
+	ck_assert_int_eq(git_revparse_single_called, 1);
+	ck_assert_int_eq(git_object_lookup_called, 1);
+
+	git_reference_name_to_id_oid = 2;
+	ck_assert_str_eq(git_get_file_revision("1.sql"), "1234");
+	ck_assert_int_eq(git_revparse_single_called, 2);
+	ck_assert_str_eq(git_get_file_revision("1.sql"), "1234");
+	ck_assert_int_eq(git_revparse_single_called, 2);
+
+	/* Without HEAD, nothing's reused */
+	git_reference_name_to_id_returns = ~GIT_OK;
+	ck_assert_str_eq(git_get_file_revision("1.sql"), "1234");
+	ck_assert_int_eq(git_revparse_single_called, 3);
+}
+END_TEST
+
+/**
+ * Test that full object IDs are only resolved once, and that other
+ * revisions are resolved every time.
+ */
+START_TEST(revparse_oid)
+{
+	const char *oid = "0123456789abcdef0123456789abcdef01234567";
+	size_t size;
+	int head = 1234;
+
+	giterr_last_returns          = NULL;
+	git_revparse_single_out_head = &head;
+	git_revparse_single_out      = &head;
+	git_revwalk_next_returns     = 1;
+	memcpy(config.migration_path, "/tmp", 5);
+
+	ck_assert_ptr_null(git_find_migrations(oid, NULL, &size));
+	ck_assert_int_eq(git_revparse_single_called, 2);
+	git_revwalk_next_returns = 1;
+	ck_assert_ptr_null(git_find_migrations(oid, NULL, &size));
+	ck_assert_int_eq(git_revparse_single_called, 2);
+	ck_assert_int_eq(git_object_lookup_called, 2);
+
+	git_revwalk_next_returns = 1;
+	ck_assert_ptr_null(git_find_migrations("master", NULL, &size));
+	git_revwalk_next_returns = 1;
+	ck_assert_ptr_null(git_find_migrations("master", NULL, &size));
+	ck_assert_int_eq(git_revparse_single_called, 4);
+}
+END_TEST
+
+/**
+ * Test that renames and deletes apply to the first slot holding the
+ * path in each batch, and that duplicates aren't added.
+ */
+START_TEST(test_modify_mlist)
+{
+	struct mlist *ml1, *ml2;
+	char **m;
+	size_t size;
+
+	ck_assert_ptr_nonnull(ml1 = new_batch());
+	ck_assert_int_eq(add_migration(ml1, "1.sql"), 0);
+	ck_assert_int_eq(add_migration(ml1, "2.sql"), 0);
+	ck_assert_int_eq(add_migration(ml1, "1.sql"), 0);
+	ck_assert_uint_eq(ml1->size, 2);
+
+	ck_assert_ptr_nonnull(ml2 = new_batch());
+	ck_assert_int_eq(add_migration(ml2, "5.sql"), 0);
+	ck_assert_int_eq(add_migration(ml2, "2.sql"), 0);
+	ck_assert_uint_eq(ml2->size, 1);
+
+	/* 1.sql is now in both batches */
+	ck_assert_int_eq(modify_mlist("5.sql", "1.sql"), 0);
+	ck_assert_str_eq(ml2->migrations[0]->name, "1.sql");
+	ck_assert_int_eq(modify_mlist("1.sql", "7.sql"), 0);
+	ck_assert_str_eq(ml1->migrations[0]->name, "7.sql");
+	ck_assert_str_eq(ml2->migrations[0]->name, "7.sql");
+
+	ck_assert_int_eq(modify_mlist("7.sql", NULL), 0);
+	ck_assert_ptr_null(ml1->migrations[0]);
+	ck_assert_ptr_null(ml2->migrations[0]);
+	ck_assert_int_eq(modify_mlist("7.sql", NULL), 0);
+	ck_assert_int_ne(modify_mlist(NULL, NULL), 0);
+
+	ck_assert_int_eq(add_migration(ml2, "7.sql"), 0);
+	ck_assert_uint_eq(ml2->size, 2);
+
+	ck_assert_ptr_nonnull(m = flatten_mlist(3, &size));
+	ck_assert_uint_eq(size, 2);
+	ck_assert_str_eq(m[0], "2.sql");
+	ck_assert_str_eq(m[1], "7.sql");
+	ck_assert_ptr_null(arena.block);
+	ck_assert_ptr_null(mlist_head);
+	free(m[1]);
+	free(m[0]);
+	free(m);
+}
+END_TEST
+
+/**
+ * Test that the path table grows, and that the arena spans several
+ * blocks.
+ */
+START_TEST(path_table_grows)
+{
+	struct mlist *ml;
+	char path[32], **m;
+	size_t i, size;
+
+	ck_assert_ptr_nonnull(ml = new_batch());
+	for (i = 0; i < 5000; i++) {
+		sprintf(path, "%lu.sql", (unsigned long)i);
+		ck_assert_int_eq(add_migration(ml, path), 0);
+	}
+
+	ck_assert_uint_eq(paths.n, 5000);
+	ck_assert_uint_gt(paths.mask, 4096);
+	for (i = 0; i < 5000; i += 7) {
+		sprintf(path, "%lu.sql", (unsigned long)i);
+		ck_assert_int_eq(add_migration(ml, path), 0);
+	}
+
+	ck_assert_uint_eq(ml->size, 5000);
+	ck_assert_ptr_nonnull(m = flatten_mlist(ml->size, &size));
+	ck_assert_uint_eq(size, 5000);
+	for (i = 0; i < size; i++) {
+		sprintf(path, "%lu.sql", (unsigned long)i);
+		ck_assert_str_eq(m[i], path);
+		free(m[i]);
+	}
+
+	free(m);
+}
+END_TEST
+
 Suite *source_git_suite(void)
 {
 	Suite *s;
@@ -814,25 +1524,34 @@ Suite *source_git_suite(void)
 
 	s = suite_create("Migration Source: Git");
 	t = tcase_create("git_init");
-	tcase_add_checked_fixture(t, reset_libgit2_stubs, NULL);
+	tcase_add_checked_fixture(t, reset, NULL);
 	tcase_add_test(t, test_git_init_uninit);
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
 	t = tcase_create("git_get_head");
-	tcase_add_checked_fixture(t, reset_libgit2_stubs, NULL);
+	tcase_add_checked_fixture(t, reset, NULL);
 	tcase_add_test(t, test_git_get_head);
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
 	t = tcase_create("git_get_migration_path");
-	tcase_add_checked_fixture(t, reset_libgit2_stubs, NULL);
+	tcase_add_checked_fixture(t, reset, NULL);
 	tcase_add_test(t, test_git_get_migration_path);
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
+	t = tcase_create("git_get_watch_paths");
+	tcase_add_checked_fixture(t, reset, NULL);
+	tcase_add_test(t, git_get_watch_paths_fails);
+	tcase_add_test(t, test_git_get_watch_paths);
+	tcase_add_test(t, git_get_watch_paths_detached);
+	tcase_add_test(t, git_get_watch_paths_worktree);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
 	t = tcase_create("git_find_migrations");
-	tcase_add_checked_fixture(t, reset_libgit2_stubs, NULL);
+	tcase_add_checked_fixture(t, reset, NULL);
 	tcase_add_test(t, git_find_migrations_null_size);
 	tcase_add_test(t, git_find_migrations_no_migration_path);
 	tcase_add_test(t, git_find_migrations_open_repo_fails);
@@ -865,6 +1584,56 @@ Suite *source_git_suite(void)
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
+	t = tcase_create("delta_cache");
+	tcase_add_checked_fixture(t, reset, NULL);
+	tcase_add_test(t, git_find_migrations_cache_records);
+	tcase_add_test(t, git_find_migrations_cache_records_no_deltas);
+	tcase_add_test(t, git_find_migrations_cache_hit);
+	tcase_add_test(t, git_find_migrations_cache_invalid);
+	tcase_add_test(t, git_find_migrations_cache_write_fails);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("git_load_migration");
+	tcase_add_checked_fixture(t, reset, NULL);
+	tcase_add_test(t, git_load_migration_working_tree);
+	tcase_add_test(t, git_load_migration_blob);
+	tcase_add_test(t, git_load_migration_bare);
+	tcase_add_test(t, git_load_migration_not_blob);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("subtree");
+	tcase_add_checked_fixture(t, reset, NULL);
+	tcase_add_test(t, test_set_subtree);
+	tcase_add_test(t, git_find_migrations_subtree_unchanged);
+	tcase_add_test(t, git_find_migrations_subtree_changed);
+	tcase_add_test(t, git_find_migrations_subtree_missing);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("workers");
+	tcase_add_checked_fixture(t, reset, NULL);
+	tcase_add_test(t, git_find_migrations_threads);
+	tcase_add_test(t, git_find_migrations_threads_skip);
+	tcase_set_timeout(t, 5);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("path_table");
+	tcase_add_checked_fixture(t, reset, NULL);
+	tcase_add_test(t, test_modify_mlist);
+	tcase_add_test(t, path_table_grows);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("repository");
+	tcase_add_checked_fixture(t, reset, NULL);
+	tcase_add_test(t, repo_opened_once);
+	tcase_add_test(t, revparse_relative);
+	tcase_add_test(t, revparse_oid);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
 	return s;
 }
 
@@ -0,0 +1,258 @@
+/**
+ * Minimal Migration Manager - Pack Source Tests
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+#include "tests.h"
+
+/* from test_runner.c */
+extern char errbuf[];
+
+#include "posix_stubs.h"
+
+/* {{{ map_file stubs */
+#define FILE_H
+static int map_file_called = 0;
+static int unmap_file_called = 0;
+static char pack_buf[128];
+static size_t pack_len = 0;
+
+static char *map_file(const char *path, size_t *size)
+{
+	(void)path;
+	++map_file_called;
+	*size = pack_len;
+	return pack_buf;
+}
+
+static void unmap_file(char *mem, size_t len)
+{
+	(void)mem;
+	(void)len;
+	++unmap_file_called;
+}
+/* }}} */
+
+#include "../src/source/pack.c"
+
+/**
+ * Put a big-endian 32-bit number.
+ */
+static void set32(char *p, unsigned long x)
+{
+	p[0] = (char)((x >> 24) & 0xff);
+	p[1] = (char)((x >> 16) & 0xff);
+	p[2] = (char)((x >> 8) & 0xff);
+	p[3] = (char)(x & 0xff);
+}
+
+/**
+ * Put a migration into the pack.
+ */
+static void add_migration(size_t i, unsigned long num, unsigned long name,
+                          unsigned long off, const char *body)
+{
+	char *e = pack_buf + 16 + i * 24;
+	size_t len = strlen(body);
+
+	set32(e + 4, num);
+	set32(e + 8, name);
+	set32(e + 12, off);
+	set32(e + 16, (unsigned long)len);
+	set32(e + 20, checksum(body, len));
+	memcpy(pack_buf + off, body, len + 1);
+}
+
+/**
+ * Build a pack with 1.sql and 5.sql, in 'dir/test.pak'.
+ */
+static void reset(void)
+{
+	reset_stubs();
+	pack_init();
+	map_file_called   = 0;
+	unmap_file_called = 0;
+	*errbuf = '\0';
+
+	memset(pack_buf, 0, sizeof(pack_buf));
+	memcpy(pack_buf, "mmmpak1", 8);
+	set32(pack_buf + 8, 2);
+	set32(pack_buf + 12, 12);
+	memcpy(pack_buf + 64, "1.sql\0" "5.sql", 12);
+	add_migration(0, 1, 0, 76, "-- [up]\nONE;\n");
+	add_migration(1, 5, 6, 90, "-- [up]\nFIVE;\n");
+	pack_len = 105;
+
+	strcpy(config.pack_file, "dir/test.pak");
+	stat_returns_buf.st_size  = 105;
+	stat_returns_buf.st_mtime = 1;
+}
+
+static void teardown(void)
+{
+	pack_uninit();
+}
+
+/**
+ * Test that pack_find_migrations() fails if there's no pack_file,
+ * or if the pack can't be opened.
+ */
+START_TEST(pack_find_migrations_no_pack)
+{
+	size_t n = 1;
+
+	ck_assert(!pack_find_migrations(NULL, NULL, NULL));
+
+	*config.pack_file = '\0';
+	ck_assert(!pack_find_migrations(NULL, NULL, &n));
+	ck_assert_uint_eq(n, 0);
+	ck_assert_str_eq(errbuf, "no pack_file specified\n");
+
+	strcpy(config.pack_file, "dir/test.pak");
+	stat_errno = ENOENT;
+	ck_assert(!pack_find_migrations(NULL, NULL, &n));
+	ck_assert_str_eq(errbuf, "unable to stat 'dir/test.pak': "
+	                 "No such file or directory\n");
+	ck_assert(!map_file_called);
+}
+END_TEST
+
+/**
+ * Test that pack_find_migrations() refuses a damaged pack.
+ */
+START_TEST(pack_find_migrations_damaged)
+{
+	size_t n;
+
+	pack_buf[89] = ' ';
+	ck_assert(!pack_find_migrations(NULL, NULL, &n));
+	ck_assert_str_eq(errbuf, "'dir/test.pak' isn't a valid "
+	                 "migration pack\n");
+	ck_assert_int_eq(unmap_file_called, 1);
+}
+END_TEST
+
+/**
+ * Test that pack_find_migrations() lists the migrations after the
+ * current revision, or between revisions for a rollback.
+ */
+START_TEST(test_pack_find_migrations)
+{
+	char **m;
+	size_t n;
+
+	ck_assert((m = pack_find_migrations(NULL, NULL, &n)) != NULL);
+	ck_assert_uint_eq(n, 2);
+	ck_assert_str_eq(m[0], "1.sql");
+	ck_assert_str_eq(m[1], "5.sql");
+	ck_assert_str_eq(pack_get_head(), "5");
+	while (n) free(m[--n]);
+	free(m);
+
+	ck_assert((m = pack_find_migrations("1", NULL, &n)) != NULL);
+	ck_assert_uint_eq(n, 1);
+	ck_assert_str_eq(m[0], "5.sql");
+	free(m[0]);
+	free(m);
+
+	ck_assert((m = pack_find_migrations("5", "1", &n)) != NULL);
+	ck_assert_uint_eq(n, 1);
+	ck_assert_str_eq(m[0], "5.sql");
+	free(m[0]);
+	free(m);
+
+	ck_assert(!pack_find_migrations("5", NULL, &n));
+	ck_assert_uint_eq(n, 0);
+	ck_assert_str_eq(pack_get_head(), "5");
+}
+END_TEST
+
+/**
+ * Test that the pack is only mapped again if it changes.
+ */
+START_TEST(pack_find_migrations_remaps)
+{
+	char **m;
+	size_t n;
+
+	ck_assert(!pack_find_migrations("5", NULL, &n));
+	ck_assert(!pack_find_migrations("5", NULL, &n));
+	ck_assert_int_eq(map_file_called, 1);
+	ck_assert(!unmap_file_called);
+
+	stat_returns_buf.st_mtime = 2;
+	ck_assert((m = pack_find_migrations("1", NULL, &n)) != NULL);
+	ck_assert_int_eq(map_file_called, 2);
+	ck_assert_int_eq(unmap_file_called, 1);
+	free(m[0]);
+	free(m);
+}
+END_TEST
+
+/**
+ * Test that pack_load_migration() hands out migrations straight
+ * from the pack, provided they're intact.
+ */
+START_TEST(test_pack_load_migration)
+{
+	size_t size;
+
+	ck_assert(pack_load_migration("5.sql", &size) == pack_buf + 90);
+	ck_assert_uint_eq(size, 14);
+	ck_assert_int_eq(map_file_called, 1);
+
+	ck_assert(!pack_load_migration("3.sql", &size));
+	ck_assert_str_eq(errbuf, "'3.sql' isn't in 'dir/test.pak'\n");
+
+	pack_buf[80] = 'X';
+	ck_assert(!pack_load_migration("1.sql", &size));
+	ck_assert_str_eq(errbuf, "'1.sql' is damaged in 'dir/test.pak'\n");
+}
+END_TEST
+
+/**
+ * Test that pack_get_watch_paths() gives the directory the pack is in.
+ */
+START_TEST(test_pack_get_watch_paths)
+{
+	ck_assert_str_eq(pack_get_watch_paths()[0], "dir");
+	ck_assert_ptr_null(pack_get_watch_paths()[1]);
+	strcpy(config.pack_file, "/test.pak");
+	ck_assert_str_eq(pack_get_watch_paths()[0], "/");
+	strcpy(config.pack_file, "test.pak");
+	ck_assert_str_eq(pack_get_watch_paths()[0], ".");
+	ck_assert_ptr_eq(pack_get_migration_path(), config.pack_file);
+	ck_assert_str_eq(pack_get_file_revision("seed.sql"), "0");
+}
+END_TEST
+
+Suite *source_pack_suite(void)
+{
+	Suite *s;
+	TCase *t;
+
+	s = suite_create("Source (Pack)");
+	t = tcase_create("pack_find_migrations");
+	tcase_add_checked_fixture(t, reset, teardown);
+	tcase_add_test(t, pack_find_migrations_no_pack);
+	tcase_add_test(t, pack_find_migrations_damaged);
+	tcase_add_test(t, test_pack_find_migrations);
+	tcase_add_test(t, pack_find_migrations_remaps);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("pack_load_migration");
+	tcase_add_checked_fixture(t, reset, teardown);
+	tcase_add_test(t, test_pack_load_migration);
+	tcase_add_test(t, test_pack_get_watch_paths);
+	suite_add_tcase(s, t);
+
+	return s;
+}
@@ -0,0 +1,202 @@
+/**
+ * Minimal Migration Manager - SQL Statement Scanner Tests
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+#include "tests.h"
+
+#include "../src/sql.h"
+#include "../src/sql.c"
+
+/**
+ * Scan a whole string, returning the number of statements in it.
+ */
+static unsigned long count(const char *sql, unsigned int flags)
+{
+	struct sql_scanner s;
+	size_t len = strlen(sql);
+
+	sql_scan_init(&s, flags);
+	sql_scan(&s, sql, len, len);
+	return s.n_stmts + (s.tokens ? 1 : 0);
+}
+
+/**
+ * Test that sql_dialect() returns the flags for each driver.
+ */
+START_TEST(test_sql_dialect)
+{
+	ck_assert_uint_eq(sql_dialect(NULL), 0);
+	ck_assert_uint_eq(sql_dialect("x"), 0);
+	ck_assert_uint_eq(sql_dialect("mysql"),
+	                  SQL_BACKSLASH | SQL_HASH | SQL_DELIMITER);
+	ck_assert(sql_dialect("pgsql") & SQL_DOLLAR);
+	ck_assert_uint_eq(sql_dialect("sqlite3"), SQL_TRIGGER);
+}
+END_TEST
+
+/**
+ * Test that semicolons in strings, identifiers and comments don't
+ * end statements.
+ */
+START_TEST(sql_scan_quotes_and_comments)
+{
+	ck_assert_uint_eq(count("SELECT 1; SELECT 2;", 0), 2);
+	ck_assert_uint_eq(count("SELECT ';'; SELECT \";\"", 0), 2);
+	ck_assert_uint_eq(count("SELECT `;`;", 0), 1);
+	ck_assert_uint_eq(count("-- ;\nSELECT 1; /* ; */", 0), 1);
+	ck_assert_uint_eq(count("; ; SELECT 1;;", 0), 1);
+	ck_assert_uint_eq(count("# ;\nSELECT 1;", SQL_HASH), 1);
+	ck_assert_uint_eq(count("# ;\nSELECT 1;", 0), 2);
+}
+END_TEST
+
+/**
+ * Test the PostgreSQL-specific quoting: dollar quotes, E'' strings
+ * and nested block comments.
+ */
+START_TEST(sql_scan_pgsql)
+{
+	unsigned int f = sql_dialect("pgsql");
+
+	ck_assert_uint_eq(count("SELECT $$;$$; SELECT $a$ $$; $a$;", f), 2);
+	ck_assert_uint_eq(count("SELECT $1; SELECT 2;", f), 2);
+	ck_assert_uint_eq(count("SELECT E'\\';'; SELECT 1;", f), 2);
+	ck_assert_uint_eq(count("SELECT '\\'; SELECT 1;", f), 2);
+	ck_assert_uint_eq(count("/* /* */ SELECT 1; */ SELECT 2;", f), 1);
+	ck_assert_uint_eq(count("/* /* */ SELECT 1; */ SELECT 2;", 0), 2);
+	ck_assert_uint_eq(count("CREATE FUNCTION f() RETURNS int "
+	                        "LANGUAGE sql BEGIN ATOMIC SELECT 1; "
+	                        "SELECT 2; END; SELECT 3;", f), 2);
+}
+END_TEST
+
+/**
+ * Test that the semicolons in SQLite trigger bodies, and in
+ * parentheses, don't end statements.
+ */
+START_TEST(sql_scan_bodies)
+{
+	ck_assert_uint_eq(count("CREATE TEMP TRIGGER t AFTER INSERT ON a "
+	                        "BEGIN UPDATE b SET c = CASE WHEN 1 THEN 2 "
+	                        "END; DELETE FROM c; END; SELECT 1;",
+	                        SQL_TRIGGER), 2);
+	ck_assert_uint_eq(count("CREATE TABLE end (a); SELECT 1;",
+	                        SQL_TRIGGER), 2);
+	ck_assert_uint_eq(count("CREATE RULE r AS ON INSERT TO t DO "
+	                        "(INSERT INTO a VALUES (1); NOTIFY a); "
+	                        "SELECT 1;", 0), 2);
+}
+END_TEST
+
+/**
+ * Test that SQL_ONE stops just past each statement, and that
+ * SQL_COPY stops at copy section markers.
+ */
+START_TEST(sql_scan_stops)
+{
+	struct sql_scanner s;
+	const char *sql = "SELECT 1; SELECT 2;\n-- [copy t]\n1\n";
+	size_t len = strlen(sql);
+
+	sql_scan_init(&s, SQL_ONE | SQL_COPY);
+	sql_scan(&s, sql, len, len);
+	ck_assert_uint_eq(s.pos, 9);
+	ck_assert_uint_eq(s.boundary, 9);
+	ck_assert_uint_eq(s.n_stmts, 1);
+
+	sql_scan(&s, sql, len, len);
+	ck_assert_uint_eq(s.boundary, 19);
+	ck_assert_uint_eq(s.n_stmts, 2);
+	ck_assert(!s.marker);
+
+	sql_scan(&s, sql, len, len);
+	ck_assert_uint_eq(s.pos, 20);
+	ck_assert_uint_eq(s.n_stmts, 2);
+	ck_assert(s.marker);
+}
+END_TEST
+
+/**
+ * Test that SQL_DELIMITER follows DELIMITER lines, and gives the
+ * text of each statement without the DELIMITER.
+ */
+START_TEST(sql_scan_delimiter)
+{
+	struct sql_scanner s;
+	const char *sql = "DELIMITER $$\nBEGIN; END$$ DELIMITER ;\nSELECT 1;";
+	size_t len = strlen(sql);
+
+	sql_scan_init(&s, SQL_DELIMITER | SQL_ONE);
+	sql_scan(&s, sql, len, len);
+	ck_assert_uint_eq(s.boundary, 13);
+	ck_assert_uint_eq(s.n_stmts, 0);
+	ck_assert_str_eq(s.delim, "$$");
+
+	sql_scan(&s, sql, len, len);
+	ck_assert_uint_eq(s.n_stmts, 1);
+	ck_assert_uint_eq(s.start, 13);
+	ck_assert_uint_eq(s.end, 23);
+	ck_assert_uint_eq(s.boundary, 25);
+
+	sql_scan(&s, sql, len, len);
+	ck_assert_uint_eq(s.n_stmts, 1);
+	ck_assert_uint_eq(s.delim_len, 0);
+
+	sql_scan(&s, sql, len, len);
+	ck_assert_uint_eq(s.n_stmts, 2);
+	ck_assert_uint_eq(s.start, 38);
+	ck_assert_uint_eq(s.end, len);
+
+	/* Only with SQL_ONE */
+	ck_assert_uint_eq(count(sql, SQL_DELIMITER), 3);
+}
+END_TEST
+
+/**
+ * Test that the scanner state carries over from one scan to the
+ * next.
+ */
+START_TEST(sql_scan_resumes)
+{
+	struct sql_scanner s;
+	const char *sql = "SELECT ';'; SELECT 2;";
+	size_t len = strlen(sql);
+
+	sql_scan_init(&s, 0);
+	sql_scan(&s, sql, 9, len);
+	ck_assert_int_eq(s.state, IN_QUOTE);
+	ck_assert_uint_eq(s.n_stmts, 0);
+	sql_scan(&s, sql, len, len);
+	ck_assert_uint_eq(s.n_stmts, 2);
+	ck_assert_uint_eq(s.boundary, len);
+}
+END_TEST
+
+Suite *sql_suite(void)
+{
+	Suite *s;
+	TCase *t;
+
+	s = suite_create("SQL Scanner");
+	t = tcase_create("sql_scan");
+	tcase_add_test(t, test_sql_dialect);
+	tcase_add_test(t, sql_scan_quotes_and_comments);
+	tcase_add_test(t, sql_scan_pgsql);
+	tcase_add_test(t, sql_scan_bodies);
+	tcase_add_test(t, sql_scan_stops);
+	tcase_add_test(t, sql_scan_delimiter);
+	tcase_add_test(t, sql_scan_resumes);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	return s;
+}
@@ -25,8 +25,13 @@
 
 #define SQLITE_OK 1
 #define SQLITE_ABORT 2
+#define SQLITE_ROW 100
+#define SQLITE_DONE 101
+#define SQLITE_PREPARE_PERSISTENT 1
+#define SQLITE_STATIC ((void(*)(void *))0)
 
 typedef int sqlite3;
+typedef int sqlite3_stmt;
 
 static sqlite3 *sqlite3_open_dbh = NULL;
 static int sqlite3_initialize_returns = SQLITE_OK;
@@ -35,6 +40,19 @@ static int sqlite3_open_returns = SQLITE_OK;
 static int sqlite3_exec_returns = SQLITE_OK;
 static const char *sqlite3_errmsg_returns = NULL;
 static char *sqlite3_exec_errmsg = NULL;
+static sqlite3_stmt *sqlite3_prepare_stmt = NULL;
+static int sqlite3_prepare_returns = SQLITE_OK;
+static int sqlite3_bind_returns = SQLITE_OK;
+static int sqlite3_bind_called = 0;
+static int sqlite3_step_rows = 0;
+static int sqlite3_step_returns = SQLITE_DONE;
+static int sqlite3_reset_called = 0;
+static int sqlite3_finalize_called = 0;
+static int sqlite3_prepare_v2_called = 0;
+static char sqlite3_exec_queries[256];
+static char sqlite3_queries[256];
+static char sqlite3_prepare_query[128];
+static char sqlite3_bound[256];
 
 /* }}} */
 
@@ -62,9 +80,11 @@ static const char *sqlite3_errmsg(sqlite3 *dbh)
 }
 
 static int sqlite3_exec(sqlite3 *dbh, const char *query,
-                        db_row_callback_t callback, void *userdata,
-                        char **errmsg)
+                        int (*callback)(void *, int, char **, char **),
+                        void *userdata, char **errmsg)
 {
+	strcat(sqlite3_exec_queries, query);
+	strcat(sqlite3_exec_queries, "|");
 	*errmsg = sqlite3_exec_errmsg;
 	return sqlite3_exec_returns;
 }
@@ -79,6 +99,92 @@ static void sqlite3_free(void *x)
 	return;
 }
 
+static int sqlite3_prepare_v3(sqlite3 *dbh, const char *query, int len,
+                              unsigned int flags, sqlite3_stmt **stmt,
+                              const char **tail)
+{
+	strncpy(sqlite3_prepare_query, query, sizeof sqlite3_prepare_query - 1);
+	*stmt = sqlite3_prepare_stmt;
+	return sqlite3_prepare_returns;
+}
+
+static int sqlite3_prepare_v2(sqlite3 *dbh, const char *query, int len,
+                              sqlite3_stmt **stmt, const char **tail)
+{
+	const char *end = memchr(query, ';', (size_t)len);
+
+	/* Consume one statement at a time */
+	sqlite3_prepare_v2_called++;
+	*tail = end ? end + 1 : query + len;
+	sprintf(sqlite3_queries + strlen(sqlite3_queries), "%.*s|",
+	        (int)(*tail - query), query);
+	*stmt = sqlite3_prepare_stmt;
+	return sqlite3_prepare_returns;
+}
+
+static int sqlite3_bind_text(sqlite3_stmt *stmt, int i, const char *val,
+                             int len, void (*dtor)(void *))
+{
+	sqlite3_bind_called++;
+	if (len >= 0)
+		sprintf(sqlite3_bound + strlen(sqlite3_bound), "%.*s|", len, val);
+	return sqlite3_bind_returns;
+}
+
+static int sqlite3_bind_null(sqlite3_stmt *stmt, int i)
+{
+	sqlite3_bind_called++;
+	strcat(sqlite3_bound, "NULL|");
+	return sqlite3_bind_returns;
+}
+
+static int sqlite3_column_count(sqlite3_stmt *stmt)
+{
+	return 1;
+}
+
+static const char *sqlite3_column_name(sqlite3_stmt *stmt, int i)
+{
+	return "column";
+}
+
+static const unsigned char *sqlite3_column_text(sqlite3_stmt *stmt, int i)
+{
+	return (const unsigned char *)"value";
+}
+
+static int sqlite3_column_bytes(sqlite3_stmt *stmt, int i)
+{
+	return 5;
+}
+
+static int sqlite3_step(sqlite3_stmt *stmt)
+{
+	if (sqlite3_step_rows) {
+		sqlite3_step_rows--;
+		return SQLITE_ROW;
+	}
+
+	return sqlite3_step_returns;
+}
+
+static int sqlite3_reset(sqlite3_stmt *stmt)
+{
+	sqlite3_reset_called++;
+	return SQLITE_OK;
+}
+
+static int sqlite3_clear_bindings(sqlite3_stmt *stmt)
+{
+	return SQLITE_OK;
+}
+
+static int sqlite3_finalize(sqlite3_stmt *stmt)
+{
+	sqlite3_finalize_called++;
+	return SQLITE_OK;
+}
+
 /* }}} */
 
 #endif /* TEST_SQLITE3_STUBS_H */
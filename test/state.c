@@ -18,11 +18,36 @@
 extern char errbuf[];
 
 /* {{{ DB stubs */
-typedef int (*db_row_callback_t)(void *userdata, int n_cols,
-                                 char **fields, char **column_names);
+struct db_row {
+	int n_cols;
+	unsigned long index;
+	char **fields;
+	size_t *lengths;
+	char **column_names;
+};
+
+typedef int (*db_row_callback_t)(void *userdata, const struct db_row *row);
+
+struct db_stmt {
+	char query[256];
+};
 
 static int db_query(const char *query, db_row_callback_t cb,
                     void *userdata);
+static struct db_stmt *db_prepare(const char *query);
+static int db_execute(struct db_stmt *stmt, const char *const *params,
+                      db_row_callback_t cb, void *userdata);
+static void db_finalize(struct db_stmt *stmt);
+/* }}} */
+
+/* {{{ gettimeofday stub */
+struct timeval {
+	time_t tv_sec;
+	long tv_usec;
+};
+
+static int gettimeofday(struct timeval *tv, void *tz);
+/* }}} */
 
 #define DB_H
 #include "../src/state.h"
@@ -30,32 +55,105 @@ static int db_query(const char *query, db_row_callback_t cb,
 
 static const char *expected_query = NULL;
 
+/* Queries seen by the stub, for checking sequences of queries */
+#define N_QUERIES 10
+static const char *queries[N_QUERIES];
+static size_t n_queries = 0;
+static const char *fail_query = NULL;
+
+/* Prepared statements, and the queries they've rendered */
+#define N_PREPARED 16
+static struct db_stmt prepared[N_PREPARED];
+static size_t n_prepared = 0;
+static size_t n_finalized = 0;
+static char rendered[N_QUERIES][256];
+static int fail_prepare = 0;
+
 /**
  * Values to test state fetching.
  */
 static const time_t tstamp = 1434730500;
+static const long tstamp_usec = 123456;
 
 static char xrow_0[] = "1434730500";
-static char xrow_1[] = "1";
+static char xrow_1[] = "2";
 static char xrow_2[] = "cur_rev";
 static char xrow_3[] = "prev_rev";
+static char xrow_4[] = "654321";
+static char xrow_5[] = "7";
 
 static char *xrow[] = {
-	xrow_0, xrow_1, xrow_2, xrow_3
+	xrow_0, xrow_4, xrow_5, xrow_1, xrow_2, xrow_3
 };
 
 static char xcolnames_0[] = "tstamp";
 static char xcolnames_1[] = "version";
 static char xcolnames_2[] = "revision";
 static char xcolnames_3[] = "previous";
+static char xcolnames_4[] = "usec";
+static char xcolnames_5[] = "seq";
 
 static char *xcolnames[] = {
-	xcolnames_0, xcolnames_1, xcolnames_2, xcolnames_3
+	xcolnames_0, xcolnames_4, xcolnames_5, xcolnames_1,
+	xcolnames_2, xcolnames_3
 };
 
-static int xcols = 4;
+static int xcols = 6;
 static size_t set_states_loaded = 0;
 
+/**
+ * Version row, for the table version query.
+ */
+static char xversion_0[] = "2";
+static char *xversion[] = { xversion_0 };
+static char *xversion_null[] = { NULL };
+static char *xversion_colnames[] = { xcolnames_1 };
+static int version_is_null = 0;
+
+/**
+ * Ledger rows, in no particular order.
+ */
+static char xledger_0[] = "2-b.sql";
+static char xledger_1[] = "bbbbbbbb";
+static char xledger_2[] = "1-a.sql";
+static char xledger_3[] = "aaaaaaaa";
+static char *xledger[][2] = {
+	{ xledger_0, xledger_1 },
+	{ xledger_2, xledger_3 }
+};
+
+/**
+ * gettimeofday() stub
+ */
+static int gettimeofday(struct timeval *tv, void *tz)
+{
+	(void)tz;
+	tv->tv_sec  = tstamp;
+	tv->tv_usec = tstamp_usec;
+	return 0;
+}
+
+/**
+ * Pass a row to a callback, the way the db layer would.
+ */
+static int feed_row(db_row_callback_t cb, void *userdata, int n_cols,
+                    char **fields, char **column_names)
+{
+	struct db_row row;
+	size_t lengths[8];
+	int i;
+
+	for (i = 0; i < n_cols && i < 8; i++)
+		lengths[i] = fields[i] ? strlen(fields[i]) : 0;
+
+	row.n_cols       = n_cols;
+	row.index        = 0;
+	row.fields       = fields;
+	row.lengths      = lengths;
+	row.column_names = column_names;
+	return cb(userdata, &row);
+}
+
 /**
  * Database query stub
  */
@@ -66,6 +164,28 @@ static int db_query(const char *query, db_row_callback_t cb,
 
 	if (!query) goto ret;
 
+	if (n_queries < N_QUERIES)
+		queries[n_queries++] = query;
+
+	if (fail_query && !strncmp(query, fail_query, strlen(fail_query)))
+		goto ret;
+
+	/* Feed the ledger rows, stopping as a driver would */
+	if (cb == get_ledger_cb) {
+		if (!feed_row(cb, userdata, 2, xledger[0], NULL))
+			feed_row(cb, userdata, 2, xledger[1], NULL);
+		retval = 0;
+		goto ret;
+	}
+
+	/* The table version is checked before fetching the state */
+	if (cb == get_version_cb) {
+		retval = feed_row(cb, userdata, 1,
+		                  version_is_null ? xversion_null : xversion,
+		                  xversion_colnames);
+		goto ret;
+	}
+
 	/* Check the query */
 	if (expected_query)
 		ck_assert_str_eq(query, expected_query);
@@ -74,12 +194,81 @@ static int db_query(const char *query, db_row_callback_t cb,
 		ck_assert(cb == get_state_cb);
 		if (set_states_loaded)
 			states_loaded = set_states_loaded;
-		retval = cb(userdata, xcols, xrow, xcolnames);
-	} else retval = 0;
+		feed_row(cb, userdata, xcols, xrow, xcolnames);
+	}
+
+	retval = 0;
 
 ret:
 	return retval;
 }
+
+/**
+ * Prepare stub
+ */
+static struct db_stmt *db_prepare(const char *query)
+{
+	struct db_stmt *stmt = NULL;
+
+	if (query && !fail_prepare && n_prepared < N_PREPARED) {
+		stmt = &prepared[n_prepared++];
+		strncpy(stmt->query, query, sizeof(stmt->query) - 1);
+	}
+
+	return stmt;
+}
+
+/**
+ * Execute stub: the parameters are substituted into the
+ * query, which is then handed to the query stub.
+ */
+static int db_execute(struct db_stmt *stmt, const char *const *params,
+                      db_row_callback_t cb, void *userdata)
+{
+	char *d;
+	const char *q;
+	size_t i = n_queries < N_QUERIES ? n_queries : N_QUERIES - 1;
+
+	if (!stmt) return -1;
+
+	for (d = rendered[i], q = stmt->query; *q; q++) {
+		if (*q != '?') {
+			*d++ = *q;
+			continue;
+		}
+
+		strcpy(d, *params ? *params : "NULL");
+		d += strlen(d);
+		params++;
+	}
+
+	*d = '\0';
+	return db_query(rendered[i], cb, userdata);
+}
+
+/**
+ * Finalize stub
+ */
+static void db_finalize(struct db_stmt *stmt)
+{
+	if (stmt) ++n_finalized;
+}
+
+/**
+ * Build the query get_current_state should be prepared as.
+ */
+static const char *current_state(size_t n)
+{
+	static char buf[256];
+
+	sprintf(buf, "%s %lu", get_current_state, (unsigned long)n);
+	return buf;
+}
+
+/* The format of the rendered INSERT statement for a new state */
+static const char *insert_state_fmt =
+    "INSERT INTO mmm_state(tstamp, usec, seq, version, revision, "
+    "previous) VALUES (%ld, %ld, %ld, %ld, %s, %s)";
 /* }}} */
 
 /**
@@ -112,8 +301,10 @@ END_TEST
  */
 START_TEST(test_state_create)
 {
-	expected_query = create_state_table;
-	state_create();
+	ck_assert_int_eq(state_create(), 0);
+	ck_assert_uint_eq(n_queries, 2);
+	ck_assert_str_eq(queries[0], create_state_table);
+	ck_assert_str_eq(queries[1], create_ledger_table);
 }
 END_TEST
 
@@ -153,13 +344,13 @@ START_TEST(state_get_current_no_room_for_new_state)
 {
 	state_init(1);
 	set_states_loaded = states_allocated;
-	expected_query = get_current_state;
+	expected_query = current_state(1);
 	ck_assert_ptr_null(state_get_current());
 	state_uninit();
 
 	state_init(1);
 	set_states_loaded = states_allocated + 1;
-	expected_query = get_current_state;
+	expected_query = current_state(1);
 	ck_assert_ptr_null(state_get_current());
 	state_uninit();
 }
@@ -173,13 +364,15 @@ START_TEST(state_get_current_fetches_current_state)
 {
 	state_init(1);
 	states_loaded = set_states_loaded = 0;
-	expected_query = get_current_state;
+	expected_query = current_state(1);
 
 	ck_assert_ptr_eq(state_get_current(), states[0].revision);
 	ck_assert_int_eq(states[0].timestamp, tstamp);
+	ck_assert_int_eq(states[0].usec, 654321);
+	ck_assert_int_eq(states[0].seq, 7);
 	ck_assert_int_eq(states[0].version, STATE_VERSION);
-	ck_assert_str_eq(states[0].revision, xrow[2]);
-	ck_assert_str_eq(states[0].previous, xrow[3]);
+	ck_assert_str_eq(states[0].revision, xrow[4]);
+	ck_assert_str_eq(states[0].previous, xrow[5]);
 	ck_assert_uint_eq(states_loaded, 1);
 	ck_assert_uint_eq(states_allocated, 1);
 	state_uninit();
@@ -262,7 +455,8 @@ START_TEST(test_state_cleanup_table)
 	state_init(1);
 	states_loaded = 1;
 	states[0].timestamp = tstamp;
-	sprintf(buf, "%s %ld;", delete_state, tstamp);
+	states[0].seq = 42;
+	sprintf(buf, "DELETE FROM mmm_state WHERE seq < %ld", 42L);
 	expected_query = buf;
 	ck_assert_int_eq(state_cleanup_table(), 0);
 	state_uninit();
@@ -310,19 +504,19 @@ END_TEST
  */
 START_TEST(state_add_revision_zero_states)
 {
-	time_t timestamp;
-	char buf[200];
+	char buf[256];
 
 	state_init(1);
 	states_loaded = 0;
-	timestamp = time(NULL);
-	sprintf(buf, "%s (%ld,%ld,'%s','%s');", insert_state,
-	        timestamp, STATE_VERSION, "xxx", states[0].revision);
+	sprintf(buf, insert_state_fmt, (long)tstamp, tstamp_usec, 1L, STATE_VERSION, "xxx",
+	        states[0].revision);
 	expected_query = buf;
 
 	ck_assert_int_eq(state_add_revision("xxx"), 0);
 	ck_assert_uint_eq(states_allocated, 1);
-	ck_assert_int_eq(states[0].timestamp, timestamp);
+	ck_assert_int_eq(states[0].timestamp, tstamp);
+	ck_assert_int_eq(states[0].usec, tstamp_usec);
+	ck_assert_int_eq(states[0].seq, 1);
 	ck_assert_int_eq(states[0].version, STATE_VERSION);
 	ck_assert_str_eq(states[0].revision, "xxx");
 	ck_assert(!*states[0].previous);
@@ -335,21 +529,21 @@ END_TEST
  */
 START_TEST(state_add_revision_one_state)
 {
-	time_t timestamp;
-	char buf[200];
+	char buf[256];
 
 	state_init(2);
 	states_loaded = 1;
+	states[0].seq = 5;
 	memcpy(states[0].revision, "test", 5);
-	timestamp = time(NULL);
-	sprintf(buf, "%s (%ld,%ld,'%s','%s');", insert_state,
-	        timestamp, STATE_VERSION, "xxx", states[0].revision);
+	sprintf(buf, insert_state_fmt, (long)tstamp, tstamp_usec, 6L, STATE_VERSION, "xxx",
+	        states[0].revision);
 	expected_query = buf;
 
 	ck_assert_int_eq(state_add_revision("xxx"), 0);
 	ck_assert_uint_eq(states_allocated, 2);
 	ck_assert_uint_eq(states_loaded, 2);
-	ck_assert_int_eq(states[0].timestamp, timestamp);
+	ck_assert_int_eq(states[0].timestamp, tstamp);
+	ck_assert_int_eq(states[0].seq, 6);
 	ck_assert_int_eq(states[0].version, STATE_VERSION);
 	ck_assert_str_eq(states[0].revision, "xxx");
 	ck_assert_str_eq(states[0].previous, "test");
@@ -363,26 +557,30 @@ END_TEST
  */
 START_TEST(state_add_revision_two_states)
 {
-	time_t timestamp;
-	char buf[200];
+	char buf[256];
 
 	state_init(3);
 	states_loaded = 3;
-	timestamp = time(NULL);
-	states[0].timestamp = timestamp;
+	states[0].timestamp = tstamp;
+	states[0].usec      = tstamp_usec;
+	states[0].seq       = 2;
 	states[0].version   = STATE_VERSION;
-	states[1].timestamp = timestamp;
+	states[1].timestamp = tstamp;
+	states[1].usec      = tstamp_usec;
+	states[1].seq       = 1;
 	states[1].version   = STATE_VERSION;
 	memcpy(states[0].revision, "test", 5);
 	memcpy(states[0].previous, "xxxx", 5);
 	memcpy(states[1].revision, "xxxx", 5);
-	sprintf(buf, "%s (%ld,%ld,'%s','%s');", insert_state,
-	        timestamp, STATE_VERSION, "xxx", states[0].revision);
+	sprintf(buf, insert_state_fmt, (long)tstamp, tstamp_usec, 3L, STATE_VERSION, "xxx",
+	        states[0].revision);
 	expected_query = buf;
 
 	ck_assert_int_eq(state_add_revision("xxx"), 0);
 	ck_assert_uint_eq(states_loaded, 3);
-	ck_assert_int_eq(states[0].timestamp, timestamp);
+	ck_assert_int_eq(states[0].timestamp, tstamp);
+	ck_assert_int_eq(states[0].usec, tstamp_usec);
+	ck_assert_int_eq(states[0].seq, 3);
 	ck_assert_int_eq(states[0].version, STATE_VERSION);
 	ck_assert_str_eq(states[0].revision, "xxx");
 	ck_assert_str_eq(states[0].previous, "test");
@@ -393,13 +591,292 @@ START_TEST(state_add_revision_two_states)
 }
 END_TEST
 
+/**
+ * Test that state_add_revision() can add states within the same
+ * clock tick without their keys colliding, and without waiting.
+ */
+START_TEST(state_add_revision_same_tick)
+{
+	state_init(3);
+	states_loaded = 0;
+	expected_query = NULL;
+
+	ck_assert_int_eq(state_add_revision("a"), 0);
+	ck_assert_int_eq(state_add_revision("b"), 0);
+	ck_assert_int_eq(state_add_revision("c"), 0);
+	ck_assert_uint_eq(n_queries, 3);
+	ck_assert_int_eq(states[0].timestamp, states[2].timestamp);
+	ck_assert_int_eq(states[0].usec, states[2].usec);
+	ck_assert_int_eq(states[2].seq, 1);
+	ck_assert_int_eq(states[1].seq, 2);
+	ck_assert_int_eq(states[0].seq, 3);
+	ck_assert_str_eq(states[0].previous, "b");
+}
+END_TEST
+
+/**
+ * Test that state_add_revision() can shift a full set of states.
+ */
+START_TEST(state_add_revision_max_states)
+{
+	state_init(N_STATES);
+	states_loaded = N_STATES;
+	states[0].seq = N_STATES;
+	expected_query = NULL;
+
+	ck_assert_int_eq(state_add_revision("xxx"), 0);
+	ck_assert_uint_eq(states_loaded, N_STATES);
+	ck_assert_int_eq(states[0].seq, N_STATES + 1);
+	ck_assert_int_eq(states[1].seq, N_STATES);
+}
+END_TEST
+
+/**
+ * Test that state_get_current() leaves a current table alone.
+ */
+START_TEST(state_upgrade_current_version)
+{
+	state_init(1);
+	ck_assert_ptr_nonnull(state_get_current());
+	ck_assert_uint_eq(n_queries, 2);
+	ck_assert_str_eq(queries[0], get_state_version);
+	ck_assert_str_eq(queries[1], current_state(1));
+}
+END_TEST
+
+/**
+ * Test that state_get_current() leaves an empty table alone.
+ */
+START_TEST(state_upgrade_empty_table)
+{
+	state_init(1);
+	version_is_null = 1;
+	ck_assert_ptr_nonnull(state_get_current());
+	ck_assert_uint_eq(n_queries, 2);
+	ck_assert_str_eq(queries[1], current_state(1));
+}
+END_TEST
+
+/**
+ * Test that state_get_current() upgrades a version 1 table, keying
+ * it on the sequence, and adding the ledger.
+ */
+START_TEST(state_upgrade_from_v1)
+{
+	size_t i;
+
+	state_init(1);
+	memcpy(xversion_0, "1", 2);
+	ck_assert_ptr_nonnull(state_get_current());
+	ck_assert_str_eq(queries[0], get_state_version);
+	ck_assert_str_eq(queries[1], "BEGIN");
+	for (i = 0; upgrade_v1[i]; i++)
+		ck_assert_str_eq(queries[i + 2], upgrade_v1[i]);
+	ck_assert_str_eq(queries[i + 1], create_ledger_table);
+	ck_assert_str_eq(queries[i + 2], "COMMIT");
+	ck_assert_str_eq(queries[i + 3], current_state(1));
+	ck_assert_uint_eq(n_queries, i + 4);
+	ck_assert(strstr(upgrade_v1[0], "PRIMARY KEY(seq)") != NULL);
+}
+END_TEST
+
+/**
+ * Test that a failed upgrade is rolled back.
+ */
+START_TEST(state_upgrade_fails)
+{
+	size_t i;
+
+	state_init(1);
+	memcpy(xversion_0, "1", 2);
+	fail_query = upgrade_v1[2];
+	*errbuf = '\0';
+	ck_assert_ptr_null(state_get_current());
+	for (i = 0; i < 3; i++)
+		ck_assert_str_eq(queries[i + 2], upgrade_v1[i]);
+	ck_assert_str_eq(queries[5], "ROLLBACK");
+	ck_assert_uint_eq(n_queries, 6);
+	ck_assert_str_eq(errbuf, "Unable to upgrade the state table\n");
+}
+END_TEST
+
+/**
+ * Test that an unknown table version isn't upgraded.
+ */
+START_TEST(state_upgrade_unknown_version)
+{
+	state_init(1);
+	memcpy(xversion_0, "0", 2);
+	ck_assert_ptr_null(state_get_current());
+	ck_assert_uint_eq(n_queries, 1);
+}
+END_TEST
+
 /**
  * Test that state_destroy() works.
  */
 START_TEST(test_state_destroy)
 {
-	expected_query = drop_state;
 	ck_assert_int_eq(state_destroy(), 0);
+	ck_assert_uint_eq(n_queries, 2);
+	ck_assert_str_eq(queries[0], drop_ledger);
+	ck_assert_str_eq(queries[1], drop_state);
+}
+END_TEST
+
+/**
+ * Test that state_destroy() finalizes the prepared statements
+ * before dropping the tables.
+ */
+START_TEST(state_destroy_finalizes_statements)
+{
+	state_init(1);
+	ck_assert_int_eq(state_add_revision("xxx"), 0);
+	ck_assert_uint_eq(n_prepared, 1);
+	ck_assert_int_eq(state_destroy(), 0);
+	ck_assert_uint_eq(n_finalized, 1);
+	ck_assert_ptr_null(stmts[STMT_INSERT_STATE]);
+}
+END_TEST
+
+/**
+ * Test that statements are only prepared once, and that
+ * state_uninit() finalizes them.
+ */
+START_TEST(state_statements_are_reused)
+{
+	state_init(3);
+	ck_assert_int_eq(state_add_revision("a"), 0);
+	ck_assert_int_eq(state_add_revision("b"), 0);
+	ck_assert_int_eq(state_cleanup_table(), 0);
+	ck_assert_uint_eq(n_queries, 2);
+	ck_assert_uint_eq(n_prepared, 1);
+
+	states_loaded = 3;
+	ck_assert_int_eq(state_cleanup_table(), 0);
+	ck_assert_uint_eq(n_prepared, 2);
+	state_uninit();
+	ck_assert_uint_eq(n_finalized, 2);
+}
+END_TEST
+
+/**
+ * Test that a statement which can't be prepared fails.
+ */
+START_TEST(state_prepare_fails)
+{
+	state_init(1);
+	fail_prepare = 1;
+	ck_assert_ptr_null(state_get_current());
+	ck_assert_int_ne(state_add_revision("xxx"), 0);
+	ck_assert_int_ne(state_ledger_remove("1-a.sql"), 0);
+	ck_assert_uint_eq(n_queries, 1);
+	ck_assert_str_eq(queries[0], get_state_version);
+}
+END_TEST
+
+/**
+ * Test that state_ledger_load() loads and sorts the ledger once.
+ */
+START_TEST(test_state_ledger_load)
+{
+	ck_assert_int_eq(state_ledger_load(), 0);
+	ck_assert_int_eq(state_ledger_load(), 0);
+	ck_assert_uint_eq(n_queries, 1);
+	ck_assert_str_eq(queries[0], get_ledger);
+	ck_assert_uint_eq(state_ledger_size(), 2);
+	ck_assert_str_eq(ledger[0].migration, "1-a.sql");
+	ck_assert_str_eq(ledger[1].migration, "2-b.sql");
+	state_uninit();
+	ck_assert_uint_eq(state_ledger_size(), 0);
+}
+END_TEST
+
+/**
+ * Test that state_ledger_load() fails if the query fails.
+ */
+START_TEST(state_ledger_load_fails)
+{
+	*errbuf = '\0';
+	fail_query = get_ledger;
+	ck_assert_int_ne(state_ledger_load(), 0);
+	ck_assert_uint_eq(state_ledger_size(), 0);
+	ck_assert_str_eq(errbuf, "Unable to load the migration ledger\n");
+}
+END_TEST
+
+/**
+ * Test that state_ledger_lookup() finds entries.
+ */
+START_TEST(test_state_ledger_lookup)
+{
+	ck_assert_int_eq(state_ledger_load(), 0);
+	ck_assert_ptr_null(state_ledger_lookup("3-c.sql"));
+	ck_assert_str_eq(state_ledger_lookup("2-b.sql"), "bbbbbbbb");
+	ck_assert_str_eq(state_ledger_lookup("1-a.sql"), "aaaaaaaa");
+	state_uninit();
+}
+END_TEST
+
+/**
+ * Test that state_ledger_add() inserts a row, and keeps the
+ * ledger sorted.
+ */
+START_TEST(test_state_ledger_add)
+{
+	const char *prefix = "INSERT INTO mmm_applied(migration, checksum, "
+	                     "applied, duration) VALUES (0-z.sql, "
+	                     "zzzzzzzz, ";
+
+	ck_assert_int_eq(state_ledger_load(), 0);
+	ck_assert_int_eq(state_ledger_add("0-z.sql", "zzzzzzzz", 12), 0);
+	ck_assert_uint_eq(n_queries, 2);
+	ck_assert(!strncmp(queries[1], prefix, strlen(prefix)));
+	ck_assert_str_eq(strrchr(queries[1], ','), ", 12)");
+	ck_assert_uint_eq(state_ledger_size(), 3);
+	ck_assert_str_eq(ledger[0].migration, "0-z.sql");
+	ck_assert_str_eq(state_ledger_lookup("0-z.sql"), "zzzzzzzz");
+	state_uninit();
+}
+END_TEST
+
+/**
+ * Test that state_ledger_add() rejects names which won't fit, and
+ * leaves the ledger alone if the query fails.
+ */
+START_TEST(state_ledger_add_fails)
+{
+	char name[300];
+
+	memset(name, 'x', sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+	*errbuf = '\0';
+	ck_assert_int_ne(state_ledger_add(name, "zzzzzzzz", 0), 0);
+	ck_assert(!strncmp(errbuf, "invalid migration name: xxx", 27));
+	ck_assert_int_ne(state_ledger_add(NULL, "zzzzzzzz", 0), 0);
+	ck_assert_uint_eq(n_queries, 0);
+
+	fail_query = "INSERT INTO mmm_applied";
+	ck_assert_int_ne(state_ledger_add("0-z.sql", "zzzzzzzz", 0), 0);
+	ck_assert_uint_eq(n_queries, 1);
+	ck_assert_uint_eq(state_ledger_size(), 0);
+}
+END_TEST
+
+/**
+ * Test that state_ledger_remove() works.
+ */
+START_TEST(test_state_ledger_remove)
+{
+	ck_assert_int_eq(state_ledger_load(), 0);
+	ck_assert_int_eq(state_ledger_remove("1-a.sql"), 0);
+	ck_assert_str_eq(queries[1], "DELETE FROM mmm_applied WHERE "
+	                 "migration = 1-a.sql");
+	ck_assert_uint_eq(state_ledger_size(), 1);
+	ck_assert_ptr_null(state_ledger_lookup("1-a.sql"));
+	ck_assert_int_eq(state_ledger_remove("1-a.sql"), 0);
+	ck_assert_uint_eq(state_ledger_size(), 1);
+	state_uninit();
 }
 END_TEST
 
@@ -448,11 +925,39 @@ Suite *state_suite(void)
 	tcase_add_test(t, state_add_revision_zero_states);
 	tcase_add_test(t, state_add_revision_one_state);
 	tcase_add_test(t, state_add_revision_two_states);
-	tcase_set_timeout(t, 3);
+	tcase_add_test(t, state_add_revision_same_tick);
+	tcase_add_test(t, state_add_revision_max_states);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("state_upgrade");
+	tcase_add_test(t, state_upgrade_current_version);
+	tcase_add_test(t, state_upgrade_empty_table);
+	tcase_add_test(t, state_upgrade_from_v1);
+	tcase_add_test(t, state_upgrade_fails);
+	tcase_add_test(t, state_upgrade_unknown_version);
+	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
 	t = tcase_create("state_destroy");
 	tcase_add_test(t, test_state_destroy);
+	tcase_add_test(t, state_destroy_finalizes_statements);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("state_statements");
+	tcase_add_test(t, state_statements_are_reused);
+	tcase_add_test(t, state_prepare_fails);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("state_ledger");
+	tcase_add_test(t, test_state_ledger_load);
+	tcase_add_test(t, state_ledger_load_fails);
+	tcase_add_test(t, test_state_ledger_lookup);
+	tcase_add_test(t, test_state_ledger_add);
+	tcase_add_test(t, state_ledger_add_fails);
+	tcase_add_test(t, test_state_ledger_remove);
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
@@ -34,6 +34,14 @@ int main(void)
 	srunner_add_suite(sr, db_mysql_suite());
 	srunner_add_suite(sr, migration_suite());
 	srunner_add_suite(sr, commands_suite());
+	srunner_add_suite(sr, seed_suite());
+	srunner_add_suite(sr, copy_suite());
+	srunner_add_suite(sr, sql_suite());
+	srunner_add_suite(sr, watch_suite());
+	srunner_add_suite(sr, pack_suite());
+	srunner_add_suite(sr, source_pack_suite());
+	srunner_add_suite(sr, scan_suite());
+	srunner_add_suite(sr, prefetch_suite());
 
 	srunner_run_all(sr, CK_ENV);
 	failed = srunner_ntests_failed(sr);
@@ -29,6 +29,14 @@ Suite *db_pgsql_suite(void);
 Suite *db_mysql_suite(void);
 Suite *migration_suite(void);
 Suite *commands_suite(void);
+Suite *seed_suite(void);
+Suite *copy_suite(void);
+Suite *sql_suite(void);
+Suite *watch_suite(void);
+Suite *pack_suite(void);
+Suite *source_pack_suite(void);
+Suite *scan_suite(void);
+Suite *prefetch_suite(void);
 
 #endif /* TESTS_H */
 
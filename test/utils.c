@@ -17,6 +17,8 @@
 /* from test_runner.c */
 extern char errbuf[];
 
+#define HAVE_LIBZ
+#define HAVE_LIBZSTD
 #include "../src/utils.h"
 #include "../src/utils.c"
 
@@ -28,131 +30,156 @@ static char tset_1[]  = "1-tset";
 static char test_99[] = "99-test";
 static char test_1s[] = "1-test.sql";
 static char one_sql[] = "1.sql";
+static char one_sql_gz[] = "1.sql.gz";
 static char one_xxx[] = "1-xxx.sql";
 
 /**
- * Test that calling bubblesort() with an array containing
+ * Test that calling sort_migrations() with an array containing
  * one string, or NULL, works.
  */
-START_TEST(bubblesort_one_string)
+START_TEST(sort_migrations_one_string)
 {
 	char *a[1];
 
 	a[0] = test;
-	bubblesort(a, 1);
-	bubblesort(NULL, 0);
+	sort_migrations(a, 1);
+	sort_migrations(NULL, 0);
 	ck_assert_ptr_eq(a[0], test);
 
 	a[0] = test_1;
-	bubblesort(a, 1);
+	sort_migrations(a, 1);
 	ck_assert_ptr_eq(a[0], test_1);
 
 	a[0] = NULL;
-	bubblesort(a, 1);
+	sort_migrations(a, 1);
 	ck_assert_ptr_null(a[0]);
 }
 END_TEST
 
 /**
- * Test that bubblesort() correctly sorts an array of two
+ * Test that sort_migrations() correctly sorts an array of two
  * strings.
  */
-START_TEST(bubblesort_two_strings)
+START_TEST(sort_migrations_two_strings)
 {
 	char *a[2];
 
 	/* The array is already sorted - no designation */
 	a[0] = test;
 	a[1] = tset;
-	bubblesort(a, 2);
+	sort_migrations(a, 2);
 	ck_assert_ptr_eq(a[0], test);
 	ck_assert_ptr_eq(a[1], tset);
 
 	/* The array is in revers order - no designation */
 	a[0] = tset;
 	a[1] = test;
-	bubblesort(a, 2);
+	sort_migrations(a, 2);
 	ck_assert_ptr_eq(a[0], test);
 	ck_assert_ptr_eq(a[1], tset);
 
 	/* The array is already sorted - with designations */
 	a[0] = test_1;
 	a[1] = tset_1;
-	bubblesort(a, 2);
+	sort_migrations(a, 2);
 	ck_assert_ptr_eq(a[0], test_1);
 	ck_assert_ptr_eq(a[1], tset_1);
 
 	/* The array is in reverse order - with designation */
 	a[0] = tset_1;
 	a[1] = test_1;
-	bubblesort(a, 2);
+	sort_migrations(a, 2);
 	ck_assert_ptr_eq(a[0], test_1);
 	ck_assert_ptr_eq(a[1], tset_1);
 
 	/* The array is already sorted - mixed designations */
 	a[0] = test_1;
 	a[1] = tset;
-	bubblesort(a, 2);
+	sort_migrations(a, 2);
 	ck_assert_ptr_eq(a[0], test_1);
 	ck_assert_ptr_eq(a[1], tset);
 
 	/* The array is in reverse order - mixed designations */
 	a[0] = tset;
 	a[1] = test_1;
-	bubblesort(a, 2);
+	sort_migrations(a, 2);
 	ck_assert_ptr_eq(a[0], test_1);
 	ck_assert_ptr_eq(a[1], tset);
 
 	/* The array is already sorted - differing designations */
 	a[0] = test_1;
 	a[1] = test_99;
-	bubblesort(a, 2);
+	sort_migrations(a, 2);
 	ck_assert_ptr_eq(a[0], test_1);
 	ck_assert_ptr_eq(a[1], test_99);
 
 	/* The array is in reverse order - differing designations */
 	a[0] = test_99;
 	a[1] = test_1;
-	bubblesort(a, 2);
+	sort_migrations(a, 2);
 	ck_assert_ptr_eq(a[0], test_1);
 	ck_assert_ptr_eq(a[1], test_99);
 }
 END_TEST
 
 /**
- * Test that if bubblesort() gets two strings, with equal designations,
+ * Test that sql_ext() recognizes .sql files, and their compressed
+ * variants.
+ */
+START_TEST(test_sql_ext)
+{
+	ck_assert_uint_eq(sql_ext(NULL, 5), 0);
+	ck_assert_uint_eq(sql_ext("1.sql", 5), 4);
+	ck_assert_uint_eq(sql_ext("1.sql.gz", 8), 7);
+	ck_assert_uint_eq(sql_ext("1.sql.zst", 9), 8);
+	ck_assert_uint_eq(sql_ext(".sql", 4), 4);
+	ck_assert_uint_eq(sql_ext("sql", 3), 0);
+	ck_assert_uint_eq(sql_ext("1.gz", 4), 0);
+	ck_assert_uint_eq(sql_ext("1.sql.bz2", 9), 0);
+}
+END_TEST
+
+/**
+ * Test that if sort_migrations() gets two strings, with equal designations,
  * that if one of the two only contains the deisgnation and .sql, that
  * it is pushed farther towards the beginning of the array.
  */
-START_TEST(bubblesort_sql)
+START_TEST(sort_migrations_sql)
 {
 	char *a[2];
 
 	a[0] = test_1s;
 	a[1] = one_sql;
-	bubblesort(a, 2);
+	sort_migrations(a, 2);
 	ck_assert_ptr_eq(a[0], one_sql);
 	ck_assert_ptr_eq(a[1], test_1s);
 
 	a[0] = one_xxx;
 	a[1] = one_sql;
-	bubblesort(a, 2);
+	sort_migrations(a, 2);
 	ck_assert_ptr_eq(a[0], one_sql);
 	ck_assert_ptr_eq(a[1], one_xxx);
 
 	a[0] = one_sql;
 	a[1] = one_xxx;
-	bubblesort(a, 2);
+	sort_migrations(a, 2);
 	ck_assert_ptr_eq(a[0], one_sql);
 	ck_assert_ptr_eq(a[1], one_xxx);
+
+	/* ... even if it's compressed */
+	a[0] = test_1s;
+	a[1] = one_sql_gz;
+	sort_migrations(a, 2);
+	ck_assert_ptr_eq(a[0], one_sql_gz);
+	ck_assert_ptr_eq(a[1], test_1s);
 }
 END_TEST
 
 /**
- * Test that bubblesort() can handle designations that would result
+ * Test that sort_migrations() can handle designations that would result
  * in strtoul() erroring out with ERANGE.
  */
-START_TEST(bubblesort_erange)
+START_TEST(sort_migrations_erange)
 {
 	char *a[2];
 	char s[50];
@@ -162,23 +189,102 @@ START_TEST(bubblesort_erange)
 
 	a[0] = s;
 	a[1] = one_sql;
-	bubblesort(a, 2);
+	sort_migrations(a, 2);
 	ck_assert_ptr_eq(a[0], one_sql);
 	ck_assert_ptr_eq(a[1], s);
 }
 END_TEST
 
+/**
+ * Test that sort_migrations() sorts a larger array by designation,
+ * whether or not every string has one.
+ */
+START_TEST(sort_migrations_many)
+{
+	char names[64][32], *a[64], *b[65];
+	size_t i;
+
+	/* Designations which differ in more than just the low byte */
+	for (i = 0; i < 64; i++) {
+		sprintf(names[i], "%lu-%c.sql", (63 - i) * 1000UL,
+		        (int)('a' + i % 3));
+		a[i] = names[i];
+	}
+
+	a[10] = one_sql;
+	a[20] = one_xxx;
+	sort_migrations(a, 64);
+	ck_assert_ptr_eq(a[0], names[63]);
+	ck_assert_ptr_eq(a[1], one_sql);
+	ck_assert_ptr_eq(a[2], one_xxx);
+	for (i = 4; i < 64; i++)
+		ck_assert_uint_lt(strtoul(a[i - 1], NULL, 10),
+		                  strtoul(a[i], NULL, 10));
+
+	/* Equal designations are ordered by the rest of the name */
+	for (i = 0; i < 64; i++) {
+		sprintf(names[i], "7-%02lu.sql", (unsigned long)(63 - i));
+		b[i] = names[i];
+	}
+
+	/* Mixed with a name that lacks a designation */
+	b[64] = test;
+	sort_migrations(b, 65);
+	for (i = 1; i < 64; i++)
+		ck_assert_int_lt(strcmp(b[i - 1], b[i]), 0);
+	ck_assert_ptr_eq(b[64], test);
+}
+END_TEST
+
+/**
+ * Test that checksum() computes a CRC-32.
+ */
+START_TEST(test_checksum)
+{
+	ck_assert_uint_eq(checksum(NULL, 0), 0);
+	ck_assert_uint_eq(checksum("", 0), 0);
+	ck_assert_uint_eq(checksum("123456789", 9), 0xcbf43926UL);
+	ck_assert_uint_eq(checksum("a", 1), 0xe8b7be43UL);
+}
+END_TEST
+
+/**
+ * Test that now_ms() doesn't go backwards.
+ */
+START_TEST(test_now_ms)
+{
+	unsigned long start = now_ms();
+	ck_assert_uint_lt(now_ms() - start, 1000);
+}
+END_TEST
+
 Suite *utils_suite(void)
 {
 	Suite *s;
 	TCase *t;
 
 	s = suite_create("Utils");
-	t = tcase_create("bubblesort");
-	tcase_add_test(t, bubblesort_one_string);
-	tcase_add_test(t, bubblesort_two_strings);
-	tcase_add_test(t, bubblesort_sql);
-	tcase_add_test(t, bubblesort_erange);
+	t = tcase_create("sql_ext");
+	tcase_add_test(t, test_sql_ext);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("sort_migrations");
+	tcase_add_test(t, sort_migrations_one_string);
+	tcase_add_test(t, sort_migrations_two_strings);
+	tcase_add_test(t, sort_migrations_sql);
+	tcase_add_test(t, sort_migrations_erange);
+	tcase_add_test(t, sort_migrations_many);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("checksum");
+	tcase_add_test(t, test_checksum);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("now_ms");
+	tcase_add_test(t, test_now_ms);
 	tcase_set_timeout(t, 1);
 	suite_add_tcase(s, t);
 
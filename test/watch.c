@@ -0,0 +1,368 @@
+/**
+ * Minimal Migration Manager - Watch Tests
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <check.h>
+#include "tests.h"
+
+/* from test_runner.c */
+extern char errbuf[];
+
+/* {{{ POSIX / inotify stubs */
+typedef long ssize_t;
+
+#define IN_MOVED_FROM   0x0040
+#define IN_MOVED_TO     0x0080
+#define IN_DELETE       0x0200
+#define IN_CLOSE_WRITE  0x0008
+#define IN_DELETE_SELF  0x0400
+#define IN_MOVE_SELF    0x0800
+#define IN_IGNORED      0x8000
+#define POLLIN          0x0001
+
+struct inotify_event {
+	int wd;
+	unsigned int mask;
+	unsigned int cookie;
+	unsigned int len;
+	char name[1];
+};
+
+struct pollfd {
+	int fd;
+	short events;
+	short revents;
+};
+
+static int inotify_init(void);
+static int inotify_add_watch(int fd, const char *path, unsigned int mask);
+static int poll(struct pollfd *fds, unsigned long nfds, int timeout);
+static ssize_t read(int fd, void *buf, size_t count);
+static int close(int fd);
+/* }}} */
+
+#include "../src/watch.c"
+
+static int inotify_init_returns = 3;
+static int inotify_add_watch_returns = 1;
+static const char *add_watch_fails = NULL; /* Path which can't be */
+static const int *poll_returns = NULL;
+static int poll_errno = 0;
+static int poll_interrupts = 0; /* Call which is interrupted */
+static unsigned int read_mask = IN_CLOSE_WRITE;
+static int read_wd = 1;
+static int read_fails = 0;
+
+static int poll_called = 0;
+static int poll_timeout = 0;
+static int close_called = 0;
+static int add_watch_called = 0;
+
+static const char *tmp[2] = { "/tmp", NULL };
+static const char *tmp_etc[4] = { "/tmp", "/etc", "/tmp", NULL };
+
+static void reset_stubs(void)
+{
+	inotify_init_returns = 3;
+	inotify_add_watch_returns = 1;
+	add_watch_fails = NULL;
+	poll_returns = NULL;
+	poll_errno = 0;
+	poll_interrupts = 0;
+	read_mask = IN_CLOSE_WRITE;
+	read_wd = 1;
+	read_fails = 0;
+
+	poll_called = 0;
+	poll_timeout = 0;
+	close_called = 0;
+	add_watch_called = 0;
+	*errbuf = '\0';
+}
+
+static void stop_watching(void)
+{
+	watch_stop();
+}
+
+/* {{{ POSIX / inotify stubs */
+static int inotify_init(void)
+{
+	if (inotify_init_returns < 0)
+		errno = EMFILE;
+	return inotify_init_returns;
+}
+
+/**
+ * Each path watched gets the next descriptor, starting from
+ * inotify_add_watch_returns.
+ */
+static int inotify_add_watch(int fd, const char *path, unsigned int mask)
+{
+	(void)fd;
+	(void)mask;
+	if (inotify_add_watch_returns < 0 ||
+	    (add_watch_fails && !strcmp(path, add_watch_fails))) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	return inotify_add_watch_returns + add_watch_called++;
+}
+
+/**
+ * Each call returns the next value in poll_returns.
+ */
+static int poll(struct pollfd *fds, unsigned long nfds, int timeout)
+{
+	int retval = poll_returns[poll_called++];
+
+	(void)fds;
+	(void)nfds;
+	poll_timeout = timeout;
+	if (retval < 0) {
+		if (poll_called == poll_interrupts) on_signal(SIGINT);
+		errno = poll_errno;
+	}
+
+	return retval;
+}
+
+static ssize_t read(int fd, void *buf, size_t count)
+{
+	struct inotify_event ev;
+
+	(void)fd;
+	if (read_fails) {
+		errno = EIO;
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.wd   = read_wd;
+	ev.mask = read_mask;
+	if (count < sizeof(ev)) return 0;
+	memcpy(buf, &ev, sizeof(ev));
+	return (ssize_t)sizeof(ev);
+}
+
+static int close(int fd)
+{
+	(void)fd;
+	++close_called;
+	return 0;
+}
+/* }}} */
+
+/**
+ * Test that watch_start() fails if given a NULL path, or if we're
+ * already watching something.
+ */
+START_TEST(watch_start_invalid_params)
+{
+	const char *none[1] = { NULL };
+
+	ck_assert_int_ne(watch_start(NULL), 0);
+	ck_assert_int_ne(watch_start(none), 0);
+	ck_assert_int_eq(watch_start(tmp), 0);
+	ck_assert_int_ne(watch_start(tmp), 0);
+}
+END_TEST
+
+/**
+ * Test that watch_start() fails if inotify can't be initialized.
+ */
+START_TEST(watch_start_init_fails)
+{
+	inotify_init_returns = -1;
+	ck_assert_int_ne(watch_start(tmp), 0);
+	ck_assert_str_eq(errbuf, "watch: unable to watch '/tmp': "
+	                 "Too many open files\n");
+	ck_assert(!close_called);
+}
+END_TEST
+
+/**
+ * Test that watch_start() fails, and cleans up, if the path can't
+ * be watched.
+ */
+START_TEST(watch_start_add_watch_fails)
+{
+	inotify_add_watch_returns = -1;
+	ck_assert_int_ne(watch_start(tmp), 0);
+	ck_assert_str_eq(errbuf, "watch: unable to watch '/tmp': "
+	                 "No such file or directory\n");
+	ck_assert_int_eq(close_called, 1);
+	ck_assert_int_eq(watch_wait(), -1);
+}
+END_TEST
+
+/**
+ * Test that watch_start() watches each path once, and skips any
+ * but the first which can't be watched.
+ */
+START_TEST(watch_start_paths)
+{
+	add_watch_fails = "/etc";
+	ck_assert_int_eq(watch_start(tmp_etc), 0);
+	ck_assert_uint_eq(w.n, 1);
+	ck_assert_int_eq(add_watch_called, 1);
+	ck_assert_str_eq(errbuf, "");
+
+	add_watch_fails = NULL;
+	watch_add(tmp_etc);
+	ck_assert_uint_eq(w.n, 2);
+	ck_assert_int_eq(add_watch_called, 2);
+	ck_assert_str_eq(w.paths[1].path, "/etc");
+}
+END_TEST
+
+/**
+ * Test that watch_start() catches SIGINT and SIGTERM, and that
+ * watch_stop() puts the old handlers back.
+ */
+START_TEST(watch_start_catches_signals)
+{
+	ck_assert_int_eq(watch_start(tmp), 0);
+	ck_assert(signal(SIGINT, on_signal) == on_signal);
+	ck_assert(signal(SIGTERM, on_signal) == on_signal);
+
+	watch_stop();
+	ck_assert_int_eq(close_called, 1);
+	ck_assert(signal(SIGINT, SIG_DFL) == SIG_DFL);
+	ck_assert(signal(SIGTERM, SIG_DFL) == SIG_DFL);
+
+	/* Stopping twice is harmless */
+	watch_stop();
+	ck_assert_int_eq(close_called, 1);
+}
+END_TEST
+
+/**
+ * Test that watch_wait() waits for things to settle after a change.
+ */
+START_TEST(test_watch_wait)
+{
+	const int polls[4] = { 1, 1, 1, 0 };
+
+	poll_returns = polls;
+	ck_assert_int_eq(watch_start(tmp), 0);
+	ck_assert_int_eq(watch_wait(), 1);
+	ck_assert_int_eq(poll_called, 4);
+	ck_assert_int_eq(poll_timeout, WATCH_SETTLE_MS);
+}
+END_TEST
+
+/**
+ * Test that watch_wait() returns 0 once we've been interrupted, and
+ * retries if poll() is interrupted by anything else.
+ */
+START_TEST(watch_wait_interrupted)
+{
+	const int polls[2] = { -1, -1 };
+
+	poll_returns    = polls;
+	poll_errno      = EINTR;
+	poll_interrupts = 2;
+	ck_assert_int_eq(watch_start(tmp), 0);
+	ck_assert_int_eq(watch_wait(), 0);
+	ck_assert_int_eq(poll_called, 2);
+
+	/* ... and doesn't wait again */
+	ck_assert_int_eq(watch_wait(), 0);
+	ck_assert_int_eq(poll_called, 2);
+}
+END_TEST
+
+/**
+ * Test that watch_wait() fails if poll() or read() fails.
+ */
+START_TEST(watch_wait_fails)
+{
+	const int polls[2] = { -1, 1 };
+
+	poll_returns = polls;
+	poll_errno   = EBADF;
+	ck_assert_int_eq(watch_start(tmp), 0);
+	ck_assert_int_eq(watch_wait(), -1);
+	ck_assert_str_eq(errbuf, "watch: Bad file descriptor\n");
+
+	read_fails = 1;
+	ck_assert_int_eq(watch_wait(), -1);
+	ck_assert_str_eq(errbuf, "watch: unable to read events: "
+	                 "Input/output error\n");
+}
+END_TEST
+
+/**
+ * Test that watch_wait() fails if the directory goes away.
+ */
+START_TEST(watch_wait_gone)
+{
+	const int polls[1] = { 1 };
+
+	poll_returns = polls;
+	read_mask = IN_DELETE_SELF;
+	ck_assert_int_eq(watch_start(tmp), 0);
+	ck_assert_int_eq(watch_wait(), -1);
+	ck_assert_str_eq(errbuf, "watch: '/tmp' went away\n");
+}
+END_TEST
+
+/**
+ * Test that watch_wait() stops watching any but the first path if
+ * it goes away, and takes that as a change.
+ */
+START_TEST(watch_wait_gone_extra)
+{
+	const int polls[2] = { 1, 0 };
+
+	poll_returns = polls;
+	read_mask = IN_DELETE_SELF;
+	read_wd   = 2;
+	ck_assert_int_eq(watch_start(tmp_etc), 0);
+	ck_assert_uint_eq(w.n, 2);
+	ck_assert_int_eq(watch_wait(), 1);
+	ck_assert_uint_eq(w.n, 1);
+	ck_assert_str_eq(w.paths[0].path, "/tmp");
+	ck_assert_str_eq(errbuf, "");
+}
+END_TEST
+
+Suite *watch_suite(void)
+{
+	Suite *s;
+	TCase *t;
+
+	s = suite_create("Watch");
+	t = tcase_create("watch_start");
+	tcase_add_checked_fixture(t, reset_stubs, stop_watching);
+	tcase_add_test(t, watch_start_invalid_params);
+	tcase_add_test(t, watch_start_init_fails);
+	tcase_add_test(t, watch_start_add_watch_fails);
+	tcase_add_test(t, watch_start_paths);
+	tcase_add_test(t, watch_start_catches_signals);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("watch_wait");
+	tcase_add_checked_fixture(t, reset_stubs, stop_watching);
+	tcase_add_test(t, test_watch_wait);
+	tcase_add_test(t, watch_wait_interrupted);
+	tcase_add_test(t, watch_wait_fails);
+	tcase_add_test(t, watch_wait_gone);
+	tcase_add_test(t, watch_wait_gone_extra);
+	tcase_set_timeout(t, 1);
+	suite_add_tcase(s, t);
+
+	return s;
+}
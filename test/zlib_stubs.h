@@ -0,0 +1,99 @@
+/**
+ * Minimal Migration Manager - zlib stubs for tests
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+#ifndef TEST_ZLIB_STUBS_H
+#define TEST_ZLIB_STUBS_H
+
+/* {{{ GCC: Disable warnings
+ *
+ * The parameters in the functions below are intentionally unused,
+ * and not all functions may be used in the translation unit including
+ * this file. Thus, we want GCC to see this as a system header and
+ * not complain about unused functions and the like.
+ */
+#if defined(__GNUC__) && __GNUC__ >= 3
+#pragma GCC system_header
+#endif /* GCC >= 3 }}} */
+
+/* {{{ zlib types, and return values */
+#define Z_OK          0
+#define Z_STREAM_END  1
+#define Z_DATA_ERROR  (-3)
+#define Z_MEM_ERROR   (-4)
+#define Z_NO_FLUSH    0
+
+typedef unsigned char Bytef;
+typedef unsigned int uInt;
+
+/**
+ * The "compressed" data is a 2 byte header, and the data itself,
+ * up to a '$'. A '!' is corrupt data.
+ */
+typedef struct {
+	const Bytef *next_in;
+	uInt avail_in;
+	Bytef *next_out;
+	uInt avail_out;
+	const char *msg;
+	int header;
+} z_stream;
+/* }}} */
+
+static int inflateInit2_returns = Z_OK;
+static int inflateEnd_called = 0;
+static int inflateReset_called = 0;
+
+static void reset_zlib_stubs(void)
+{
+	inflateInit2_returns = Z_OK;
+	inflateEnd_called = 0;
+	inflateReset_called = 0;
+}
+
+static int inflateInit2(z_stream *z, int window_bits)
+{
+	z->header = 0;
+	return inflateInit2_returns;
+}
+
+static int inflateReset(z_stream *z)
+{
+	++inflateReset_called;
+	z->header = 0;
+	return Z_OK;
+}
+
+static int inflateEnd(z_stream *z)
+{
+	++inflateEnd_called;
+	return Z_OK;
+}
+
+static int inflate(z_stream *z, int flush)
+{
+	for (; z->avail_in && z->header < 2; z->header++) {
+		++z->next_in;
+		--z->avail_in;
+	}
+
+	while (z->avail_in && z->avail_out) {
+		--z->avail_in;
+		switch (*z->next_in++) {
+		case '$': return Z_STREAM_END;
+		case '!':
+			z->msg = "invalid stub data";
+			return Z_DATA_ERROR;
+		default:
+			*z->next_out++ = z->next_in[-1];
+			--z->avail_out;
+		}
+	}
+
+	return Z_OK;
+}
+
+#endif /* TEST_ZLIB_STUBS_H */
@@ -0,0 +1,105 @@
+/**
+ * Minimal Migration Manager - zstd stubs for tests
+ * Copyright (C) 2015 Tim Hentenaar.
+ *
+ * This code is licenced under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+#ifndef TEST_ZSTD_STUBS_H
+#define TEST_ZSTD_STUBS_H
+
+/* {{{ GCC: Disable warnings
+ *
+ * The parameters in the functions below are intentionally unused,
+ * and not all functions may be used in the translation unit including
+ * this file. Thus, we want GCC to see this as a system header and
+ * not complain about unused functions and the like.
+ */
+#if defined(__GNUC__) && __GNUC__ >= 3
+#pragma GCC system_header
+#endif /* GCC >= 3 }}} */
+
+/* {{{ zstd types */
+#define ZSTD_CORRUPT ((size_t)-20)
+
+/**
+ * A "frame" is a 4 byte header, and the data itself, up to a '$'.
+ * A '!' is corrupt data.
+ */
+typedef struct {
+	int header;
+} ZSTD_DStream;
+
+typedef struct {
+	const void *src;
+	size_t size;
+	size_t pos;
+} ZSTD_inBuffer;
+
+typedef struct {
+	void *dst;
+	size_t size;
+	size_t pos;
+} ZSTD_outBuffer;
+/* }}} */
+
+static ZSTD_DStream zstd_stream;
+static int ZSTD_createDStream_fails = 0;
+static int ZSTD_freeDStream_called = 0;
+
+static void reset_zstd_stubs(void)
+{
+	ZSTD_createDStream_fails = 0;
+	ZSTD_freeDStream_called = 0;
+}
+
+static ZSTD_DStream *ZSTD_createDStream(void)
+{
+	return ZSTD_createDStream_fails ? NULL : &zstd_stream;
+}
+
+static size_t ZSTD_initDStream(ZSTD_DStream *zs)
+{
+	zs->header = 0;
+	return 0;
+}
+
+static size_t ZSTD_freeDStream(ZSTD_DStream *zs)
+{
+	++ZSTD_freeDStream_called;
+	return 0;
+}
+
+static unsigned ZSTD_isError(size_t code)
+{
+	return code > (size_t)-100;
+}
+
+static const char *ZSTD_getErrorName(size_t code)
+{
+	return "Corrupted block detected";
+}
+
+static size_t ZSTD_decompressStream(ZSTD_DStream *zs, ZSTD_outBuffer *out,
+                                    ZSTD_inBuffer *in)
+{
+	const char *src = in->src;
+	char *dst = out->dst;
+
+	for (; in->pos < in->size && zs->header < 4; zs->header++)
+		++in->pos;
+
+	while (in->pos < in->size && out->pos < out->size) {
+		switch (src[in->pos++]) {
+		case '$':
+			zs->header = 0;
+			return 0;
+		case '!': return ZSTD_CORRUPT;
+		default: dst[out->pos++] = src[in->pos - 1];
+		}
+	}
+
+	return 1;
+}
+
+#endif /* TEST_ZSTD_STUBS_H */